@@ -38,6 +38,9 @@
 #include "Loader.h"
 #include "GLTFLoader.h"
 #include "Renderer.h"
+#include "Denoiser.h"
+#include "Distributed.h"
+#include "ImageWriter.h"
 #include "boyTestScene.h"
 #include "ajaxTestScene.h"
 #include "cornellTestScene.h"
@@ -161,15 +164,87 @@ bool InitRenderer()
     return true;
 }
 
-void SaveFrame(const std::string filename)
+// Splits the samples of the frame over worker processes, numLocalWorkers of them are started here and the
+// rest connect from other hosts. Writes the merged image
+int RunCoordinator(const std::string &executable, const std::string &sceneFile, int numWorkers, int numLocalWorkers, int port, int numSamples, const std::string &outputFile)
 {
-    unsigned char *data = nullptr;
-    int w, h;
-    renderer->GetOutputBuffer(&data, w, h);
-    stbi_flip_vertically_on_write(true);
-    stbi_write_png(filename.c_str(), w, h, 4, data, w * 4);
+    if (numSamples <= 0)
+    {
+        printf("Distributed rendering needs a sample count, set maxspp or --spp\n");
+        return 1;
+    }
+
+    scene->ProcessScene();
+
+    // Every worker needs at least one sample
+    numWorkers = std::min(numWorkers, numSamples);
+    numLocalWorkers = std::min(numLocalWorkers, numWorkers);
+
+    RenderCoordinator coordinator;
+    if (!coordinator.Listen(port, numLocalWorkers >= numWorkers))
+        return 1;
+    printf("Waiting for %d workers on port %d\n", numWorkers, coordinator.GetPort());
+
+    std::vector<intptr_t> localWorkers;
+    for (int i = 0; i < numLocalWorkers; i++)
+    {
+        std::vector<std::string> args = { "--scene", sceneFile, "--worker", "127.0.0.1:" + to_string(coordinator.GetPort()) };
+        intptr_t process;
+        if (SpawnProcess(executable, args, &process))
+            localWorkers.push_back(process);
+        else
+        {
+            printf("Unable to start worker %d\n", i);
+            numWorkers--;
+        }
+    }
+
+    iVec2 resolution = scene->renderOptions.renderResolution;
+    if (numWorkers <= 0 || !coordinator.Render(numWorkers, numSamples, scene->Hash(), resolution.x, resolution.y, localWorkers))
+        return 1;
+
+    std::string filename = outputFile.empty() ? "./distributed_" + to_string(coordinator.GetNumSamples()) + ".exr" : outputFile;
+    const std::vector<Vec4> &accum = coordinator.GetAccumBuffer();
+    if (!ImageWriter::SaveEXR(filename, coordinator.GetWidth(), coordinator.GetHeight(), &accum[0].x, 1.0f / coordinator.GetNumSamples()))
+    {
+        printf("Unable to save frame: %s\n", filename.c_str());
+        return 1;
+    }
     printf("Frame saved: %s\n", filename.c_str());
-    delete[] data;
+    return 0;
+}
+
+// Renders the samples of the job without presenting them and sends the accumulation buffer to the coordinator
+int RunWorker(RenderWorker &worker, const RenderJob &job)
+{
+    if (scene->Hash() != job.sceneHash)
+    {
+        printf("Scene or settings differ from the coordinator\n");
+        worker.SendResult(0, 0, 0, std::vector<Vec4>());
+        return 1;
+    }
+
+    renderer->SetSampleOffset(job.firstSample);
+    while (renderer->GetSampleCount() <= job.numSamples)
+    {
+        SDL_PumpEvents();
+        renderer->Update(0.0f);
+        renderer->Render();
+    }
+
+    std::vector<Vec4> accum;
+    int w, h;
+    int numSamples = renderer->GetAccumBuffer(accum, w, h);
+    return worker.SendResult(w, h, numSamples, accum) ? 0 : 1;
+}
+
+void SaveBvhReport(const std::string filename)
+{
+    BvhAnalyzer analyzer;
+    analyzer.AnalyzeScene(scene);
+    if (renderer)
+        renderer->AnalyzeLightPathBVH(analyzer);
+    analyzer.WriteJson(filename);
 }
 
 void Render()
@@ -316,7 +391,25 @@ void MainLoop(void *arg)
 
         if (ImGui::Button("Save Screenshot"))
         {
-            SaveFrame("./img_" + to_string(renderer->GetSampleCount()) + ".png");
+            renderer->SaveFrame("./img_" + to_string(renderer->GetSampleCount()) + ".png", false);
+        }
+
+        ImGui::SameLine();
+        if (ImGui::Button("Save EXR"))
+        {
+            renderer->SaveFrame("./img_" + to_string(renderer->GetSampleCount()) + ".exr", true);
+        }
+
+        ImGui::SameLine();
+        if (ImGui::Button("Save Checkpoint"))
+        {
+            renderer->SaveCheckpoint("./checkpoint.ckpt");
+        }
+
+        ImGui::SameLine();
+        if (ImGui::Button("Save BVH Report"))
+        {
+            SaveBvhReport("./bvh_report.json");
         }
 
         // Scenes
@@ -356,8 +449,30 @@ void MainLoop(void *arg)
             reloadShaders |= ImGui::Checkbox("Use Bidirectional Path Tracing", &renderOptions.useBidirectionalPathTracing);
             if (renderOptions.useBidirectionalPathTracing)
                 reloadShaders |= ImGui::Checkbox("Use HRRVC", &renderOptions.useHRRVC);
+            if (renderOptions.useBidirectionalPathTracing && renderOptions.useHRRVC)
+            {
+                reloadShaders |= ImGui::Checkbox("Enable Vertex Merging", &renderOptions.enableVertexMerging);
+                if (renderOptions.enableVertexMerging)
+                {
+                    optionsChanged |= ImGui::SliderFloat("Merge Radius", &renderOptions.vertexMergingRadius, 0.0005f, 0.05f, "%.4f");
+                    optionsChanged |= ImGui::SliderFloat("Merge Radius Alpha", &renderOptions.vertexMergingAlpha, 0.5f, 1.0f);
+                }
+            }
+            else
+            {
+                reloadShaders |= ImGui::Checkbox("Enable Path Guiding", &renderOptions.enablePathGuiding);
+                if (renderOptions.enablePathGuiding)
+                    optionsChanged |= ImGui::SliderFloat("Guiding BSDF Fraction", &renderOptions.guidingBsdfFraction, 0.05f, 0.95f);
+            }
 
             optionsChanged |= ImGui::SliderInt("Max Spp", &renderOptions.maxSpp, -1, 256);
+            ImGui::SliderInt("Checkpoint Interval", &renderOptions.checkpointInterval, 0, 256);
+            reloadShaders |= ImGui::Checkbox("Enable Adaptive Sampling", &renderOptions.enableAdaptiveSampling);
+            if (renderOptions.enableAdaptiveSampling)
+            {
+                optionsChanged |= ImGui::SliderFloat("Adaptive Error Threshold", &renderOptions.adaptiveThreshold, 0.001f, 0.2f, "%.3f");
+                optionsChanged |= ImGui::SliderInt("Adaptive Min Spp", &renderOptions.adaptiveMinSpp, 1, 256);
+            }
             optionsChanged |= ImGui::SliderInt("Max Depth", &renderOptions.maxDepth, 1, 10);
 
             optionsChanged |= ImGui::SliderInt("Max EyePath Depth", &renderOptions.sc_BDPT_EYEPATH, 1, 8);
@@ -368,6 +483,9 @@ void MainLoop(void *arg)
             reloadShaders |= ImGui::Checkbox("Enable Roughness Mollification", &renderOptions.enableRoughnessMollification);
             optionsChanged |= ImGui::SliderFloat("Roughness Mollification Amount", &renderOptions.roughnessMollificationAmt, 0, 1);
             reloadShaders |= ImGui::Checkbox("Enable Volume MIS", &renderOptions.enableVolumeMIS);
+            reloadShaders |= ImGui::Checkbox("Enable Texture LOD", &renderOptions.enableTextureLod);
+            reloadShaders |= ImGui::Combo("Light Sampling", &renderOptions.lightSampling, "Uniform\0Power\0Light BVH\0");
+            reloadShaders |= ImGui::Combo("Sampler", &renderOptions.sampler, "Independent\0Sobol\0Blue Noise Sobol\0");
         }
 
         if (ImGui::CollapsingHeader("Environment"))
@@ -402,8 +520,12 @@ void MainLoop(void *arg)
         if (ImGui::CollapsingHeader("Denoiser"))
         {
 
-            ImGui::Checkbox("Enable Denoiser", &renderOptions.enableDenoiser);
+            // The AOVs are compiled into the shaders
+            reloadShaders |= ImGui::Checkbox("Enable Denoiser", &renderOptions.enableDenoiser) && renderOptions.denoiserAOVs;
             ImGui::SliderInt("Number of Frames to skip", &renderOptions.denoiserFrameCnt, 5, 50);
+            reloadShaders |= ImGui::Checkbox("Albedo and Normal AOVs", &renderOptions.denoiserAOVs) && renderOptions.enableDenoiser;
+            if (renderOptions.denoiserAOVs && Denoiser::CanPrefilter())
+                ImGui::Checkbox("Prefilter AOVs", &renderOptions.denoiserPrefilter);
         }
 
         if (ImGui::CollapsingHeader("Camera"))
@@ -440,59 +562,64 @@ void MainLoop(void *arg)
             }
             ImGui::ListBoxFooter();
 
-            ImGui::Separator();
-            ImGui::Text("Materials");
-
-            // Material Properties
-            Material *mat = &scene->materials[scene->meshInstances[selectedInstance].materialID];
-
-            // Gamma correction for color picker. Internally, the renderer uses linear RGB values for colors
-            Vec3 albedo = Vec3::Pow(mat->baseColor, 1.0 / 2.2);
-            objectPropChanged |= ImGui::ColorEdit3("Albedo (Gamma Corrected)", (float *)(&albedo), 0);
-            mat->baseColor = Vec3::Pow(albedo, 2.2);
-
-            objectPropChanged |= ImGui::SliderFloat("Metallic", &mat->metallic, 0.0f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("Roughness", &mat->roughness, 0.001f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("SpecularTint", &mat->specularTint, 0.0f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("Subsurface", &mat->subsurface, 0.0f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("Anisotropic", &mat->anisotropic, 0.0f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("Sheen", &mat->sheen, 0.0f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("SheenTint", &mat->sheenTint, 0.0f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("Clearcoat", &mat->clearcoat, 0.0f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("ClearcoatGloss", &mat->clearcoatGloss, 0.0f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("SpecTrans", &mat->specTrans, 0.0f, 1.0f);
-            objectPropChanged |= ImGui::SliderFloat("Ior", &mat->ior, 1.001f, 2.0f);
-
-            int mediumType = (int)mat->mediumType;
-            if (ImGui::Combo("Medium Type", &mediumType, "None\0Absorb\0Scatter\0Emissive\0"))
+            // Group instances have no material of their own
+            int materialID = scene->meshInstances[selectedInstance].materialID;
+            if (materialID >= 0)
             {
-                reloadShaders = true;
-                objectPropChanged = true;
-                mat->mediumType = mediumType;
-            }
+                ImGui::Separator();
+                ImGui::Text("Materials");
+
+                // Material Properties
+                Material *mat = &scene->materials[materialID];
+
+                // Gamma correction for color picker. Internally, the renderer uses linear RGB values for colors
+                Vec3 albedo = Vec3::Pow(mat->baseColor, 1.0 / 2.2);
+                objectPropChanged |= ImGui::ColorEdit3("Albedo (Gamma Corrected)", (float *)(&albedo), 0);
+                mat->baseColor = Vec3::Pow(albedo, 2.2);
+
+                objectPropChanged |= ImGui::SliderFloat("Metallic", &mat->metallic, 0.0f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("Roughness", &mat->roughness, 0.001f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("SpecularTint", &mat->specularTint, 0.0f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("Subsurface", &mat->subsurface, 0.0f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("Anisotropic", &mat->anisotropic, 0.0f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("Sheen", &mat->sheen, 0.0f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("SheenTint", &mat->sheenTint, 0.0f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("Clearcoat", &mat->clearcoat, 0.0f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("ClearcoatGloss", &mat->clearcoatGloss, 0.0f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("SpecTrans", &mat->specTrans, 0.0f, 1.0f);
+                objectPropChanged |= ImGui::SliderFloat("Ior", &mat->ior, 1.001f, 2.0f);
+
+                int mediumType = (int)mat->mediumType;
+                if (ImGui::Combo("Medium Type", &mediumType, "None\0Absorb\0Scatter\0Emissive\0"))
+                {
+                    reloadShaders = true;
+                    objectPropChanged = true;
+                    mat->mediumType = mediumType;
+                }
 
-            if (mediumType != MediumType::None)
-            {
-                Vec3 mediumColor = Vec3::Pow(mat->mediumColor, 1.0 / 2.2);
-                objectPropChanged |= ImGui::ColorEdit3("Medium Color (Gamma Corrected)", (float *)(&mediumColor), 0);
-                mat->mediumColor = Vec3::Pow(mediumColor, 2.2);
+                if (mediumType != MediumType::None)
+                {
+                    Vec3 mediumColor = Vec3::Pow(mat->mediumColor, 1.0 / 2.2);
+                    objectPropChanged |= ImGui::ColorEdit3("Medium Color (Gamma Corrected)", (float *)(&mediumColor), 0);
+                    mat->mediumColor = Vec3::Pow(mediumColor, 2.2);
 
-                objectPropChanged |= ImGui::SliderFloat("Medium Density", &mat->mediumDensity, 0.0f, 5.0f);
+                    objectPropChanged |= ImGui::SliderFloat("Medium Density", &mat->mediumDensity, 0.0f, 5.0f);
 
-                if (mediumType == MediumType::Scatter)
-                    objectPropChanged |= ImGui::SliderFloat("Medium Anisotropy", &mat->mediumAnisotropy, -0.9f, 0.9f);
-            }
+                    if (mediumType == MediumType::Scatter)
+                        objectPropChanged |= ImGui::SliderFloat("Medium Anisotropy", &mat->mediumAnisotropy, -0.9f, 0.9f);
+                }
 
-            int alphaMode = (int)mat->alphaMode;
-            if (ImGui::Combo("Alpha Mode", &alphaMode, "Opaque\0Blend"))
-            {
-                reloadShaders = true;
-                objectPropChanged = true;
-                mat->alphaMode = alphaMode;
-            }
+                int alphaMode = (int)mat->alphaMode;
+                if (ImGui::Combo("Alpha Mode", &alphaMode, "Opaque\0Blend"))
+                {
+                    reloadShaders = true;
+                    objectPropChanged = true;
+                    mat->alphaMode = alphaMode;
+                }
 
-            if (alphaMode != AlphaMode::Opaque)
-                objectPropChanged |= ImGui::SliderFloat("Opacity", &mat->opacity, 0.0f, 1.0f);
+                if (alphaMode != AlphaMode::Opaque)
+                    objectPropChanged |= ImGui::SliderFloat("Opacity", &mat->opacity, 0.0f, 1.0f);
+            }
 
             // Transforms
             ImGui::Separator();
@@ -515,7 +642,7 @@ void MainLoop(void *arg)
             }
 
             if (objectPropChanged)
-                scene->RebuildInstances();
+                scene->UpdateInstance(selectedInstance);
         }
 
         scene->renderOptions = renderOptions;
@@ -549,6 +676,14 @@ int main(int argc, char **argv)
     srand((unsigned int)time(0));
 
     std::string sceneFile;
+    std::string bvhReportFile;
+    std::string checkpointFile;
+    std::string workerAddress;
+    std::string outputFile;
+    int numWorkers = 0;
+    int numLocalWorkers = -1;
+    int port = 0;
+    int numSamples = 0;
 
     for (int i = 1; i < argc; ++i)
     {
@@ -557,6 +692,38 @@ int main(int argc, char **argv)
         {
             sceneFile = argv[++i];
         }
+        else if (arg == "--bvh-report")
+        {
+            bvhReportFile = argv[++i];
+        }
+        else if (arg == "--resume")
+        {
+            checkpointFile = argv[++i];
+        }
+        else if (arg == "--distribute")
+        {
+            numWorkers = atoi(argv[++i]);
+        }
+        else if (arg == "--local-workers")
+        {
+            numLocalWorkers = atoi(argv[++i]);
+        }
+        else if (arg == "--port")
+        {
+            port = atoi(argv[++i]);
+        }
+        else if (arg == "--spp")
+        {
+            numSamples = atoi(argv[++i]);
+        }
+        else if (arg == "-o" || arg == "--output")
+        {
+            outputFile = argv[++i];
+        }
+        else if (arg == "--worker")
+        {
+            workerAddress = argv[++i];
+        }
         else if (arg[0] == '-')
         {
             printf("Unknown option %s \n'", arg.c_str());
@@ -577,6 +744,36 @@ int main(int argc, char **argv)
         LoadScene(sceneFiles[sampleSceneIdx]);
     }
 
+    // Builds the scene BVHs without a window, writes the report and exits
+    if (!bvhReportFile.empty())
+    {
+        scene->ProcessScene();
+        SaveBvhReport(bvhReportFile);
+        return 0;
+    }
+
+    // The coordinator only merges, rendering happens in the workers
+    if (numWorkers > 0)
+    {
+        if (sceneFile.empty())
+            sceneFile = sceneFiles[sampleSceneIdx];
+        if (numSamples <= 0)
+            numSamples = renderOptions.maxSpp;
+        return RunCoordinator(argv[0], sceneFile, numWorkers, numLocalWorkers < 0 ? numWorkers : numLocalWorkers, port, numSamples, outputFile);
+    }
+
+    // Workers render their share of the samples without a visible window or the denoiser
+    RenderWorker worker;
+    RenderJob job;
+    if (!workerAddress.empty())
+    {
+        if (!worker.Connect(workerAddress) || !worker.ReceiveJob(job))
+            return 1;
+        renderOptions.maxSpp = job.numSamples + 1;
+        renderOptions.enableDenoiser = false;
+        scene->renderOptions = renderOptions;
+    }
+
     // Setup SDL
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_GAMECONTROLLER) != 0)
     {
@@ -609,6 +806,8 @@ int main(int argc, char **argv)
     SDL_DisplayMode current;
     SDL_GetCurrentDisplayMode(0, &current);
     SDL_WindowFlags window_flags = (SDL_WindowFlags)(SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI);
+    if (!workerAddress.empty())
+        window_flags = (SDL_WindowFlags)(SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
     loopdata.mWindow = SDL_CreateWindow("GLSL PathTracer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, renderOptions.windowResolution.x, renderOptions.windowResolution.y, window_flags);
 
     // Query actual drawable window size
@@ -643,6 +842,17 @@ int main(int argc, char **argv)
     }
 #endif
 
+    if (!workerAddress.empty())
+    {
+        int result = InitRenderer() ? RunWorker(worker, job) : 1;
+        delete renderer;
+        delete scene;
+        SDL_GL_DeleteContext(loopdata.mGLContext);
+        SDL_DestroyWindow(loopdata.mWindow);
+        SDL_Quit();
+        return result;
+    }
+
     // Setup Dear ImGui context
     IMGUI_CHECKVERSION();
     ImGui::CreateContext();
@@ -657,6 +867,10 @@ int main(int argc, char **argv)
     if (!InitRenderer())
         return 1;
 
+    // Continues an interrupted render, starts over if the checkpoint does not match the scene
+    if (!checkpointFile.empty())
+        renderer->LoadCheckpoint(checkpointFile);
+
     while (!done)
     {
         MainLoop(&loopdata);
@@ -0,0 +1,169 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include "BlasCache.h"
+#include "Mesh.h"
+
+namespace GLSLPT
+{
+    namespace
+    {
+        // Bump when the builders or the node format change so stale entries are not picked up
+        const uint32_t kBuilderVersion = 1;
+        const uint32_t kCacheMagic = 0x53414c42; // "BLAS"
+    }
+
+    BlasCache& BlasCache::Instance()
+    {
+        static BlasCache cache;
+        return cache;
+    }
+
+    uint64_t BlasCache::Key(const Mesh& mesh)
+    {
+        // FNV-1a over the settings and the positions. Texture coordinates don't affect the tree
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const void* data, size_t size)
+        {
+            const unsigned char* bytes = (const unsigned char*)data;
+            for (size_t i = 0; i < size; i++)
+            {
+                hash ^= bytes[i];
+                hash *= 1099511628211ull;
+            }
+        };
+
+        const BvhSettings& settings = mesh.bvhSettings;
+        uint32_t header[6] = { kBuilderVersion, (uint32_t)mesh.verticesUVX.size(), settings.spatialSplits, (uint32_t)settings.maxSplitDepth, settings.optimize, (uint32_t)settings.optimizeIterations };
+        float thresholds[2] = { settings.minOverlap, settings.splitBudget };
+        mix(header, sizeof(header));
+        mix(thresholds, sizeof(thresholds));
+
+        for (const Vec4& v : mesh.verticesUVX)
+        {
+            float position[3] = { v.x, v.y, v.z };
+            mix(position, sizeof(position));
+        }
+        return hash;
+    }
+
+    std::string BlasCache::Path(const std::string& directory, uint64_t key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.blas", (unsigned long long)key);
+        return directory + "/" + name;
+    }
+
+    std::shared_ptr<RadeonRays::Bvh> BlasCache::Find(uint64_t key, const Mesh& mesh, const std::string& directory)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(key);
+            if (it != entries.end())
+            {
+                it->second.lastUse = ++useCounter;
+                return it->second.bvh;
+            }
+        }
+
+        if (directory.empty())
+            return nullptr;
+
+        std::ifstream file(Path(directory, key), std::ios::binary);
+        if (!file)
+            return nullptr;
+
+        // Spatial splits add at most splitBudget references per triangle
+        int numTriangles = mesh.verticesUVX.size() / 3;
+        int maxRefs = numTriangles;
+        if (mesh.bvhSettings.spatialSplits)
+            maxRefs += (int)(numTriangles * mesh.bvhSettings.splitBudget);
+
+        uint32_t header[2];
+        std::shared_ptr<RadeonRays::Bvh> bvh = std::make_shared<RadeonRays::Bvh>(2.0f, 64, true, 3);
+        bool ok = file.read((char*)header, sizeof(header)) && header[0] == kCacheMagic && header[1] == kBuilderVersion && bvh->Load(file, numTriangles, maxRefs);
+        if (!ok)
+        {
+            printf("Ignoring invalid BVH cache entry %s\n", Path(directory, key).c_str());
+            return nullptr;
+        }
+
+        // Loaded entries stay in memory for the next scene
+        std::lock_guard<std::mutex> lock(mutex);
+        entries[key] = Entry{ bvh, bvh->GetMemoryUsage(), ++useCounter };
+        return bvh;
+    }
+
+    void BlasCache::Insert(uint64_t key, const std::shared_ptr<RadeonRays::Bvh>& bvh, const std::string& directory)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries[key] = Entry{ bvh, bvh->GetMemoryUsage(), ++useCounter };
+        }
+
+        if (directory.empty())
+            return;
+
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+
+        std::ofstream file(Path(directory, key), std::ios::binary);
+        if (!file)
+        {
+            printf("Couldn't open %s for writing\n", Path(directory, key).c_str());
+            return;
+        }
+
+        uint32_t header[2] = { kCacheMagic, kBuilderVersion };
+        file.write((const char*)header, sizeof(header));
+        bvh->Save(file);
+    }
+
+    void BlasCache::Trim(size_t maxBytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        size_t totalBytes = 0;
+        std::vector<std::pair<uint64_t, uint64_t>> unused;
+        for (const auto& entry : entries)
+        {
+            totalBytes += entry.second.bytes;
+            if (entry.second.bvh.use_count() == 1)
+                unused.push_back(std::make_pair(entry.second.lastUse, entry.first));
+        }
+
+        std::sort(unused.begin(), unused.end());
+        for (int i = 0; i < (int)unused.size() && totalBytes > maxBytes; i++)
+        {
+            auto it = entries.find(unused[i].second);
+            totalBytes -= it->second.bytes;
+            entries.erase(it);
+        }
+    }
+}
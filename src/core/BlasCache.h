@@ -0,0 +1,71 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "bvh.h"
+
+namespace GLSLPT
+{
+    class Mesh;
+
+    // Process wide cache of mesh BVHs keyed by a hash of the vertex positions and the build settings.
+    // Hierarchies outlive the scene that built them so scene switches and re-imports reuse them,
+    // with a directory set they are also kept on disk across runs
+    class BlasCache
+    {
+    public:
+        static BlasCache& Instance();
+
+        static uint64_t Key(const Mesh& mesh);
+
+        // Looks in memory first, then in the directory unless it is empty. Files that don't fit the mesh are misses
+        std::shared_ptr<RadeonRays::Bvh> Find(uint64_t key, const Mesh& mesh, const std::string& directory);
+        void Insert(uint64_t key, const std::shared_ptr<RadeonRays::Bvh>& bvh, const std::string& directory);
+
+        // Releases hierarchies that no mesh uses anymore, least recently used first, until the cache fits in maxBytes
+        void Trim(size_t maxBytes);
+
+    private:
+        BlasCache() = default;
+
+        struct Entry
+        {
+            std::shared_ptr<RadeonRays::Bvh> bvh;
+            size_t bytes;
+            uint64_t lastUse;
+        };
+
+        static std::string Path(const std::string& directory, uint64_t key);
+
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Entry> entries;
+        uint64_t useCounter = 0;
+    };
+}
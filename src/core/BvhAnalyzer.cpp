@@ -0,0 +1,638 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include "BvhAnalyzer.h"
+#include "Scene.h"
+
+namespace GLSLPT
+{
+    // Same costs as the mesh builders so the SAH cost of a BLAS matches Bvh::GetSahCost
+    static const float kTraversalCost = 2.0f;
+    static const float kIntersectionCost = 1.0f;
+
+    static float SurfaceArea(const Vec3& pmin, const Vec3& pmax)
+    {
+        Vec3 extents = pmax - pmin;
+        if (extents.x < 0.0f || extents.y < 0.0f || extents.z < 0.0f)
+            return 0.0f;
+        return 2.0f * (extents.x * extents.y + extents.x * extents.z + extents.y * extents.z);
+    }
+
+    static bool Contains(const BvhAnalyzer::Node& node, const Vec3& p)
+    {
+        return p.x >= node.bboxmin.x && p.y >= node.bboxmin.y && p.z >= node.bboxmin.z &&
+               p.x <= node.bboxmax.x && p.y <= node.bboxmax.y && p.z <= node.bboxmax.z;
+    }
+
+    // Same as AABBIntersect in the shaders
+    static float BoxIntersect(const BvhAnalyzer::Node& node, const Vec3& origin, const Vec3& invDir)
+    {
+        Vec3 f = (node.bboxmax - origin) * invDir;
+        Vec3 n = (node.bboxmin - origin) * invDir;
+
+        Vec3 tmax = Vec3::Max(f, n);
+        Vec3 tmin = Vec3::Min(f, n);
+
+        float t1 = std::min(tmax.x, std::min(tmax.y, tmax.z));
+        float t0 = std::max(tmin.x, std::max(tmin.y, tmin.z));
+
+        return (t1 >= t0) ? (t0 > 0.0f ? t0 : t1) : -1.0f;
+    }
+
+    // Same as the triangle test in ClosestHit
+    static float TriangleIntersect(const Vec3& v0, const Vec3& v1, const Vec3& v2, const Vec3& origin, const Vec3& direction)
+    {
+        Vec3 e0 = v1 - v0;
+        Vec3 e1 = v2 - v0;
+        Vec3 pv = Vec3::Cross(direction, e1);
+        float det = Vec3::Dot(e0, pv);
+
+        Vec3 tv = origin - v0;
+        Vec3 qv = Vec3::Cross(tv, e0);
+
+        float u = Vec3::Dot(tv, pv) / det;
+        float v = Vec3::Dot(direction, qv) / det;
+        float t = Vec3::Dot(e1, qv) / det;
+
+        return (u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t >= 0.0f) ? t : FLT_MAX;
+    }
+
+    BvhAnalyzer::BvhAnalyzer(int numRays, int numSurfaceSamples)
+        : numRays(numRays), numSurfaceSamples(numSurfaceSamples), rng(1337)
+    {
+    }
+
+    Vec3 BvhAnalyzer::randomDirection()
+    {
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        float z = 1.0f - 2.0f * uniform(rng);
+        float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+        float phi = 2.0f * PI * uniform(rng);
+        return Vec3(r * cosf(phi), r * sinf(phi), z);
+    }
+
+    void BvhAnalyzer::computeTreeStats(const std::vector<Node>& nodes, int root, Report& report) const
+    {
+        double sah = 0.0;
+        double overlap = 0.0;
+        double overlapArea = 0.0;
+        double leafDepthSum = 0.0;
+        int numInterior = 0;
+
+        std::vector<std::pair<int, int>> stack(1, std::make_pair(root, 0));
+        while (!stack.empty())
+        {
+            const Node& node = nodes[stack.back().first];
+            int depth = stack.back().second;
+            stack.pop_back();
+
+            float area = SurfaceArea(node.bboxmin, node.bboxmax);
+            report.numNodes++;
+            report.maxDepth = std::max(report.maxDepth, depth);
+
+            if (node.left < 0)
+            {
+                report.numLeaves++;
+                report.numPrimRefs += node.numPrims;
+                sah += area * node.numPrims * kIntersectionCost;
+                leafDepthSum += depth;
+
+                if ((int)report.depthHistogram.size() <= depth)
+                    report.depthHistogram.resize(depth + 1, 0);
+                report.depthHistogram[depth]++;
+                if ((int)report.leafSizeHistogram.size() <= node.numPrims)
+                    report.leafSizeHistogram.resize(node.numPrims + 1, 0);
+                report.leafSizeHistogram[node.numPrims]++;
+            }
+            else
+            {
+                const Node& left = nodes[node.left];
+                const Node& right = nodes[node.right];
+                float childOverlap = SurfaceArea(Vec3::Max(left.bboxmin, right.bboxmin), Vec3::Min(left.bboxmax, right.bboxmax));
+
+                sah += area * kTraversalCost;
+                overlap += area > 0.0f ? childOverlap / area : 0.0f;
+                overlapArea += childOverlap;
+                numInterior++;
+
+                stack.push_back(std::make_pair(node.left, depth + 1));
+                stack.push_back(std::make_pair(node.right, depth + 1));
+            }
+        }
+
+        float rootArea = SurfaceArea(nodes[root].bboxmin, nodes[root].bboxmax);
+        report.sahCost = rootArea > 0.0f ? sah / rootArea : 0.0f;
+        report.siblingOverlap = numInterior > 0 ? overlap / numInterior : 0.0f;
+        report.siblingOverlapCost = rootArea > 0.0f ? overlapArea / rootArea : 0.0f;
+        report.avgLeafDepth = report.numLeaves > 0 ? leafDepthSum / report.numLeaves : 0.0f;
+    }
+
+    // End point overlap (Aila et al. 2013): cost of the nodes whose box contains surface points that are not
+    // in their subtree, averaged over points sampled uniformly on the geometry. Nodes of a BLAS are contiguous
+    float BvhAnalyzer::computeEpo(const std::vector<Node>& nodes, int root, int numNodes)
+    {
+        std::vector<int> parents(numNodes, -1);
+        std::vector<std::pair<int, int>> triangleLeaves;
+
+        std::vector<int> stack(1, root);
+        while (!stack.empty())
+        {
+            int index = stack.back();
+            stack.pop_back();
+            const Node& node = nodes[index];
+
+            if (node.left < 0)
+            {
+                // Vertices are stored three per triangle. Spatial splits can reference a triangle from several leaves
+                for (int i = node.firstPrim; i < node.firstPrim + node.numPrims; i++)
+                    triangleLeaves.push_back(std::make_pair(primTriangles[i], index));
+            }
+            else
+            {
+                parents[node.left - root] = index;
+                parents[node.right - root] = index;
+                stack.push_back(node.left);
+                stack.push_back(node.right);
+            }
+        }
+        std::sort(triangleLeaves.begin(), triangleLeaves.end());
+
+        // Area distribution over the unique triangles
+        std::vector<int> triangleStart;
+        std::vector<float> areaCdf;
+        float totalArea = 0.0f;
+        for (int i = 0; i < (int)triangleLeaves.size(); i++)
+        {
+            if (i > 0 && triangleLeaves[i].first == triangleLeaves[i - 1].first)
+                continue;
+
+            int triangle = triangleLeaves[i].first;
+            Vec3 v0 = vertices[triangle * 3 + 0];
+            Vec3 v1 = vertices[triangle * 3 + 1];
+            Vec3 v2 = vertices[triangle * 3 + 2];
+            totalArea += 0.5f * Vec3::Length(Vec3::Cross(v1 - v0, v2 - v0));
+
+            triangleStart.push_back(i);
+            areaCdf.push_back(totalArea);
+        }
+
+        if (totalArea <= 0.0f)
+            return -1.0f;
+
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        std::vector<int> stamps(numNodes, -1);
+        double cost = 0.0;
+
+        for (int sample = 0; sample < numSurfaceSamples; sample++)
+        {
+            int t = std::upper_bound(areaCdf.begin(), areaCdf.end(), uniform(rng) * totalArea) - areaCdf.begin();
+            t = std::min(t, (int)areaCdf.size() - 1);
+
+            int triangle = triangleLeaves[triangleStart[t]].first;
+            Vec3 v0 = vertices[triangle * 3 + 0];
+            Vec3 v1 = vertices[triangle * 3 + 1];
+            Vec3 v2 = vertices[triangle * 3 + 2];
+
+            float r1 = sqrtf(uniform(rng));
+            float r2 = uniform(rng);
+            Vec3 p = v0 * (1.0f - r1) + v1 * (r1 * (1.0f - r2)) + v2 * (r1 * r2);
+
+            // Nodes above the leaves referencing the triangle contain it legitimately
+            for (int i = triangleStart[t]; i < (int)triangleLeaves.size() && triangleLeaves[i].first == triangle; i++)
+            {
+                for (int index = triangleLeaves[i].second; index != -1 && stamps[index - root] != sample; index = parents[index - root])
+                    stamps[index - root] = sample;
+            }
+
+            stack.assign(1, root);
+            while (!stack.empty())
+            {
+                int index = stack.back();
+                stack.pop_back();
+                const Node& node = nodes[index];
+
+                if (!Contains(node, p))
+                    continue;
+
+                bool isLeaf = node.left < 0;
+                if (stamps[index - root] != sample)
+                    cost += isLeaf ? node.numPrims * kIntersectionCost : kTraversalCost;
+
+                if (!isLeaf)
+                {
+                    stack.push_back(node.left);
+                    stack.push_back(node.right);
+                }
+            }
+        }
+
+        return cost / numSurfaceSamples;
+    }
+
+    float BvhAnalyzer::traceLeaves(const Node& leaf, const Vec3& origin, const Vec3& direction, RayStats& stats) const
+    {
+        float t = FLT_MAX;
+        for (int i = leaf.firstPrim; i < leaf.firstPrim + leaf.numPrims; i++)
+        {
+            int triangle = primTriangles[i];
+            float d = TriangleIntersect(vertices[triangle * 3 + 0], vertices[triangle * 3 + 1], vertices[triangle * 3 + 2], origin, direction);
+            t = std::min(t, d);
+        }
+        stats.primTests += leaf.numPrims;
+        return t;
+    }
+
+    // Follows the shader traversal: the nearer child first and no culling of boxes behind the closest hit.
+    // Instance leaves continue into the BLAS or the group tree with the ray in instance space
+    float BvhAnalyzer::traverse(const std::vector<Node>& nodes, int root, const Vec3& origin, const Vec3& direction, bool topLevel, RayStats& stats) const
+    {
+        Vec3 invDir(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+        float t = FLT_MAX;
+
+        std::vector<int> stack;
+        int index = root;
+        while (true)
+        {
+            const Node& node = nodes[index];
+            stats.nodeVisits++;
+
+            if (node.left < 0)
+            {
+                if (topLevel)
+                {
+                    const InstanceTransform& transform = worldToInstance[node.firstPrim];
+                    Vec3 o = origin - transform.translation;
+                    Vec3 localOrigin(Vec3::Dot(transform.rows[0], o), Vec3::Dot(transform.rows[1], o), Vec3::Dot(transform.rows[2], o));
+                    Vec3 localDirection(Vec3::Dot(transform.rows[0], direction), Vec3::Dot(transform.rows[1], direction), Vec3::Dot(transform.rows[2], direction));
+                    bool group = node.right >= groupNodesBegin && node.right < groupNodesEnd;
+                    t = std::min(t, traverse(nodes, node.right, localOrigin, localDirection, group, stats));
+                }
+                else
+                {
+                    t = std::min(t, traceLeaves(node, origin, direction, stats));
+                }
+            }
+            else
+            {
+                float leftHit = BoxIntersect(nodes[node.left], origin, invDir);
+                float rightHit = BoxIntersect(nodes[node.right], origin, invDir);
+                stats.boxTests += 2;
+
+                if (leftHit > 0.0f && rightHit > 0.0f)
+                {
+                    stack.push_back(leftHit > rightHit ? node.left : node.right);
+                    index = leftHit > rightHit ? node.right : node.left;
+                    continue;
+                }
+                else if (leftHit > 0.0f)
+                {
+                    index = node.left;
+                    continue;
+                }
+                else if (rightHit > 0.0f)
+                {
+                    index = node.right;
+                    continue;
+                }
+            }
+
+            if (stack.empty())
+                break;
+            index = stack.back();
+            stack.pop_back();
+        }
+
+        return t;
+    }
+
+    BvhAnalyzer::RayStats BvhAnalyzer::traceBLAS(const std::vector<Node>& nodes, int root)
+    {
+        // Rays start inside the mesh bounds in random directions, like secondary rays
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        const Node& node = nodes[root];
+        RayStats stats;
+
+        for (int i = 0; i < numRays; i++)
+        {
+            Vec3 extents = node.bboxmax - node.bboxmin;
+            Vec3 origin = node.bboxmin + extents * Vec3(uniform(rng), uniform(rng), uniform(rng));
+            if (traverse(nodes, root, origin, randomDirection(), false, stats) < FLT_MAX)
+                stats.hits++;
+        }
+        stats.numRays = numRays;
+
+        return stats;
+    }
+
+    BvhAnalyzer::RayStats BvhAnalyzer::traceBoxes(const std::vector<Node>& nodes, int root)
+    {
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        RayStats stats;
+        std::vector<int> stack;
+
+        for (int i = 0; i < numRays; i++)
+        {
+            Vec3 extents = nodes[root].bboxmax - nodes[root].bboxmin;
+            Vec3 origin = nodes[root].bboxmin + extents * Vec3(uniform(rng), uniform(rng), uniform(rng));
+            Vec3 direction = randomDirection();
+            Vec3 invDir(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+
+            bool hit = false;
+            stack.assign(1, root);
+            while (!stack.empty())
+            {
+                const Node& node = nodes[stack.back()];
+                stack.pop_back();
+                stats.nodeVisits++;
+
+                if (node.left < 0)
+                {
+                    stats.primTests += node.numPrims;
+                    hit = true;
+                    continue;
+                }
+
+                stats.boxTests += 2;
+                if (BoxIntersect(nodes[node.left], origin, invDir) > 0.0f)
+                    stack.push_back(node.left);
+                if (BoxIntersect(nodes[node.right], origin, invDir) > 0.0f)
+                    stack.push_back(node.right);
+            }
+
+            if (hit)
+                stats.hits++;
+        }
+        stats.numRays = numRays;
+
+        return stats;
+    }
+
+    void BvhAnalyzer::AnalyzeScene(const Scene* scene)
+    {
+        this->scene = scene;
+        const RadeonRays::BvhTranslator& translator = scene->bvhTranslator;
+
+        // The scene streams its mesh data to the GPU, gather a copy in the layout of the GPU buffers
+        std::vector<Indices> vertIndices(scene->numIndices);
+        if (scene->numIndices > 0)
+            scene->GetVertexIndices(0, scene->numIndices, &vertIndices[0]);
+        primTriangles.resize(scene->numIndices);
+        for (int i = 0; i < scene->numIndices; i++)
+            primTriangles[i] = vertIndices[i].x / 3;
+        vertices.resize(scene->numVertices);
+        for (int i = 0; i < (int)scene->meshes.size(); i++)
+        {
+            const std::vector<Vec4>& meshVertices = scene->meshes[i]->verticesUVX;
+            for (int j = 0; j < (int)meshVertices.size(); j++)
+                vertices[scene->meshVertexOffsets[i] + j] = Vec3(meshVertices[j]);
+        }
+
+        // Builder independent copy of the flattened nodes, indices are kept
+        std::vector<Node> nodes(translator.nodes.size());
+        for (int i = 0; i < (int)nodes.size(); i++)
+        {
+            const RadeonRays::BvhTranslator::Node& src = translator.nodes[i];
+            Node& node = nodes[i];
+            node.bboxmin = src.bboxmin;
+            node.bboxmax = src.bboxmax;
+
+            if (src.LRLeaf.z > 0)
+            {
+                node.left = node.right = -1;
+                node.firstPrim = (int)src.LRLeaf.x;
+                node.numPrims = (int)src.LRLeaf.y;
+            }
+            else if (src.LRLeaf.z < 0)
+            {
+                // Instance leaf, right is the root of the BLAS
+                node.left = -1;
+                node.right = (int)src.LRLeaf.x;
+                node.firstPrim = -(int)src.LRLeaf.z - 1;
+                node.numPrims = 1;
+            }
+            else
+            {
+                node.left = (int)src.LRLeaf.x;
+                node.right = (int)src.LRLeaf.y;
+                node.firstPrim = -1;
+                node.numPrims = 0;
+            }
+        }
+
+        // Invert the affine instance transforms. Columns of the 3x3 part are data[0..2], the translation is data[3]
+        worldToInstance.resize(scene->transforms.size());
+        for (int i = 0; i < (int)scene->transforms.size(); i++)
+        {
+            const Mat4& m = scene->transforms[i];
+            Vec3 c0(m.data[0][0], m.data[0][1], m.data[0][2]);
+            Vec3 c1(m.data[1][0], m.data[1][1], m.data[1][2]);
+            Vec3 c2(m.data[2][0], m.data[2][1], m.data[2][2]);
+            Vec3 r0 = Vec3::Cross(c1, c2);
+            float invDet = 1.0f / Vec3::Dot(c0, r0);
+
+            worldToInstance[i].rows[0] = r0 * invDet;
+            worldToInstance[i].rows[1] = Vec3::Cross(c2, c0) * invDet;
+            worldToInstance[i].rows[2] = Vec3::Cross(c0, c1) * invDet;
+            worldToInstance[i].translation = Vec3(m.data[3][0], m.data[3][1], m.data[3][2]);
+        }
+
+        // Compressed trees are measured by their wide nodes, the other layouts have one entry per binary node
+        bool compressed = !translator.wideNodes.empty();
+        size_t nodeSize = scene->renderOptions.packBVH ? sizeof(RadeonRays::BvhTranslator::PackedNode) : sizeof(RadeonRays::BvhTranslator::Node);
+        sceneMemoryBytes = compressed ? sizeof(RadeonRays::BvhTranslator::WideNode) * translator.wideNodes.size() : nodeSize * nodes.size();
+
+        const std::vector<int>& blasRoots = translator.GetBLASRootIndices();
+        const std::vector<int>& groupRoots = translator.GetGroupRootIndices();
+        groupNodesBegin = groupRoots.empty() ? translator.topLevelIndex : groupRoots[0];
+        groupNodesEnd = translator.topLevelIndex;
+        int wideGroupsBegin = translator.wideGroupRootIndices.empty() ? translator.wideTopLevelIndex : translator.wideGroupRootIndices[0];
+
+        for (int i = 0; i < (int)scene->meshes.size(); i++)
+        {
+            Report report;
+            report.name = scene->meshes[i]->name;
+            report.type = "blas";
+            computeTreeStats(nodes, blasRoots[i], report);
+            if (compressed)
+            {
+                int end = i + 1 < (int)scene->meshes.size() ? translator.wideRootIndices[i + 1] : wideGroupsBegin;
+                report.memoryBytes = sizeof(RadeonRays::BvhTranslator::WideNode) * (end - translator.wideRootIndices[i]);
+            }
+            else
+                report.memoryBytes = nodeSize * report.numNodes;
+            report.epoCost = computeEpo(nodes, blasRoots[i], report.numNodes);
+            report.rays = traceBLAS(nodes, blasRoots[i]);
+            reports.push_back(report);
+        }
+
+        // Group trees only get their structure measured, rays through them are part of the scene rays below
+        for (int i = 0; i < (int)groupRoots.size(); i++)
+        {
+            Report report;
+            report.name = scene->instanceGroups[i].name;
+            report.type = "group";
+            computeTreeStats(nodes, groupRoots[i], report);
+            if (compressed)
+            {
+                int end = i + 1 < (int)groupRoots.size() ? translator.wideGroupRootIndices[i + 1] : translator.wideTopLevelIndex;
+                report.memoryBytes = sizeof(RadeonRays::BvhTranslator::WideNode) * (end - translator.wideGroupRootIndices[i]);
+            }
+            else
+                report.memoryBytes = nodeSize * report.numNodes;
+            reports.push_back(report);
+        }
+
+        Report report;
+        report.name = "instances";
+        report.type = "tlas";
+        computeTreeStats(nodes, translator.topLevelIndex, report);
+        if (compressed)
+            report.memoryBytes = sizeof(RadeonRays::BvhTranslator::WideNode) * (translator.wideNodes.size() - translator.wideTopLevelIndex);
+        else
+            report.memoryBytes = nodeSize * report.numNodes;
+
+        // Random rays through the scene bounds and primary rays of the current camera, traced through both levels
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        const Node& root = nodes[translator.topLevelIndex];
+        randomRays = RayStats();
+        for (int i = 0; i < numRays; i++)
+        {
+            Vec3 origin = root.bboxmin + (root.bboxmax - root.bboxmin) * Vec3(uniform(rng), uniform(rng), uniform(rng));
+            if (traverse(nodes, translator.topLevelIndex, origin, randomDirection(), true, randomRays) < FLT_MAX)
+                randomRays.hits++;
+        }
+        randomRays.numRays = numRays;
+        report.rays = randomRays;
+        reports.push_back(report);
+
+        cameraRays = RayStats();
+        if (scene->camera)
+        {
+            const Camera* camera = scene->camera;
+            float scale = tanf(camera->fov * 0.5f);
+            float aspect = (float)scene->renderOptions.renderResolution.y / scene->renderOptions.renderResolution.x;
+
+            for (int i = 0; i < numRays; i++)
+            {
+                float dx = (2.0f * uniform(rng) - 1.0f) * scale;
+                float dy = (2.0f * uniform(rng) - 1.0f) * scale * aspect;
+                Vec3 direction = Vec3::Normalize(camera->right * dx + camera->up * dy + camera->forward);
+                if (traverse(nodes, translator.topLevelIndex, camera->position, direction, true, cameraRays) < FLT_MAX)
+                    cameraRays.hits++;
+            }
+            cameraRays.numRays = numRays;
+        }
+
+        this->scene = nullptr;
+        primTriangles.clear();
+        vertices.clear();
+    }
+
+    void BvhAnalyzer::AnalyzeTree(const std::string& name, const std::vector<Node>& nodes, int nodeSize)
+    {
+        if (nodes.empty())
+            return;
+
+        Report report;
+        report.name = name;
+        report.type = "points";
+        computeTreeStats(nodes, 0, report);
+        report.memoryBytes = (size_t)nodeSize * nodes.size();
+        report.rays = traceBoxes(nodes, 0);
+        reports.push_back(report);
+    }
+
+    bool BvhAnalyzer::WriteJson(const std::string& filename) const
+    {
+        FILE* file = fopen(filename.c_str(), "w");
+        if (!file)
+        {
+            printf("Unable to write BVH report %s\n", filename.c_str());
+            return false;
+        }
+
+        // Per ray averages
+        auto writeRays = [file](const char* name, const RayStats& stats, const char* indent, bool last)
+        {
+            double n = std::max(stats.numRays, 1);
+            fprintf(file, "%s\"%s\": { \"rays\": %d, \"nodeVisits\": %.3f, \"boxTests\": %.3f, \"primitiveTests\": %.3f, \"hitRate\": %.4f }%s\n",
+                indent, name, stats.numRays, stats.nodeVisits / n, stats.boxTests / n, stats.primTests / n, stats.hits / n, last ? "" : ",");
+        };
+
+        auto writeHistogram = [file](const char* name, const std::vector<int>& histogram)
+        {
+            fprintf(file, "      \"%s\": [", name);
+            for (int i = 0; i < (int)histogram.size(); i++)
+                fprintf(file, i == 0 ? "%d" : ", %d", histogram[i]);
+            fprintf(file, "],\n");
+        };
+
+        fprintf(file, "{\n");
+        fprintf(file, "  \"scene\": {\n");
+        fprintf(file, "    \"memoryBytes\": %zu,\n", sceneMemoryBytes);
+        writeRays("cameraRays", cameraRays, "    ", false);
+        writeRays("randomRays", randomRays, "    ", true);
+        fprintf(file, "  },\n");
+
+        fprintf(file, "  \"trees\": [\n");
+        for (int i = 0; i < (int)reports.size(); i++)
+        {
+            const Report& report = reports[i];
+            std::string name = report.name;
+            for (size_t c = name.find_first_of("\"\\"); c != std::string::npos; c = name.find_first_of("\"\\", c + 2))
+                name.insert(c, "\\");
+
+            fprintf(file, "    {\n");
+            fprintf(file, "      \"name\": \"%s\",\n", name.c_str());
+            fprintf(file, "      \"type\": \"%s\",\n", report.type.c_str());
+            fprintf(file, "      \"nodes\": %d,\n", report.numNodes);
+            fprintf(file, "      \"leaves\": %d,\n", report.numLeaves);
+            fprintf(file, "      \"primitiveReferences\": %d,\n", report.numPrimRefs);
+            fprintf(file, "      \"memoryBytes\": %zu,\n", report.memoryBytes);
+            fprintf(file, "      \"maxDepth\": %d,\n", report.maxDepth);
+            fprintf(file, "      \"averageLeafDepth\": %.3f,\n", report.avgLeafDepth);
+            fprintf(file, "      \"sahCost\": %.4f,\n", report.sahCost);
+            if (report.epoCost >= 0.0f)
+                fprintf(file, "      \"epoCost\": %.4f,\n", report.epoCost);
+            else
+                fprintf(file, "      \"epoCost\": null,\n");
+            fprintf(file, "      \"siblingOverlap\": %.4f,\n", report.siblingOverlap);
+            fprintf(file, "      \"siblingOverlapCost\": %.4f,\n", report.siblingOverlapCost);
+            writeHistogram("leafDepthHistogram", report.depthHistogram);
+            writeHistogram("leafSizeHistogram", report.leafSizeHistogram);
+            writeRays("rays", report.rays, "      ", true);
+            fprintf(file, "    }%s\n", i + 1 < (int)reports.size() ? "," : "");
+        }
+        fprintf(file, "  ]\n");
+        fprintf(file, "}\n");
+
+        fclose(file);
+        printf("Wrote BVH report %s\n", filename.c_str());
+        return true;
+    }
+}
@@ -0,0 +1,124 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <random>
+#include <string>
+#include <vector>
+#include "Vec3.h"
+
+namespace GLSLPT
+{
+    class Scene;
+
+    // Measures the quality of flattened BVHs so builders and their settings can be compared without rendering.
+    // Covers every BLAS, instance group and the TLAS of a scene and the light path BVH, results are written as JSON
+    class BvhAnalyzer
+    {
+    public:
+        // Builder independent node of a flattened binary BVH
+        struct Node
+        {
+            Vec3 bboxmin;
+            Vec3 bboxmax;
+            int left;      // -1 for leaves
+            int right;     // Root of the BLAS or group tree for instance leaves
+            int firstPrim; // Leaves only
+            int numPrims;
+        };
+
+        BvhAnalyzer(int numRays = 1 << 14, int numSurfaceSamples = 1 << 14);
+
+        // Every BLAS with EPO and rays in object space, the TLAS, and camera and random rays through the whole scene
+        void AnalyzeScene(const Scene* scene);
+
+        // Tree without geometry, rays count every node whose box they pass through
+        void AnalyzeTree(const std::string& name, const std::vector<Node>& nodes, int nodeSize);
+
+        bool WriteJson(const std::string& filename) const;
+
+    private:
+        struct RayStats
+        {
+            int numRays = 0;
+            double nodeVisits = 0.0;
+            double boxTests = 0.0;
+            double primTests = 0.0;
+            double hits = 0.0;
+        };
+
+        struct Report
+        {
+            std::string name;
+            std::string type;
+            int numNodes = 0;
+            int numLeaves = 0;
+            int numPrimRefs = 0;
+            int maxDepth = 0;
+            float avgLeafDepth = 0.0f;
+            float sahCost = 0.0f;
+            float epoCost = -1.0f; // Negative without surface geometry
+            float siblingOverlap = 0.0f;
+            float siblingOverlapCost = 0.0f;
+            size_t memoryBytes = 0;
+            std::vector<int> depthHistogram;
+            std::vector<int> leafSizeHistogram;
+            RayStats rays;
+        };
+
+        // World to instance transform, rows of the inverted 3x3 part applied after removing the translation
+        struct InstanceTransform
+        {
+            Vec3 rows[3];
+            Vec3 translation;
+        };
+
+        void computeTreeStats(const std::vector<Node>& nodes, int root, Report& report) const;
+        float computeEpo(const std::vector<Node>& nodes, int root, int numNodes);
+        RayStats traceBLAS(const std::vector<Node>& nodes, int root);
+        RayStats traceBoxes(const std::vector<Node>& nodes, int root);
+        float traverse(const std::vector<Node>& nodes, int root, const Vec3& origin, const Vec3& direction, bool topLevel, RayStats& stats) const;
+        float traceLeaves(const Node& leaf, const Vec3& origin, const Vec3& direction, RayStats& stats) const;
+        Vec3 randomDirection();
+
+        int numRays;
+        int numSurfaceSamples;
+        std::mt19937 rng;
+
+        // Geometry of the analyzed scene
+        const Scene* scene = nullptr;
+        std::vector<InstanceTransform> worldToInstance;
+        // Node range of the group trees, whose leaves are instances again
+        int groupNodesBegin = 0;
+        int groupNodesEnd = 0;
+        std::vector<int> primTriangles; // Triangle of every primitive reference, vertices are stored three per triangle
+        std::vector<Vec3> vertices;
+
+        std::vector<Report> reports;
+        RayStats cameraRays;
+        RayStats randomRays;
+        size_t sceneMemoryBytes = 0;
+    };
+}
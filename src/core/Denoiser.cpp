@@ -0,0 +1,212 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include "Denoiser.h"
+
+namespace GLSLPT
+{
+    Denoiser::Denoiser()
+    {
+        worker = std::thread(&Denoiser::run, this);
+    }
+
+    Denoiser::~Denoiser()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wakeUp.notify_one();
+        worker.join();
+    }
+
+    void Denoiser::Resize(int width, int height)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->width = width;
+        this->height = height;
+        input.resize(width * height);
+        inputAOVs = false;
+        pending = false;
+        resultReady = false;
+        generation++;
+    }
+
+    bool Denoiser::Busy()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pending || running;
+    }
+
+    bool Denoiser::CanPrefilter()
+    {
+#if OIDN_VERSION >= 10400
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void Denoiser::SetPrefilter(bool prefilter)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->prefilter = prefilter && CanPrefilter();
+    }
+
+    bool Denoiser::Submit(const float* color, const Vec4* albedo, const Vec4* normal)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (pending || running || input.empty())
+                return false;
+
+            const Vec3* pixels = reinterpret_cast<const Vec3*>(color);
+            std::copy(pixels, pixels + input.size(), input.begin());
+            inputAOVs = albedo && normal;
+            if (inputAOVs)
+            {
+                inputAlbedo.assign(albedo, albedo + input.size());
+                inputNormal.assign(normal, normal + input.size());
+            }
+            pending = true;
+        }
+        wakeUp.notify_one();
+        return true;
+    }
+
+    bool Denoiser::FetchResult(Vec3* image)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!resultReady)
+            return false;
+
+        std::copy(result.begin(), result.end(), image);
+        resultReady = false;
+        return true;
+    }
+
+    void Denoiser::Discard()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = false;
+        resultReady = false;
+        generation++;
+    }
+
+    void Denoiser::bindImages(int w, int h, bool aovs, bool prefilter)
+    {
+        filterWidth = w;
+        filterHeight = h;
+        filterAOVs = aovs;
+        filterPrefilter = prefilter;
+
+        filterInput.resize(w * h);
+        filterOutput.resize(w * h);
+        filter = device.newFilter("RT"); // generic ray tracing filter
+        filter.setImage("color", &filterInput[0], oidn::Format::Float3, w, h, 0, 0, 0);
+        filter.setImage("output", &filterOutput[0], oidn::Format::Float3, w, h, 0, 0, 0);
+        filter.set("hdr", false);
+
+        if (aovs)
+        {
+            filterAlbedo.resize(w * h);
+            filterNormal.resize(w * h);
+            if (prefilter)
+            {
+                // An RT filter with only an auxiliary image as input denoises that image on its own.
+                // SetPrefilter keeps this off for versions before 1.4, which lack that mode
+                prefilteredAlbedo.resize(w * h);
+                prefilteredNormal.resize(w * h);
+                albedoFilter = device.newFilter("RT");
+                albedoFilter.setImage("albedo", &filterAlbedo[0], oidn::Format::Float3, w, h, 0, 0, 0);
+                albedoFilter.setImage("output", &prefilteredAlbedo[0], oidn::Format::Float3, w, h, 0, 0, 0);
+                albedoFilter.commit();
+                normalFilter = device.newFilter("RT");
+                normalFilter.setImage("normal", &filterNormal[0], oidn::Format::Float3, w, h, 0, 0, 0);
+                normalFilter.setImage("output", &prefilteredNormal[0], oidn::Format::Float3, w, h, 0, 0, 0);
+                normalFilter.commit();
+                filter.set("cleanAux", true);
+            }
+            filter.setImage("albedo", prefilter ? &prefilteredAlbedo[0] : &filterAlbedo[0], oidn::Format::Float3, w, h, 0, 0, 0);
+            filter.setImage("normal", prefilter ? &prefilteredNormal[0] : &filterNormal[0], oidn::Format::Float3, w, h, 0, 0, 0);
+        }
+        filter.commit();
+    }
+
+    void Denoiser::run()
+    {
+        device = oidn::newDevice();
+        device.commit();
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wakeUp.wait(lock, [this] { return quit || pending; });
+            if (quit)
+                break;
+
+            int frameGeneration = generation;
+            bool aovs = inputAOVs;
+            bool prefilterAOVs = aovs && prefilter;
+            if (width != filterWidth || height != filterHeight || aovs != filterAOVs || prefilterAOVs != filterPrefilter)
+                bindImages(width, height, aovs, prefilterAOVs);
+
+            // Take the frame so the render thread can keep going while the filter runs
+            filterInput.assign(input.begin(), input.end());
+            if (aovs)
+            {
+                for (int i = 0; i < (int)filterInput.size(); i++)
+                {
+                    float invSamples = inputAlbedo[i].w > 0.0f ? 1.0f / inputAlbedo[i].w : 0.0f;
+                    filterAlbedo[i] = Vec3(inputAlbedo[i]) * invSamples;
+                    filterNormal[i] = Vec3(inputNormal[i]) * invSamples;
+                }
+            }
+            pending = false;
+            running = true;
+            lock.unlock();
+
+            if (prefilterAOVs)
+            {
+                albedoFilter.execute();
+                normalFilter.execute();
+            }
+            filter.execute();
+
+            const char* errorMessage;
+            if (device.getError(errorMessage) != oidn::Error::None)
+                printf("Denoiser error: %s\n", errorMessage);
+
+            lock.lock();
+            running = false;
+            if (frameGeneration == generation)
+            {
+                result.assign(filterOutput.begin(), filterOutput.end());
+                resultReady = true;
+            }
+        }
+    }
+}
@@ -0,0 +1,106 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Vec3.h"
+#include "OpenImageDenoise/oidn.hpp"
+
+namespace GLSLPT
+{
+    // Runs Open Image Denoise on a worker thread. The device and the "RT" filter are created once and
+    // only recommitted when the resolution or the inputs change, so the render thread just hands over
+    // frames and picks up results
+    class Denoiser
+    {
+    public:
+        Denoiser();
+        ~Denoiser();
+
+        // Takes effect with the next submitted frame
+        void Resize(int width, int height);
+
+        // True while a frame is being denoised or waits for the worker
+        bool Busy();
+
+        // Open Image Denoise can prefilter the AOVs on their own from version 1.4
+        static bool CanPrefilter();
+
+        // Denoise the albedo and normal AOVs first so their noise does not end up in the result.
+        // Worth it when the first hits are noisy, e.g. with depth of field or motion. Ignored without CanPrefilter
+        void SetPrefilter(bool prefilter);
+
+        // Copies a width * height RGB frame and wakes the worker. Fails while busy. The optional albedo and
+        // normal AOVs are sums over the samples with the number of samples in alpha
+        bool Submit(const float* color, const Vec4* albedo = nullptr, const Vec4* normal = nullptr);
+
+        // Copies the latest finished frame to image, false if there is none since the last call
+        bool FetchResult(Vec3* image);
+
+        // Drops the frame in flight and any finished result, e.g. after the scene changed
+        void Discard();
+
+    private:
+        void run();
+        void bindImages(int w, int h, bool aovs, bool prefilter);
+
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable wakeUp;
+        bool quit = false;
+        bool pending = false;   // Input waits for the worker
+        bool running = false;   // Worker is executing the filter
+        bool resultReady = false;
+        int generation = 0;     // Incremented by Discard so results of stale frames are dropped
+
+        int width = 0;
+        int height = 0;
+        bool prefilter = false;
+        bool inputAOVs = false;
+        std::vector<Vec3> input;
+        std::vector<Vec4> inputAlbedo;
+        std::vector<Vec4> inputNormal;
+        std::vector<Vec3> result;
+
+        // Owned by the worker thread. The filters keep pointers to these buffers
+        oidn::DeviceRef device;
+        oidn::FilterRef filter;
+        oidn::FilterRef albedoFilter;
+        oidn::FilterRef normalFilter;
+        std::vector<Vec3> filterInput;
+        std::vector<Vec3> filterAlbedo;
+        std::vector<Vec3> filterNormal;
+        std::vector<Vec3> prefilteredAlbedo;
+        std::vector<Vec3> prefilteredNormal;
+        std::vector<Vec3> filterOutput;
+        int filterWidth = 0;
+        int filterHeight = 0;
+        bool filterAOVs = false;
+        bool filterPrefilter = false;
+    };
+}
@@ -0,0 +1,360 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include "Distributed.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+typedef int socklen_t;
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <spawn.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define INVALID_SOCKET (-1)
+extern char** environ;
+#endif
+
+namespace GLSLPT
+{
+    static const uint32_t kJobMagic = 0x424f4a48;    // "HJOB"
+    static const uint32_t kResultMagic = 0x53455248; // "HRES"
+    static const int kAcceptTimeout = 120;           // Seconds without a new connection before the coordinator stops waiting
+
+    struct JobMessage
+    {
+        uint32_t magic;
+        int32_t firstSample;
+        uint64_t sceneHash;
+        int32_t numSamples;
+        int32_t padding;
+    };
+
+    struct ResultMessage
+    {
+        uint32_t magic;
+        int32_t width;
+        int32_t height;
+        int32_t numSamples;
+    };
+
+    static bool InitSockets()
+    {
+#ifdef _WIN32
+        static bool initialized = false;
+        if (!initialized)
+        {
+            WSADATA data;
+            initialized = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+        }
+        return initialized;
+#else
+        return true;
+#endif
+    }
+
+    static void CloseSocket(intptr_t connection)
+    {
+#ifdef _WIN32
+        closesocket((SOCKET)connection);
+#else
+        close((int)connection);
+#endif
+    }
+
+    static bool SendAll(intptr_t connection, const void* data, size_t size)
+    {
+        const char* bytes = (const char*)data;
+        while (size > 0)
+        {
+            // A worker that died must not take the coordinator down with SIGPIPE
+#ifdef MSG_NOSIGNAL
+            int sent = send(connection, bytes, (int)std::min<size_t>(size, 1 << 30), MSG_NOSIGNAL);
+#else
+            int sent = send(connection, bytes, (int)std::min<size_t>(size, 1 << 30), 0);
+#endif
+            if (sent <= 0)
+                return false;
+            bytes += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    static bool ReceiveAll(intptr_t connection, void* data, size_t size)
+    {
+        char* bytes = (char*)data;
+        while (size > 0)
+        {
+            int received = recv(connection, bytes, (int)std::min<size_t>(size, 1 << 30), 0);
+            if (received <= 0)
+                return false;
+            bytes += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    RenderCoordinator::RenderCoordinator()
+        : listenSocket(INVALID_SOCKET), port(0), width(0), height(0), numSamples(0)
+    {
+    }
+
+    RenderCoordinator::~RenderCoordinator()
+    {
+        if (listenSocket != INVALID_SOCKET)
+            CloseSocket(listenSocket);
+    }
+
+    bool RenderCoordinator::Listen(int port, bool loopbackOnly)
+    {
+        if (!InitSockets())
+            return false;
+
+        listenSocket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listenSocket == INVALID_SOCKET)
+            return false;
+
+        int reuse = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((uint16_t)port);
+        address.sin_addr.s_addr = htonl(loopbackOnly ? INADDR_LOOPBACK : INADDR_ANY);
+        if (bind(listenSocket, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenSocket, SOMAXCONN) != 0)
+        {
+            printf("Unable to listen on port %d\n", port);
+            return false;
+        }
+
+        socklen_t length = sizeof(address);
+        getsockname(listenSocket, (sockaddr*)&address, &length);
+        this->port = ntohs(address.sin_port);
+        return true;
+    }
+
+    bool RenderCoordinator::Render(int numWorkers, int numSamples, uint64_t sceneHash, int width, int height, const std::vector<intptr_t>& localWorkers)
+    {
+        std::vector<intptr_t> workers;
+        int idleSeconds = 0;
+        while ((int)workers.size() < numWorkers)
+        {
+            // Waits a second at a time, so workers that crashed before connecting don't block the coordinator
+            fd_set pending;
+            FD_ZERO(&pending);
+            FD_SET(listenSocket, &pending);
+            timeval interval = { 1, 0 };
+            int ready = select((int)listenSocket + 1, &pending, nullptr, nullptr, &interval);
+            if (ready < 0)
+                break;
+            if (ready == 0)
+            {
+                // Without remote workers nobody else can connect once all started ones exited
+                bool localOnly = (int)localWorkers.size() == numWorkers;
+                bool running = std::any_of(localWorkers.begin(), localWorkers.end(), [](intptr_t process) { return !ProcessExited(process); });
+                if ((localOnly && !running) || ++idleSeconds >= kAcceptTimeout)
+                    break;
+                continue;
+            }
+            idleSeconds = 0;
+
+            intptr_t connection = accept(listenSocket, nullptr, nullptr);
+            if (connection == INVALID_SOCKET)
+                return false;
+
+            // Consecutive ranges, the first workers take one sample more when it does not divide evenly
+            int index = (int)workers.size();
+            JobMessage job = {};
+            job.magic = kJobMagic;
+            job.sceneHash = sceneHash;
+            job.numSamples = numSamples / numWorkers + (index < numSamples % numWorkers ? 1 : 0);
+            job.firstSample = index * (numSamples / numWorkers) + std::min(index, numSamples % numWorkers);
+            if (!SendAll(connection, &job, sizeof(job)))
+            {
+                CloseSocket(connection);
+                continue;
+            }
+
+            printf("Worker %d renders samples %d to %d\n", index, job.firstSample, job.firstSample + job.numSamples - 1);
+            workers.push_back(connection);
+        }
+
+        if ((int)workers.size() < numWorkers)
+            printf("Only %d of %d workers connected, their samples are missing\n", (int)workers.size(), numWorkers);
+
+        // Accumulation buffers are sums, merging is adding them up. Every worker renders at the resolution of
+        // the scene, so the size is checked before anything of the payload is read
+        this->width = width;
+        this->height = height;
+        accum.clear();
+        this->numSamples = 0;
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            ResultMessage result;
+            std::vector<Vec4> pixels;
+            bool ok = ReceiveAll(workers[i], &result, sizeof(result)) && result.magic == kResultMagic && result.numSamples > 0 &&
+                result.width == width && result.height == height;
+            if (ok)
+            {
+                pixels.resize((size_t)width * height);
+                ok = ReceiveAll(workers[i], &pixels[0], sizeof(Vec4) * pixels.size());
+            }
+            CloseSocket(workers[i]);
+
+            if (!ok)
+            {
+                printf("Worker %d failed, its samples are missing\n", (int)i);
+                continue;
+            }
+
+            if (accum.empty())
+                accum.swap(pixels);
+            else
+            {
+                for (size_t j = 0; j < accum.size(); j++)
+                {
+                    accum[j].x += pixels[j].x;
+                    accum[j].y += pixels[j].y;
+                    accum[j].z += pixels[j].z;
+                    accum[j].w += pixels[j].w;
+                }
+            }
+            this->numSamples += result.numSamples;
+            printf("Merged worker %d, %d of %d samples\n", (int)i, this->numSamples, numSamples);
+        }
+
+        return this->numSamples > 0;
+    }
+
+    RenderWorker::RenderWorker()
+        : connection(INVALID_SOCKET)
+    {
+    }
+
+    RenderWorker::~RenderWorker()
+    {
+        if (connection != INVALID_SOCKET)
+            CloseSocket(connection);
+    }
+
+    bool RenderWorker::Connect(const std::string& address)
+    {
+        if (!InitSockets())
+            return false;
+
+        std::string host = "127.0.0.1";
+        std::string port = address;
+        size_t colon = address.rfind(':');
+        if (colon != std::string::npos)
+        {
+            host = address.substr(0, colon);
+            port = address.substr(colon + 1);
+        }
+
+        sockaddr_in server = {};
+        server.sin_family = AF_INET;
+        server.sin_port = htons((uint16_t)atoi(port.c_str()));
+        if (inet_pton(AF_INET, host.c_str(), &server.sin_addr) != 1)
+        {
+            printf("Invalid coordinator address %s\n", address.c_str());
+            return false;
+        }
+
+        connection = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (connection == INVALID_SOCKET || connect(connection, (sockaddr*)&server, sizeof(server)) != 0)
+        {
+            printf("Unable to connect to %s\n", address.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool RenderWorker::ReceiveJob(RenderJob& job)
+    {
+        JobMessage message;
+        if (!ReceiveAll(connection, &message, sizeof(message)) || message.magic != kJobMagic)
+            return false;
+
+        job.sceneHash = message.sceneHash;
+        job.firstSample = message.firstSample;
+        job.numSamples = message.numSamples;
+        return true;
+    }
+
+    bool RenderWorker::SendResult(int width, int height, int numSamples, const std::vector<Vec4>& accum)
+    {
+        ResultMessage result;
+        result.magic = kResultMagic;
+        result.width = width;
+        result.height = height;
+        result.numSamples = numSamples;
+        if (!SendAll(connection, &result, sizeof(result)))
+            return false;
+        return numSamples <= 0 || SendAll(connection, &accum[0], sizeof(Vec4) * accum.size());
+    }
+
+    bool SpawnProcess(const std::string& executable, const std::vector<std::string>& args, intptr_t* process)
+    {
+        std::vector<char*> argv;
+        argv.push_back((char*)executable.c_str());
+        for (const std::string& arg : args)
+            argv.push_back((char*)arg.c_str());
+        argv.push_back(nullptr);
+
+#ifdef _WIN32
+        intptr_t handle = _spawnvp(_P_NOWAIT, executable.c_str(), &argv[0]);
+        if (handle == -1)
+            return false;
+#else
+        pid_t pid;
+        if (posix_spawnp(&pid, executable.c_str(), nullptr, nullptr, &argv[0], environ) != 0)
+            return false;
+        intptr_t handle = pid;
+#endif
+        if (process)
+            *process = handle;
+        return true;
+    }
+
+    bool ProcessExited(intptr_t process)
+    {
+#ifdef _WIN32
+        return WaitForSingleObject((HANDLE)process, 0) != WAIT_TIMEOUT;
+#else
+        // Reaps the process the first time, after that it is no child anymore and waitpid fails
+        int status;
+        return waitpid((pid_t)process, &status, WNOHANG) != 0;
+#endif
+    }
+}
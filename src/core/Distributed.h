@@ -0,0 +1,98 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Vec4.h"
+
+namespace GLSLPT
+{
+    // Share of a frame rendered by one worker process, samples [firstSample, firstSample + numSamples)
+    struct RenderJob
+    {
+        uint64_t sceneHash;
+        int firstSample;
+        int numSamples;
+    };
+
+    // Splits the samples of a frame over worker processes and adds up their accumulation buffers.
+    // Workers seed their samples by sample index, so together they render the same passes a single
+    // renderer would. Messages are plain structs over TCP, workers may run on other hosts
+    class RenderCoordinator
+    {
+    public:
+        RenderCoordinator();
+        ~RenderCoordinator();
+
+        // Port 0 picks a free one. Without remote workers only loopback connections are accepted
+        bool Listen(int port, bool loopbackOnly);
+        int GetPort() const { return port; }
+
+        // Waits for numWorkers connections, hands each an equal share of numSamples and merges what comes back.
+        // The wait ends early once every started local worker exited or nobody connected for a while. Workers
+        // that fail or return an image of another size are reported and left out, false if none succeeded
+        bool Render(int numWorkers, int numSamples, uint64_t sceneHash, int width, int height, const std::vector<intptr_t>& localWorkers);
+
+        // Sum over all samples of the merged workers, divide by GetNumSamples for the image
+        const std::vector<Vec4>& GetAccumBuffer() const { return accum; }
+        int GetWidth() const { return width; }
+        int GetHeight() const { return height; }
+        int GetNumSamples() const { return numSamples; }
+
+    private:
+        intptr_t listenSocket;
+        int port;
+        std::vector<Vec4> accum;
+        int width;
+        int height;
+        int numSamples;
+    };
+
+    class RenderWorker
+    {
+    public:
+        RenderWorker();
+        ~RenderWorker();
+
+        // host:port, or just the port for a coordinator on this machine
+        bool Connect(const std::string& address);
+        bool ReceiveJob(RenderJob& job);
+
+        // Sum of numSamples samples per pixel. Zero samples tell the coordinator the job failed
+        bool SendResult(int width, int height, int numSamples, const std::vector<Vec4>& accum);
+
+    private:
+        intptr_t connection;
+    };
+
+    // Starts a copy of this program without waiting for it, e.g. a local worker. The handle of the process is
+    // stored in process if given
+    bool SpawnProcess(const std::string& executable, const std::vector<std::string>& args, intptr_t* process = nullptr);
+
+    // True once a process started by SpawnProcess has exited. Does not wait
+    bool ProcessExited(intptr_t process);
+}
@@ -26,6 +26,7 @@
 #include <memory.h>
 #include <stdio.h>
 #include <string>
+#include <vector>
 #include "EnvironmentMap.h"
 
 namespace GLSLPT
@@ -35,29 +36,103 @@ namespace GLSLPT
         return 0.212671f * r + 0.715160f * g + 0.072169f * b;
     }
 
+    // Vose's alias method. weights are scaled to average 1 and each slot gets a probability and an alias
+    void BuildAliasTable(const double* weights, int n, double sum, float* out, int stride)
+    {
+        std::vector<double> scaled(n);
+        std::vector<int> small, large;
+        small.reserve(n);
+        large.reserve(n);
+
+        for (int i = 0; i < n; i++)
+        {
+            scaled[i] = sum > 0.0 ? weights[i] * n / sum : 1.0;
+            if (scaled[i] < 1.0)
+                small.push_back(i);
+            else
+                large.push_back(i);
+        }
+
+        while (!small.empty() && !large.empty())
+        {
+            int s = small.back();
+            small.pop_back();
+            int l = large.back();
+
+            out[s * stride + 0] = (float)scaled[s];
+            out[s * stride + 1] = (float)l;
+
+            scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+            if (scaled[l] < 1.0)
+            {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // Leftovers are 1 up to rounding
+        for (int i = 0; i < (int)large.size(); i++)
+        {
+            out[large[i] * stride + 0] = 1.0f;
+            out[large[i] * stride + 1] = (float)large[i];
+        }
+        for (int i = 0; i < (int)small.size(); i++)
+        {
+            out[small[i] * stride + 0] = 1.0f;
+            out[small[i] * stride + 1] = (float)small[i];
+        }
+    }
+
     // https://pbr-book.org/3ed-2018/Light_Transport_I_Surface_Reflection/Sampling_Light_Sources#InfiniteAreaLights
-    void EnvironmentMap::BuildCDF()
+    // Piecewise constant 2D distribution over the lat-long image. Pixels are weighted by luminance * sin(theta) so the
+    // pdf is proportional to radiance per solid angle, and both the marginal and the conditional distributions are
+    // turned into alias tables so the shader can sample them with constant work
+    void EnvironmentMap::BuildSamplingTables()
     {
-        // Gather weights for CDF
-        float* weights = new float[width * height];
+        int stride = (width + 1) * 4;
+        aliasTable = new float[stride * height];
+
+        std::vector<double> weights((size_t)width * height);
+        std::vector<double> rowSums(height);
+
+        // Rows are independent
+#pragma omp parallel for
         for (int v = 0; v < height; v++)
         {
+            float sinTheta = sinf(PI * (v + 0.5f) / height);
+            double rowSum = 0.0;
             for (int u = 0; u < width; u++)
             {
                 int imgIdx = v * width * 3 + u * 3;
-                weights[u + v * width] = Luminance(img[imgIdx + 0], img[imgIdx + 1], img[imgIdx + 2]);
+                double w = Luminance(img[imgIdx + 0], img[imgIdx + 1], img[imgIdx + 2]) * sinTheta;
+                weights[(size_t)v * width + u] = w;
+                rowSum += w;
             }
+            rowSums[v] = rowSum;
+
+            BuildAliasTable(&weights[(size_t)v * width], width, rowSum, &aliasTable[v * stride], 4);
         }
 
-        // Build CDF
-        cdf = new float[width * height];
-        cdf[0] = weights[0];
-        for (int i = 1; i < width * height; i++)
-            cdf[i] = cdf[i - 1] + weights[i];
+        double total = 0.0;
+        for (int v = 0; v < height; v++)
+            total += rowSums[v];
+        totalSum = (float)total;
 
-        totalSum = cdf[width * height - 1];
+        // Marginal distribution over rows, stored in the last column
+        BuildAliasTable(&rowSums[0], height, total, &aliasTable[width * 4], stride);
 
-        delete[] weights;
+        // Pdfs with respect to the unit square, uniform if the map is black
+#pragma omp parallel for
+        for (int v = 0; v < height; v++)
+        {
+            for (int u = 0; u < width; u++)
+                aliasTable[v * stride + u * 4 + 2] = total > 0.0 ? (float)(weights[(size_t)v * width + u] / total * width * height) : 1.0f;
+            aliasTable[v * stride + width * 4 + 2] = total > 0.0 ? (float)(rowSums[v] / total * height) : 1.0f;
+
+            aliasTable[v * stride + width * 4 + 3] = 0.0f;
+            for (int u = 0; u < width; u++)
+                aliasTable[v * stride + u * 4 + 3] = 0.0f;
+        }
     }
 
     bool EnvironmentMap::LoadMap(const std::string& filename)
@@ -67,7 +142,7 @@ namespace GLSLPT
         if (img == nullptr)
             return false;
 
-        BuildCDF();
+        BuildSamplingTables();
 
         return true;
     }
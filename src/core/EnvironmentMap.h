@@ -30,19 +30,29 @@
 
 namespace GLSLPT
 {
+    float Luminance(float r, float g, float b);
+
+    // Vose's alias method over n weights summing to sum. Writes (probability, alias) to the first two
+    // floats of each stride sized slot of out
+    void BuildAliasTable(const double* weights, int n, double sum, float* out, int stride);
+
     class EnvironmentMap
     {
     public:
-        EnvironmentMap() : width(0), height(0), img(nullptr), cdf(nullptr) {};
-        ~EnvironmentMap() { stbi_image_free(img); delete[] cdf; }
+        EnvironmentMap() : width(0), height(0), totalSum(0.0f), img(nullptr), aliasTable(nullptr) {};
+        ~EnvironmentMap() { stbi_image_free(img); delete[] aliasTable; }
 
         bool LoadMap(const std::string& filename);
-        void BuildCDF();
+        void BuildSamplingTables();
 
         int width;
         int height;
         float totalSum;
         float* img;
-        float* cdf;
+
+        // (width + 1) x height RGBA texels. Columns 0..width-1 hold the conditional alias table of each row
+        // (probability, alias, pdf of the pixel over the unit square). Column width holds the marginal alias
+        // table over rows (probability, alias, pdf of the row)
+        float* aliasTable;
     };
 }
@@ -0,0 +1,218 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include "ImageWriter.h"
+#include "stb_image_write.h"
+
+namespace GLSLPT
+{
+    ImageWriter::ImageWriter()
+    {
+        worker = std::thread(&ImageWriter::run, this);
+    }
+
+    ImageWriter::~ImageWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        wakeUp.notify_one();
+        worker.join();
+    }
+
+    void ImageWriter::WriteEXR(const std::string& filename, int width, int height, std::vector<float>&& pixels, float scale)
+    {
+        Job job;
+        job.filename = filename;
+        job.width = width;
+        job.height = height;
+        job.scale = scale;
+        job.hdrPixels = std::move(pixels);
+        push(std::move(job));
+    }
+
+    void ImageWriter::WritePNG(const std::string& filename, int width, int height, std::vector<unsigned char>&& pixels)
+    {
+        Job job;
+        job.filename = filename;
+        job.width = width;
+        job.height = height;
+        job.scale = 1.0f;
+        job.ldrPixels = std::move(pixels);
+        push(std::move(job));
+    }
+
+    void ImageWriter::WriteFile(const std::string& filename, std::vector<char>&& data)
+    {
+        Job job;
+        job.filename = filename;
+        job.width = 0;
+        job.height = 0;
+        job.scale = 1.0f;
+        job.data = std::move(data);
+        push(std::move(job));
+    }
+
+    void ImageWriter::push(Job&& job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        wakeUp.notify_one();
+    }
+
+    void ImageWriter::run()
+    {
+        // Only this thread writes, so the flip flag of stb is not shared
+        stbi_flip_vertically_on_write(true);
+
+        while (true)
+        {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeUp.wait(lock, [this] { return quit || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            bool saved;
+            if (!job.data.empty())
+                saved = saveFile(job.filename, job.data);
+            else if (!job.hdrPixels.empty())
+                saved = SaveEXR(job.filename, job.width, job.height, &job.hdrPixels[0], job.scale);
+            else
+                saved = stbi_write_png(job.filename.c_str(), job.width, job.height, 4, &job.ldrPixels[0], job.width * 4) != 0;
+
+            const char* kind = job.data.empty() ? "frame" : "file";
+            if (saved)
+                printf("Saved %s: %s\n", kind, job.filename.c_str());
+            else
+                printf("Unable to save %s: %s\n", kind, job.filename.c_str());
+        }
+    }
+
+    bool ImageWriter::saveFile(const std::string& filename, const std::vector<char>& data)
+    {
+        std::string tempName = filename + ".tmp";
+        {
+            std::ofstream file(tempName, std::ios::binary);
+            if (!file || !file.write(&data[0], data.size()))
+                return false;
+        }
+
+        std::error_code ec;
+        std::filesystem::rename(tempName, filename, ec);
+        return !ec;
+    }
+
+    // Header attributes and pixel data are little endian like the hosts the renderer runs on
+    static void WriteAttribute(std::vector<char>& header, const char* name, const char* type, const void* value, int size)
+    {
+        header.insert(header.end(), name, name + strlen(name) + 1);
+        header.insert(header.end(), type, type + strlen(type) + 1);
+        header.insert(header.end(), (const char*)&size, (const char*)&size + sizeof(int));
+        header.insert(header.end(), (const char*)value, (const char*)value + size);
+    }
+
+    bool ImageWriter::SaveEXR(const std::string& filename, int width, int height, const float* pixels, float scale)
+    {
+        FILE* file = fopen(filename.c_str(), "wb");
+        if (!file)
+            return false;
+
+        std::vector<char> header;
+        const int magic = 20000630;
+        const int version = 2; // Single part scanline file
+        header.insert(header.end(), (const char*)&magic, (const char*)&magic + sizeof(int));
+        header.insert(header.end(), (const char*)&version, (const char*)&version + sizeof(int));
+
+        // Channels are stored in alphabetical order
+        const char* channelNames[4] = { "A", "B", "G", "R" };
+        const int channelOffsets[4] = { 3, 2, 1, 0 };
+        std::vector<char> channels;
+        for (int i = 0; i < 4; i++)
+        {
+            const int pixelType = 2; // FLOAT
+            const int sampling[2] = { 1, 1 };
+            const char linear[4] = { 0, 0, 0, 0 };
+            channels.insert(channels.end(), channelNames[i], channelNames[i] + 2);
+            channels.insert(channels.end(), (const char*)&pixelType, (const char*)&pixelType + sizeof(int));
+            channels.insert(channels.end(), linear, linear + 4);
+            channels.insert(channels.end(), (const char*)sampling, (const char*)sampling + sizeof(sampling));
+        }
+        channels.push_back(0);
+
+        const char compression = 0; // NO_COMPRESSION
+        const char lineOrder = 0;   // INCREASING_Y
+        const int window[4] = { 0, 0, width - 1, height - 1 };
+        const float aspectRatio = 1.0f;
+        const float center[2] = { 0.0f, 0.0f };
+        const float screenWidth = 1.0f;
+        WriteAttribute(header, "channels", "chlist", &channels[0], (int)channels.size());
+        WriteAttribute(header, "compression", "compression", &compression, 1);
+        WriteAttribute(header, "dataWindow", "box2i", window, sizeof(window));
+        WriteAttribute(header, "displayWindow", "box2i", window, sizeof(window));
+        WriteAttribute(header, "lineOrder", "lineOrder", &lineOrder, 1);
+        WriteAttribute(header, "pixelAspectRatio", "float", &aspectRatio, sizeof(float));
+        WriteAttribute(header, "screenWindowCenter", "v2f", center, sizeof(center));
+        WriteAttribute(header, "screenWindowWidth", "float", &screenWidth, sizeof(float));
+        header.push_back(0);
+
+        // Offset table, every uncompressed block holds one scanline
+        const int lineSize = width * 4 * sizeof(float);
+        const int blockSize = 2 * sizeof(int) + lineSize;
+        std::vector<uint64_t> offsets(height);
+        for (int y = 0; y < height; y++)
+            offsets[y] = header.size() + height * sizeof(uint64_t) + (uint64_t)y * blockSize;
+
+        bool ok = fwrite(&header[0], header.size(), 1, file) == 1;
+        ok = ok && fwrite(&offsets[0], sizeof(uint64_t), height, file) == (size_t)height;
+
+        // Scanline 0 is the top of the image
+        std::vector<float> line(width * 4);
+        for (int y = 0; y < height && ok; y++)
+        {
+            const float* row = pixels + (size_t)(height - 1 - y) * width * 4;
+            for (int c = 0; c < 4; c++)
+                for (int x = 0; x < width; x++)
+                    line[c * width + x] = row[x * 4 + channelOffsets[c]] * scale;
+
+            ok = fwrite(&y, sizeof(int), 1, file) == 1;
+            ok = ok && fwrite(&lineSize, sizeof(int), 1, file) == 1;
+            ok = ok && fwrite(&line[0], lineSize, 1, file) == 1;
+        }
+
+        return fclose(file) == 0 && ok;
+    }
+}
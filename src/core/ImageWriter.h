@@ -0,0 +1,81 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace GLSLPT
+{
+    // Encodes and writes images on a worker thread so saving a frame never stalls rendering.
+    // Pixels are RGBA with rows from bottom to top as read back from OpenGL
+    class ImageWriter
+    {
+    public:
+        ImageWriter();
+
+        // Writes everything still queued before returning
+        ~ImageWriter();
+
+        // Linear float image, every value is multiplied by scale before it is written
+        void WriteEXR(const std::string& filename, int width, int height, std::vector<float>&& pixels, float scale = 1.0f);
+
+        // 8 bit image as displayed
+        void WritePNG(const std::string& filename, int width, int height, std::vector<unsigned char>&& pixels);
+
+        // Any other file. It is written next to the destination first and then renamed, so an interrupted
+        // write never replaces a complete file
+        void WriteFile(const std::string& filename, std::vector<char>&& data);
+
+        // Uncompressed single part scanline OpenEXR with 32 bit float RGBA channels
+        static bool SaveEXR(const std::string& filename, int width, int height, const float* pixels, float scale = 1.0f);
+
+    private:
+        struct Job
+        {
+            std::string filename;
+            int width;
+            int height;
+            float scale;
+            std::vector<float> hdrPixels;
+            std::vector<unsigned char> ldrPixels;
+            std::vector<char> data;
+        };
+
+        void push(Job&& job);
+        void run();
+        static bool saveFile(const std::string& filename, const std::vector<char>& data);
+
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable wakeUp;
+        std::deque<Job> jobs;
+        bool quit = false;
+    };
+}
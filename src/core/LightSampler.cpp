@@ -0,0 +1,384 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include "LightSampler.h"
+#include "Scene.h"
+
+namespace GLSLPT
+{
+    // Bit trails are stored as floats on the GPU so they have to stay exact
+    static const int kMaxTrailDepth = 23;
+    static const int kNumBuckets = 12;
+
+    // Subtrees with more emitters than this are built as separate tasks
+    static const int kParallelBuildSize = 4096;
+
+    static float SafeAcos(float x)
+    {
+        return acosf(std::min(1.0f, std::max(-1.0f, x)));
+    }
+
+    static float SafeSqrt(float x)
+    {
+        return sqrtf(std::max(0.0f, x));
+    }
+
+    static Vec3 Rotate(const Vec3& v, const Vec3& axis, float angle)
+    {
+        // Rodrigues' rotation formula
+        float c = cosf(angle);
+        float s = sinf(angle);
+        return v * c + Vec3::Cross(axis, v) * s + axis * (Vec3::Dot(axis, v) * (1.0f - c));
+    }
+
+    // Smallest cone containing both cones.
+    // https://pbr-book.org/4ed/Light_Sources/Light_Sampling#BoundingtheDirections
+    static void UnionCones(const Vec3& wa, float cosA, const Vec3& wb, float cosB, Vec3& w, float& cosTheta)
+    {
+        float thetaA = SafeAcos(cosA);
+        float thetaB = SafeAcos(cosB);
+        float thetaD = SafeAcos(Vec3::Dot(wa, wb));
+
+        if (std::min(thetaD + thetaB, PI) <= thetaA)
+        {
+            w = wa;
+            cosTheta = cosA;
+            return;
+        }
+        if (std::min(thetaD + thetaA, PI) <= thetaB)
+        {
+            w = wb;
+            cosTheta = cosB;
+            return;
+        }
+
+        float thetaO = (thetaA + thetaD + thetaB) * 0.5f;
+        Vec3 wr = Vec3::Cross(wa, wb);
+        if (thetaO >= PI || Vec3::Dot(wr, wr) == 0.0f)
+        {
+            w = wa;
+            cosTheta = -1.0f;
+            return;
+        }
+
+        w = Rotate(wa, Vec3::Normalize(wr), thetaO - thetaA);
+        cosTheta = cosf(thetaO);
+    }
+
+    static LightBounds Union(const LightBounds& a, const LightBounds& b)
+    {
+        if (a.phi == 0.0f)
+            return b;
+        if (b.phi == 0.0f)
+            return a;
+
+        LightBounds u;
+        u.pmin = Vec3::Min(a.pmin, b.pmin);
+        u.pmax = Vec3::Max(a.pmax, b.pmax);
+        u.phi = a.phi + b.phi;
+        UnionCones(a.axis, a.cosThetaO, b.axis, b.cosThetaO, u.axis, u.cosThetaO);
+        u.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+        u.twoSided = a.twoSided || b.twoSided;
+        return u;
+    }
+
+    static float SurfaceArea(const Vec3& pmin, const Vec3& pmax)
+    {
+        Vec3 d = pmax - pmin;
+        return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    // Surface area orientation heuristic of a cluster
+    static float EvaluateCost(const LightBounds& b, const Vec3& extent, int dim)
+    {
+        float thetaO = SafeAcos(b.cosThetaO);
+        float thetaE = SafeAcos(b.cosThetaE);
+        float thetaW = std::min(thetaO + thetaE, PI);
+        float sinThetaO = SafeSqrt(1.0f - b.cosThetaO * b.cosThetaO);
+        float mOmega = 2.0f * PI * (1.0f - b.cosThetaO) +
+                       PI / 2.0f * (2.0f * thetaW * sinThetaO - cosf(thetaO - 2.0f * thetaW) - 2.0f * thetaO * sinThetaO + b.cosThetaO);
+
+        float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+        float kr = extent[dim] > 0.0f ? maxExtent / extent[dim] : 0.0f;
+
+        return b.phi * mOmega * kr * SurfaceArea(b.pmin, b.pmax);
+    }
+
+    static LightBounds BoundLight(const Light& light)
+    {
+        LightBounds b;
+        b.phi = Luminance(light.emission.x, light.emission.y, light.emission.z) * light.area * PI;
+        b.cosThetaE = 0.0f;
+        b.twoSided = false;
+
+        if ((int)light.type == LightType::RectLight)
+        {
+            Vec3 p1 = light.position + light.u;
+            Vec3 p2 = light.position + light.v;
+            Vec3 p3 = light.position + light.u + light.v;
+            b.pmin = Vec3::Min(Vec3::Min(light.position, p1), Vec3::Min(p2, p3));
+            b.pmax = Vec3::Max(Vec3::Max(light.position, p1), Vec3::Max(p2, p3));
+            b.axis = Vec3::Normalize(Vec3::Cross(light.u, light.v));
+            b.cosThetaO = 1.0f;
+        }
+        else
+        {
+            Vec3 r = Vec3(light.radius, light.radius, light.radius);
+            b.pmin = light.position - r;
+            b.pmax = light.position + r;
+            b.axis = Vec3(0.0f, 0.0f, 1.0f);
+            b.cosThetaO = -1.0f;
+        }
+
+        return b;
+    }
+
+    static LightBounds BoundTriangle(const EmissiveTriangle& tri, float luminance)
+    {
+        Vec3 p0 = Vec3(tri.p0.x, tri.p0.y, tri.p0.z);
+        Vec3 p1 = Vec3(tri.p1.x, tri.p1.y, tri.p1.z);
+        Vec3 p2 = Vec3(tri.p2.x, tri.p2.y, tri.p2.z);
+        Vec3 n = Vec3::Cross(p1 - p0, p2 - p0);
+        float len = Vec3::Length(n);
+
+        // Mesh emission is not culled by facing so triangles emit from both sides
+        LightBounds b;
+        b.pmin = Vec3::Min(p0, Vec3::Min(p1, p2));
+        b.pmax = Vec3::Max(p0, Vec3::Max(p1, p2));
+        b.axis = len > 0.0f ? n * (1.0f / len) : Vec3(0.0f, 0.0f, 1.0f);
+        b.phi = luminance * 0.5f * len * PI * 2.0f;
+        b.cosThetaO = 1.0f;
+        b.cosThetaE = 0.0f;
+        b.twoSided = true;
+        return b;
+    }
+
+    // A subtree over n emitters always has 2n - 1 nodes, so the position of every node is known up front
+    // and both children can be built concurrently
+    LightBounds LightSampler::buildRecursive(std::vector<std::pair<int, LightBounds>>& emitters, int start, int end, int nodeIndex, unsigned int bitTrail, int depth)
+    {
+        if (end - start == 1)
+        {
+            int emitterIndex = emitters[start].first;
+            nodes[nodeIndex].bounds = emitters[start].second;
+            nodes[nodeIndex].childOrLight = emitterIndex;
+            nodes[nodeIndex].isLeaf = true;
+            aliasTable[emitterIndex].w = (float)bitTrail;
+            return emitters[start].second;
+        }
+
+        Vec3 pmin(INFINITY, INFINITY, INFINITY), pmax(-INFINITY, -INFINITY, -INFINITY);
+        Vec3 cmin(INFINITY, INFINITY, INFINITY), cmax(-INFINITY, -INFINITY, -INFINITY);
+        for (int i = start; i < end; i++)
+        {
+            const LightBounds& lb = emitters[i].second;
+            Vec3 c = (lb.pmin + lb.pmax) * 0.5f;
+            pmin = Vec3::Min(pmin, lb.pmin);
+            pmax = Vec3::Max(pmax, lb.pmax);
+            cmin = Vec3::Min(cmin, c);
+            cmax = Vec3::Max(cmax, c);
+        }
+        Vec3 extent = pmax - pmin;
+
+        auto centroid = [](const LightBounds& lb, int dim) { return (lb.pmin[dim] + lb.pmax[dim]) * 0.5f; };
+        auto bucketOf = [&](const LightBounds& lb, int dim)
+        {
+            int b = (int)(kNumBuckets * (centroid(lb, dim) - cmin[dim]) / (cmax[dim] - cmin[dim]));
+            return std::min(std::max(b, 0), kNumBuckets - 1);
+        };
+
+        // Find the cheapest bucket boundary over all axes. Once the subtree could get deeper than the
+        // bit trail allows, fall back to splitting by count which keeps the remaining depth at log2(n)
+        int count = end - start;
+        int minDim = -1, minBucket = -1;
+        int depthLeft = kMaxTrailDepth - depth;
+        bool useSAOH = depthLeft > 1 && count < (1 << std::min(depthLeft - 1, 30));
+
+        if (useSAOH)
+        {
+            float minCost = INFINITY;
+            for (int dim = 0; dim < 3; dim++)
+            {
+                if (cmax[dim] == cmin[dim])
+                    continue;
+
+                LightBounds buckets[kNumBuckets] = {};
+                for (int i = start; i < end; i++)
+                {
+                    int b = bucketOf(emitters[i].second, dim);
+                    buckets[b] = Union(buckets[b], emitters[i].second);
+                }
+
+                for (int i = 1; i < kNumBuckets; i++)
+                {
+                    LightBounds below = {}, above = {};
+                    for (int j = 0; j < i; j++)
+                        below = Union(below, buckets[j]);
+                    for (int j = i; j < kNumBuckets; j++)
+                        above = Union(above, buckets[j]);
+
+                    float cost = EvaluateCost(below, extent, dim) + EvaluateCost(above, extent, dim);
+                    if (cost > 0.0f && cost < minCost)
+                    {
+                        minCost = cost;
+                        minDim = dim;
+                        minBucket = i;
+                    }
+                }
+            }
+        }
+
+        int mid;
+        if (minDim == -1)
+        {
+            int dim = 0;
+            Vec3 cextent = cmax - cmin;
+            if (cextent.y > cextent[dim])
+                dim = 1;
+            if (cextent.z > cextent[dim])
+                dim = 2;
+
+            mid = (start + end) / 2;
+            std::nth_element(emitters.begin() + start, emitters.begin() + mid, emitters.begin() + end,
+                [&](const std::pair<int, LightBounds>& a, const std::pair<int, LightBounds>& b)
+                { return centroid(a.second, dim) < centroid(b.second, dim); });
+        }
+        else
+        {
+            mid = std::partition(emitters.begin() + start, emitters.begin() + end,
+                [&](const std::pair<int, LightBounds>& l) { return bucketOf(l.second, minDim) < minBucket; }) - emitters.begin();
+
+            if (mid == start || mid == end)
+                mid = (start + end) / 2;
+        }
+
+        int secondChild = nodeIndex + 2 * (mid - start);
+        LightBounds b0, b1;
+
+        // Tasks need OpenMP 3.0, older runtimes (MSVC) build serially
+#if _OPENMP >= 200805
+#pragma omp task shared(emitters, b0) if (mid - start > kParallelBuildSize)
+#endif
+        b0 = buildRecursive(emitters, start, mid, nodeIndex + 1, bitTrail, depth + 1);
+        b1 = buildRecursive(emitters, mid, end, secondChild, bitTrail | (1u << depth), depth + 1);
+#if _OPENMP >= 200805
+#pragma omp taskwait
+#endif
+
+        nodes[nodeIndex].bounds = Union(b0, b1);
+        nodes[nodeIndex].childOrLight = secondChild;
+        nodes[nodeIndex].isLeaf = false;
+        return nodes[nodeIndex].bounds;
+    }
+
+    // https://pbr-book.org/4ed/Light_Sources/Light_Sampling
+    void LightSampler::Build(const std::vector<Light>& lights, const std::vector<EmissiveTriangle>& triangles,
+                             const std::vector<float>& materialLuminance, float sceneRadius)
+    {
+        int numLights = lights.size();
+        int numTriangles = triangles.size();
+        int numEmitters = numLights + numTriangles;
+        aliasTable.assign(numEmitters, Vec4());
+        bvhNodes.clear();
+        nodes.clear();
+        numInfiniteLights = 0;
+        bvhUsable = true;
+
+        if (numEmitters == 0)
+            return;
+
+        // Bound every emitter. Distant lights are weighted as a disk covering the scene
+        std::vector<LightBounds> bounds(numEmitters);
+        std::vector<double> power(numEmitters);
+
+        for (int i = 0; i < numLights; i++)
+        {
+            const Light& light = lights[i];
+            if ((int)light.type == LightType::DistantLight)
+            {
+                power[i] = Luminance(light.emission.x, light.emission.y, light.emission.z) * PI * sceneRadius * sceneRadius;
+                bounds[i].phi = 0.0f;
+                numInfiniteLights++;
+            }
+            else
+            {
+                bounds[i] = BoundLight(light);
+                power[i] = bounds[i].phi;
+            }
+        }
+
+#pragma omp parallel for
+        for (int i = 0; i < numTriangles; i++)
+        {
+            int matID = (int)triangles[i].uvMat.w;
+            bounds[numLights + i] = BoundTriangle(triangles[i], materialLuminance[matID]);
+            power[numLights + i] = bounds[numLights + i].phi;
+        }
+
+        double totalPower = 0.0;
+        std::vector<std::pair<int, LightBounds>> bounded;
+        for (int i = 0; i < numEmitters; i++)
+        {
+            totalPower += power[i];
+            if (bounds[i].phi > 0.0f)
+                bounded.push_back(std::make_pair(i, bounds[i]));
+        }
+
+        // Power weighted alias table
+        BuildAliasTable(&power[0], numEmitters, totalPower, &aliasTable[0].x, 4);
+        for (int i = 0; i < numEmitters; i++)
+            aliasTable[i].z = totalPower > 0.0 ? (float)(power[i] / totalPower) : 1.0f / numEmitters;
+
+        // Emitter bvh over everything with a finite extent. A tree over n emitters needs trails of log2(n) bits
+        if (bounded.size() > (1u << kMaxTrailDepth))
+        {
+            printf("Light sampler: %d bounded emitters exceed the light bvh limit of %d, using power sampling\n", (int)bounded.size(), 1 << kMaxTrailDepth);
+            bvhUsable = false;
+        }
+        else if (!bounded.empty())
+        {
+            nodes.resize(2 * bounded.size() - 1);
+
+#pragma omp parallel
+#pragma omp single
+            buildRecursive(bounded, 0, bounded.size(), 0, 0, 0);
+        }
+
+        bvhNodes.resize(nodes.size() * 4);
+        for (int i = 0; i < (int)nodes.size(); i++)
+        {
+            const BuildNode& node = nodes[i];
+            const LightBounds& b = node.bounds;
+            bvhNodes[i * 4 + 0] = Vec4(b.pmin.x, b.pmin.y, b.pmin.z, b.phi);
+            bvhNodes[i * 4 + 1] = Vec4(b.pmax.x, b.pmax.y, b.pmax.z, b.cosThetaO);
+            bvhNodes[i * 4 + 2] = Vec4(b.axis.x, b.axis.y, b.axis.z, b.cosThetaE);
+            bvhNodes[i * 4 + 3] = Vec4((float)node.childOrLight, node.isLeaf ? 1.0f : 0.0f, b.twoSided ? 1.0f : 0.0f, 0.0f);
+        }
+
+        printf("Light sampler: %d lights, %d emissive triangles, %d light bvh nodes\n", numLights, numTriangles, (int)nodes.size());
+    }
+}
@@ -0,0 +1,97 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <utility>
+#include <vector>
+#include "MathUtils.h"
+#include "Vec3.h"
+#include "Vec4.h"
+
+namespace GLSLPT
+{
+    struct Light;
+
+    // Where an emitter is and which directions it can emit into. The cone around axis bounds the
+    // surface normals (cosThetaO) and cosThetaE bounds the emission around each normal
+    struct LightBounds
+    {
+        Vec3 pmin;
+        Vec3 pmax;
+        Vec3 axis;
+        float phi;
+        float cosThetaO;
+        float cosThetaE;
+        bool twoSided;
+    };
+
+    // World space triangle of an emissive mesh instance, laid out as four texels for the GPU:
+    // (p0, uv0.x) (p1, uv0.y) (p2, uv1.x) (uv1.y, uv2.x, uv2.y, material id)
+    struct EmissiveTriangle
+    {
+        Vec4 p0;
+        Vec4 p1;
+        Vec4 p2;
+        Vec4 uvMat;
+    };
+
+    // Light selection structures built on the CPU and uploaded next to lightsTex.
+    // Emitters are indexed as the analytic lights followed by the emissive triangles.
+    // Distant lights have to be at the end of the light list as they are addressed as a range
+    class LightSampler
+    {
+    public:
+        LightSampler() : numInfiniteLights(0), bvhUsable(true) {};
+
+        // materialLuminance is the average emitted luminance of each material, used to weight triangles
+        void Build(const std::vector<Light>& lights, const std::vector<EmissiveTriangle>& triangles,
+                   const std::vector<float>& materialLuminance, float sceneRadius);
+
+        // One texel per emitter: (alias probability, alias, power pmf, bit trail of the emitter in the bvh)
+        std::vector<Vec4> aliasTable;
+
+        // Four texels per node in depth first order, the first child directly follows its parent:
+        // (bounds min, power) (bounds max, cos theta_o) (cone axis, cos theta_e) (second child or emitter, is leaf, two sided, 0)
+        std::vector<Vec4> bvhNodes;
+
+        int numInfiniteLights;
+
+        // False when there are more bounded emitters than bit trails can address. BVH selection then falls back
+        // to the power alias table
+        bool bvhUsable;
+
+    private:
+        struct BuildNode
+        {
+            LightBounds bounds;
+            int childOrLight;
+            bool isLeaf;
+        };
+
+        LightBounds buildRecursive(std::vector<std::pair<int, LightBounds>>& emitters, int start, int end, int nodeIndex, unsigned int bitTrail, int depth);
+
+        std::vector<BuildNode> nodes;
+    };
+}
@@ -24,6 +24,7 @@
 
 #define TINYOBJLOADER_IMPLEMENTATION
 
+#include <algorithm>
 #include <iostream>
 #include "tiny_obj_loader.h"
 #include "Mesh.h"
@@ -97,10 +98,19 @@ namespace GLSLPT
                     normalsUVY.push_back(Vec4(nx, ny, nz, ty));
                 }
 
+                // Slots follow the materials of the .mtl file
+                int slot = f < shapes[s].mesh.material_ids.size() ? shapes[s].mesh.material_ids[f] : 0;
+                slot = slot < 0 ? 0 : slot;
+                materialSlots.push_back(slot);
+                numMaterialSlots = std::max(numMaterialSlots, slot + 1);
+
                 index_offset += 3;
             }
         }
 
+        if (numMaterialSlots == 1)
+            materialSlots.clear();
+
         /*Vec3 center = Vec3(0.0, 0.0, 0.0);
 
         for (int i = 0; i < verticesUVX.size(); i++)
@@ -135,6 +145,30 @@ namespace GLSLPT
             bounds[i].grow(v3);
         }
 
-        bvh->Build(&bounds[0], numTris);
+        bvh.reset();
+
+        if (bvhSettings.spatialSplits)
+        {
+            RadeonRays::SplitBvh* splitBvh = new RadeonRays::SplitBvh(2.0f, 64, bvhSettings.maxSplitDepth, bvhSettings.minOverlap, bvhSettings.splitBudget);
+            splitBvh->SetTriangles(&verticesUVX[0]);
+            splitBvh->Build(&bounds[0], numTris);
+
+            int extraRefs = splitBvh->GetNumExtraRefs();
+            printf("Spatial splits for %s: %d triangles, %d references (+%.1f%%)\n", name.c_str(), numTris, numTris + extraRefs, 100.0f * extraRefs / numTris);
+            bvh.reset(splitBvh);
+        }
+        else
+        {
+            // Binned SAH with leaves of up to 3 triangles, built on all threads
+            bvh = std::make_shared<RadeonRays::Bvh>(2.0f, 64, true, 3);
+            bvh->Build(&bounds[0], numTris);
+        }
+
+        if (bvhSettings.optimize)
+        {
+            float sahCost = bvh->GetSahCost();
+            bvh->Optimize(bvhSettings.optimizeIterations);
+            printf("Optimized BVH for %s: SAH cost %.2f -> %.2f\n", name.c_str(), sahCost, bvh->GetSahCost());
+        }
     }
 }
\ No newline at end of file
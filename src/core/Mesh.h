@@ -24,20 +24,32 @@
 
 #pragma once
 
+#include <memory>
 #include <vector>
 #include "split_bvh.h"
 
 namespace GLSLPT
 {
+    struct BvhSettings
+    {
+        // Spatial splits (SBVH) duplicate references of long, thin triangles so that sibling nodes
+        // overlap less. Slower to build but faster to trace on architectural geometry
+        bool spatialSplits = false;
+        int maxSplitDepth = 48;
+        // Only try spatial splits when the children of the object split overlap by this fraction of the root area
+        float minOverlap = 1e-5f;
+        // Extra references allowed, as a fraction of the triangle count
+        float splitBudget = 0.3f;
+        // Treelet restructuring after the build. Lowers the SAH cost for static meshes at the price of build time
+        bool optimize = false;
+        int optimizeIterations = 3;
+    };
+
     class Mesh
     {
     public:
-        Mesh()
-        {
-            bvh = new RadeonRays::SplitBvh(2.0f, 64, 0, 0.001f, 0);
-            //bvh = new RadeonRays::Bvh(2.0f, 64, false);
-        }
-        ~Mesh() { delete bvh; }
+        Mesh() {}
+        ~Mesh() {}
 
         void BuildBVH();
         bool LoadFromFile(const std::string& filename);
@@ -45,7 +57,14 @@ namespace GLSLPT
         std::vector<Vec4> verticesUVX; // Vertex + texture Coord (u/s)
         std::vector<Vec4> normalsUVY;  // Normal + texture Coord (v/t)
 
-        RadeonRays::Bvh* bvh;
+        // Material slot of every triangle, resolved to a scene material by each instance. Empty when the
+        // whole mesh uses slot 0
+        std::vector<int> materialSlots;
+        int numMaterialSlots = 1;
+
+        BvhSettings bvhSettings;
+        // Shared with the BLAS cache and with meshes of identical geometry
+        std::shared_ptr<RadeonRays::Bvh> bvh;
         std::string name;
     };
 
@@ -62,10 +81,34 @@ namespace GLSLPT
         }
         ~MeshInstance() {}
 
+        // Scene material of a material slot of the mesh. Slots without an override use materialID
+        int GetMaterial(int slot) const
+        {
+            if (slot < (int)materialOverrides.size() && materialOverrides[slot] >= 0)
+                return materialOverrides[slot];
+            return materialID;
+        }
+
         Mat4 transform;
         std::string name;
 
         int materialID;
         int meshID;
+        // Instance group placed by this instance instead of a mesh, -1 for mesh instances.
+        // Group instances have no mesh and no material
+        int groupID = -1;
+        // Per slot materials, -1 keeps materialID
+        std::vector<int> materialOverrides;
+    };
+
+    // Instances that are placed together as one instance of the top level BVH. The instances of all groups are
+    // stored back to back with transforms relative to the group, this group owns [firstInstance, firstInstance + numInstances)
+    struct InstanceGroup
+    {
+        std::string name;
+        int firstInstance = 0;
+        int numInstances = 0;
+        // Built over the bounds of the instances in group space
+        std::shared_ptr<RadeonRays::Bvh> bvh;
     };
 }
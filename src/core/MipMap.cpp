@@ -0,0 +1,143 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include "MipMap.h"
+
+namespace GLSLPT
+{
+    namespace
+    {
+        // Matches the pow(col, 2.2) decode done by the shaders so filtering happens in linear space
+        const float* GammaToLinearTable()
+        {
+            static const std::vector<float> table = []()
+            {
+                std::vector<float> t(256);
+                for (int i = 0; i < 256; i++)
+                    t[i] = powf(i / 255.0f, 2.2f);
+                return t;
+            }();
+            return table.data();
+        }
+
+        unsigned char ToByte(float v)
+        {
+            v = std::min(std::max(v, 0.0f), 1.0f);
+            return (unsigned char)(v * 255.0f + 0.5f);
+        }
+    }
+
+    int MipLevelCount(int width, int height)
+    {
+        int levels = 1;
+        int size = std::max(width, height);
+        while (size > 1)
+        {
+            size >>= 1;
+            levels++;
+        }
+        return levels;
+    }
+
+    void DownsampleRGBA8(const unsigned char* src, int srcWidth, int srcHeight,
+                         unsigned char* dst, int dstWidth, int dstHeight, TexelEncoding encoding)
+    {
+        const float* toLinear = GammaToLinearTable();
+
+        for (int y = 0; y < dstHeight; y++)
+        {
+            int y0 = (y * srcHeight) / dstHeight;
+            int y1 = std::max(y0 + 1, ((y + 1) * srcHeight) / dstHeight);
+
+            for (int x = 0; x < dstWidth; x++)
+            {
+                int x0 = (x * srcWidth) / dstWidth;
+                int x1 = std::max(x0 + 1, ((x + 1) * srcWidth) / dstWidth);
+
+                float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                for (int sy = y0; sy < y1; sy++)
+                {
+                    const unsigned char* row = src + (size_t)sy * srcWidth * 4;
+                    for (int sx = x0; sx < x1; sx++)
+                    {
+                        const unsigned char* texel = row + sx * 4;
+                        if (encoding == TexelEncoding::Gamma)
+                        {
+                            sum[0] += toLinear[texel[0]];
+                            sum[1] += toLinear[texel[1]];
+                            sum[2] += toLinear[texel[2]];
+                        }
+                        else if (encoding == TexelEncoding::NormalMap)
+                        {
+                            sum[0] += texel[0] / 255.0f * 2.0f - 1.0f;
+                            sum[1] += texel[1] / 255.0f * 2.0f - 1.0f;
+                            sum[2] += texel[2] / 255.0f * 2.0f - 1.0f;
+                        }
+                        else
+                        {
+                            sum[0] += texel[0] / 255.0f;
+                            sum[1] += texel[1] / 255.0f;
+                            sum[2] += texel[2] / 255.0f;
+                        }
+                        sum[3] += texel[3] / 255.0f;
+                    }
+                }
+
+                float invCount = 1.0f / ((x1 - x0) * (y1 - y0));
+                unsigned char* out = dst + ((size_t)y * dstWidth + x) * 4;
+
+                if (encoding == TexelEncoding::Gamma)
+                {
+                    for (int c = 0; c < 3; c++)
+                        out[c] = ToByte(powf(sum[c] * invCount, 1.0f / 2.2f));
+                }
+                else if (encoding == TexelEncoding::NormalMap)
+                {
+                    float len = sqrtf(sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2]);
+                    if (len > 0.0f)
+                    {
+                        for (int c = 0; c < 3; c++)
+                            out[c] = ToByte(sum[c] / len * 0.5f + 0.5f);
+                    }
+                    else
+                    {
+                        // Normals cancelled out, fall back to the unperturbed normal
+                        out[0] = 128;
+                        out[1] = 128;
+                        out[2] = 255;
+                    }
+                }
+                else
+                {
+                    for (int c = 0; c < 3; c++)
+                        out[c] = ToByte(sum[c] * invCount);
+                }
+                out[3] = ToByte(sum[3] * invCount);
+            }
+        }
+    }
+}
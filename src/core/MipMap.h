@@ -0,0 +1,51 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+namespace GLSLPT
+{
+    // How the channels of an 8 bit texel have to be interpreted while filtering
+    enum class TexelEncoding
+    {
+        Linear,    // Metallic/roughness and other data maps
+        Gamma,     // Albedo and emission maps, decoded with pow(2.2) in GetMaterial
+        NormalMap  // Tangent space normals, renormalized after filtering
+    };
+
+    // Number of levels of a full mip chain down to 1x1
+    int MipLevelCount(int width, int height);
+
+    // Size of a given level of the chain
+    inline int MipLevelSize(int size, int level)
+    {
+        int s = size >> level;
+        return s > 0 ? s : 1;
+    }
+
+    // Box filters an RGBA8 image into a smaller one. Each destination texel averages the source
+    // texels whose centers fall into its footprint, so odd and non power of two sizes are handled
+    void DownsampleRGBA8(const unsigned char* src, int srcWidth, int srcHeight,
+                         unsigned char* dst, int dstWidth, int dstHeight, TexelEncoding encoding);
+}
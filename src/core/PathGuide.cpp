@@ -0,0 +1,233 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include "PathGuide.h"
+#include "MathUtils.h"
+
+namespace GLSLPT
+{
+    // Leaves split once they recorded more than kSpatialThreshold * sqrt(2^iteration) samples
+    static const float kSpatialThreshold = 12000.0f;
+    static const int kMaxSpatialDepth = 48;
+    // Quadrants holding more than this fraction of the energy of their quadtree are subdivided
+    static const float kSubdivideEnergy = 0.01f;
+    static const int kMaxQuadDepth = 20; // GUIDE_MAX_DEPTH of guiding.glsl
+
+    PathGuide::PathGuide()
+    {
+        Reset(Vec3(0.0f, 0.0f, 0.0f), Vec3(1.0f, 1.0f, 1.0f));
+    }
+
+    float PathGuide::DTree::Total() const
+    {
+        if (nodes.empty())
+            return 0.0f;
+        const QuadNode& root = nodes[0];
+        return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+    }
+
+    void PathGuide::ClearDTree(DTree& tree)
+    {
+        QuadNode root = {};
+        tree.nodes.assign(1, root);
+    }
+
+    void PathGuide::Reset(const Vec3& bboxMin, const Vec3& bboxMax)
+    {
+        // Flat scenes still get a box with volume
+        boundsMin = bboxMin;
+        boundsSize = Vec3::Max(bboxMax - bboxMin, Vec3(1e-4f, 1e-4f, 1e-4f));
+        iteration = 0;
+
+        SNode root;
+        root.axis = -1;
+        root.children = 0;
+        root.depth = 0;
+        root.numSamples = 0.0f;
+        root.sampling.nodes.clear();
+        ClearDTree(root.building);
+        nodes.assign(1, root);
+    }
+
+    void PathGuide::RecordDTree(DTree& tree, float u, float v, float value)
+    {
+        int node = 0;
+        while (true)
+        {
+            int qx = u >= 0.5f ? 1 : 0;
+            int qy = v >= 0.5f ? 1 : 0;
+            int q = qx + 2 * qy;
+            tree.nodes[node].sum[q] += value;
+
+            int child = tree.nodes[node].child[q];
+            if (child == 0)
+                break;
+            u = u * 2.0f - qx;
+            v = v * 2.0f - qy;
+            node = child;
+        }
+    }
+
+    void PathGuide::Record(const Vec3& position, const Vec3& direction, float value)
+    {
+        if (!(value > 0.0f) || std::isinf(value))
+            return;
+
+        // Position relative to the box of the current node
+        Vec3 p = Vec3::Clamp((position - boundsMin) * Vec3(1.0f / boundsSize.x, 1.0f / boundsSize.y, 1.0f / boundsSize.z),
+                             Vec3(0.0f, 0.0f, 0.0f), Vec3(1.0f, 1.0f, 1.0f));
+        int index = 0;
+        while (nodes[index].axis >= 0)
+        {
+            const SNode& node = nodes[index];
+            float c = p[node.axis] * 2.0f;
+            bool second = c >= 1.0f;
+            p[node.axis] = second ? c - 1.0f : c;
+            index = node.children + (second ? 1 : 0);
+        }
+
+        // Cylindrical coordinates keep areas, so the quadtree cells are solid angles
+        const float oneMinusEps = 0.99999994f;
+        float cosTheta = std::min(std::max(direction.z, -1.0f), 1.0f);
+        float phi = atan2f(direction.y, direction.x);
+        if (phi < 0.0f)
+            phi += 2.0f * PI;
+        float u = std::min((cosTheta + 1.0f) * 0.5f, oneMinusEps);
+        float v = std::min(phi / (2.0f * PI), oneMinusEps);
+
+        SNode& leaf = nodes[index];
+        leaf.numSamples += 1.0f;
+        RecordDTree(leaf.building, u, v, value);
+    }
+
+    void PathGuide::RefineDTree(const DTree& src, DTree& dst)
+    {
+        ClearDTree(dst);
+        float total = src.Total();
+        if (total <= 0.0f)
+            return;
+
+        // Source node of every new node, -1 below the leaves of src where the energy is spread evenly
+        struct Entry
+        {
+            int dst;
+            int src;
+            float sum;
+            int depth;
+        };
+
+        std::vector<Entry> stack;
+        stack.push_back({ 0, 0, total, 1 });
+        while (!stack.empty())
+        {
+            Entry entry = stack.back();
+            stack.pop_back();
+
+            for (int q = 0; q < 4; q++)
+            {
+                float sum = entry.src >= 0 ? src.nodes[entry.src].sum[q] : entry.sum * 0.25f;
+                if (sum <= kSubdivideEnergy * total || entry.depth >= kMaxQuadDepth)
+                    continue;
+
+                int child = (int)dst.nodes.size();
+                QuadNode node = {};
+                dst.nodes.push_back(node);
+                dst.nodes[entry.dst].child[q] = child;
+
+                int srcChild = entry.src >= 0 && src.nodes[entry.src].child[q] != 0 ? src.nodes[entry.src].child[q] : -1;
+                stack.push_back({ child, srcChild, sum, entry.depth + 1 });
+            }
+        }
+    }
+
+    void PathGuide::Refine()
+    {
+        // Children start with the distributions of their parent. Nodes appended here are visited as well,
+        // so a leaf keeps splitting until its share of the samples is below the threshold
+        float threshold = kSpatialThreshold * sqrtf((float)(1 << iteration));
+        for (int i = 0; i < (int)nodes.size(); i++)
+        {
+            if (nodes[i].axis >= 0 || nodes[i].numSamples <= threshold || nodes[i].depth >= kMaxSpatialDepth)
+                continue;
+
+            SNode child = nodes[i];
+            child.depth++;
+            child.numSamples *= 0.5f;
+
+            nodes[i].axis = nodes[i].depth % 3;
+            nodes[i].children = (int)nodes.size();
+            nodes[i].sampling.nodes.clear();
+            nodes[i].building.nodes.clear();
+
+            nodes.push_back(child);
+            nodes.push_back(child);
+        }
+
+        // Leaves that recorded nothing in this iteration keep sampling what they learned before
+        for (SNode& node : nodes)
+        {
+            if (node.axis >= 0)
+                continue;
+            if (node.building.Total() > 0.0f)
+                node.sampling = node.building;
+            RefineDTree(node.sampling, node.building);
+            node.numSamples = 0.0f;
+        }
+
+        iteration = std::min(iteration + 1, 16);
+    }
+
+    void PathGuide::GetTextureData(std::vector<Vec4>& data) const
+    {
+        data.assign(nodes.size(), Vec4());
+        for (int i = 0; i < (int)nodes.size(); i++)
+        {
+            const SNode& node = nodes[i];
+            if (node.axis >= 0)
+            {
+                data[i] = Vec4((float)node.axis, (float)node.children, 0.0f, 0.0f);
+                continue;
+            }
+
+            if (node.sampling.Total() <= 0.0f)
+            {
+                data[i] = Vec4(-1.0f, -1.0f, 0.0f, 0.0f);
+                continue;
+            }
+
+            int base = (int)data.size();
+            data[i] = Vec4(-1.0f, (float)base, 0.0f, 0.0f);
+            for (const QuadNode& quad : node.sampling.nodes)
+            {
+                data.push_back(Vec4(quad.sum[0], quad.sum[1], quad.sum[2], quad.sum[3]));
+                float child[4];
+                for (int q = 0; q < 4; q++)
+                    child[q] = quad.child[q] != 0 ? (float)(base + 2 * quad.child[q]) : -1.0f;
+                data.push_back(Vec4(child[0], child[1], child[2], child[3]));
+            }
+        }
+    }
+}
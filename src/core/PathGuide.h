@@ -0,0 +1,95 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include "Vec3.h"
+#include "Vec4.h"
+
+namespace GLSLPT
+{
+    // SD-tree for path guiding (Mueller et al. 2017, Practical Path Guiding). A binary tree over the scene
+    // bounds holds a quadtree over the directions in every leaf, learned from the incident radiance of the
+    // rendered paths. Training runs in iterations of doubling length, the distribution learned in one
+    // iteration is sampled during the next
+    class PathGuide
+    {
+    public:
+        PathGuide();
+
+        // Starts over with a single spatial leaf that has learned nothing yet
+        void Reset(const Vec3& bboxMin, const Vec3& bboxMax);
+
+        // value is the luminance of the radiance arriving from direction, divided by the pdf of the direction
+        void Record(const Vec3& position, const Vec3& direction, float value);
+
+        // Ends the iteration. Leaves that collected many samples are split, the recorded radiance becomes the
+        // sampling distribution and the quadtrees are refined where it is concentrated
+        void Refine();
+
+        // Spatial nodes first, one texel each: (split axis or -1 for leaves, first child or quadtree texel, 0, 0).
+        // Leaves that learned nothing point to -1. Quadtree nodes follow with two texels each:
+        // (energy of the four quadrants) (texel of the child node of every quadrant, -1 for leaves)
+        void GetTextureData(std::vector<Vec4>& data) const;
+
+        // Number of passes the current iteration records
+        int IterationPasses() const { return 1 << iteration; }
+
+        Vec3 boundsMin;
+        Vec3 boundsSize;
+
+    private:
+        // Quadrants are numbered x + 2y over the square of cylindrical coordinates (cos theta, phi)
+        struct QuadNode
+        {
+            float sum[4];
+            int child[4]; // 0 for leaves
+        };
+
+        struct DTree
+        {
+            std::vector<QuadNode> nodes;
+            float Total() const;
+        };
+
+        struct SNode
+        {
+            int axis;     // -1 for leaves
+            int children; // The second child directly follows the first
+            int depth;    // Leaves split along depth % 3
+            float numSamples;
+            DTree sampling;
+            DTree building;
+        };
+
+        static void ClearDTree(DTree& tree);
+        static void RecordDTree(DTree& tree, float u, float v, float value);
+        // Structure of dst subdivides the quadrants of src holding more than kSubdivideEnergy of its energy
+        static void RefineDTree(const DTree& src, DTree& dst);
+
+        std::vector<SNode> nodes;
+        int iteration;
+    };
+}
@@ -26,11 +26,16 @@
 #include "Renderer.h"
 #include "ShaderIncludes.h"
 #include "Scene.h"
-#include "OpenImageDenoise/oidn.hpp"
+#include "MipMap.h"
+#include "TextureCompressor.h"
+#include "Denoiser.h"
+#include "ImageWriter.h"
+#include "Sampler.h"
 #include "assert.h"
 #include "cstring"
 #include "lightbvh.h"
-#include <chrono>
+#include <cmath>
+#include <fstream>
 // point cloud
 #include <pcl/io/pcd_io.h>
 #include <pcl/point_types.h>
@@ -54,6 +59,28 @@ char *checkLinkErrors(uint32_t prog, int len, char *buffer)
 
 namespace GLSLPT
 {
+    // Checkpoint files start with this header, followed by the accumulation buffer, the AOVs, the moments and the light paths
+    struct CheckpointHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t sceneHash;
+        int32_t width;
+        int32_t height;
+        int32_t sampleCounter;
+        int32_t frameCounter;
+        int32_t tileX;
+        int32_t tileY;
+        int32_t currentBuffer;
+        int32_t numAOVs;
+        int32_t numMoments;
+        int32_t numLightPaths;
+        int32_t lightPathSize;
+    };
+
+    static const uint32_t kCheckpointMagic = 0x504b4348; // "HCKP"
+    static const uint32_t kCheckpointVersion = 2;
+
     Program *LoadShaders(const ShaderInclude::ShaderSource &vertShaderObj, const ShaderInclude::ShaderSource &fragShaderObj)
     {
         std::vector<Shader> shaders;
@@ -62,14 +89,81 @@ namespace GLSLPT
         return new Program(shaders);
     }
 
+    static GLuint CreateCompressedTextureArray(GLenum format, int width, int height, int layers, const std::vector<std::vector<unsigned char>> &levels)
+    {
+        GLuint tex;
+        glGenTextures(1, &tex);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+        for (int level = 0; level < levels.size(); level++)
+        {
+            int w = MipLevelSize(width, level);
+            int h = MipLevelSize(height, level);
+            glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, w, h, layers, 0, levels[level].size(), &levels[level][0]);
+        }
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels.size() - 1);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, levels.size() > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        return tex;
+    }
+
+    // Large buffers are allocated once and filled in pieces of this size, straight from the arrays that own the
+    // data, so no concatenated host copy is needed and the driver never stages more than one piece
+    static const size_t kUploadChunkBytes = 16 << 20;
+
+    static void UploadChunked(size_t offset, const void *data, size_t size)
+    {
+        const char *bytes = (const char *)data;
+        for (size_t done = 0; done < size; done += kUploadChunkBytes)
+            glBufferSubData(GL_TEXTURE_BUFFER, offset + done, std::min(kUploadChunkBytes, size - done), bytes + done);
+    }
+
+    // Creates or deletes an optional render target and attaches it to the bound framebuffer, a deleted one detaches
+    static void UpdateRenderTarget(GLuint &tex, bool enabled, int width, int height, GLenum attachment)
+    {
+        if (enabled && !tex)
+        {
+            glGenTextures(1, &tex);
+            glBindTexture(GL_TEXTURE_2D, tex);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, 0);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+        else if (!enabled && tex)
+        {
+            glDeleteTextures(1, &tex);
+            tex = 0;
+        }
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, tex, 0);
+    }
+
+    // MergeLightVertices walks the light path BVH with a stack of 64 nodes. A node at depth d leaves at most one
+    // sibling per level above it on the stack, so leaves up to 63 levels below the root fit
+    static const int kLightPathBvhMaxDepth = 63;
+
+    // BVH_ACC1 splits the longest axis in the middle, so every three levels at least halve the longest side of a
+    // node and a leaf is made once all sides are below the leaf size. Leaves sized to the extent over 2^20 are
+    // therefore reached within 63 levels. Larger leaves only cost merging time, the radius is checked per vertex
+    static double LightPathLeafSize(const RadeonRays::bbox &bounds)
+    {
+        Vec3 extents = bounds.extents();
+        double extent = std::max(extents.x, std::max(extents.y, extents.z));
+        return std::max(0.07, std::ldexp(extent, -(kLightPathBvhMaxDepth / 3 - 1)));
+    }
+
     Renderer::Renderer(Scene *scene, const std::string &shadersDirectory)
-        : scene(scene), BVHBuffer(0), BVHTex(0), vertexIndicesBuffer(0), vertexIndicesTex(0), verticesBuffer(0), verticesTex(0), normalsBuffer(0), normalsTex(0), materialsTex(0), transformsTex(0), lightsTex(0), textureMapsArrayTex(0), envMapTex(0), envMapCDFTex(0), pathTraceTextureLowRes(0), pathTraceTexture(0), accumTexture(0), tileOutputTexture(), denoisedTexture(0), pathTraceFBO(0), pathTraceFBOLowRes(0), accumFBO(0), outputFBO(0), shadersDirectory(shadersDirectory), pathTraceShader(nullptr), pathTraceShaderLowRes(nullptr), outputShader(nullptr), tonemapShader(nullptr)
+        : scene(scene), BVHBuffer(0), BVHTex(0), vertexIndicesBuffer(0), vertexIndicesTex(0), verticesBuffer(0), verticesTex(0), normalsBuffer(0), normalsTex(0), materialsTex(0), transformsTex(0), lightsTex(0), lightAliasBuffer(0), lightAliasTex(0), lightBvhBuffer(0), lightBvhTex(0), emissiveTrianglesBuffer(0), emissiveTrianglesTex(0), instanceEmittersBuffer(0), instanceEmittersTex(0), instanceMaterialsBuffer(0), instanceMaterialsTex(0), materialTablesBuffer(0), materialTablesTex(0), triangleSlotsBuffer(0), triangleSlotsTex(0), textureMapsArrayTex(0), normalMapsArrayTex(0), envMapTex(0), envMapAliasTex(0), sobolDirectionsTex(0), blueNoiseTex(0), pathTraceFBO(0), pathTraceFBOLowRes(0), accumFBO(0), outputFBO(0), shadersDirectory(shadersDirectory), pathTraceShader(nullptr), pathTraceShaderLowRes(nullptr), outputShader(nullptr), tonemapShader(nullptr), pathTraceTextureLowRes(0), pathTraceTexture(0), accumTexture(0), pathTraceAOVTextures(), accumAOVTextures(), pathTraceMomentsTexture(0), accumMomentsTexture(0), pathTraceGuideTextures(), guideSampleTextures(), tileOutputTexture(), denoisedTexture(0), frameOffset(0), sampleOffset(0), denoiserPBO(0), denoiserAOVPBO(0), denoiserFence(0), denoiser(nullptr), denoiserAOVs(false), emitterTriangles(false), lightBvh(false), adaptiveSampling(false), adaptivePBO(0), adaptiveFence(0), vertexMerging(false), pathGuiding(false), guidePasses(0), guidePBO(0), guideFence(0), guideTreeBuffer(0), guideTreeTex(0), captureScale(1.0f), capturePBO(0), captureFence(0), imageWriter(nullptr), resumeCheckpoint(nullptr), lightPathsRestored(false), lightPathEpoch(0)
     {
         lightInTex = 0;
         lightOutTex = 0;
         lightPathTex = 0;
         lightPathBVHTex = 0;
         lightPathBVHIndexTex = 0;
+        lightPathPBO = 0;
+        lightPathFence = 0;
+        lightPathFenceEpoch = 0;
 
         scPreLightSize = scene->renderOptions.sc_BDPT_LIGHTPATH;
 
@@ -84,6 +178,8 @@ namespace GLSLPT
 
         InitGPUDataBuffers();
         quad = new Quad();
+        denoiser = new Denoiser();
+        imageWriter = new ImageWriter();
         pixelRatio = 0.25f;
 
         InitFBOs();
@@ -92,7 +188,16 @@ namespace GLSLPT
 
     Renderer::~Renderer()
     {
+        // Frames already read back are still written, requests that did not start yet are dropped
+        if (captureFence)
+            FinishCapture();
+        for (const CaptureRequest &request : captureRequests)
+            printf("Frame not saved: %s\n", request.filename.c_str());
+        delete imageWriter;
+        delete resumeCheckpoint;
+
         delete quad;
+        delete denoiser;
         // Delete textures
         glDeleteTextures(1, &BVHTex);
         glDeleteTextures(1, &vertexIndicesTex);
@@ -101,12 +206,29 @@ namespace GLSLPT
         glDeleteTextures(1, &materialsTex);
         glDeleteTextures(1, &transformsTex);
         glDeleteTextures(1, &lightsTex);
+        glDeleteTextures(1, &lightAliasTex);
+        glDeleteTextures(1, &lightBvhTex);
+        glDeleteTextures(1, &emissiveTrianglesTex);
+        glDeleteTextures(1, &instanceEmittersTex);
+        glDeleteTextures(1, &instanceMaterialsTex);
+        glDeleteTextures(1, &materialTablesTex);
+        glDeleteTextures(1, &triangleSlotsTex);
         glDeleteTextures(1, &textureMapsArrayTex);
+        glDeleteTextures(1, &normalMapsArrayTex);
         glDeleteTextures(1, &envMapTex);
-        glDeleteTextures(1, &envMapCDFTex);
+        glDeleteTextures(1, &envMapAliasTex);
+        glDeleteTextures(1, &sobolDirectionsTex);
+        glDeleteTextures(1, &blueNoiseTex);
+        glDeleteTextures(1, &guideTreeTex);
         glDeleteTextures(1, &pathTraceTexture);
         glDeleteTextures(1, &pathTraceTextureLowRes);
         glDeleteTextures(1, &accumTexture);
+        glDeleteTextures(2, pathTraceAOVTextures);
+        glDeleteTextures(2, accumAOVTextures);
+        glDeleteTextures(1, &pathTraceMomentsTexture);
+        glDeleteTextures(1, &accumMomentsTexture);
+        glDeleteTextures(2, pathTraceGuideTextures);
+        glDeleteTextures(2, guideSampleTextures);
         glDeleteTextures(1, &tileOutputTexture[0]);
         glDeleteTextures(1, &tileOutputTexture[1]);
         glDeleteTextures(1, &denoisedTexture);
@@ -116,6 +238,14 @@ namespace GLSLPT
         glDeleteBuffers(1, &vertexIndicesBuffer);
         glDeleteBuffers(1, &verticesBuffer);
         glDeleteBuffers(1, &normalsBuffer);
+        glDeleteBuffers(1, &lightAliasBuffer);
+        glDeleteBuffers(1, &lightBvhBuffer);
+        glDeleteBuffers(1, &emissiveTrianglesBuffer);
+        glDeleteBuffers(1, &instanceEmittersBuffer);
+        glDeleteBuffers(1, &instanceMaterialsBuffer);
+        glDeleteBuffers(1, &materialTablesBuffer);
+        glDeleteBuffers(1, &triangleSlotsBuffer);
+        glDeleteBuffers(1, &guideTreeBuffer);
 
         // Delete FBOs
         glDeleteFramebuffers(1, &pathTraceFBO);
@@ -133,8 +263,22 @@ namespace GLSLPT
         delete sc_computeShader;
 
         // Delete denoiser data
-        delete[] denoiserInputFramePtr;
+        glDeleteBuffers(1, &denoiserPBO);
+        glDeleteBuffers(1, &denoiserAOVPBO);
+        if (denoiserFence)
+            glDeleteSync(denoiserFence);
+        denoiserFence = 0;
         delete[] frameOutputPtr;
+
+        glDeleteBuffers(1, &capturePBO);
+
+        glDeleteBuffers(1, &adaptivePBO);
+        if (adaptiveFence)
+            glDeleteSync(adaptiveFence);
+
+        glDeleteBuffers(1, &guidePBO);
+        if (guideFence)
+            glDeleteSync(guideFence);
     }
     void Renderer::ScReleaseLocalBuffer()
     {
@@ -147,6 +291,10 @@ namespace GLSLPT
         glDeleteBuffers(1, &lightPathBVHBuffer);
         glDeleteBuffers(1, &lightPathBVHIndexBuffer);
         glDeleteBuffers(1, &lightPathBuffer);
+        glDeleteBuffers(1, &lightPathPBO);
+        if (lightPathFence)
+            glDeleteSync(lightPathFence);
+        lightPathFence = 0;
 
         delete[] lightInPixels;
         for (int i = 0; i < lpnum; i++)
@@ -188,8 +336,18 @@ namespace GLSLPT
 
         glGenTextures(1, &lightOutTex);
         glBindTexture(GL_TEXTURE_2D, lightOutTex);
-        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, lpnum, scPreLightSize * 7); // wyd update light
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, lpnum, scPreLightSize * 9); // wyd update light
         glBindTexture(GL_TEXTURE_2D, 0);
+
+        // Paths traced for the previous buffers are not read anymore
+        if (lightPathFence)
+            glDeleteSync(lightPathFence);
+        lightPathFence = 0;
+        glDeleteBuffers(1, &lightPathPBO);
+        glGenBuffers(1, &lightPathPBO);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, lightPathPBO);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(GLfloat) * lpnum * scPreLightSize * 4 * 9, nullptr, GL_STREAM_READ);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
     }
 
     void Renderer::InitGPUDataBuffers()
@@ -198,25 +356,104 @@ namespace GLSLPT
             glPixelStorei(GL_PACK_ALIGNMENT, 1);
 
             // Create buffer and texture for BVH
+            RadeonRays::BvhTranslator& bvhTranslator = scene->bvhTranslator;
             glGenBuffers(1, &BVHBuffer);
             glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
-            glBufferData(GL_TEXTURE_BUFFER, sizeof(RadeonRays::BvhTranslator::Node) * scene->bvhTranslator.nodes.size(), &scene->bvhTranslator.nodes[0], GL_STATIC_DRAW);
             glGenTextures(1, &BVHTex);
             glBindTexture(GL_TEXTURE_BUFFER, BVHTex);
-            glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, BVHBuffer);
+            if (scene->renderOptions.compressBVH)
+            {
+                // Four integer texels per wide node
+                size_t size = sizeof(RadeonRays::BvhTranslator::WideNode) * bvhTranslator.wideNodes.size();
+                glBufferData(GL_TEXTURE_BUFFER, size, nullptr, GL_STATIC_DRAW);
+                UploadChunked(0, &bvhTranslator.wideNodes[0], size);
+                glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, BVHBuffer);
+            }
+            else if (scene->renderOptions.packBVH)
+            {
+                // Two integer texels per node, the shaders read the bounds back with intBitsToFloat.
+                // Nodes are packed one chunk at a time
+                typedef RadeonRays::BvhTranslator::PackedNode PackedNode;
+                int numNodes = bvhTranslator.nodes.size();
+                int chunkNodes = kUploadChunkBytes / sizeof(PackedNode);
+                glBufferData(GL_TEXTURE_BUFFER, sizeof(PackedNode) * numNodes, nullptr, GL_STATIC_DRAW);
+                std::vector<PackedNode> packedNodes;
+                for (int begin = 0; begin < numNodes; begin += chunkNodes)
+                {
+                    bvhTranslator.PackNodes(begin, std::min(begin + chunkNodes, numNodes), packedNodes);
+                    glBufferSubData(GL_TEXTURE_BUFFER, sizeof(PackedNode) * begin, sizeof(PackedNode) * packedNodes.size(), &packedNodes[0]);
+                }
+                glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, BVHBuffer);
+            }
+            else
+            {
+                size_t size = sizeof(RadeonRays::BvhTranslator::Node) * bvhTranslator.nodes.size();
+                glBufferData(GL_TEXTURE_BUFFER, size, nullptr, GL_STATIC_DRAW);
+                UploadChunked(0, &bvhTranslator.nodes[0], size);
+                glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, BVHBuffer);
+            }
+
+            // Packed and compressed top level leaves have no room for the material so it is looked up per instance
+            if (scene->renderOptions.compressBVH || scene->renderOptions.packBVH)
+            {
+                std::vector<int> instanceMaterials;
+                GetInstanceMaterials(instanceMaterials);
+
+                glGenBuffers(1, &instanceMaterialsBuffer);
+                glBindBuffer(GL_TEXTURE_BUFFER, instanceMaterialsBuffer);
+                glBufferData(GL_TEXTURE_BUFFER, sizeof(int) * instanceMaterials.size(), &instanceMaterials[0], GL_STATIC_DRAW);
+                glGenTextures(1, &instanceMaterialsTex);
+                glBindTexture(GL_TEXTURE_BUFFER, instanceMaterialsTex);
+                glTexBuffer(GL_TEXTURE_BUFFER, scene->renderOptions.compressBVH ? GL_RG32I : GL_R32I, instanceMaterialsBuffer);
+            }
+            bvhTranslator.dirtyBegin = bvhTranslator.dirtyEnd = 0;
 
-            // Create buffer and texture for vertex indices
+            // Create buffer and texture for vertex indices. They are offset per mesh while streaming
             glGenBuffers(1, &vertexIndicesBuffer);
             glBindBuffer(GL_TEXTURE_BUFFER, vertexIndicesBuffer);
-            glBufferData(GL_TEXTURE_BUFFER, sizeof(Indices) * scene->vertIndices.size(), &scene->vertIndices[0], GL_STATIC_DRAW);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(Indices) * scene->numIndices, nullptr, GL_STATIC_DRAW);
+            {
+                int chunkIndices = kUploadChunkBytes / sizeof(Indices);
+                std::vector<Indices> indices(std::min(chunkIndices, scene->numIndices));
+                for (int first = 0; first < scene->numIndices; first += chunkIndices)
+                {
+                    int count = std::min(chunkIndices, scene->numIndices - first);
+                    scene->GetVertexIndices(first, count, &indices[0]);
+                    glBufferSubData(GL_TEXTURE_BUFFER, sizeof(Indices) * first, sizeof(Indices) * count, &indices[0]);
+                }
+            }
             glGenTextures(1, &vertexIndicesTex);
             glBindTexture(GL_TEXTURE_BUFFER, vertexIndicesTex);
             glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32I, vertexIndicesBuffer);
 
+            // Material slot per triangle and the per instance tables mapping slots to materials
+            if (!scene->materialTables.empty())
+            {
+                glGenBuffers(1, &triangleSlotsBuffer);
+                glBindBuffer(GL_TEXTURE_BUFFER, triangleSlotsBuffer);
+                glBufferData(GL_TEXTURE_BUFFER, sizeof(int) * scene->triangleMaterialSlots.size(), &scene->triangleMaterialSlots[0], GL_STATIC_DRAW);
+                glGenTextures(1, &triangleSlotsTex);
+                glBindTexture(GL_TEXTURE_BUFFER, triangleSlotsTex);
+                glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, triangleSlotsBuffer);
+
+                glGenBuffers(1, &materialTablesBuffer);
+                glBindBuffer(GL_TEXTURE_BUFFER, materialTablesBuffer);
+                glBufferData(GL_TEXTURE_BUFFER, sizeof(int) * scene->materialTables.size(), &scene->materialTables[0], GL_STATIC_DRAW);
+                glGenTextures(1, &materialTablesTex);
+                glBindTexture(GL_TEXTURE_BUFFER, materialTablesTex);
+                glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, materialTablesBuffer);
+            }
+
             // Create buffer and texture for vertices
             glGenBuffers(1, &verticesBuffer);
             glBindBuffer(GL_TEXTURE_BUFFER, verticesBuffer);
-            glBufferData(GL_TEXTURE_BUFFER, sizeof(Vec4) * scene->verticesUVX.size(), &scene->verticesUVX[0], GL_STATIC_DRAW);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(Vec4) * scene->numVertices, nullptr, GL_STATIC_DRAW);
+            for (int i = 0; i < scene->meshes.size(); i++)
+            {
+                const std::vector<Vec4> &vertices = scene->meshes[i]->verticesUVX;
+                if (!vertices.empty())
+                    UploadChunked(sizeof(Vec4) * scene->meshVertexOffsets[i], &vertices[0], sizeof(Vec4) * vertices.size());
+            }
             glGenTextures(1, &verticesTex);
             glBindTexture(GL_TEXTURE_BUFFER, verticesTex);
             glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, verticesBuffer);
@@ -224,7 +461,13 @@ namespace GLSLPT
             // Create buffer and texture for normals
             glGenBuffers(1, &normalsBuffer);
             glBindBuffer(GL_TEXTURE_BUFFER, normalsBuffer);
-            glBufferData(GL_TEXTURE_BUFFER, sizeof(Vec4) * scene->normalsUVY.size(), &scene->normalsUVY[0], GL_STATIC_DRAW);
+            glBufferData(GL_TEXTURE_BUFFER, sizeof(Vec4) * scene->numVertices, nullptr, GL_STATIC_DRAW);
+            for (int i = 0; i < scene->meshes.size(); i++)
+            {
+                const std::vector<Vec4> &normals = scene->meshes[i]->normalsUVY;
+                if (!normals.empty())
+                    UploadChunked(sizeof(Vec4) * scene->meshVertexOffsets[i], &normals[0], sizeof(Vec4) * normals.size());
+            }
             glGenTextures(1, &normalsTex);
             glBindTexture(GL_TEXTURE_BUFFER, normalsTex);
             glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, normalsBuffer);
@@ -257,14 +500,40 @@ namespace GLSLPT
             glBindTexture(GL_TEXTURE_2D, 0);
         }
 
+        // Create buffers and textures for light selection, emissive triangles and the per instance emitter lookup
+        UploadEmitters();
+
         // Create texture for scene textures
-        if (!scene->textures.empty())
+        if (scene->texturesCompressed)
+        {
+            int width = scene->renderOptions.texArrayWidth;
+            int height = scene->renderOptions.texArrayHeight;
+
+            if (scene->numColorLayers > 0)
+                textureMapsArrayTex = CreateCompressedTextureArray(GL_COMPRESSED_RGBA_BPTC_UNORM_ARB, width, height, scene->numColorLayers, scene->compressedTextureMaps);
+
+            if (scene->numNormalLayers > 0)
+                normalMapsArrayTex = CreateCompressedTextureArray(GL_COMPRESSED_RG_RGTC2, width, height, scene->numNormalLayers, scene->compressedNormalMaps);
+        }
+        else if (!scene->textures.empty())
         {
             glGenTextures(1, &textureMapsArrayTex);
             glBindTexture(GL_TEXTURE_2D_ARRAY, textureMapsArrayTex);
             glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, scene->renderOptions.texArrayWidth, scene->renderOptions.texArrayHeight, scene->textures.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, &scene->textureMapsArray[0]);
+
+            // Upload the mip chain generated in ProcessScene
+            int numMips = scene->textureMapsArrayMips.size();
+            for (int i = 0; i < numMips; i++)
+            {
+                int level = i + 1;
+                int w = MipLevelSize(scene->renderOptions.texArrayWidth, level);
+                int h = MipLevelSize(scene->renderOptions.texArrayHeight, level);
+                glTexImage3D(GL_TEXTURE_2D_ARRAY, level, GL_RGBA8, w, h, scene->textures.size(), 0, GL_RGBA, GL_UNSIGNED_BYTE, &scene->textureMapsArrayMips[i][0]);
+            }
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, numMips);
             glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, numMips > 0 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
             glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
         }
 
@@ -278,14 +547,30 @@ namespace GLSLPT
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
             glBindTexture(GL_TEXTURE_2D, 0);
 
-            glGenTextures(1, &envMapCDFTex);
-            glBindTexture(GL_TEXTURE_2D, envMapCDFTex);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, scene->envMap->width, scene->envMap->height, 0, GL_RED, GL_FLOAT, scene->envMap->cdf);
+            glGenTextures(1, &envMapAliasTex);
+            glBindTexture(GL_TEXTURE_2D, envMapAliasTex);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, scene->envMap->width + 1, scene->envMap->height, 0, GL_RGBA, GL_FLOAT, scene->envMap->aliasTable);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
             glBindTexture(GL_TEXTURE_2D, 0);
         }
 
+        // Sobol direction numbers, a row of 32 per dimension
+        std::vector<uint32_t> sobolDirections;
+        SobolDirections(sobolDirections);
+        glGenTextures(1, &sobolDirectionsTex);
+        glBindTexture(GL_TEXTURE_2D, sobolDirectionsTex);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, 32, kSobolDimensions, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, &sobolDirections[0]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        // SD-tree for path guiding, starts out without anything learned
+        glGenBuffers(1, &guideTreeBuffer);
+        glGenTextures(1, &guideTreeTex);
+        pathGuide.Reset(scene->sceneBounds.pmin, scene->sceneBounds.pmax);
+        UploadPathGuide();
+
         // Bind textures to texture slots as they will not change slots during the lifespan of the renderer
         glActiveTexture(GL_TEXTURE1);
         glBindTexture(GL_TEXTURE_BUFFER, BVHTex);
@@ -306,7 +591,7 @@ namespace GLSLPT
         glActiveTexture(GL_TEXTURE9);
         glBindTexture(GL_TEXTURE_2D, envMapTex);
         glActiveTexture(GL_TEXTURE10);
-        glBindTexture(GL_TEXTURE_2D, envMapCDFTex);
+        glBindTexture(GL_TEXTURE_2D, envMapAliasTex);
 
         glGenTextures(1, &lightPathTex);
         glGenTextures(1, &lightPathBVHTex);
@@ -326,6 +611,67 @@ namespace GLSLPT
         glBindTexture(GL_TEXTURE_BUFFER, lightPathBVHTex);
         glActiveTexture(GL_TEXTURE15);
         glBindTexture(GL_TEXTURE_BUFFER, lightPathBVHIndexTex);
+        glActiveTexture(GL_TEXTURE16);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, normalMapsArrayTex);
+        glActiveTexture(GL_TEXTURE17);
+        glBindTexture(GL_TEXTURE_BUFFER, lightAliasTex);
+        glActiveTexture(GL_TEXTURE18);
+        glBindTexture(GL_TEXTURE_BUFFER, lightBvhTex);
+        glActiveTexture(GL_TEXTURE19);
+        glBindTexture(GL_TEXTURE_BUFFER, emissiveTrianglesTex);
+        glActiveTexture(GL_TEXTURE20);
+        glBindTexture(GL_TEXTURE_BUFFER, instanceEmittersTex);
+        glActiveTexture(GL_TEXTURE21);
+        glBindTexture(GL_TEXTURE_BUFFER, instanceMaterialsTex);
+        glActiveTexture(GL_TEXTURE22);
+        glBindTexture(GL_TEXTURE_BUFFER, materialTablesTex);
+        glActiveTexture(GL_TEXTURE23);
+        glBindTexture(GL_TEXTURE_BUFFER, triangleSlotsTex);
+        glActiveTexture(GL_TEXTURE27);
+        glBindTexture(GL_TEXTURE_2D, sobolDirectionsTex);
+        glActiveTexture(GL_TEXTURE29);
+        glBindTexture(GL_TEXTURE_BUFFER, guideTreeTex);
+    }
+
+    // Light selection tables are created once there are emitters, the emissive triangles and the per instance emitter
+    // lookup once there are emissive meshes. Instance edits can add emitters, so the buffers grow when needed
+    void Renderer::UploadEmitters()
+    {
+        auto upload = [](GLuint &buffer, GLuint &tex, GLenum format, size_t size, const void *data)
+        {
+            if (!buffer)
+            {
+                glGenBuffers(1, &buffer);
+                glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+                glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+                glGenTextures(1, &tex);
+                glBindTexture(GL_TEXTURE_BUFFER, tex);
+                glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+                return;
+            }
+
+            GLint capacity = 0;
+            glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+            glGetBufferParameteriv(GL_TEXTURE_BUFFER, GL_BUFFER_SIZE, &capacity);
+            if (size > (size_t)capacity)
+                glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STATIC_DRAW);
+            else if (size > 0)
+                glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+        };
+
+        // The light BVH is empty if there are only distant lights
+        const LightSampler &lightSampler = scene->lightSampler;
+        if (!lightSampler.aliasTable.empty())
+        {
+            upload(lightAliasBuffer, lightAliasTex, GL_RGBA32F, sizeof(Vec4) * lightSampler.aliasTable.size(), &lightSampler.aliasTable[0]);
+            upload(lightBvhBuffer, lightBvhTex, GL_RGBA32F, sizeof(Vec4) * lightSampler.bvhNodes.size(), lightSampler.bvhNodes.empty() ? nullptr : &lightSampler.bvhNodes[0]);
+        }
+
+        if (!scene->emissiveTriangles.empty())
+        {
+            upload(emissiveTrianglesBuffer, emissiveTrianglesTex, GL_RGBA32F, sizeof(EmissiveTriangle) * scene->emissiveTriangles.size(), &scene->emissiveTriangles[0]);
+            upload(instanceEmittersBuffer, instanceEmittersTex, GL_RG32I, sizeof(iVec2) * scene->instanceEmitters.size(), &scene->instanceEmitters[0]);
+        }
     }
 
     void Renderer::ResizeRenderer()
@@ -334,10 +680,24 @@ namespace GLSLPT
         glDeleteTextures(1, &pathTraceTexture);
         glDeleteTextures(1, &pathTraceTextureLowRes);
         glDeleteTextures(1, &accumTexture);
+        glDeleteTextures(2, pathTraceAOVTextures);
+        glDeleteTextures(2, accumAOVTextures);
+        glDeleteTextures(1, &pathTraceMomentsTexture);
+        glDeleteTextures(1, &accumMomentsTexture);
+        glDeleteTextures(2, pathTraceGuideTextures);
+        glDeleteTextures(2, guideSampleTextures);
         glDeleteTextures(1, &tileOutputTexture[0]);
         glDeleteTextures(1, &tileOutputTexture[1]);
         glDeleteTextures(1, &denoisedTexture);
 
+        // InitOptionalTargets creates the enabled ones again at the new size
+        for (int i = 0; i < 2; i++)
+        {
+            pathTraceAOVTextures[i] = accumAOVTextures[i] = 0;
+            pathTraceGuideTextures[i] = guideSampleTextures[i] = 0;
+        }
+        pathTraceMomentsTexture = accumMomentsTexture = 0;
+
         // Delete FBOs
         glDeleteFramebuffers(1, &pathTraceFBO);
         glDeleteFramebuffers(1, &pathTraceFBOLowRes);
@@ -345,9 +705,27 @@ namespace GLSLPT
         glDeleteFramebuffers(1, &outputFBO);
 
         // Delete denoiser data
-        delete[] denoiserInputFramePtr;
+        glDeleteBuffers(1, &denoiserPBO);
+        glDeleteBuffers(1, &denoiserAOVPBO);
+        if (denoiserFence)
+            glDeleteSync(denoiserFence);
+        denoiserFence = 0;
         delete[] frameOutputPtr;
 
+        if (captureFence)
+            FinishCapture();
+        glDeleteBuffers(1, &capturePBO);
+
+        glDeleteBuffers(1, &adaptivePBO);
+        if (adaptiveFence)
+            glDeleteSync(adaptiveFence);
+        adaptiveFence = 0;
+
+        glDeleteBuffers(1, &guidePBO);
+        if (guideFence)
+            glDeleteSync(guideFence);
+        guideFence = 0;
+
         // Delete shaders
         delete pathTraceShader;
         delete pathTraceShaderLowRes;
@@ -442,9 +820,27 @@ namespace GLSLPT
 
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tileOutputTexture[currentBuffer], 0);
 
-        // For Denoiser
-        denoiserInputFramePtr = new Vec3[renderSize.x * renderSize.y];
+        // For Denoiser. Frames are read back asynchronously into the PBO and denoised on the worker thread
+        glGenBuffers(1, &denoiserPBO);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, denoiserPBO);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(Vec3) * renderSize.x * renderSize.y, nullptr, GL_STREAM_READ);
+        glGenBuffers(1, &denoiserAOVPBO);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, denoiserAOVPBO);
+        glBufferData(GL_PIXEL_PACK_BUFFER, 2 * sizeof(Vec4) * renderSize.x * renderSize.y, nullptr, GL_STREAM_READ);
+        glGenBuffers(1, &capturePBO);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capturePBO);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(Vec4) * renderSize.x * renderSize.y, nullptr, GL_STREAM_READ);
+        glGenBuffers(1, &adaptivePBO);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, adaptivePBO);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(float) * renderSize.x * renderSize.y, nullptr, GL_STREAM_READ);
+        glGenBuffers(1, &guidePBO);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, guidePBO);
+        glBufferData(GL_PIXEL_PACK_BUFFER, 2 * sizeof(Vec4) * renderSize.x * renderSize.y, nullptr, GL_STREAM_READ);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        tileConverged.assign(numTiles.x * numTiles.y, 0);
         frameOutputPtr = new Vec3[renderSize.x * renderSize.y];
+        denoiser->Resize(renderSize.x, renderSize.y);
+        denoised = false;
 
         glGenTextures(1, &denoisedTexture);
         glBindTexture(GL_TEXTURE_2D, denoisedTexture);
@@ -459,6 +855,34 @@ namespace GLSLPT
         printf("Tile Size : %d %d\n", tileWidth, tileHeight);
     }
 
+    void Renderer::InitOptionalTargets()
+    {
+        // Attachments 1 to 5 of the tile and the accumulation: albedo and normal AOVs for the denoiser, moments for
+        // adaptive sampling and training samples for path guiding. The accumulated AOVs and moments are only written
+        // by blits, the guiding samples of the whole pass are overwritten instead of accumulated
+        bool enabled[5] = { denoiserAOVs, denoiserAOVs, adaptiveSampling, pathGuiding, pathGuiding };
+        GLuint *tileTargets[5] = { &pathTraceAOVTextures[0], &pathTraceAOVTextures[1], &pathTraceMomentsTexture, &pathTraceGuideTextures[0], &pathTraceGuideTextures[1] };
+        GLuint *accumTargets[5] = { &accumAOVTextures[0], &accumAOVTextures[1], &accumMomentsTexture, &guideSampleTextures[0], &guideSampleTextures[1] };
+
+        // Outputs the shader does not write stay unattached and off the draw buffers
+        GLenum pathTraceBuffers[6] = { GL_COLOR_ATTACHMENT0 };
+        int numBuffers = 1;
+        glBindFramebuffer(GL_FRAMEBUFFER, pathTraceFBO);
+        for (int i = 0; i < 5; i++)
+        {
+            UpdateRenderTarget(*tileTargets[i], enabled[i], tileWidth, tileHeight, GL_COLOR_ATTACHMENT1 + i);
+            pathTraceBuffers[i + 1] = enabled[i] ? GL_COLOR_ATTACHMENT1 + i : GL_NONE;
+            if (enabled[i])
+                numBuffers = i + 2;
+        }
+        glDrawBuffers(numBuffers, pathTraceBuffers);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, accumFBO);
+        for (int i = 0; i < 5; i++)
+            UpdateRenderTarget(*accumTargets[i], enabled[i], renderSize.x, renderSize.y, GL_COLOR_ATTACHMENT1 + i);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
     void Renderer::ReloadShaders()
     {
         // Delete shaders
@@ -490,8 +914,36 @@ namespace GLSLPT
         if (scene->renderOptions.enableEnvMap && scene->envMap != nullptr)
             pathtraceDefines += "#define OPT_ENVMAP\n";
 
-        if (!scene->lights.empty())
-            pathtraceDefines += "#define OPT_LIGHTS\n";
+        // Shaders and render targets have to agree on the AOVs, so they are only toggled by a shader reload
+        denoiserAOVs = scene->renderOptions.enableDenoiser && scene->renderOptions.denoiserAOVs;
+        if (denoiserAOVs)
+            pathtraceDefines += "#define OPT_DENOISER_AOVS\n";
+
+        // The moments are only blitted and read back when the shader writes them
+        adaptiveSampling = scene->renderOptions.enableAdaptiveSampling;
+        if (adaptiveSampling)
+            pathtraceDefines += "#define OPT_ADAPTIVE_SAMPLING\n";
+
+        // Instance edits can change both, UpdateEmitters reloads the shaders then. Light subpaths start
+        // on the same emitters, so the light compute shader gets the emitter defines as well
+        std::string emitterDefines;
+        emitterTriangles = !scene->emissiveTriangles.empty();
+        lightBvh = false;
+        if (!scene->lights.empty() || emitterTriangles)
+        {
+            emitterDefines += "#define OPT_LIGHTS\n";
+
+            if (emitterTriangles)
+                emitterDefines += "#define OPT_EMISSIVE_TRIANGLES\n";
+
+            // Scenes with more emitters than the light bvh can address use the power table instead
+            lightBvh = scene->renderOptions.lightSampling == BvhLightSampling && scene->lightSampler.bvhUsable;
+            if (lightBvh)
+                pathtraceDefines += "#define OPT_LIGHT_BVH\n";
+            else if (scene->renderOptions.lightSampling != UniformLightSampling)
+                pathtraceDefines += "#define OPT_LIGHT_ALIAS\n";
+        }
+        pathtraceDefines += emitterDefines;
 
         if (scene->renderOptions.enableRR)
         {
@@ -500,12 +952,26 @@ namespace GLSLPT
         }
 
         // sc:
+        vertexMerging = false;
         if (scene->renderOptions.useBidirectionalPathTracing)
         {
             pathtraceDefines += "#define OPT_BDPT\n";
             if (scene->renderOptions.useHRRVC)
+            {
                 pathtraceDefines += "#define OPT_HRRVC\n";
+                vertexMerging = scene->renderOptions.enableVertexMerging;
+            }
         }
+        if (vertexMerging)
+            pathtraceDefines += "#define OPT_VERTEX_MERGING\n";
+
+        // The vertex connections of HRRVC are not guided, so neither is their eye subpath
+        pathGuiding = scene->renderOptions.enablePathGuiding && !(scene->renderOptions.useBidirectionalPathTracing && scene->renderOptions.useHRRVC);
+        if (pathGuiding)
+            pathtraceDefines += "#define OPT_PATH_GUIDING\n";
+
+        // Only the targets of the outputs enabled above exist
+        InitOptionalTargets();
 
         // scend
 
@@ -554,14 +1020,56 @@ namespace GLSLPT
         if (scene->renderOptions.enableVolumeMIS)
             pathtraceDefines += "#define OPT_VOL_MIS\n";
 
-        if (pathtraceDefines.size() > 0)
+        if (scene->renderOptions.enableTextureLod && !scene->textures.empty())
+            pathtraceDefines += "#define OPT_TEXTURE_LOD\n";
+
+        if (scene->texturesCompressed)
+            pathtraceDefines += "#define OPT_COMPRESSED_TEXTURES\n";
+
+        // Only the tile shader takes its samples from the Sobol sequence, the preview stays independent
+        std::string samplerDefines = "";
+        if (scene->renderOptions.sampler != IndependentSampler)
+            samplerDefines += "#define OPT_SOBOL\n";
+        if (scene->renderOptions.sampler == BlueNoiseSobolSampler)
+        {
+            samplerDefines += "#define OPT_BLUE_NOISE\n";
+            if (!blueNoiseTex)
+            {
+                std::vector<float> mask;
+                BlueNoiseMask(64, mask);
+                glGenTextures(1, &blueNoiseTex);
+                glBindTexture(GL_TEXTURE_2D, blueNoiseTex);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, 64, 64, 0, GL_RED, GL_FLOAT, &mask[0]);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glBindTexture(GL_TEXTURE_2D, 0);
+                glActiveTexture(GL_TEXTURE28);
+                glBindTexture(GL_TEXTURE_2D, blueNoiseTex);
+                glActiveTexture(GL_TEXTURE0);
+            }
+        }
+
+        // The BVH layout is fixed at upload so the light subpath shader has to match it as well
+        std::string bvhDefines = "";
+        if (scene->renderOptions.compressBVH)
+            bvhDefines += "#define OPT_COMPRESSED_BVH\n";
+        else if (scene->renderOptions.packBVH)
+            bvhDefines += "#define OPT_PACKED_BVH\n";
+        if (!scene->materialTables.empty())
+            bvhDefines += "#define OPT_MATERIAL_TABLES\n";
+
+        // Compressed traversal starts from a stack entry, wide node indices are shifted by 3
+        int topBVHIndex = scene->renderOptions.compressBVH ? scene->bvhTranslator.wideTopLevelIndex << 3 : scene->bvhTranslator.topLevelIndex;
+        pathtraceDefines += bvhDefines;
+
+        if (pathtraceDefines.size() > 0 || samplerDefines.size() > 0)
         {
             size_t idx = pathTraceShaderSrcObj.src.find("#version");
             if (idx != -1)
                 idx = pathTraceShaderSrcObj.src.find("\n", idx);
             else
                 idx = 0;
-            pathTraceShaderSrcObj.src.insert(idx + 1, pathtraceDefines);
+            pathTraceShaderSrcObj.src.insert(idx + 1, pathtraceDefines + samplerDefines);
 
             idx = pathTraceShaderLowResSrcObj.src.find("#version");
             if (idx != -1)
@@ -581,6 +1089,27 @@ namespace GLSLPT
             tonemapShaderSrcObj.src.insert(idx + 1, tonemapDefines);
         }
 
+        // Light subpaths are stratified by the Sobol sequence as well
+        std::string lightDefines = bvhDefines + emitterDefines;
+        if (scene->renderOptions.sampler != IndependentSampler)
+            lightDefines += "#define OPT_SOBOL\n";
+        // Subpaths pick their emitter by power, the light bvh needs a shading point so it falls back to the
+        // same table. The MIS weights of vertex merging read the probability from it as well
+        if (scene->renderOptions.lightSampling != UniformLightSampling && !scene->lightSampler.aliasTable.empty())
+            lightDefines += "#define OPT_LIGHT_ALIAS\n";
+        if (vertexMerging)
+            lightDefines += "#define OPT_VERTEX_MERGING\n";
+
+        if (lightDefines.size() > 0)
+        {
+            size_t idx = lightShaderSrcObj.src.find("#version");
+            if (idx != -1)
+                idx = lightShaderSrcObj.src.find("\n", idx);
+            else
+                idx = 0;
+            lightShaderSrcObj.src.insert(idx + 1, lightDefines);
+        }
+
         pathTraceShader = LoadShaders(vertexShaderSrcObj, pathTraceShaderSrcObj);
         pathTraceShaderLowRes = LoadShaders(vertexShaderSrcObj, pathTraceShaderLowResSrcObj);
         outputShader = LoadShaders(vertexShaderSrcObj, outputShaderSrcObj);
@@ -601,14 +1130,21 @@ namespace GLSLPT
         if (scene->envMap)
         {
             glUniform2f(glGetUniformLocation(shaderObject, "envMapRes"), (float)scene->envMap->width, (float)scene->envMap->height);
-            glUniform1f(glGetUniformLocation(shaderObject, "envMapTotalSum"), scene->envMap->totalSum);
         }
 
-        glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), scene->bvhTranslator.topLevelIndex);
+        glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), topBVHIndex);
         glUniform2f(glGetUniformLocation(shaderObject, "resolution"), float(renderSize.x), float(renderSize.y));
         glUniform2f(glGetUniformLocation(shaderObject, "invNumTiles"), invNumTiles.x, invNumTiles.y);
         glUniform1i(glGetUniformLocation(shaderObject, "numOfLights"), scene->lights.size());
+        glUniform1i(glGetUniformLocation(shaderObject, "numLightPaths"), lpnum);
+        glUniform1i(glGetUniformLocation(shaderObject, "numInfiniteLights"), scene->lightSampler.numInfiniteLights);
+        glUniform1i(glGetUniformLocation(shaderObject, "numEmissiveTriangles"), scene->emissiveTriangles.size());
         glUniform1i(glGetUniformLocation(shaderObject, "accumTexture"), 0);
+        glUniform1i(glGetUniformLocation(shaderObject, "accumAlbedoTexture"), 24);
+        glUniform1i(glGetUniformLocation(shaderObject, "accumNormalTexture"), 25);
+        glUniform1i(glGetUniformLocation(shaderObject, "accumMomentsTexture"), 26);
+        glUniform1i(glGetUniformLocation(shaderObject, "sobolDirectionsTex"), 27);
+        glUniform1i(glGetUniformLocation(shaderObject, "blueNoiseTex"), 28);
         glUniform1i(glGetUniformLocation(shaderObject, "BVH"), 1);
         glUniform1i(glGetUniformLocation(shaderObject, "vertexIndicesTex"), 2);
         glUniform1i(glGetUniformLocation(shaderObject, "verticesTex"), 3);
@@ -618,11 +1154,20 @@ namespace GLSLPT
         glUniform1i(glGetUniformLocation(shaderObject, "lightsTex"), 7);
         glUniform1i(glGetUniformLocation(shaderObject, "textureMapsArrayTex"), 8);
         glUniform1i(glGetUniformLocation(shaderObject, "envMapTex"), 9);
-        glUniform1i(glGetUniformLocation(shaderObject, "envMapCDFTex"), 10);
+        glUniform1i(glGetUniformLocation(shaderObject, "envMapAliasTex"), 10);
         // wyd:
         glUniform1i(glGetUniformLocation(shaderObject, "lightPathTex"), 13);
         glUniform1i(glGetUniformLocation(shaderObject, "lightPathBVHTex"), 14);
         glUniform1i(glGetUniformLocation(shaderObject, "lightPathBVHIndexTex"), 15);
+        glUniform1i(glGetUniformLocation(shaderObject, "normalMapsArrayTex"), 16);
+        glUniform1i(glGetUniformLocation(shaderObject, "lightAliasTex"), 17);
+        glUniform1i(glGetUniformLocation(shaderObject, "lightBvhTex"), 18);
+        glUniform1i(glGetUniformLocation(shaderObject, "emissiveTrianglesTex"), 19);
+        glUniform1i(glGetUniformLocation(shaderObject, "instanceEmittersTex"), 20);
+        glUniform1i(glGetUniformLocation(shaderObject, "instanceMaterialsTex"), 21);
+        glUniform1i(glGetUniformLocation(shaderObject, "materialTablesTex"), 22);
+        glUniform1i(glGetUniformLocation(shaderObject, "triangleSlotsTex"), 23);
+        glUniform1i(glGetUniformLocation(shaderObject, "guideTreeTex"), 29);
 
         pathTraceShader->StopUsing();
 
@@ -632,11 +1177,13 @@ namespace GLSLPT
         if (scene->envMap)
         {
             glUniform2f(glGetUniformLocation(shaderObject, "envMapRes"), (float)scene->envMap->width, (float)scene->envMap->height);
-            glUniform1f(glGetUniformLocation(shaderObject, "envMapTotalSum"), scene->envMap->totalSum);
         }
-        glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), scene->bvhTranslator.topLevelIndex);
+        glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), topBVHIndex);
         glUniform2f(glGetUniformLocation(shaderObject, "resolution"), float(renderSize.x), float(renderSize.y));
         glUniform1i(glGetUniformLocation(shaderObject, "numOfLights"), scene->lights.size());
+        glUniform1i(glGetUniformLocation(shaderObject, "numLightPaths"), lpnum);
+        glUniform1i(glGetUniformLocation(shaderObject, "numInfiniteLights"), scene->lightSampler.numInfiniteLights);
+        glUniform1i(glGetUniformLocation(shaderObject, "numEmissiveTriangles"), scene->emissiveTriangles.size());
         glUniform1i(glGetUniformLocation(shaderObject, "accumTexture"), 0);
         glUniform1i(glGetUniformLocation(shaderObject, "BVH"), 1);
         glUniform1i(glGetUniformLocation(shaderObject, "vertexIndicesTex"), 2);
@@ -647,11 +1194,20 @@ namespace GLSLPT
         glUniform1i(glGetUniformLocation(shaderObject, "lightsTex"), 7);
         glUniform1i(glGetUniformLocation(shaderObject, "textureMapsArrayTex"), 8);
         glUniform1i(glGetUniformLocation(shaderObject, "envMapTex"), 9);
-        glUniform1i(glGetUniformLocation(shaderObject, "envMapCDFTex"), 10);
+        glUniform1i(glGetUniformLocation(shaderObject, "envMapAliasTex"), 10);
         // wyd:
         glUniform1i(glGetUniformLocation(shaderObject, "lightPathTex"), 13);
         glUniform1i(glGetUniformLocation(shaderObject, "lightPathBVHTex"), 14);
         glUniform1i(glGetUniformLocation(shaderObject, "lightPathBVHIndexTex"), 15);
+        glUniform1i(glGetUniformLocation(shaderObject, "normalMapsArrayTex"), 16);
+        glUniform1i(glGetUniformLocation(shaderObject, "lightAliasTex"), 17);
+        glUniform1i(glGetUniformLocation(shaderObject, "lightBvhTex"), 18);
+        glUniform1i(glGetUniformLocation(shaderObject, "emissiveTrianglesTex"), 19);
+        glUniform1i(glGetUniformLocation(shaderObject, "instanceEmittersTex"), 20);
+        glUniform1i(glGetUniformLocation(shaderObject, "instanceMaterialsTex"), 21);
+        glUniform1i(glGetUniformLocation(shaderObject, "materialTablesTex"), 22);
+        glUniform1i(glGetUniformLocation(shaderObject, "triangleSlotsTex"), 23);
+        glUniform1i(glGetUniformLocation(shaderObject, "guideTreeTex"), 29);
 
         pathTraceShaderLowRes->StopUsing();
 
@@ -668,10 +1224,13 @@ namespace GLSLPT
             glBindTexture(GL_TEXTURE_2D, lightInTex);
             glBindImageTexture(0, lightOutTex, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
 
-            glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), scene->bvhTranslator.topLevelIndex);
+            glUniform1i(glGetUniformLocation(shaderObject, "topBVHIndex"), topBVHIndex);
             glUniform2f(glGetUniformLocation(shaderObject, "resolution"), float(renderSize.x), float(renderSize.y));
             glUniform2f(glGetUniformLocation(shaderObject, "invNumTiles"), invNumTiles.x, invNumTiles.y);
             glUniform1i(glGetUniformLocation(shaderObject, "numOfLights"), scene->lights.size());
+            glUniform1i(glGetUniformLocation(shaderObject, "numLightPaths"), lpnum);
+            glUniform1i(glGetUniformLocation(shaderObject, "numInfiniteLights"), scene->lightSampler.numInfiniteLights);
+            glUniform1i(glGetUniformLocation(shaderObject, "numEmissiveTriangles"), scene->emissiveTriangles.size());
             glUniform1i(glGetUniformLocation(shaderObject, "accumTexture"), 0);
             glUniform1i(glGetUniformLocation(shaderObject, "BVH"), 1);
             glUniform1i(glGetUniformLocation(shaderObject, "vertexIndicesTex"), 2);
@@ -682,7 +1241,16 @@ namespace GLSLPT
             glUniform1i(glGetUniformLocation(shaderObject, "lightsTex"), 7);
             glUniform1i(glGetUniformLocation(shaderObject, "textureMapsArrayTex"), 8);
             glUniform1i(glGetUniformLocation(shaderObject, "envMapTex"), 9);
-            glUniform1i(glGetUniformLocation(shaderObject, "envMapCDFTex"), 10);
+            glUniform1i(glGetUniformLocation(shaderObject, "envMapAliasTex"), 10);
+            glUniform1i(glGetUniformLocation(shaderObject, "normalMapsArrayTex"), 16);
+            glUniform1i(glGetUniformLocation(shaderObject, "lightAliasTex"), 17);
+            glUniform1i(glGetUniformLocation(shaderObject, "lightBvhTex"), 18);
+            glUniform1i(glGetUniformLocation(shaderObject, "emissiveTrianglesTex"), 19);
+            glUniform1i(glGetUniformLocation(shaderObject, "instanceEmittersTex"), 20);
+            glUniform1i(glGetUniformLocation(shaderObject, "instanceMaterialsTex"), 21);
+            glUniform1i(glGetUniformLocation(shaderObject, "materialTablesTex"), 22);
+            glUniform1i(glGetUniformLocation(shaderObject, "triangleSlotsTex"), 23);
+            glUniform1i(glGetUniformLocation(shaderObject, "sobolDirectionsTex"), 27);
             // wyd:
 
             glUniform1i(glGetUniformLocation(shaderObject, "enableEnvMap"), scene->envMap == nullptr ? false : scene->renderOptions.enableEnvMap);
@@ -713,266 +1281,7 @@ namespace GLSLPT
         if (scene->dirty)
         {
             if (scene->renderOptions.useHRRVC)
-            {
-                sc_computeShader->Use();
-                glDispatchCompute((lpnum + 31) / 32, (scPreLightSize + 31) / 32, 1);
-
-                glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
-                GLfloat *img = new GLfloat[lpnum * scPreLightSize * 4 * 7]; // wyd: update light
-                glBindTexture(GL_TEXTURE_2D, lightOutTex);
-                glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-                glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, img);
-                sc_computeShader->StopUsing();
-
-                for (int i = 0; i < lpnum; i++)
-                {
-                    for (int j = 0; j < scPreLightSize; j++)
-                    {
-
-                        lightPathInfos[i * scPreLightSize + j].position =
-                            Vec3(
-                                img[i * 4 + j * 4 * lpnum + 0],
-                                img[i * 4 + j * 4 * lpnum + 1],
-                                img[i * 4 + j * 4 * lpnum + 2]);
-                        lightPathInfos[i * scPreLightSize + j].radiance =
-                            Vec3(
-                                img[i * 4 + (j + 3) * 4 * lpnum + 0],
-                                img[i * 4 + (j + 3) * 4 * lpnum + 1],
-                                img[i * 4 + (j + 3) * 4 * lpnum + 2]);
-                        lightPathInfos[i * scPreLightSize + j].normal =
-                            Vec3(
-                                img[i * 4 + (j + 6) * 4 * lpnum + 0],
-                                img[i * 4 + (j + 6) * 4 * lpnum + 1],
-                                img[i * 4 + (j + 6) * 4 * lpnum + 2]);
-                        lightPathInfos[i * scPreLightSize + j].ffnormal =
-                            Vec3(
-                                img[i * 4 + (j + 9) * 4 * lpnum + 0],
-                                img[i * 4 + (j + 9) * 4 * lpnum + 1],
-                                img[i * 4 + (j + 9) * 4 * lpnum + 2]);
-                        lightPathInfos[i * scPreLightSize + j].direction =
-                            Vec3(
-                                img[i * 4 + (j + 12) * 4 * lpnum + 0],
-                                img[i * 4 + (j + 12) * 4 * lpnum + 1],
-                                img[i * 4 + (j + 12) * 4 * lpnum + 2]);
-                        lightPathInfos[i * scPreLightSize + j].eta = img[i * 4 + (j + 15) * 4 * lpnum + 0];
-                        lightPathInfos[i * scPreLightSize + j].matID = img[i * 4 + (j + 15) * 4 * lpnum + 1];
-                        lightPathInfos[i * scPreLightSize + j].avaliable = img[i * 4 + (j + 15) * 4 * lpnum + 2];
-                        lightPathInfos[i * scPreLightSize + j].texCoods =
-                            Vec2(
-                                img[i * 4 + (j + 18) * 4 * lpnum + 0],
-                                img[i * 4 + (j + 18) * 4 * lpnum + 1]);
-                        lightPathInfos[i * scPreLightSize + j].matroughness = img[i * 4 + (j + 18) * 4 * lpnum + 2];
-                    }
-                }
-
-                // wyd:
-                // print to check lightPathNodes
-                // freopen("out.txt", "w", stdout);
-                // for(int i = 0; i < lpnum; i++){
-                //     for(int j = 0; j < scene->renderOptions.sc_BDPT_LIGHTPATH; j++){
-                //         printf("lightPathInfos[%d][%d].position = %f %f %f\n", i,j,
-                //         lightPathInfos[i*scPreLightSize+j].position.x, lightPathInfos[i*scPreLightSize+j].position.y, lightPathInfos[i*scPreLightSize+j].position.z);
-                //         printf("lightPathInfos[%d][%d].radiance = %f %f %f\n", i,j,
-                //         lightPathInfos[i*scPreLightSize+j].radiance.x, lightPathInfos[i*scPreLightSize+j].radiance.y, lightPathInfos[i*scPreLightSize+j].radiance.z);
-                //         printf("lightPathInfos[%d][%d].normal = %f %f %f\n", i,j,
-                //         lightPathInfos[i*scPreLightSize+j].normal.x, lightPathInfos[i*scPreLightSize+j].normal.y, lightPathInfos[i*scPreLightSize+j].normal.z);
-                //         printf("lightPathInfos[%d][%d].ffnormal = %f %f %f\n", i,j,
-                //         lightPathInfos[i*scPreLightSize+j].ffnormal.x, lightPathInfos[i*scPreLightSize+j].ffnormal.y, lightPathInfos[i*scPreLightSize+j].ffnormal.z);
-                //         printf("lightPathInfos[%d][%d].direction = %f %f %f\n", i,j,
-                //         lightPathInfos[i*scPreLightSize+j].direction.x, lightPathInfos[i*scPreLightSize+j].direction.y, lightPathInfos[i*scPreLightSize+j].direction.z);
-                //         printf("lightPathInfos[%d][%d].eta = %f\n", i,j,lightPathInfos[i*scPreLightSize+j].eta);
-                //         printf("lightPathInfos[%d][%d].matID = %f\n", i,j,lightPathInfos[i*scPreLightSize+j].matID);
-                //         printf("lightPathInfos[%d][%d].avaliable = %f\n", i,j,lightPathInfos[i*scPreLightSize+j].avaliable);
-                //         printf("lightPathInfos[%d][%d].texCoods = %f %f\n", i,j,
-                //         lightPathInfos[i*scPreLightSize+j].texCoods.x, lightPathInfos[i*scPreLightSize+j].texCoods.y);
-                //         printf("lightPathInfos[%d][%d].matroughness = %f\n", i,j,lightPathInfos[i*scPreLightSize+j].matroughness);
-                //     }
-                // }
-                // freopen("CON","w",stdout);
-
-                // print image to check memory allocation
-                // freopen("out.txt", "w", stdout);
-                // for(int i = 0; i < lpnum; i++){
-                //     for(int j = 0; j < scene->renderOptions.sc_BDPT_LIGHTPATH * 6; j++){
-                //         printf("img[%d][%d] = %f %f %f %f\n", i, j, img[i * 4 + j * 4 *lpnum + 0], img[i * 4 + j * 4 *lpnum + 1], img[i * 4 + j * 4 *lpnum + 2], img[i * 4 + j * 4 *lpnum + 3]);
-                //     }
-                // }
-
-                // construct bvh
-                std::vector<Point3f> pts;
-                for (int i = 0; i < lpnum; i++)
-                {
-                    for (int j = 0; j < scPreLightSize; j++)
-                    {
-                        pts.push_back(Point3f(lightPathInfos[i * scPreLightSize + j].position.x,
-                                              lightPathInfos[i * scPreLightSize + j].position.y,
-                                              lightPathInfos[i * scPreLightSize + j].position.z));
-                    }
-                }
-
-                // output pts value
-                // freopen("out.txt", "w", stdout);
-                // for (int i = 0; i < pts.size(); i++)
-                // {
-                //     printf("pts[%d] = %f %f %f\n", i, pts[i].x, pts[i].y, pts[i].z);
-                // }
-                //
-                // point cloud visualization
-                //
-                // pcl::PointCloud<pcl::PointXYZ> cloud;
-                // cloud.width = lpnum * scene->renderOptions.sc_BDPT_LIGHTPATH;
-                // cloud.height = 1;
-                // cloud.is_dense = false;
-                // cloud.points.resize(cloud.width * cloud.height);
-                // for (size_t i = 0; i < cloud.points.size(); ++i)
-                // {
-                //     cloud.points[i].x = pts[i].x;
-                //     cloud.points[i].y = pts[i].y;
-                //     cloud.points[i].z = pts[i].z;
-                // }
-
-                // pcl::io::savePCDFileASCII("selfgen.pcd", cloud);
-
-                // pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2(new pcl::PointCloud<pcl::PointXYZ>);
-
-                // if (pcl::io::loadPCDFile<pcl::PointXYZ>("selfgen.pcd", *cloud2) == -1) //*打开点云文件
-                // {
-                //     PCL_ERROR("Couldn't read file test_pcd.pcd\n");
-                // }
-
-                // pcl::visualization::PCLVisualizer::Ptr viewer(new pcl::visualization::PCLVisualizer("viewer"));
-                // viewer->addCoordinateSystem(1);
-
-                // viewer->addPointCloud(cloud2);
-
-                // viewer->spin();
-
-                auto beforeTime = std::chrono::steady_clock::now();
-
-                BVH_ACC1 bvh_lightpath(pts, 0.03, 0.07);
-                auto afterTime = std::chrono::steady_clock::now();
-                double duration_millsecond = std::chrono::duration<double, std::milli>(afterTime - beforeTime).count();
-                printf("bvh construction time: %f ms\n", duration_millsecond);
-
-                std::vector<LinearBVHNodeForTransmit> Linearnodefortex;
-                for (int i = 0; i < bvh_lightpath.totalNodes; i++)
-                {
-                    LinearBVHNodeForTransmit tmp;
-                    tmp.bounds = bvh_lightpath.nodes[i].bounds;
-                    tmp.primitivesOffsetOrSecondChildOffset = float(bvh_lightpath.nodes[i].primitivesOffset);
-                    tmp.nPrimitives = float(bvh_lightpath.nodes[i].nPrimitives);
-                    tmp.axis = float(bvh_lightpath.nodes[i].axis);
-                    Linearnodefortex.push_back(tmp);
-                }
-
-                // // output for debug
-                // for (int i = 0; i < bvh_lightpath.totalNodes; i++)
-                // {
-                //     printf("Linearnodefortex[%d].bounds: (%f, %f, %f) (%f, %f, %f)\n", i, Linearnodefortex[i].bounds.pMin.x,
-                //            Linearnodefortex[i].bounds.pMin.y,
-                //            Linearnodefortex[i].bounds.pMin.z,
-                //            Linearnodefortex[i].bounds.pMax.x,
-                //            Linearnodefortex[i].bounds.pMax.y,
-                //            Linearnodefortex[i].bounds.pMax.z);
-                //     printf("Linearnodefortex[%d].primitivesOffset: %f\n", i, Linearnodefortex[i].primitivesOffsetOrSecondChildOffset);
-                //     printf("Linearnodefortex[%d].nPrimitives: %f\n", i, Linearnodefortex[i].nPrimitives);
-                //     printf("Linearnodefortex[%d].axis: %f\n", i, Linearnodefortex[i].axis);
-                // }
-
-                std::vector<float> orderdatafortex;
-                for (int i = 0; i < bvh_lightpath.totalNodes; i++)
-                {
-                    orderdatafortex.push_back(float(bvh_lightpath.orderdata[i]));
-                }
-                while (orderdatafortex.size() % 3 != 0)
-                {
-                    orderdatafortex.push_back(-1.0f);
-                }
-                // output bvh_lightpath.orderdata for debug
-                // for (int i = 0; i < bvh_lightpath.totalNodes; i++)
-                // {
-                //     printf("orderdatafortex[%d] = %f\n", i, orderdatafortex[i]);
-                // }
-
-                glBindBuffer(GL_TEXTURE_BUFFER, lightPathBuffer);
-                glBufferData(GL_TEXTURE_BUFFER, sizeof(LightInfo) * lpnum * scPreLightSize, &lightPathInfos[0], GL_STATIC_DRAW);
-                glBindTexture(GL_TEXTURE_BUFFER, lightPathTex);
-                glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, lightPathBuffer);
-
-                glBindBuffer(GL_TEXTURE_BUFFER, lightPathBVHBuffer);
-                glBufferData(GL_TEXTURE_BUFFER, sizeof(LinearBVHNode) * bvh_lightpath.totalNodes, &Linearnodefortex[0], GL_STATIC_DRAW);
-                glBindTexture(GL_TEXTURE_BUFFER, lightPathBVHTex);
-                glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, lightPathBVHBuffer);
-
-                // TODO:
-                glBindBuffer(GL_TEXTURE_BUFFER, lightPathBVHIndexBuffer);
-                glBufferData(GL_TEXTURE_BUFFER, sizeof(float) * orderdatafortex.size(), &orderdatafortex[0], GL_STATIC_DRAW);
-                glBindTexture(GL_TEXTURE_BUFFER, lightPathBVHIndexTex);
-                glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, lightPathBVHIndexBuffer);
-
-                // print bvh
-                // struct LinearBVHNode
-                //     {
-                //         Bounds3<float> bounds;
-                //         union
-                //         {
-                //             uint primitivesOffset;  // leaf
-                //             uint secondChildOffset; // interior
-                //         };
-                //         uint32_t nPrimitives; // 0 -> interior node
-                //         uint32_t axis;         // interior node: xyz
-
-                //     };
-
-                //     struct LightInfo
-                //     {
-                //         Vec3 position;
-                //         Vec3 radiance;
-                //         Vec3 normal;
-                //         Vec3 ffnormal;
-                //         Vec3 direction;
-                //         float eta;
-                //         int matID;
-                //         int avaliable;
-                //         Vec2 texCoods;
-                //         float matroughness;
-                //     };
-                // {
-                //     for (int i = 0; i < bvh_lightpath.totalNodes; i++)
-                //     {
-                //         // output LinearBVHNode infomations
-                //         printf("node %d: \n", i);
-                //         printf("bounds: (%f, %f, %f) (%f, %f, %f)\n", bvh_lightpath.nodes[i].bounds.pMin.x,
-                //         bvh_lightpath.nodes[i].bounds.pMin.y,
-                //         bvh_lightpath.nodes[i].bounds.pMin.z,
-                //         bvh_lightpath.nodes[i].bounds.pMax.x,
-                //         bvh_lightpath.nodes[i].bounds.pMax.y,
-                //         bvh_lightpath.nodes[i].bounds.pMax.z);
-                //         printf("primitivesOffset or secondchildoffset: %d\n",
-                //         bvh_lightpath.nodes[i].primitivesOffset);
-                //         printf("nPrimitives: %d\n",
-                //         bvh_lightpath.nodes[i].nPrimitives);
-                //         printf("axis: %d\n",
-                //         bvh_lightpath.nodes[i].axis);
-
-                //         if(bvh_lightpath.nodes[i].axis == 3){ // leaf node
-                //             uint primitivesOffset = bvh_lightpath.nodes[i].primitivesOffset;
-                //             uint nPrimitives = bvh_lightpath.nodes[i].nPrimitives;
-                //             printf("primitivesOffset: %d\n", primitivesOffset);
-                //             printf("nPrimitives: %d\n", nPrimitives);
-                //             for(int j = 0; j < nPrimitives; j++){
-                //                 printf("primitives[%d] = %d\n", j,
-                //                 lightPathInfos
-                //                 [bvh_lightpath.orderdata[(primitivesOffset + j)] / scPreLightSize]
-                //                 [bvh_lightpath.orderdata[(primitivesOffset + j)] % scPreLightSize].matID);
-                //             }
-
-                //         }
-                //     }
-                // }
-
-                delete[] img;
-            }
+                GenerateLightPaths(vertexMerging ? sampleCounter - 1 + sampleOffset : lightPathEpoch++);
 
             // Renders a low res preview if camera/instances are modified
             glBindFramebuffer(GL_FRAMEBUFFER, pathTraceFBOLowRes);
@@ -981,24 +1290,32 @@ namespace GLSLPT
             glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
             scene->instancesModified = false;
+            scene->emittersModified = false;
             scene->dirty = false;
             scene->envMapModified = false;
         }
         else
         {
-            // Renders to pathTraceTexture while using previously accumulated samples from accumTexture
             // Rendering is done a tile per frame, so if a 500x500 image is rendered with a tileWidth and tileHeight of 250 then, all tiles (for a single sample)
             // get rendered after 4 frames
-            glBindFramebuffer(GL_FRAMEBUFFER, pathTraceFBO);
-            glViewport(0, 0, tileWidth, tileHeight);
-            glBindTexture(GL_TEXTURE_2D, accumTexture);
-            quad->Draw(pathTraceShader);
+            if (denoiserAOVs)
+            {
+                glActiveTexture(GL_TEXTURE24);
+                glBindTexture(GL_TEXTURE_2D, accumAOVTextures[0]);
+                glActiveTexture(GL_TEXTURE25);
+                glBindTexture(GL_TEXTURE_2D, accumAOVTextures[1]);
+            }
+            if (adaptiveSampling)
+            {
+                glActiveTexture(GL_TEXTURE26);
+                glBindTexture(GL_TEXTURE_2D, accumMomentsTexture);
+            }
+            glActiveTexture(GL_TEXTURE0);
 
-            // pathTraceTexture is copied to accumTexture and re-used as input for the first step.
-            glBindFramebuffer(GL_FRAMEBUFFER, accumFBO);
-            glViewport(tileWidth * tile.x, tileHeight * tile.y, tileWidth, tileHeight);
-            glBindTexture(GL_TEXTURE_2D, pathTraceTexture);
-            quad->Draw(outputShader);
+            // Converged tiles the update passed over don't trace any rays but still need their sample
+            for (const iVec2 &skipped : skippedTiles)
+                RenderTile(skipped);
+            RenderTile(tile);
 
             // Here we render to tileOutputTexture[currentBuffer] but display tileOutputTexture[1-currentBuffer] until all tiles are done rendering
             // When all tiles are rendered, we flip the bound texture and start rendering to the other one
@@ -1010,6 +1327,389 @@ namespace GLSLPT
         }
     }
 
+    void Renderer::DispatchLightPaths(int epoch)
+    {
+        glActiveTexture(GL_TEXTURE0);
+        sc_computeShader->Use();
+        glUniform1i(glGetUniformLocation(sc_computeShader->getObject(), "lightPathEpoch"), epoch);
+        if (vertexMerging)
+        {
+            float radius = VertexMergingRadius(epoch);
+            glUniform1f(glGetUniformLocation(sc_computeShader->getObject(), "vmEta"), PI * radius * radius * lpnum);
+        }
+        glDispatchCompute((lpnum + 31) / 32, (scPreLightSize + 31) / 32, 1);
+        sc_computeShader->StopUsing();
+
+        // The vertices are copied into the PBO on the GPU, ReadLightPaths maps it once the fence passed
+        glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, lightPathPBO);
+        glBindTexture(GL_TEXTURE_2D, lightOutTex);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        lightPathFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        lightPathFenceEpoch = epoch;
+    }
+
+    void Renderer::ReadLightPaths()
+    {
+        // Paths traced a pass ahead are long done, only paths dispatched right before are waited for
+        while (glClientWaitSync(lightPathFence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(lightPathFence);
+        lightPathFence = 0;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, lightPathPBO);
+        const GLfloat *img = (const GLfloat *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (img)
+        {
+            for (int i = 0; i < lpnum; i++)
+            {
+                for (int j = 0; j < scPreLightSize; j++)
+                {
+
+                    lightPathInfos[i * scPreLightSize + j].position =
+                        Vec3(
+                            img[i * 4 + j * 4 * lpnum + 0],
+                            img[i * 4 + j * 4 * lpnum + 1],
+                            img[i * 4 + j * 4 * lpnum + 2]);
+                    lightPathInfos[i * scPreLightSize + j].radiance =
+                        Vec3(
+                            img[i * 4 + (j + 3) * 4 * lpnum + 0],
+                            img[i * 4 + (j + 3) * 4 * lpnum + 1],
+                            img[i * 4 + (j + 3) * 4 * lpnum + 2]);
+                    lightPathInfos[i * scPreLightSize + j].normal =
+                        Vec3(
+                            img[i * 4 + (j + 6) * 4 * lpnum + 0],
+                            img[i * 4 + (j + 6) * 4 * lpnum + 1],
+                            img[i * 4 + (j + 6) * 4 * lpnum + 2]);
+                    lightPathInfos[i * scPreLightSize + j].ffnormal =
+                        Vec3(
+                            img[i * 4 + (j + 9) * 4 * lpnum + 0],
+                            img[i * 4 + (j + 9) * 4 * lpnum + 1],
+                            img[i * 4 + (j + 9) * 4 * lpnum + 2]);
+                    lightPathInfos[i * scPreLightSize + j].direction =
+                        Vec3(
+                            img[i * 4 + (j + 12) * 4 * lpnum + 0],
+                            img[i * 4 + (j + 12) * 4 * lpnum + 1],
+                            img[i * 4 + (j + 12) * 4 * lpnum + 2]);
+                    lightPathInfos[i * scPreLightSize + j].eta = img[i * 4 + (j + 15) * 4 * lpnum + 0];
+                    lightPathInfos[i * scPreLightSize + j].matID = img[i * 4 + (j + 15) * 4 * lpnum + 1];
+                    lightPathInfos[i * scPreLightSize + j].avaliable = img[i * 4 + (j + 15) * 4 * lpnum + 2];
+                    lightPathInfos[i * scPreLightSize + j].texCoods =
+                        Vec2(
+                            img[i * 4 + (j + 18) * 4 * lpnum + 0],
+                            img[i * 4 + (j + 18) * 4 * lpnum + 1]);
+                    lightPathInfos[i * scPreLightSize + j].matroughness = img[i * 4 + (j + 18) * 4 * lpnum + 2];
+                    lightPathInfos[i * scPreLightSize + j].flux =
+                        Vec3(
+                            img[i * 4 + (j + 21) * 4 * lpnum + 0],
+                            img[i * 4 + (j + 21) * 4 * lpnum + 1],
+                            img[i * 4 + (j + 21) * 4 * lpnum + 2]);
+                    lightPathInfos[i * scPreLightSize + j].vcm =
+                        Vec3(
+                            img[i * 4 + (j + 24) * 4 * lpnum + 0],
+                            img[i * 4 + (j + 24) * 4 * lpnum + 1],
+                            img[i * 4 + (j + 24) * 4 * lpnum + 2]);
+                }
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    void Renderer::GenerateLightPaths(int epoch)
+    {
+        glActiveTexture(GL_TEXTURE0);
+
+        // The light paths of a resumed checkpoint are kept so the remaining samples see the same cache. Vertex
+        // merging traced the paths of this pass during the previous one, other paths are traced and read right away
+        if (!lightPathsRestored)
+        {
+            if (lightPathFence && lightPathFenceEpoch != epoch)
+            {
+                glDeleteSync(lightPathFence);
+                lightPathFence = 0;
+            }
+            if (!lightPathFence)
+                DispatchLightPaths(epoch);
+            ReadLightPaths();
+        }
+        lightPathsRestored = false;
+
+        // wyd:
+        // print to check lightPathNodes
+        // freopen("out.txt", "w", stdout);
+        // for(int i = 0; i < lpnum; i++){
+        //     for(int j = 0; j < scene->renderOptions.sc_BDPT_LIGHTPATH; j++){
+        //         printf("lightPathInfos[%d][%d].position = %f %f %f\n", i,j,
+        //         lightPathInfos[i*scPreLightSize+j].position.x, lightPathInfos[i*scPreLightSize+j].position.y, lightPathInfos[i*scPreLightSize+j].position.z);
+        //         printf("lightPathInfos[%d][%d].radiance = %f %f %f\n", i,j,
+        //         lightPathInfos[i*scPreLightSize+j].radiance.x, lightPathInfos[i*scPreLightSize+j].radiance.y, lightPathInfos[i*scPreLightSize+j].radiance.z);
+        //         printf("lightPathInfos[%d][%d].normal = %f %f %f\n", i,j,
+        //         lightPathInfos[i*scPreLightSize+j].normal.x, lightPathInfos[i*scPreLightSize+j].normal.y, lightPathInfos[i*scPreLightSize+j].normal.z);
+        //         printf("lightPathInfos[%d][%d].ffnormal = %f %f %f\n", i,j,
+        //         lightPathInfos[i*scPreLightSize+j].ffnormal.x, lightPathInfos[i*scPreLightSize+j].ffnormal.y, lightPathInfos[i*scPreLightSize+j].ffnormal.z);
+        //         printf("lightPathInfos[%d][%d].direction = %f %f %f\n", i,j,
+        //         lightPathInfos[i*scPreLightSize+j].direction.x, lightPathInfos[i*scPreLightSize+j].direction.y, lightPathInfos[i*scPreLightSize+j].direction.z);
+        //         printf("lightPathInfos[%d][%d].eta = %f\n", i,j,lightPathInfos[i*scPreLightSize+j].eta);
+        //         printf("lightPathInfos[%d][%d].matID = %f\n", i,j,lightPathInfos[i*scPreLightSize+j].matID);
+        //         printf("lightPathInfos[%d][%d].avaliable = %f\n", i,j,lightPathInfos[i*scPreLightSize+j].avaliable);
+        //         printf("lightPathInfos[%d][%d].texCoods = %f %f\n", i,j,
+        //         lightPathInfos[i*scPreLightSize+j].texCoods.x, lightPathInfos[i*scPreLightSize+j].texCoods.y);
+        //         printf("lightPathInfos[%d][%d].matroughness = %f\n", i,j,lightPathInfos[i*scPreLightSize+j].matroughness);
+        //     }
+        // }
+        // freopen("CON","w",stdout);
+
+        // print image to check memory allocation
+        // freopen("out.txt", "w", stdout);
+        // for(int i = 0; i < lpnum; i++){
+        //     for(int j = 0; j < scene->renderOptions.sc_BDPT_LIGHTPATH * 6; j++){
+        //         printf("img[%d][%d] = %f %f %f %f\n", i, j, img[i * 4 + j * 4 *lpnum + 0], img[i * 4 + j * 4 *lpnum + 1], img[i * 4 + j * 4 *lpnum + 2], img[i * 4 + j * 4 *lpnum + 3]);
+        //     }
+        // }
+
+        // Vertices lie on the geometry or on an analytic light. Slots the subpath never reached hold no position
+        // and are clamped into the same bounds, so the leaf size below keeps the tree within the shader stack
+        RadeonRays::bbox lightPathBounds = scene->sceneBounds;
+        for (const Light &light : scene->lights)
+        {
+            Vec3 radius(light.radius, light.radius, light.radius);
+            lightPathBounds.grow(light.position - radius);
+            lightPathBounds.grow(light.position + radius);
+            lightPathBounds.grow(light.position + light.u + light.v);
+        }
+
+        // construct bvh
+        std::vector<Point3f> pts;
+        for (int i = 0; i < lpnum; i++)
+        {
+            for (int j = 0; j < scPreLightSize; j++)
+            {
+                Vec3 position = Vec3::Min(Vec3::Max(lightPathInfos[i * scPreLightSize + j].position, lightPathBounds.pmin), lightPathBounds.pmax);
+                pts.push_back(Point3f(position.x, position.y, position.z));
+            }
+        }
+
+        // output pts value
+        // freopen("out.txt", "w", stdout);
+        // for (int i = 0; i < pts.size(); i++)
+        // {
+        //     printf("pts[%d] = %f %f %f\n", i, pts[i].x, pts[i].y, pts[i].z);
+        // }
+        //
+        // point cloud visualization
+        //
+        // pcl::PointCloud<pcl::PointXYZ> cloud;
+        // cloud.width = lpnum * scene->renderOptions.sc_BDPT_LIGHTPATH;
+        // cloud.height = 1;
+        // cloud.is_dense = false;
+        // cloud.points.resize(cloud.width * cloud.height);
+        // for (size_t i = 0; i < cloud.points.size(); ++i)
+        // {
+        //     cloud.points[i].x = pts[i].x;
+        //     cloud.points[i].y = pts[i].y;
+        //     cloud.points[i].z = pts[i].z;
+        // }
+
+        // pcl::io::savePCDFileASCII("selfgen.pcd", cloud);
+
+        // pcl::PointCloud<pcl::PointXYZ>::Ptr cloud2(new pcl::PointCloud<pcl::PointXYZ>);
+
+        // if (pcl::io::loadPCDFile<pcl::PointXYZ>("selfgen.pcd", *cloud2) == -1) //*打开点云文件
+        // {
+        //     PCL_ERROR("Couldn't read file test_pcd.pcd\n");
+        // }
+
+        // pcl::visualization::PCLVisualizer::Ptr viewer(new pcl::visualization::PCLVisualizer("viewer"));
+        // viewer->addCoordinateSystem(1);
+
+        // viewer->addPointCloud(cloud2);
+
+        // viewer->spin();
+
+        BVH_ACC1 bvh_lightpath(pts, 0.03, LightPathLeafSize(lightPathBounds));
+
+        std::vector<LinearBVHNodeForTransmit> Linearnodefortex;
+        for (int i = 0; i < bvh_lightpath.totalNodes; i++)
+        {
+            LinearBVHNodeForTransmit tmp;
+            tmp.bounds = bvh_lightpath.nodes[i].bounds;
+            tmp.primitivesOffsetOrSecondChildOffset = float(bvh_lightpath.nodes[i].primitivesOffset);
+            tmp.nPrimitives = float(bvh_lightpath.nodes[i].nPrimitives);
+            tmp.axis = float(bvh_lightpath.nodes[i].axis);
+            Linearnodefortex.push_back(tmp);
+        }
+
+        // // output for debug
+        // for (int i = 0; i < bvh_lightpath.totalNodes; i++)
+        // {
+        //     printf("Linearnodefortex[%d].bounds: (%f, %f, %f) (%f, %f, %f)\n", i, Linearnodefortex[i].bounds.pMin.x,
+        //            Linearnodefortex[i].bounds.pMin.y,
+        //            Linearnodefortex[i].bounds.pMin.z,
+        //            Linearnodefortex[i].bounds.pMax.x,
+        //            Linearnodefortex[i].bounds.pMax.y,
+        //            Linearnodefortex[i].bounds.pMax.z);
+        //     printf("Linearnodefortex[%d].primitivesOffset: %f\n", i, Linearnodefortex[i].primitivesOffsetOrSecondChildOffset);
+        //     printf("Linearnodefortex[%d].nPrimitives: %f\n", i, Linearnodefortex[i].nPrimitives);
+        //     printf("Linearnodefortex[%d].axis: %f\n", i, Linearnodefortex[i].axis);
+        // }
+
+        // One entry per vertex referenced by the leaves, not per node
+        std::vector<float> orderdatafortex;
+        for (size_t i = 0; i < bvh_lightpath.orderdata.size(); i++)
+        {
+            orderdatafortex.push_back(float(bvh_lightpath.orderdata[i]));
+        }
+        while (orderdatafortex.size() % 3 != 0)
+        {
+            orderdatafortex.push_back(-1.0f);
+        }
+        // output bvh_lightpath.orderdata for debug
+        // for (int i = 0; i < bvh_lightpath.totalNodes; i++)
+        // {
+        //     printf("orderdatafortex[%d] = %f\n", i, orderdatafortex[i]);
+        // }
+
+        glBindBuffer(GL_TEXTURE_BUFFER, lightPathBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(LightInfo) * lpnum * scPreLightSize, &lightPathInfos[0], GL_STATIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, lightPathTex);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, lightPathBuffer);
+
+        glBindBuffer(GL_TEXTURE_BUFFER, lightPathBVHBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(LinearBVHNode) * bvh_lightpath.totalNodes, &Linearnodefortex[0], GL_STATIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, lightPathBVHTex);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, lightPathBVHBuffer);
+
+        // TODO:
+        glBindBuffer(GL_TEXTURE_BUFFER, lightPathBVHIndexBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(float) * orderdatafortex.size(), &orderdatafortex[0], GL_STATIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, lightPathBVHIndexTex);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGB32F, lightPathBVHIndexBuffer);
+
+        // print bvh
+        // struct LinearBVHNode
+        //     {
+        //         Bounds3<float> bounds;
+        //         union
+        //         {
+        //             uint primitivesOffset;  // leaf
+        //             uint secondChildOffset; // interior
+        //         };
+        //         uint32_t nPrimitives; // 0 -> interior node
+        //         uint32_t axis;         // interior node: xyz
+
+        //     };
+
+        //     struct LightInfo
+        //     {
+        //         Vec3 position;
+        //         Vec3 radiance;
+        //         Vec3 normal;
+        //         Vec3 ffnormal;
+        //         Vec3 direction;
+        //         float eta;
+        //         int matID;
+        //         int avaliable;
+        //         Vec2 texCoods;
+        //         float matroughness;
+        //     };
+        // {
+        //     for (int i = 0; i < bvh_lightpath.totalNodes; i++)
+        //     {
+        //         // output LinearBVHNode infomations
+        //         printf("node %d: \n", i);
+        //         printf("bounds: (%f, %f, %f) (%f, %f, %f)\n", bvh_lightpath.nodes[i].bounds.pMin.x,
+        //         bvh_lightpath.nodes[i].bounds.pMin.y,
+        //         bvh_lightpath.nodes[i].bounds.pMin.z,
+        //         bvh_lightpath.nodes[i].bounds.pMax.x,
+        //         bvh_lightpath.nodes[i].bounds.pMax.y,
+        //         bvh_lightpath.nodes[i].bounds.pMax.z);
+        //         printf("primitivesOffset or secondchildoffset: %d\n",
+        //         bvh_lightpath.nodes[i].primitivesOffset);
+        //         printf("nPrimitives: %d\n",
+        //         bvh_lightpath.nodes[i].nPrimitives);
+        //         printf("axis: %d\n",
+        //         bvh_lightpath.nodes[i].axis);
+
+        //         if(bvh_lightpath.nodes[i].axis == 3){ // leaf node
+        //             uint primitivesOffset = bvh_lightpath.nodes[i].primitivesOffset;
+        //             uint nPrimitives = bvh_lightpath.nodes[i].nPrimitives;
+        //             printf("primitivesOffset: %d\n", primitivesOffset);
+        //             printf("nPrimitives: %d\n", nPrimitives);
+        //             for(int j = 0; j < nPrimitives; j++){
+        //                 printf("primitives[%d] = %d\n", j,
+        //                 lightPathInfos
+        //                 [bvh_lightpath.orderdata[(primitivesOffset + j)] / scPreLightSize]
+        //                 [bvh_lightpath.orderdata[(primitivesOffset + j)] % scPreLightSize].matID);
+        //             }
+
+        //         }
+        //     }
+        // }
+
+        // Every pass merges with its own paths, the next ones are traced now so their readback overlaps the pass
+        if (vertexMerging)
+            DispatchLightPaths(epoch + 1);
+    }
+
+    float Renderer::VertexMergingRadius(int pass) const
+    {
+        // Progressive radius reduction of VCM, the passes are its iterations
+        const RenderOptions &options = scene->renderOptions;
+        float sceneRadius = Vec3::Length(scene->sceneBounds.extents()) * 0.5f;
+        int iteration = pass + 1;
+        return options.vertexMergingRadius * sceneRadius * powf((float)iteration, (options.vertexMergingAlpha - 1.0f) * 0.5f);
+    }
+
+    void Renderer::RenderTile(const iVec2 &t)
+    {
+        pathTraceShader->Use();
+        glUniform2f(glGetUniformLocation(pathTraceShader->getObject(), "tileOffset"), (float)t.x * invNumTiles.x, (float)t.y * invNumTiles.y);
+        pathTraceShader->StopUsing();
+
+        // Renders to pathTraceTexture while using previously accumulated samples from accumTexture
+        glBindFramebuffer(GL_FRAMEBUFFER, pathTraceFBO);
+        glViewport(0, 0, tileWidth, tileHeight);
+        glBindTexture(GL_TEXTURE_2D, accumTexture);
+        quad->Draw(pathTraceShader);
+
+        // pathTraceTexture is copied to accumTexture and re-used as input for the first step.
+        glBindFramebuffer(GL_FRAMEBUFFER, accumFBO);
+        glViewport(tileWidth * t.x, tileHeight * t.y, tileWidth, tileHeight);
+        glBindTexture(GL_TEXTURE_2D, pathTraceTexture);
+        quad->Draw(outputShader);
+
+        // The AOVs, moments and guiding samples of the tile are copied the same way
+        GLenum copies[5];
+        int numCopies = 0;
+        if (denoiserAOVs)
+        {
+            copies[numCopies++] = GL_COLOR_ATTACHMENT1;
+            copies[numCopies++] = GL_COLOR_ATTACHMENT2;
+        }
+        if (adaptiveSampling)
+            copies[numCopies++] = GL_COLOR_ATTACHMENT3;
+        if (pathGuiding)
+        {
+            copies[numCopies++] = GL_COLOR_ATTACHMENT4;
+            copies[numCopies++] = GL_COLOR_ATTACHMENT5;
+        }
+
+        if (numCopies > 0)
+        {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, pathTraceFBO);
+            for (int i = 0; i < numCopies; i++)
+            {
+                glReadBuffer(copies[i]);
+                glDrawBuffer(copies[i]);
+                glBlitFramebuffer(0, 0, tileWidth, tileHeight, tileWidth * t.x, tileHeight * t.y, tileWidth * (t.x + 1), tileHeight * (t.y + 1), GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            }
+            glReadBuffer(GL_COLOR_ATTACHMENT0);
+            glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        }
+    }
+
     void Renderer::Present()
     {
         glActiveTexture(GL_TEXTURE0);
@@ -1054,35 +1754,551 @@ namespace GLSLPT
         glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, *data);
     }
 
+    int Renderer::GetAccumBuffer(std::vector<Vec4> &pixels, int &w, int &h)
+    {
+        w = renderSize.x;
+        h = renderSize.y;
+        pixels.resize(w * h);
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, accumTexture);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &pixels[0]);
+        return sampleCounter - 1;
+    }
+
+    void Renderer::SetSampleOffset(int firstSample)
+    {
+        // Every pass renders each tile once and advances the frame counter per tile
+        frameOffset = firstSample * numTiles.x * numTiles.y;
+        sampleOffset = firstSample;
+    }
+
+    void Renderer::SaveFrame(const std::string &filename, bool hdr)
+    {
+        CaptureRequest request;
+        request.filename = filename;
+        request.hdr = hdr;
+        request.checkpoint = false;
+        captureRequests.push_back(request);
+    }
+
+    void Renderer::SaveCheckpoint(const std::string &filename)
+    {
+        CaptureRequest request;
+        request.filename = filename;
+        request.hdr = true;
+        request.checkpoint = true;
+        captureRequests.push_back(request);
+    }
+
+    void Renderer::UpdateCaptures(bool accumComplete)
+    {
+        if (captureFence)
+        {
+            GLenum status = glClientWaitSync(captureFence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                return;
+            FinishCapture();
+        }
+
+        if (captureRequests.empty())
+            return;
+
+        // Tiles of the current pass have one sample more than the rest, so the accumulation buffer
+        // is only read once all tiles are done and before the next pass starts
+        const CaptureRequest &request = captureRequests.front();
+        if (request.hdr && !accumComplete)
+            return;
+
+        // Checkpoints are rare enough to read back right away
+        if (request.checkpoint)
+        {
+            WriteCheckpoint(request.filename);
+            captureRequests.pop_front();
+            return;
+        }
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capturePBO);
+        if (request.hdr)
+        {
+            glBindTexture(GL_TEXTURE_2D, accumTexture);
+            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, 0);
+            captureScale = 1.0f / (sampleCounter - 1);
+        }
+        else
+        {
+            if (scene->renderOptions.enableDenoiser && denoised)
+                glBindTexture(GL_TEXTURE_2D, denoisedTexture);
+            else
+                glBindTexture(GL_TEXTURE_2D, tileOutputTexture[1 - currentBuffer]);
+            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+            captureScale = 1.0f;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        captureFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        capture = request;
+        captureRequests.pop_front();
+    }
+
+    void Renderer::FinishCapture()
+    {
+        glClientWaitSync(captureFence, GL_SYNC_FLUSH_COMMANDS_BIT, ~GLuint64(0));
+        glDeleteSync(captureFence);
+        captureFence = 0;
+
+        int w = renderSize.x;
+        int h = renderSize.y;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, capturePBO);
+        const void *pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (pixels && capture.hdr)
+        {
+            const float *data = (const float *)pixels;
+            imageWriter->WriteEXR(capture.filename, w, h, std::vector<float>(data, data + w * h * 4), captureScale);
+        }
+        else if (pixels)
+        {
+            const unsigned char *data = (const unsigned char *)pixels;
+            imageWriter->WritePNG(capture.filename, w, h, std::vector<unsigned char>(data, data + w * h * 4));
+        }
+        else
+            printf("Unable to read back frame: %s\n", capture.filename.c_str());
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    void Renderer::WriteCheckpoint(const std::string &filename)
+    {
+        // The shaders seed their RNG with the frame counter, so the counters are the whole sampler state
+        CheckpointHeader header;
+        header.magic = kCheckpointMagic;
+        header.version = kCheckpointVersion;
+        header.sceneHash = scene->Hash();
+        header.width = renderSize.x;
+        header.height = renderSize.y;
+        header.sampleCounter = sampleCounter;
+        header.frameCounter = frameCounter;
+        header.tileX = tile.x;
+        header.tileY = tile.y;
+        header.currentBuffer = currentBuffer;
+        header.numAOVs = denoiserAOVs ? 2 : 0;
+        header.numMoments = adaptiveSampling ? 1 : 0;
+        header.numLightPaths = scene->renderOptions.useHRRVC && !vertexMerging ? lpnum * scPreLightSize : 0;
+        header.lightPathSize = sizeof(LightInfo);
+
+        size_t imageSize = sizeof(Vec4) * renderSize.x * renderSize.y;
+        int numImages = 1 + header.numAOVs + header.numMoments;
+        std::vector<char> data(sizeof(header) + imageSize * numImages + sizeof(LightInfo) * header.numLightPaths);
+        memcpy(&data[0], &header, sizeof(header));
+        char *images = &data[sizeof(header)];
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, accumTexture);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, images);
+        for (int i = 0; i < header.numAOVs; i++)
+        {
+            glBindTexture(GL_TEXTURE_2D, accumAOVTextures[i]);
+            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, images + imageSize * (1 + i));
+        }
+        if (header.numMoments > 0)
+        {
+            glBindTexture(GL_TEXTURE_2D, accumMomentsTexture);
+            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, images + imageSize * (1 + header.numAOVs));
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        if (header.numLightPaths > 0)
+            memcpy(images + imageSize * numImages, lightPathInfos, sizeof(LightInfo) * header.numLightPaths);
+
+        imageWriter->WriteFile(filename, std::move(data));
+    }
+
+    bool Renderer::LoadCheckpoint(const std::string &filename)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        CheckpointHeader header;
+        if (!file || !file.read((char *)&header, sizeof(header)) || header.magic != kCheckpointMagic || header.version != kCheckpointVersion)
+        {
+            printf("Invalid checkpoint %s\n", filename.c_str());
+            return false;
+        }
+
+        if (header.sceneHash != scene->Hash())
+        {
+            printf("Checkpoint %s was rendered with a different scene or settings\n", filename.c_str());
+            return false;
+        }
+
+        bool validLightPaths = header.numLightPaths == 0 || (header.numLightPaths == lpnum * scPreLightSize && header.lightPathSize == sizeof(LightInfo));
+        bool validState = header.tileX >= 0 && header.tileX < numTiles.x && header.tileY >= 0 && header.tileY < numTiles.y && (header.currentBuffer == 0 || header.currentBuffer == 1);
+        if (header.width != renderSize.x || header.height != renderSize.y || header.sampleCounter < 2 || header.numAOVs < 0 || header.numAOVs > 2 || header.numMoments < 0 || header.numMoments > 1 || !validLightPaths || !validState)
+        {
+            printf("Checkpoint %s does not match the renderer\n", filename.c_str());
+            return false;
+        }
+
+        Checkpoint *checkpoint = new Checkpoint();
+        checkpoint->sampleCounter = header.sampleCounter;
+        checkpoint->frameCounter = header.frameCounter;
+        checkpoint->tile = iVec2(header.tileX, header.tileY);
+        checkpoint->currentBuffer = header.currentBuffer;
+        checkpoint->accum.resize(renderSize.x * renderSize.y);
+        checkpoint->aovs.resize(renderSize.x * renderSize.y * header.numAOVs);
+        checkpoint->moments.resize(renderSize.x * renderSize.y * header.numMoments);
+        checkpoint->lightPaths.resize(header.numLightPaths);
+
+        file.read((char *)&checkpoint->accum[0], sizeof(Vec4) * checkpoint->accum.size());
+        if (!checkpoint->aovs.empty())
+            file.read((char *)&checkpoint->aovs[0], sizeof(Vec4) * checkpoint->aovs.size());
+        if (!checkpoint->moments.empty())
+            file.read((char *)&checkpoint->moments[0], sizeof(Vec4) * checkpoint->moments.size());
+        if (!checkpoint->lightPaths.empty())
+            file.read((char *)&checkpoint->lightPaths[0], sizeof(LightInfo) * checkpoint->lightPaths.size());
+        if (!file)
+        {
+            printf("Checkpoint %s is truncated\n", filename.c_str());
+            delete checkpoint;
+            return false;
+        }
+
+        delete resumeCheckpoint;
+        resumeCheckpoint = checkpoint;
+        scene->dirty = true;
+
+        printf("Resuming from %s at %d spp\n", filename.c_str(), header.sampleCounter - 1);
+        return true;
+    }
+
+    void Renderer::RestoreCheckpoint()
+    {
+        Checkpoint *checkpoint = resumeCheckpoint;
+        resumeCheckpoint = nullptr;
+
+        // Update advances the frame and the tile before rendering, the checkpoint holds the values after that
+        sampleCounter = checkpoint->sampleCounter;
+        frameCounter = checkpoint->frameCounter - 1;
+        tile = iVec2(checkpoint->tile.x - 1, checkpoint->tile.y);
+        currentBuffer = checkpoint->currentBuffer;
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, accumTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, renderSize.x, renderSize.y, GL_RGBA, GL_FLOAT, &checkpoint->accum[0]);
+        if (denoiserAOVs && !checkpoint->aovs.empty())
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                glBindTexture(GL_TEXTURE_2D, accumAOVTextures[i]);
+                glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, renderSize.x, renderSize.y, GL_RGBA, GL_FLOAT, &checkpoint->aovs[i * renderSize.x * renderSize.y]);
+            }
+        }
+        if (adaptiveSampling && !checkpoint->moments.empty())
+        {
+            glBindTexture(GL_TEXTURE_2D, accumMomentsTexture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, renderSize.x, renderSize.y, GL_RGBA, GL_FLOAT, &checkpoint->moments[0]);
+        }
+
+        if (scene->renderOptions.useHRRVC && !checkpoint->lightPaths.empty())
+        {
+            memcpy(lightPathInfos, &checkpoint->lightPaths[0], sizeof(LightInfo) * checkpoint->lightPaths.size());
+            lightPathsRestored = true;
+        }
+
+        // Both output buffers show the restored samples until the next pass is done
+        tonemapShader->Use();
+        glUniform1f(glGetUniformLocation(tonemapShader->getObject(), "invSampleCounter"), 1.0f / (sampleCounter - 1));
+        tonemapShader->StopUsing();
+        glBindFramebuffer(GL_FRAMEBUFFER, outputFBO);
+        glViewport(0, 0, renderSize.x, renderSize.y);
+        glBindTexture(GL_TEXTURE_2D, accumTexture);
+        for (int i = 0; i < 2; i++)
+        {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tileOutputTexture[i], 0);
+            quad->Draw(tonemapShader);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        delete checkpoint;
+    }
+
+    void Renderer::GetInstanceMaterials(std::vector<int> &instanceMaterials) const
+    {
+        // Compressed instance leaves also need the wide root of the instanced mesh or group.
+        // Group instances have no material, which is how the shaders tell them apart
+        int stride = scene->renderOptions.compressBVH ? 2 : 1;
+        int numRecords = scene->NumInstanceRecords();
+        instanceMaterials.resize(numRecords * stride);
+        for (int i = 0; i < numRecords; i++)
+        {
+            const MeshInstance &instance = scene->GetInstanceRecord(i);
+            instanceMaterials[i * stride] = instance.materialID;
+            if (stride == 2)
+            {
+                const RadeonRays::BvhTranslator &translator = scene->bvhTranslator;
+                instanceMaterials[i * stride + 1] = instance.groupID >= 0 ? translator.wideGroupRootIndices[instance.groupID] : translator.wideRootIndices[instance.meshID];
+            }
+        }
+    }
+
     int Renderer::GetSampleCount()
     {
         return sampleCounter;
     }
 
+    // The tree is read back from the GPU only when a report is requested
+    void Renderer::AnalyzeLightPathBVH(BvhAnalyzer &analyzer) const
+    {
+        GLint size = 0;
+        glBindBuffer(GL_TEXTURE_BUFFER, lightPathBVHBuffer);
+        glGetBufferParameteriv(GL_TEXTURE_BUFFER, GL_BUFFER_SIZE, &size);
+
+        std::vector<LinearBVHNodeForTransmit> nodes(size / sizeof(LinearBVHNodeForTransmit));
+        if (!nodes.empty())
+            glGetBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(LinearBVHNodeForTransmit) * nodes.size(), &nodes[0]);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        std::vector<BvhAnalyzer::Node> lightPathBVH(nodes.size());
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            const LinearBVHNodeForTransmit &node = nodes[i];
+            BvhAnalyzer::Node &dst = lightPathBVH[i];
+            dst.bboxmin = Vec3(node.bounds.pMin.x, node.bounds.pMin.y, node.bounds.pMin.z);
+            dst.bboxmax = Vec3(node.bounds.pMax.x, node.bounds.pMax.y, node.bounds.pMax.z);
+            bool leaf = node.axis == 3.0f;
+            dst.left = leaf ? -1 : (int)i + 1;
+            dst.right = leaf ? -1 : (int)node.primitivesOffsetOrSecondChildOffset;
+            dst.firstPrim = leaf ? (int)node.primitivesOffsetOrSecondChildOffset : -1;
+            dst.numPrims = leaf ? (int)node.nPrimitives : 0;
+        }
+        analyzer.AnalyzeTree("lightPaths", lightPathBVH, sizeof(LinearBVHNodeForTransmit));
+    }
+
+    bool Renderer::NextTile()
+    {
+        frameCounter++;
+        tile.x++;
+        if (tile.x >= numTiles.x)
+        {
+            tile.x = 0;
+            tile.y--;
+            if (tile.y < 0)
+            {
+                // If we've reached here, it means all the tiles have been rendered (for a single sample) and the image can now be displayed.
+                tile.x = 0;
+                tile.y = numTiles.y - 1;
+                sampleCounter++;
+                currentBuffer = 1 - currentBuffer;
+
+                int checkpointInterval = scene->renderOptions.checkpointInterval;
+                if (checkpointInterval > 0 && (sampleCounter - 1) % checkpointInterval == 0)
+                {
+                    SaveFrame("./checkpoint_" + std::to_string(sampleCounter - 1) + ".exr", true);
+                    SaveCheckpoint("./checkpoint.ckpt");
+                }
+
+                // Pixels only ever become converged, so flags that arrive a few passes late just skip less
+                if (adaptiveSampling && !adaptiveFence)
+                {
+                    glActiveTexture(GL_TEXTURE0);
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, adaptivePBO);
+                    glBindTexture(GL_TEXTURE_2D, accumMomentsTexture);
+                    glGetTexImage(GL_TEXTURE_2D, 0, GL_GREEN, GL_FLOAT, 0);
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                    adaptiveFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                }
+
+                // Passes whose samples arrive while the previous ones are still being read are not trained on
+                if (pathGuiding && !guideFence)
+                {
+                    glActiveTexture(GL_TEXTURE0);
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, guidePBO);
+                    for (int i = 0; i < 2; i++)
+                    {
+                        glBindTexture(GL_TEXTURE_2D, guideSampleTextures[i]);
+                        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, (void *)(i * sizeof(Vec4) * renderSize.x * renderSize.y));
+                    }
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+                    // Tiles skipped by adaptive sampling must not hand in the same samples again
+                    const float zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                    GLenum guideBuffers[2] = { GL_COLOR_ATTACHMENT4, GL_COLOR_ATTACHMENT5 };
+                    glBindFramebuffer(GL_FRAMEBUFFER, accumFBO);
+                    glDrawBuffers(2, guideBuffers);
+                    glClearBufferfv(GL_COLOR, 0, zero);
+                    glClearBufferfv(GL_COLOR, 1, zero);
+                    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+                    guideFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Renderer::UpdateConvergedTiles()
+    {
+        GLenum status = glClientWaitSync(adaptiveFence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            return;
+        glDeleteSync(adaptiveFence);
+        adaptiveFence = 0;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, adaptivePBO);
+        const float *converged = (const float *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (converged)
+        {
+            for (int ty = 0; ty < numTiles.y; ty++)
+            {
+                for (int tx = 0; tx < numTiles.x; tx++)
+                {
+                    // Tiles at the right and top are cut off by the image
+                    int xEnd = std::min((tx + 1) * tileWidth, renderSize.x);
+                    int yEnd = std::min((ty + 1) * tileHeight, renderSize.y);
+                    bool tileDone = true;
+                    for (int y = ty * tileHeight; y < yEnd && tileDone; y++)
+                        for (int x = tx * tileWidth; x < xEnd && tileDone; x++)
+                            tileDone = converged[y * renderSize.x + x] > 0.0f;
+                    tileConverged[ty * numTiles.x + tx] = tileDone;
+                }
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    void Renderer::UpdatePathGuide()
+    {
+        GLenum status = glClientWaitSync(guideFence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            return;
+        glDeleteSync(guideFence);
+        guideFence = 0;
+
+        int numPixels = renderSize.x * renderSize.y;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, guidePBO);
+        const Vec4 *samples = (const Vec4 *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+        if (samples)
+        {
+            // Pixels without a guided bounce or without radiance leave a zero value
+            for (int i = 0; i < numPixels; i++)
+            {
+                const Vec4 &position = samples[i];
+                const Vec4 &direction = samples[numPixels + i];
+                if (position.w > 0.0f)
+                    pathGuide.Record(Vec3(position.x, position.y, position.z), Vec3(direction.x, direction.y, direction.z), position.w);
+            }
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        // Iterations double in length so the later trees learn from more samples
+        if (++guidePasses >= pathGuide.IterationPasses())
+        {
+            pathGuide.Refine();
+            UploadPathGuide();
+            guidePasses = 0;
+        }
+    }
+
+    void Renderer::UploadPathGuide()
+    {
+        std::vector<Vec4> treeData;
+        pathGuide.GetTextureData(treeData);
+
+        glBindBuffer(GL_TEXTURE_BUFFER, guideTreeBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, sizeof(Vec4) * treeData.size(), &treeData[0], GL_STATIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, guideTreeTex);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, guideTreeBuffer);
+    }
+
     void Renderer::Update(float secondsElapsed)
     {
         // If maxSpp was reached then stop updates
         // TODO: Tonemapping and denosing still need to be able to run on final image
         if (!scene->dirty && scene->renderOptions.maxSpp != -1 && sampleCounter >= scene->renderOptions.maxSpp)
+        {
+            UpdateCaptures(sampleCounter > 1);
             return;
+        }
 
         // Update data for instances
         if (scene->instancesModified)
         {
-            // Update transforms
+            // Update transforms. Instance and material counts are fixed so the textures keep their storage
             glBindTexture(GL_TEXTURE_2D, transformsTex);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, (sizeof(Mat4) / sizeof(Vec4)) * scene->transforms.size(), 1, 0, GL_RGBA, GL_FLOAT, &scene->transforms[0]);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (sizeof(Mat4) / sizeof(Vec4)) * scene->transforms.size(), 1, GL_RGBA, GL_FLOAT, &scene->transforms[0]);
 
             // Update materials
             glBindTexture(GL_TEXTURE_2D, materialsTex);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, (sizeof(Material) / sizeof(Vec4)) * scene->materials.size(), 1, 0, GL_RGBA, GL_FLOAT, &scene->materials[0]);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (sizeof(Material) / sizeof(Vec4)) * scene->materials.size(), 1, GL_RGBA, GL_FLOAT, &scene->materials[0]);
 
-            // Update top level BVH
-            int index = scene->bvhTranslator.topLevelIndex;
-            int offset = sizeof(RadeonRays::BvhTranslator::Node) * index;
-            int size = sizeof(RadeonRays::BvhTranslator::Node) * (scene->bvhTranslator.nodes.size() - index);
-            glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
-            glBufferSubData(GL_TEXTURE_BUFFER, offset, size, &scene->bvhTranslator.nodes[index]);
+            // Update top level BVH, only the nodes touched by refits or the whole tree after a rebuild
+            RadeonRays::BvhTranslator& bvhTranslator = scene->bvhTranslator;
+            if (bvhTranslator.dirtyEnd > bvhTranslator.dirtyBegin)
+            {
+                glBindBuffer(GL_TEXTURE_BUFFER, BVHBuffer);
+                if (scene->renderOptions.compressBVH)
+                {
+                    // The compressed top level nodes are rewritten as a whole
+                    int offset = sizeof(RadeonRays::BvhTranslator::WideNode) * bvhTranslator.wideTopLevelIndex;
+                    int size = sizeof(RadeonRays::BvhTranslator::WideNode) * (bvhTranslator.wideNodes.size() - bvhTranslator.wideTopLevelIndex);
+                    glBufferSubData(GL_TEXTURE_BUFFER, offset, size, &bvhTranslator.wideNodes[bvhTranslator.wideTopLevelIndex]);
+                }
+                else if (scene->renderOptions.packBVH)
+                {
+                    std::vector<RadeonRays::BvhTranslator::PackedNode> packedNodes;
+                    bvhTranslator.PackNodes(bvhTranslator.dirtyBegin, bvhTranslator.dirtyEnd, packedNodes);
+                    int offset = sizeof(RadeonRays::BvhTranslator::PackedNode) * bvhTranslator.dirtyBegin;
+                    glBufferSubData(GL_TEXTURE_BUFFER, offset, sizeof(RadeonRays::BvhTranslator::PackedNode) * packedNodes.size(), &packedNodes[0]);
+                }
+                else
+                {
+                    int offset = sizeof(RadeonRays::BvhTranslator::Node) * bvhTranslator.dirtyBegin;
+                    int size = sizeof(RadeonRays::BvhTranslator::Node) * (bvhTranslator.dirtyEnd - bvhTranslator.dirtyBegin);
+                    glBufferSubData(GL_TEXTURE_BUFFER, offset, size, &bvhTranslator.nodes[bvhTranslator.dirtyBegin]);
+                }
+                bvhTranslator.dirtyBegin = bvhTranslator.dirtyEnd = 0;
+            }
+
+            // Update instance materials read by packed and compressed top level leaves
+            if (scene->renderOptions.compressBVH || scene->renderOptions.packBVH)
+            {
+                std::vector<int> instanceMaterials;
+                GetInstanceMaterials(instanceMaterials);
+
+                glBindBuffer(GL_TEXTURE_BUFFER, instanceMaterialsBuffer);
+                glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(int) * instanceMaterials.size(), &instanceMaterials[0]);
+            }
+
+            // Material overrides of the instances
+            if (!scene->materialTables.empty())
+            {
+                glBindBuffer(GL_TEXTURE_BUFFER, materialTablesBuffer);
+                glBufferSubData(GL_TEXTURE_BUFFER, 0, sizeof(int) * scene->materialTables.size(), &scene->materialTables[0]);
+            }
+
+            // Emissive triangles moved with their instances and the light selection structures were rebuilt
+            if (scene->emittersModified)
+            {
+                UploadEmitters();
+
+                // Buffers that were just created still need their texture units
+                glActiveTexture(GL_TEXTURE17);
+                glBindTexture(GL_TEXTURE_BUFFER, lightAliasTex);
+                glActiveTexture(GL_TEXTURE18);
+                glBindTexture(GL_TEXTURE_BUFFER, lightBvhTex);
+                glActiveTexture(GL_TEXTURE19);
+                glBindTexture(GL_TEXTURE_BUFFER, emissiveTrianglesTex);
+                glActiveTexture(GL_TEXTURE20);
+                glBindTexture(GL_TEXTURE_BUFFER, instanceEmittersTex);
+                glActiveTexture(GL_TEXTURE0);
+
+                // The first emissive mesh or a light BVH outgrowing its bit trails changes the shader defines
+                bool hasLights = !scene->lights.empty() || !scene->emissiveTriangles.empty();
+                bool useLightBvh = hasLights && scene->renderOptions.lightSampling == BvhLightSampling && scene->lightSampler.bvhUsable;
+                if (emitterTriangles != !scene->emissiveTriangles.empty() || lightBvh != useLightBvh)
+                    ReloadShaders();
+            }
         }
 
         // Recreate texture for envmaps
@@ -1094,63 +2310,66 @@ namespace GLSLPT
                 glBindTexture(GL_TEXTURE_2D, envMapTex);
                 glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, scene->envMap->width, scene->envMap->height, 0, GL_RGB, GL_FLOAT, scene->envMap->img);
 
-                glBindTexture(GL_TEXTURE_2D, envMapCDFTex);
-                glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, scene->envMap->width, scene->envMap->height, 0, GL_RED, GL_FLOAT, scene->envMap->cdf);
+                glBindTexture(GL_TEXTURE_2D, envMapAliasTex);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, scene->envMap->width + 1, scene->envMap->height, 0, GL_RGBA, GL_FLOAT, scene->envMap->aliasTable);
 
                 GLuint shaderObject;
                 pathTraceShader->Use();
                 shaderObject = pathTraceShader->getObject();
                 glUniform2f(glGetUniformLocation(shaderObject, "envMapRes"), (float)scene->envMap->width, (float)scene->envMap->height);
-                glUniform1f(glGetUniformLocation(shaderObject, "envMapTotalSum"), scene->envMap->totalSum);
                 pathTraceShader->StopUsing();
 
                 pathTraceShaderLowRes->Use();
                 shaderObject = pathTraceShaderLowRes->getObject();
                 glUniform2f(glGetUniformLocation(shaderObject, "envMapRes"), (float)scene->envMap->width, (float)scene->envMap->height);
-                glUniform1f(glGetUniformLocation(shaderObject, "envMapTotalSum"), scene->envMap->totalSum);
                 pathTraceShaderLowRes->StopUsing();
             }
         }
 
-        // Denoise image if requested
+        // Denoise image if requested. The frame is read back into a PBO at the end of a pass, handed to the denoiser
+        // thread once the copy finished and the result replaces denoisedTexture when it is ready, so rendering never waits
         if (scene->renderOptions.enableDenoiser && sampleCounter > 1)
         {
-            if (!denoised || (frameCounter % (scene->renderOptions.denoiserFrameCnt * (numTiles.x * numTiles.y)) == 0))
+            if (denoiser->FetchResult(frameOutputPtr))
             {
-                // FIXME: Figure out a way to have transparency with denoiser
-                glBindTexture(GL_TEXTURE_2D, tileOutputTexture[1 - currentBuffer]);
-                glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, denoiserInputFramePtr);
-
-                // Create an Intel Open Image Denoise device
-                oidn::DeviceRef device = oidn::newDevice();
-                device.commit();
-
-                // Create a denoising filter
-                oidn::FilterRef filter = device.newFilter("RT"); // generic ray tracing filter
-                filter.setImage("color", denoiserInputFramePtr, oidn::Format::Float3, renderSize.x, renderSize.y, 0, 0, 0);
-                filter.setImage("output", frameOutputPtr, oidn::Format::Float3, renderSize.x, renderSize.y, 0, 0, 0);
-                filter.set("hdr", false);
-                filter.commit();
-
-                // Filter the image
-                filter.execute();
-
-                // Check for errors
-                const char *errorMessage;
-                if (device.getError(errorMessage) != oidn::Error::None)
-                    std::cout << "Error: " << errorMessage << std::endl;
-
-                // Copy the denoised data to denoisedTexture
                 glBindTexture(GL_TEXTURE_2D, denoisedTexture);
                 glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, renderSize.x, renderSize.y, 0, GL_RGB, GL_FLOAT, frameOutputPtr);
-
                 denoised = true;
             }
+
+            if (denoiserFence)
+            {
+                GLenum status = glClientWaitSync(denoiserFence, 0, 0);
+                if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+                {
+                    glDeleteSync(denoiserFence);
+                    denoiserFence = 0;
+
+                    denoiser->SetPrefilter(scene->renderOptions.denoiserPrefilter);
+
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, denoiserPBO);
+                    const float *pixels = (const float *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+                    if (pixels && denoiserAOVs)
+                    {
+                        glBindBuffer(GL_PIXEL_PACK_BUFFER, denoiserAOVPBO);
+                        const Vec4 *aovs = (const Vec4 *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+                        if (aovs)
+                            denoiser->Submit(pixels, aovs, aovs + renderSize.x * renderSize.y);
+                        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                        glBindBuffer(GL_PIXEL_PACK_BUFFER, denoiserPBO);
+                    }
+                    else if (pixels)
+                        denoiser->Submit(pixels);
+                    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                }
+            }
         }
         else
             denoised = false;
 
         // If scene was modified then clear out image for re-rendering
+        bool passComplete = false;
         if (scene->dirty)
         {
             tile.x = -1;
@@ -1159,27 +2378,95 @@ namespace GLSLPT
             denoised = false;
             frameCounter = 1;
 
-            // Clear out the accumulated texture for rendering a new image
+            // Frames of the old scene state must not show up later
+            denoiser->Discard();
+            if (denoiserFence)
+                glDeleteSync(denoiserFence);
+            denoiserFence = 0;
+
+            // All pixels start unconverged again
+            std::fill(tileConverged.begin(), tileConverged.end(), 0);
+            if (adaptiveFence)
+                glDeleteSync(adaptiveFence);
+            adaptiveFence = 0;
+
+            // Samples of the old scene state are not trained on. The guide only starts over when the lighting or
+            // geometry changed, camera moves keep what it learned
+            if (guideFence)
+                glDeleteSync(guideFence);
+            guideFence = 0;
+
+            // Light paths traced ahead for the old scene state are dropped, the reset traces new ones
+            if (lightPathFence)
+                glDeleteSync(lightPathFence);
+            lightPathFence = 0;
+
+            if (scene->instancesModified || scene->emittersModified || scene->envMapModified)
+            {
+                pathGuide.Reset(scene->sceneBounds.pmin, scene->sceneBounds.pmax);
+                UploadPathGuide();
+                guidePasses = 0;
+            }
+
+            // Clear out the accumulated texture, AOVs, moments and guiding samples for rendering a new image
+            GLenum accumBuffers[6] = { GL_COLOR_ATTACHMENT0,
+                                       denoiserAOVs ? GL_COLOR_ATTACHMENT1 : GL_NONE, denoiserAOVs ? GL_COLOR_ATTACHMENT2 : GL_NONE,
+                                       adaptiveSampling ? GL_COLOR_ATTACHMENT3 : GL_NONE,
+                                       pathGuiding ? GL_COLOR_ATTACHMENT4 : GL_NONE, pathGuiding ? GL_COLOR_ATTACHMENT5 : GL_NONE };
             glBindFramebuffer(GL_FRAMEBUFFER, accumFBO);
+            glDrawBuffers(6, accumBuffers);
             glClear(GL_COLOR_BUFFER_BIT);
+            glDrawBuffers(1, accumBuffers);
+
+            if (resumeCheckpoint)
+                RestoreCheckpoint();
         }
         else // Update render state
         {
-            frameCounter++;
-            tile.x++;
-            if (tile.x >= numTiles.x)
+            if (adaptiveFence)
+                UpdateConvergedTiles();
+            if (guideFence)
+                UpdatePathGuide();
+
+            passComplete = NextTile();
+        }
+
+        // Nothing of the next pass has been rendered yet right after the tiles wrapped around
+        UpdateCaptures(passComplete);
+
+        // The colour of the finished pass and the accumulated AOVs are read here so both end at the same sample
+        if (passComplete && scene->renderOptions.enableDenoiser && !denoiserFence && !denoiser->Busy() &&
+            (!denoised || (sampleCounter - 1) % scene->renderOptions.denoiserFrameCnt == 0))
+        {
+            // FIXME: Figure out a way to have transparency with denoiser
+            glActiveTexture(GL_TEXTURE0);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, denoiserPBO);
+            glBindTexture(GL_TEXTURE_2D, tileOutputTexture[1 - currentBuffer]);
+            glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_FLOAT, 0);
+            if (denoiserAOVs)
             {
-                tile.x = 0;
-                tile.y--;
-                if (tile.y < 0)
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, denoiserAOVPBO);
+                for (int i = 0; i < 2; i++)
                 {
-                    // If we've reached here, it means all the tiles have been rendered (for a single sample) and the image can now be displayed.
-                    tile.x = 0;
-                    tile.y = numTiles.y - 1;
-                    sampleCounter++;
-                    currentBuffer = 1 - currentBuffer;
+                    glBindTexture(GL_TEXTURE_2D, accumAOVTextures[i]);
+                    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, (void *)(i * sizeof(Vec4) * renderSize.x * renderSize.y));
                 }
             }
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            denoiserFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+
+        // Every pass merges with its own light paths, so the radius can shrink and the merging stays consistent
+        if (passComplete && vertexMerging)
+            GenerateLightPaths(sampleCounter - 1 + sampleOffset);
+
+        // Converged tiles don't take a frame of their own. They are passed over after the captures so checkpoints
+        // hold the first tile of a pass, and the last tile of a pass is always rendered in its own frame
+        skippedTiles.clear();
+        while (!scene->dirty && adaptiveSampling && tileConverged[tile.y * numTiles.x + tile.x] && (tile.x != numTiles.x - 1 || tile.y != 0))
+        {
+            skippedTiles.push_back(tile);
+            NextTile();
         }
 
         // Update uniforms
@@ -1200,10 +2487,23 @@ namespace GLSLPT
         glUniform1i(glGetUniformLocation(shaderObject, "maxDepth"), scene->renderOptions.maxDepth);
         glUniform1i(glGetUniformLocation(shaderObject, "LIGHTPATHLENGTH"), scene->renderOptions.sc_BDPT_LIGHTPATH); // sc:
         glUniform1i(glGetUniformLocation(shaderObject, "EYEPATHLENGTH"), scene->renderOptions.sc_BDPT_EYEPATH);     // sc:
-        glUniform2f(glGetUniformLocation(shaderObject, "tileOffset"), (float)tile.x * invNumTiles.x, (float)tile.y * invNumTiles.y);
         glUniform3f(glGetUniformLocation(shaderObject, "uniformLightCol"), scene->renderOptions.uniformLightCol.x, scene->renderOptions.uniformLightCol.y, scene->renderOptions.uniformLightCol.z);
         glUniform1f(glGetUniformLocation(shaderObject, "roughnessMollificationAmt"), scene->renderOptions.roughnessMollificationAmt);
-        glUniform1i(glGetUniformLocation(shaderObject, "frameNum"), frameCounter);
+        glUniform1i(glGetUniformLocation(shaderObject, "frameNum"), frameCounter + frameOffset);
+        glUniform1i(glGetUniformLocation(shaderObject, "numSamples"), sampleCounter - 1);
+        glUniform1i(glGetUniformLocation(shaderObject, "sampleIndex"), sampleCounter - 1 + sampleOffset);
+        glUniform1f(glGetUniformLocation(shaderObject, "adaptiveThreshold"), scene->renderOptions.adaptiveThreshold);
+        glUniform1i(glGetUniformLocation(shaderObject, "adaptiveMinSpp"), scene->renderOptions.adaptiveMinSpp);
+        if (vertexMerging)
+        {
+            float radius = VertexMergingRadius(sampleCounter - 1 + sampleOffset);
+            glUniform1f(glGetUniformLocation(shaderObject, "vmRadius"), radius);
+            glUniform1f(glGetUniformLocation(shaderObject, "vmEta"), PI * radius * radius * lpnum);
+        }
+        glUniform3f(glGetUniformLocation(shaderObject, "guideBoundsMin"), pathGuide.boundsMin.x, pathGuide.boundsMin.y, pathGuide.boundsMin.z);
+        glUniform3f(glGetUniformLocation(shaderObject, "guideBoundsSize"), pathGuide.boundsSize.x, pathGuide.boundsSize.y, pathGuide.boundsSize.z);
+        glUniform1f(glGetUniformLocation(shaderObject, "guideBsdfFraction"), scene->renderOptions.guidingBsdfFraction);
+        glUniform1f(glGetUniformLocation(shaderObject, "pixelSpreadAngle"), atanf(2.0f * tanf(scene->camera->fov * 0.5f) / renderSize.y));
         pathTraceShader->StopUsing();
 
         pathTraceShaderLowRes->Use();
@@ -1224,6 +2524,10 @@ namespace GLSLPT
         glUniform3f(glGetUniformLocation(shaderObject, "camera.position"), scene->camera->position.x, scene->camera->position.y, scene->camera->position.z);
         glUniform3f(glGetUniformLocation(shaderObject, "uniformLightCol"), scene->renderOptions.uniformLightCol.x, scene->renderOptions.uniformLightCol.y, scene->renderOptions.uniformLightCol.z);
         glUniform1f(glGetUniformLocation(shaderObject, "roughnessMollificationAmt"), scene->renderOptions.roughnessMollificationAmt);
+        glUniform3f(glGetUniformLocation(shaderObject, "guideBoundsMin"), pathGuide.boundsMin.x, pathGuide.boundsMin.y, pathGuide.boundsMin.z);
+        glUniform3f(glGetUniformLocation(shaderObject, "guideBoundsSize"), pathGuide.boundsSize.x, pathGuide.boundsSize.y, pathGuide.boundsSize.z);
+        glUniform1f(glGetUniformLocation(shaderObject, "guideBsdfFraction"), scene->renderOptions.guidingBsdfFraction);
+        glUniform1f(glGetUniformLocation(shaderObject, "pixelSpreadAngle"), atanf(2.0f * tanf(scene->camera->fov * 0.5f) / (windowSize.y * pixelRatio)));
         pathTraceShaderLowRes->StopUsing();
 
         tonemapShader->Use();
@@ -24,7 +24,11 @@
 
 #pragma once
 
+#include <deque>
+#include <string>
 #include <vector>
+#include "BvhAnalyzer.h"
+#include "PathGuide.h"
 #include "Quad.h"
 #include "Program.h"
 #include "Vec2.h"
@@ -44,10 +48,28 @@ namespace GLSLPT
         float avaliable;
         Vec2 texCoods;
         float matroughness;
+        Vec3 flux; // Throughput of the light subpath arriving at the vertex, used by vertex merging
+        Vec3 vcm;  // Partial MIS quantities dVCM, dVC and dVM of vertex connection and merging
     };
 
     Program *LoadShaders(const ShaderInclude::ShaderSource &vertShaderObj, const ShaderInclude::ShaderSource &fragShaderObj);
 
+    // How a light is picked for next event estimation
+    enum LightSamplingMode
+    {
+        UniformLightSampling,
+        PowerLightSampling,
+        BvhLightSampling
+    };
+
+    // Where the random numbers of the tile shader come from
+    enum SamplerType
+    {
+        IndependentSampler,
+        SobolSampler,         // Owen scrambled Sobol, decorrelated per pixel
+        BlueNoiseSobolSampler // One Sobol sequence for all pixels, shifted by a blue noise mask
+    };
+
     struct RenderOptions
     {
         RenderOptions()
@@ -66,6 +88,8 @@ namespace GLSLPT
             denoiserFrameCnt = 20;
             enableRR = true;
             enableDenoiser = false;
+            denoiserAOVs = true;
+            denoiserPrefilter = false;
             enableTonemap = true;
             enableAces = false;
             openglNormalMap = true;
@@ -77,9 +101,26 @@ namespace GLSLPT
             independentRenderSize = false;
             enableRoughnessMollification = false;
             enableVolumeMIS = false;
+            enableTextureLod = true;
+            enableTextureCompression = false;
+            textureCacheDir = "texcache";
+            lightSampling = BvhLightSampling;
+            sampler = SobolSampler;
+            packBVH = false;
+            compressBVH = false;
+            blasCacheMemory = 1024;
             envMapIntensity = 1.0f;
             envMapRot = 0.0f;
             roughnessMollificationAmt = 0.0f;
+            checkpointInterval = 0;
+            enableAdaptiveSampling = false;
+            adaptiveThreshold = 0.02f;
+            adaptiveMinSpp = 16;
+            enableVertexMerging = false;
+            vertexMergingRadius = 0.003f;
+            vertexMergingAlpha = 0.75f;
+            enablePathGuiding = false;
+            guidingBsdfFraction = 0.5f;
         }
 
         iVec2 renderResolution;
@@ -96,6 +137,9 @@ namespace GLSLPT
         int denoiserFrameCnt;
         bool enableRR;
         bool enableDenoiser;
+        // First hit albedo and normal passed to the denoiser, optionally denoised themselves first
+        bool denoiserAOVs;
+        bool denoiserPrefilter;
         bool enableTonemap;
         bool enableAces;
         bool simpleAcesFit;
@@ -108,9 +152,37 @@ namespace GLSLPT
         bool independentRenderSize;
         bool enableRoughnessMollification;
         bool enableVolumeMIS;
+        bool enableTextureLod;
+        bool enableTextureCompression;
+        std::string textureCacheDir;
+        int lightSampling;
+        int sampler;
+        bool packBVH;
+        // 4-wide BVH with quantized child bounds, about a third of the memory. Takes precedence over packBVH
+        bool compressBVH;
+        // Mesh BVHs are kept in memory across scene loads up to this many MB, and on disk when a directory is set
+        int blasCacheMemory;
+        std::string blasCacheDir;
         float envMapIntensity;
         float envMapRot;
         float roughnessMollificationAmt;
+        // Every this many samples the linear accumulation buffer is written as checkpoint_<spp>.exr and the render
+        // state to checkpoint.ckpt, which --resume continues from. 0 disables it
+        int checkpointInterval;
+        // Pixels stop taking samples once the relative standard error of their mean luminance is below the
+        // threshold after at least adaptiveMinSpp samples, tiles without unconverged pixels are skipped
+        bool enableAdaptiveSampling;
+        float adaptiveThreshold;
+        int adaptiveMinSpp;
+        // HRRVC also merges eye vertices with the light vertices around them (VCM). The merge radius starts at
+        // vertexMergingRadius times the scene radius and shrinks by i^((alpha - 1) / 2) over the passes i
+        bool enableVertexMerging;
+        float vertexMergingRadius;
+        float vertexMergingAlpha;
+        // Eye paths sample directions from an SD-tree learned from the rendered passes, mixed with BSDF sampling
+        // which keeps guidingBsdfFraction of the samples. Not available with HRRVC
+        bool enablePathGuiding;
+        float guidingBsdfFraction;
 
         // sc:
         bool useBidirectionalPathTracing = false;
@@ -120,6 +192,8 @@ namespace GLSLPT
     };
 
     class Scene;
+    class Denoiser;
+    class ImageWriter;
 
     class Renderer
     {
@@ -139,9 +213,26 @@ namespace GLSLPT
         GLuint materialsTex;
         GLuint transformsTex;
         GLuint lightsTex;
+        GLuint lightAliasBuffer;
+        GLuint lightAliasTex;
+        GLuint lightBvhBuffer;
+        GLuint lightBvhTex;
+        GLuint emissiveTrianglesBuffer;
+        GLuint emissiveTrianglesTex;
+        GLuint instanceEmittersBuffer;
+        GLuint instanceEmittersTex;
+        GLuint instanceMaterialsBuffer;
+        GLuint instanceMaterialsTex;
+        GLuint materialTablesBuffer;
+        GLuint materialTablesTex;
+        GLuint triangleSlotsBuffer;
+        GLuint triangleSlotsTex;
         GLuint textureMapsArrayTex;
+        GLuint normalMapsArrayTex;
         GLuint envMapTex;
-        GLuint envMapCDFTex;
+        GLuint envMapAliasTex;
+        GLuint sobolDirectionsTex;
+        GLuint blueNoiseTex; // Made on first use
 
         // wyd: gl light inout tex
         GLuint lightInTex;
@@ -155,6 +246,10 @@ namespace GLSLPT
         // bvh index tex and buffer object
         GLuint lightPathBVHIndexBuffer;
         GLuint lightPathBVHIndexTex;
+        // Readback of the compute shader output, vertex merging traces the paths of the next pass ahead
+        GLuint lightPathPBO;
+        GLsync lightPathFence;
+        int lightPathFenceEpoch;
 
         // FBOs
         GLuint pathTraceFBO;
@@ -177,6 +272,12 @@ namespace GLSLPT
         GLuint pathTraceTextureLowRes;
         GLuint pathTraceTexture;
         GLuint accumTexture;
+        GLuint pathTraceAOVTextures[2]; // Albedo and normal of the tile
+        GLuint accumAOVTextures[2];
+        GLuint pathTraceMomentsTexture; // Sum of the squared luminance and the converged flag of the tile
+        GLuint accumMomentsTexture;
+        GLuint pathTraceGuideTextures[2]; // Training sample of the first bounce of every pixel of the tile
+        GLuint guideSampleTextures[2];
         GLuint tileOutputTexture[2];
         GLuint denoisedTexture;
 
@@ -192,14 +293,74 @@ namespace GLSLPT
         int tileHeight;
         int currentBuffer;
         int frameCounter;
+        int frameOffset; // Added to the frame counter that seeds the shaders
+        int sampleOffset; // Added to the sample index of the Sobol sampler
         int sampleCounter;
         float pixelRatio;
 
         // Denoiser output
-        Vec3 *denoiserInputFramePtr;
+        GLuint denoiserPBO;
+        GLuint denoiserAOVPBO;
+        GLsync denoiserFence;
+        Denoiser *denoiser;
+        bool denoiserAOVs; // Shaders write the first hit albedo and normal
         Vec3 *frameOutputPtr;
         bool denoised;
 
+        // Emitters the shaders were built for, instance edits that change these reload the shaders
+        bool emitterTriangles;
+        bool lightBvh;
+
+        // Adaptive sampling. The converged flags are read back after every pass and decide which tiles the next passes skip
+        bool adaptiveSampling;
+        GLuint adaptivePBO;
+        GLsync adaptiveFence;
+        std::vector<char> tileConverged;
+        std::vector<iVec2> skippedTiles; // Passed over by the last update, only padded with the mean of their pixels
+
+        // Vertex merging needs light paths of the current radius, so they are regenerated after every pass
+        bool vertexMerging;
+
+        // Path guiding. The training samples of a pass are read back once it is complete, the SD-tree is
+        // uploaded again whenever an iteration of its training ends
+        bool pathGuiding;
+        PathGuide pathGuide;
+        int guidePasses; // Passes recorded in the current iteration
+        GLuint guidePBO;
+        GLsync guideFence;
+        GLuint guideTreeBuffer;
+        GLuint guideTreeTex;
+
+        // Saved frames are read back into a PBO one at a time and encoded on the writer thread
+        struct CaptureRequest
+        {
+            std::string filename;
+            bool hdr;        // Linear accumulation buffer instead of the displayed image
+            bool checkpoint; // Render state to resume from, taken between passes like HDR frames
+        };
+        std::deque<CaptureRequest> captureRequests;
+        CaptureRequest capture;
+        float captureScale;
+        GLuint capturePBO;
+        GLsync captureFence;
+        ImageWriter *imageWriter;
+
+        // Loaded by LoadCheckpoint and restored instead of clearing the accumulation on the next reset
+        struct Checkpoint
+        {
+            int sampleCounter;
+            int frameCounter; // Seeds the RNG of the shaders
+            iVec2 tile;
+            int currentBuffer;
+            std::vector<Vec4> accum;
+            std::vector<Vec4> aovs;
+            std::vector<Vec4> moments;
+            std::vector<LightInfo> lightPaths;
+        };
+        Checkpoint *resumeCheckpoint;
+        bool lightPathsRestored; // The HRRVC light paths come from the checkpoint instead of the compute shader
+        int lightPathEpoch;      // Every regeneration of the HRRVC light paths draws them from a new sequence
+
         bool initialized;
 
         // wyd:
@@ -220,11 +381,40 @@ namespace GLSLPT
         float GetProgress();
         int GetSampleCount();
         void GetOutputBuffer(unsigned char **, int &w, int &h);
+        // Sum of the samples in every pixel, the return value is their number. Only uniform between passes over the tiles
+        int GetAccumBuffer(std::vector<Vec4> &pixels, int &w, int &h);
+        // Seeds the samples as if firstSample samples had been rendered before, so renderers working on
+        // different sample ranges of the same frame produce the samples a single renderer would
+        void SetSampleOffset(int firstSample);
+        // Queues the frame to be written without waiting for the GPU. HDR frames are taken between passes over the tiles
+        void SaveFrame(const std::string &filename, bool hdr);
+        // Accumulated samples, counters and the HRRVC light paths, so an interrupted render can be continued.
+        // Written between passes over the tiles like HDR frames
+        void SaveCheckpoint(const std::string &filename);
+        // Continues from a checkpoint of the same scene and settings with the next reset, e.g. the first frame
+        bool LoadCheckpoint(const std::string &filename);
+        void AnalyzeLightPathBVH(BvhAnalyzer &analyzer) const;
 
     private:
         void InitGPUDataBuffers();
         void InitFBOs();
+        void InitOptionalTargets();
         void InitShaders();
+        void GetInstanceMaterials(std::vector<int> &instanceMaterials) const;
+        bool NextTile();
+        void UpdateConvergedTiles();
+        void UploadEmitters();
+        void UpdatePathGuide();
+        void UploadPathGuide();
+        void RenderTile(const iVec2 &t);
+        void DispatchLightPaths(int epoch);
+        void ReadLightPaths();
+        void GenerateLightPaths(int epoch);
+        float VertexMergingRadius(int pass) const;
+        void UpdateCaptures(bool accumComplete);
+        void FinishCapture();
+        void WriteCheckpoint(const std::string &filename);
+        void RestoreCheckpoint();
         void ScRegenerateLocalBuffer();
         void ScReleaseLocalBuffer();
     };
@@ -0,0 +1,171 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include "Sampler.h"
+
+namespace GLSLPT
+{
+    namespace
+    {
+        // Degree, coefficients and initial direction numbers of the primitive polynomials of dimensions 1 and up
+        struct SobolPolynomial
+        {
+            int degree;
+            uint32_t coefficients;
+            uint32_t m[3];
+        };
+
+        const SobolPolynomial kSobolPolynomials[kSobolDimensions - 1] =
+        {
+            { 1, 0, { 1 } },
+            { 2, 1, { 1, 3 } },
+            { 3, 1, { 1, 3, 1 } },
+        };
+    }
+
+    void SobolDirections(std::vector<uint32_t>& directions)
+    {
+        directions.resize(kSobolDimensions * 32);
+
+        // The first dimension is the van der Corput sequence
+        for (int i = 0; i < 32; i++)
+            directions[i] = 1u << (31 - i);
+
+        for (int d = 1; d < kSobolDimensions; d++)
+        {
+            const SobolPolynomial& poly = kSobolPolynomials[d - 1];
+            uint32_t* v = &directions[d * 32];
+            for (int i = 0; i < 32; i++)
+            {
+                if (i < poly.degree)
+                {
+                    v[i] = poly.m[i] << (31 - i);
+                    continue;
+                }
+
+                v[i] = v[i - poly.degree] ^ (v[i - poly.degree] >> poly.degree);
+                for (int k = 1; k < poly.degree; k++)
+                {
+                    if ((poly.coefficients >> (poly.degree - 1 - k)) & 1)
+                        v[i] ^= v[i - k];
+                }
+            }
+        }
+    }
+
+    void BlueNoiseMask(int size, std::vector<float>& mask)
+    {
+        const int numTexels = size * size;
+        const float sigma = 1.5f;
+
+        // Gaussian of the wrapped distance, summed over the points it measures how crowded a texel is
+        std::vector<float> kernel(numTexels);
+        for (int y = 0; y < size; y++)
+        {
+            for (int x = 0; x < size; x++)
+            {
+                float dx = (float)std::min(x, size - x);
+                float dy = (float)std::min(y, size - y);
+                kernel[y * size + x] = expf(-(dx * dx + dy * dy) / (2.0f * sigma * sigma));
+            }
+        }
+
+        std::vector<char> points(numTexels, 0);
+        std::vector<float> energy(numTexels, 0.0f);
+
+        auto setPoint = [&](int texel, bool set)
+        {
+            points[texel] = set;
+            float sign = set ? 1.0f : -1.0f;
+            int px = texel % size;
+            int py = texel / size;
+            for (int y = 0; y < size; y++)
+            {
+                const float* row = &kernel[((y - py + size) % size) * size];
+                for (int x = 0; x < size; x++)
+                    energy[y * size + x] += sign * row[(x - px + size) % size];
+            }
+        };
+
+        // Tightest cluster is the point with the most energy, largest void the empty texel with the least
+        auto findTexel = [&](bool point)
+        {
+            int best = -1;
+            for (int i = 0; i < numTexels; i++)
+            {
+                if ((points[i] != 0) == point && (best < 0 || (point ? energy[i] > energy[best] : energy[i] < energy[best])))
+                    best = i;
+            }
+            return best;
+        };
+
+        // Random initial pattern, points are moved from clusters into voids until that changes nothing
+        std::mt19937 rng(1);
+        std::vector<int> order(numTexels);
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), rng);
+        int numInitial = std::max(numTexels / 10, 1);
+        for (int i = 0; i < numInitial; i++)
+            setPoint(order[i], true);
+
+        for (int i = 0; i < numTexels; i++)
+        {
+            int cluster = findTexel(true);
+            setPoint(cluster, false);
+            int largestVoid = findTexel(false);
+            setPoint(largestVoid, true);
+            if (largestVoid == cluster)
+                break;
+        }
+
+        std::vector<int> ranks(numTexels);
+        std::vector<char> initialPoints = points;
+        std::vector<float> initialEnergy = energy;
+
+        // Points of the initial pattern are ranked by removing clusters, the rest by filling voids
+        for (int rank = numInitial - 1; rank >= 0; rank--)
+        {
+            int cluster = findTexel(true);
+            setPoint(cluster, false);
+            ranks[cluster] = rank;
+        }
+
+        points = initialPoints;
+        energy = initialEnergy;
+        for (int rank = numInitial; rank < numTexels; rank++)
+        {
+            int largestVoid = findTexel(false);
+            setPoint(largestVoid, true);
+            ranks[largestVoid] = rank;
+        }
+
+        mask.resize(numTexels);
+        for (int i = 0; i < numTexels; i++)
+            mask[i] = (float)ranks[i] / numTexels;
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace GLSLPT
+{
+    // Dimensions of the Sobol sequence uploaded for the shaders. Higher dimensions are padded with
+    // copies of these whose sample order is shuffled independently, as in Burley's hash based Owen scrambling
+    const int kSobolDimensions = 4;
+
+    // Direction numbers of the first kSobolDimensions dimensions (Joe and Kuo), 32 per dimension with the
+    // one for the lowest bit of the sample index first
+    void SobolDirections(std::vector<uint32_t>& directions);
+
+    // size x size blue noise mask made with void and cluster, the rank of every texel mapped to [0, 1).
+    // Tiles seamlessly
+    void BlueNoiseMask(int size, std::vector<float>& mask);
+}
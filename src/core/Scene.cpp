@@ -24,15 +24,22 @@
 
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include "stb_image_resize.h"
 #include "stb_image.h"
 #include "Scene.h"
 #include "Camera.h"
+#include "MipMap.h"
+#include "TextureCompressor.h"
+#include "BlasCache.h"
 
 namespace GLSLPT
 {
+    // Meshes with at least this many triangles get every thread for their own BVH build
+    static const int kParallelBLASTriangles = 1 << 18;
+
     Scene::~Scene()
     {
         for (int i = 0; i < meshes.size(); i++)
@@ -63,16 +70,19 @@ namespace GLSLPT
     {
         int id = -1;
         // Check if mesh was already loaded
-        for (int i = 0; i < meshes.size(); i++)
-            if (meshes[i]->name == filename)
-                return i;
+        auto it = meshIDs.find(filename);
+        if (it != meshIDs.end())
+            return it->second;
 
         id = meshes.size();
         Mesh* mesh = new Mesh;
 
         printf("Loading model %s\n", filename.c_str());
         if (mesh->LoadFromFile(filename))
+        {
             meshes.push_back(mesh);
+            meshIDs[filename] = id;
+        }
         else
         {
             printf("Unable to load model %s\n", filename.c_str());
@@ -145,56 +155,423 @@ namespace GLSLPT
         return id;
     }
 
+    RadeonRays::bbox Scene::getInstanceBounds(const MeshInstance& instance) const
+    {
+        // Bounds of the transformed mesh or group bounds, in world space or in the space of the group of the instance
+        RadeonRays::bbox bbox = instance.groupID >= 0 ? instanceGroups[instance.groupID].bvh->Bounds() : meshes[instance.meshID]->bvh->Bounds();
+        Mat4 matrix = instance.transform;
+
+        Vec3 minBound = bbox.pmin;
+        Vec3 maxBound = bbox.pmax;
+
+        Vec3 right       = Vec3(matrix[0][0], matrix[0][1], matrix[0][2]);
+        Vec3 up          = Vec3(matrix[1][0], matrix[1][1], matrix[1][2]);
+        Vec3 forward     = Vec3(matrix[2][0], matrix[2][1], matrix[2][2]);
+        Vec3 translation = Vec3(matrix[3][0], matrix[3][1], matrix[3][2]);
+
+        Vec3 xa = right * minBound.x;
+        Vec3 xb = right * maxBound.x;
+
+        Vec3 ya = up * minBound.y;
+        Vec3 yb = up * maxBound.y;
+
+        Vec3 za = forward * minBound.z;
+        Vec3 zb = forward * maxBound.z;
+
+        minBound = Vec3::Min(xa, xb) + Vec3::Min(ya, yb) + Vec3::Min(za, zb) + translation;
+        maxBound = Vec3::Max(xa, xb) + Vec3::Max(ya, yb) + Vec3::Max(za, zb) + translation;
+
+        RadeonRays::bbox bound;
+        bound.pmin = minBound;
+        bound.pmax = maxBound;
+
+        return bound;
+    }
+
     void Scene::createTLAS()
     {
         // Loop through all the mesh Instances and build a Top Level BVH
         std::vector<RadeonRays::bbox> bounds;
         bounds.resize(meshInstances.size());
 
+        for (int i = 0; i < meshInstances.size(); i++)
+            bounds[i] = getInstanceBounds(meshInstances[i]);
+
+        sceneBvh->Build(&bounds[0], bounds.size());
+        sceneBounds = sceneBvh->Bounds();
+    }
+
+    // Groups only pay off when they are placed more than once. Emissive triangles are sampled in world space, so
+    // groups with emitters are expanded into scene instances as well and the remaining groups are compacted
+    void Scene::flattenInstanceGroups()
+    {
+        std::vector<int> placements(instanceGroups.size(), 0);
+        for (const MeshInstance& instance : meshInstances)
+        {
+            if (instance.groupID >= 0)
+                placements[instance.groupID]++;
+        }
+
+        std::vector<bool> keep(instanceGroups.size());
+        for (int i = 0; i < (int)instanceGroups.size(); i++)
+        {
+            const InstanceGroup& group = instanceGroups[i];
+            keep[i] = placements[i] > 1;
+            for (int j = group.firstInstance; keep[i] && j < group.firstInstance + group.numInstances; j++)
+                keep[i] = !instanceEmits(groupedInstances[j]);
+        }
+
+        std::vector<MeshInstance> instances;
+        for (const MeshInstance& instance : meshInstances)
+        {
+            if (instance.groupID < 0 || keep[instance.groupID])
+            {
+                instances.push_back(instance);
+                continue;
+            }
+
+            const InstanceGroup& group = instanceGroups[instance.groupID];
+            for (int j = group.firstInstance; j < group.firstInstance + group.numInstances; j++)
+            {
+                MeshInstance flattened = groupedInstances[j];
+                flattened.transform = flattened.transform * instance.transform;
+                instances.push_back(flattened);
+            }
+        }
+        meshInstances.swap(instances);
+
+        std::vector<InstanceGroup> groups;
+        std::vector<MeshInstance> grouped;
+        std::vector<int> newGroupIDs(instanceGroups.size(), -1);
+        for (int i = 0; i < (int)instanceGroups.size(); i++)
+        {
+            if (!keep[i])
+                continue;
+
+            InstanceGroup group = instanceGroups[i];
+            newGroupIDs[i] = groups.size();
+            grouped.insert(grouped.end(), groupedInstances.begin() + group.firstInstance, groupedInstances.begin() + group.firstInstance + group.numInstances);
+            group.firstInstance = grouped.size() - group.numInstances;
+            groups.push_back(group);
+        }
+
+        for (MeshInstance& instance : meshInstances)
+        {
+            if (instance.groupID >= 0)
+                instance.groupID = newGroupIDs[instance.groupID];
+        }
+        for (auto& it : groupIDs)
+            it.second = newGroupIDs[it.second];
+
+        instanceGroups.swap(groups);
+        groupedInstances.swap(grouped);
+    }
+
+    void Scene::createGroupBVHs()
+    {
+        for (InstanceGroup& group : instanceGroups)
+        {
+            std::vector<RadeonRays::bbox> bounds(group.numInstances);
+            for (int j = 0; j < group.numInstances; j++)
+                bounds[j] = getInstanceBounds(groupedInstances[group.firstInstance + j]);
+
+            group.bvh = std::make_shared<RadeonRays::Bvh>(10.0f, 64, false);
+            group.bvh->Build(&bounds[0], bounds.size());
+        }
+    }
+
+    // Gathers the triangles of emissive instances in world space and builds the light selection structures over
+    // them and the analytic lights
+    void Scene::buildLightSampler()
+    {
+        std::vector<int> meshFirstTriangle(meshes.size());
+        int numTriangles = 0;
+        for (int i = 0; i < meshes.size(); i++)
+        {
+            meshFirstTriangle[i] = numTriangles;
+            numTriangles += meshes[i]->verticesUVX.size() / 3;
+        }
+
+        // Emitter offsets of the instances. Grouped instances never emit, groups with emitters are flattened
+        std::vector<int> instanceOffsets(meshInstances.size());
+        instanceEmitters.assign(NumInstanceRecords(), iVec2(0, 0));
+        int numEmissive = 0;
         for (int i = 0; i < meshInstances.size(); i++)
         {
-            RadeonRays::bbox bbox = meshes[meshInstances[i].meshID]->bvh->Bounds();
-            Mat4 matrix = meshInstances[i].transform;
+            const MeshInstance& instance = meshInstances[i];
+            instanceOffsets[i] = numEmissive;
 
-            Vec3 minBound = bbox.pmin;
-            Vec3 maxBound = bbox.pmax;
+            // All triangles of the instance are added, the ones without emission are never sampled
+            if (instanceEmits(instance))
+            {
+                instanceEmitters[i] = iVec2(1, lights.size() + numEmissive - meshFirstTriangle[instance.meshID]);
+                numEmissive += meshes[instance.meshID]->verticesUVX.size() / 3;
+            }
+        }
+
+        emissiveTriangles.resize(numEmissive);
+
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < meshInstances.size(); i++)
+        {
+            if (instanceEmitters[i].x == 0)
+                continue;
+
+            const MeshInstance& instance = meshInstances[i];
+            const Mesh* mesh = meshes[instance.meshID];
+            Mat4 matrix = instance.transform;
 
             Vec3 right       = Vec3(matrix[0][0], matrix[0][1], matrix[0][2]);
             Vec3 up          = Vec3(matrix[1][0], matrix[1][1], matrix[1][2]);
             Vec3 forward     = Vec3(matrix[2][0], matrix[2][1], matrix[2][2]);
             Vec3 translation = Vec3(matrix[3][0], matrix[3][1], matrix[3][2]);
 
-            Vec3 xa = right * minBound.x;
-            Vec3 xb = right * maxBound.x;
+            int numMeshTriangles = mesh->verticesUVX.size() / 3;
+            for (int j = 0; j < numMeshTriangles; j++)
+            {
+                Vec4 v[3];
+                for (int k = 0; k < 3; k++)
+                {
+                    const Vec4& p = mesh->verticesUVX[j * 3 + k];
+                    Vec3 world = right * p.x + up * p.y + forward * p.z + translation;
+                    v[k] = Vec4(world.x, world.y, world.z, 0.0f);
+                }
+
+                const Vec4& n0 = mesh->normalsUVY[j * 3 + 0];
+                const Vec4& n1 = mesh->normalsUVY[j * 3 + 1];
+                const Vec4& n2 = mesh->normalsUVY[j * 3 + 2];
+
+                EmissiveTriangle& tri = emissiveTriangles[instanceOffsets[i] + j];
+                tri.p0 = Vec4(v[0].x, v[0].y, v[0].z, mesh->verticesUVX[j * 3 + 0].w);
+                tri.p1 = Vec4(v[1].x, v[1].y, v[1].z, n0.w);
+                tri.p2 = Vec4(v[2].x, v[2].y, v[2].z, mesh->verticesUVX[j * 3 + 1].w);
+                int matID = instance.GetMaterial(mesh->materialSlots.empty() ? 0 : mesh->materialSlots[j]);
+                tri.uvMat = Vec4(n1.w, mesh->verticesUVX[j * 3 + 2].w, n2.w, (float)matID);
+            }
+        }
+
+        if (!lights.empty() || !emissiveTriangles.empty())
+        {
+            printf("Building light sampler\n");
+            lightSampler.Build(lights, emissiveTriangles, emissionLuminance, Vec3::Length(sceneBounds.extents()) * 0.5f);
+        }
+    }
 
-            Vec3 ya = up * minBound.y;
-            Vec3 yb = up * maxBound.y;
+    bool Scene::instanceEmits(const MeshInstance& instance) const
+    {
+        if (instance.groupID >= 0)
+            return false;
 
-            Vec3 za = forward * minBound.z;
-            Vec3 zb = forward * maxBound.z;
+        const Mesh* mesh = meshes[instance.meshID];
+        for (int j = 0; j < mesh->numMaterialSlots; j++)
+        {
+            if (emissionLuminance[instance.GetMaterial(j)] > 0.0f)
+                return true;
+        }
+        return false;
+    }
 
-            minBound = Vec3::Min(xa, xb) + Vec3::Min(ya, yb) + Vec3::Min(za, zb) + translation;
-            maxBound = Vec3::Max(xa, xb) + Vec3::Max(ya, yb) + Vec3::Max(za, zb) + translation;
+    // Material slots are resolved per instance on the GPU once an instance overrides the material of a slot,
+    // otherwise the material of the TLAS leaf is used. Table sizes only depend on the meshes so updates keep them.
+    // Group instances get empty tables
+    void Scene::buildMaterialTables()
+    {
+        materialTables.clear();
+        if (triangleMaterialSlots.empty())
+            return;
 
-            RadeonRays::bbox bound;
-            bound.pmin = minBound;
-            bound.pmax = maxBound;
+        int numRecords = NumInstanceRecords();
+        materialTables.resize(numRecords);
+        for (int i = 0; i < numRecords; i++)
+        {
+            const MeshInstance& instance = GetInstanceRecord(i);
+            materialTables[i] = materialTables.size();
+            if (instance.groupID >= 0)
+                continue;
 
-            bounds[i] = bound;
+            for (int j = 0; j < meshes[instance.meshID]->numMaterialSlots; j++)
+                materialTables.push_back(instance.GetMaterial(j));
         }
-        sceneBvh->Build(&bounds[0], bounds.size());
-        sceneBounds = sceneBvh->Bounds();
     }
 
     void Scene::createBLAS()
     {
-        // Loop through all meshes and build BVHs
-#pragma omp parallel for
+        BlasCache& cache = BlasCache::Instance();
+        const std::string& cacheDir = renderOptions.blasCacheDir;
+
+        std::vector<uint64_t> keys(meshes.size());
+#pragma omp parallel for schedule(dynamic)
         for (int i = 0; i < meshes.size(); i++)
+            keys[i] = BlasCache::Key(*meshes[i]);
+
+        // Meshes with the same geometry and settings share one BVH, built at most once
+        std::unordered_map<uint64_t, int> firstMesh;
+        std::vector<int> bigMeshes;
+        std::vector<int> smallMeshes;
+        int numCached = 0;
+        for (int i = 0; i < meshes.size(); i++)
+        {
+            if (!firstMesh.insert(std::make_pair(keys[i], i)).second)
+                continue;
+
+            meshes[i]->bvh = cache.Find(keys[i], *meshes[i], cacheDir);
+            if (meshes[i]->bvh)
+                numCached++;
+            else if (meshes[i]->verticesUVX.size() / 3 < kParallelBLASTriangles)
+                smallMeshes.push_back(i);
+            else
+                bigMeshes.push_back(i);
+        }
+
+        if (numCached > 0)
+            printf("Reusing %d cached mesh BVHs\n", numCached);
+
+        // Big meshes are built one after the other, each on all threads
+        for (int i = 0; i < bigMeshes.size(); i++)
         {
-            printf("Building BVH for %s\n", meshes[i]->name.c_str());
-            meshes[i]->BuildBVH();
+            printf("Building BVH for %s\n", meshes[bigMeshes[i]]->name.c_str());
+            meshes[bigMeshes[i]]->BuildBVH();
         }
+
+        // Loop through the remaining meshes and build BVHs
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < smallMeshes.size(); i++)
+        {
+            printf("Building BVH for %s\n", meshes[smallMeshes[i]]->name.c_str());
+            meshes[smallMeshes[i]]->BuildBVH();
+        }
+
+        for (int i : bigMeshes)
+            cache.Insert(keys[i], meshes[i]->bvh, cacheDir);
+        for (int i : smallMeshes)
+            cache.Insert(keys[i], meshes[i]->bvh, cacheDir);
+
+        for (int i = 0; i < meshes.size(); i++)
+            meshes[i]->bvh = meshes[firstMesh[keys[i]]]->bvh;
+
+        cache.Trim((size_t)renderOptions.blasCacheMemory << 20);
+    }
+
+    void Scene::compressTextures(const std::vector<TexelEncoding>& texEncodings)
+    {
+        int reqWidth = renderOptions.texArrayWidth;
+        int reqHeight = renderOptions.texArrayHeight;
+
+        if (reqWidth % 4 != 0 || reqHeight % 4 != 0)
+        {
+            printf("Texture array size has to be a multiple of 4 for compression. Using uncompressed textures\n");
+            return;
+        }
+
+        printf("Compressing textures\n");
+
+        // Normal maps go into a BC5 array and everything else into a BC7 array.
+        // A texture referenced in both ways gets a layer in each
+        std::vector<int> colorLayer(textures.size(), -1);
+        std::vector<int> normalLayer(textures.size(), -1);
+        numColorLayers = 0;
+        numNormalLayers = 0;
+
+        for (int i = 0; i < materials.size(); i++)
+        {
+            int colorIDs[3] = { (int)materials[i].baseColorTexId, (int)materials[i].metallicRoughnessTexID, (int)materials[i].emissionmapTexID };
+            for (int j = 0; j < 3; j++)
+                if (colorIDs[j] >= 0 && colorLayer[colorIDs[j]] == -1)
+                    colorLayer[colorIDs[j]] = numColorLayers++;
+
+            int normalID = (int)materials[i].normalmapTexID;
+            if (normalID >= 0 && normalLayer[normalID] == -1)
+                normalLayer[normalID] = numNormalLayers++;
+        }
+
+        int numLevels = textureMapsArrayMips.size() + 1;
+        compressedTextureMaps.assign(numLevels, std::vector<unsigned char>());
+        compressedNormalMaps.assign(numLevels, std::vector<unsigned char>());
+        for (int level = 0; level < numLevels; level++)
+        {
+            size_t levelBytes = CompressedLevelSize(MipLevelSize(reqWidth, level), MipLevelSize(reqHeight, level));
+            compressedTextureMaps[level].resize(levelBytes * numColorLayers);
+            compressedNormalMaps[level].resize(levelBytes * numNormalLayers);
+        }
+
+        TextureCache cache(renderOptions.textureCacheDir);
+        int numEncoded = 0;
+        int numCached = 0;
+
+        for (int i = 0; i < textures.size(); i++)
+        {
+            for (int pass = 0; pass < 2; pass++)
+            {
+                int layer = pass == 0 ? colorLayer[i] : normalLayer[i];
+                if (layer < 0)
+                    continue;
+
+                BlockFormat format = pass == 0 ? BlockFormat::BC7 : BlockFormat::BC5;
+                TexelEncoding encoding = pass == 0 ? (texEncodings[i] == TexelEncoding::NormalMap ? TexelEncoding::Linear : texEncodings[i]) : TexelEncoding::NormalMap;
+                const unsigned char* base = &textureMapsArray[(size_t)i * reqWidth * reqHeight * 4];
+
+                // Mips for a texture used with a different filter than the one it was built with
+                std::vector<std::vector<unsigned char>> mips;
+                if (encoding != texEncodings[i])
+                {
+                    mips.resize(numLevels - 1);
+                    const unsigned char* prev = base;
+                    for (int level = 1; level < numLevels; level++)
+                    {
+                        mips[level - 1].resize((size_t)MipLevelSize(reqWidth, level) * MipLevelSize(reqHeight, level) * 4);
+                        DownsampleRGBA8(prev, MipLevelSize(reqWidth, level - 1), MipLevelSize(reqHeight, level - 1),
+                                        &mips[level - 1][0], MipLevelSize(reqWidth, level), MipLevelSize(reqHeight, level), encoding);
+                        prev = &mips[level - 1][0];
+                    }
+                }
+
+                uint64_t key = TextureCache::Key(base, reqWidth, reqHeight, format, encoding);
+                std::vector<std::vector<unsigned char>> blocks;
+
+                if (cache.Load(key, reqWidth, reqHeight, numLevels, blocks))
+                    numCached++;
+                else
+                {
+                    blocks.resize(numLevels);
+                    for (int level = 0; level < numLevels; level++)
+                    {
+                        int w = MipLevelSize(reqWidth, level);
+                        int h = MipLevelSize(reqHeight, level);
+                        const unsigned char* src = base;
+                        if (level > 0)
+                            src = mips.empty() ? &textureMapsArrayMips[level - 1][(size_t)i * w * h * 4] : &mips[level - 1][0];
+                        CompressImage(src, w, h, format, blocks[level]);
+                    }
+                    cache.Save(key, blocks);
+                    numEncoded++;
+                }
+
+                std::vector<std::vector<unsigned char>>& dst = pass == 0 ? compressedTextureMaps : compressedNormalMaps;
+                for (int level = 0; level < numLevels; level++)
+                    std::copy(blocks[level].begin(), blocks[level].end(), dst[level].begin() + blocks[level].size() * layer);
+            }
+        }
+
+        // Point materials at the compressed layers
+        for (int i = 0; i < materials.size(); i++)
+        {
+            Material& mat = materials[i];
+            if (mat.baseColorTexId >= 0)
+                mat.baseColorTexId = colorLayer[(int)mat.baseColorTexId];
+            if (mat.metallicRoughnessTexID >= 0)
+                mat.metallicRoughnessTexID = colorLayer[(int)mat.metallicRoughnessTexID];
+            if (mat.emissionmapTexID >= 0)
+                mat.emissionmapTexID = colorLayer[(int)mat.emissionmapTexID];
+            if (mat.normalmapTexID >= 0)
+                mat.normalmapTexID = normalLayer[(int)mat.normalmapTexID];
+        }
+
+        // The uncompressed copies are no longer needed
+        std::vector<unsigned char>().swap(textureMapsArray);
+        std::vector<std::vector<unsigned char>>().swap(textureMapsArrayMips);
+
+        texturesCompressed = true;
+        printf("Compressed %d textures (%d loaded from cache)\n", numEncoded + numCached, numCached);
     }
 
     void Scene::RebuildInstances()
@@ -204,6 +581,13 @@ namespace GLSLPT
 
         createTLAS();
         bvhTranslator.UpdateTLAS(sceneBvh, meshInstances);
+        buildMaterialTables();
+
+        // Emissive triangles are stored in world space
+        bool hadEmitters = !emissiveTriangles.empty();
+        buildLightSampler();
+        if (hadEmitters || !emissiveTriangles.empty())
+            emittersModified = true;
 
         //Copy transforms
         for (int i = 0; i < meshInstances.size(); i++)
@@ -213,49 +597,198 @@ namespace GLSLPT
         dirty = true;
     }
 
+    void Scene::UpdateInstance(int instanceIndex)
+    {
+        const MeshInstance& instance = meshInstances[instanceIndex];
+
+        // The emission of the instance's materials may have been edited. Emission maps can't be edited, so only
+        // the constant emission is averaged again
+        for (int j = 0; instance.groupID < 0 && j < meshes[instance.meshID]->numMaterialSlots; j++)
+        {
+            int matID = instance.GetMaterial(j);
+            const Material& mat = materials[matID];
+            if (mat.emissionmapTexID < 0)
+                emissionLuminance[matID] = Luminance(mat.emission.x, mat.emission.y, mat.emission.z);
+        }
+
+        if (!bvhTranslator.RefitTLAS(instanceIndex, getInstanceBounds(instance), instance.materialID))
+        {
+            printf("Top level BVH degraded by refitting, rebuilding\n");
+            RebuildInstances();
+            return;
+        }
+        sceneBounds = bvhTranslator.GetTLASBounds();
+
+        // Emissive triangles are stored in world space. Instances that start or stop emitting change the
+        // emitter offsets of the others as well, so the whole table is rebuilt
+        if (instanceEmitters[instanceIndex].x != 0 || instanceEmits(instance))
+        {
+            buildLightSampler();
+            emittersModified = true;
+        }
+
+        transforms[instanceIndex] = instance.transform;
+        buildMaterialTables();
+
+        instancesModified = true;
+        dirty = true;
+    }
+
+    void Scene::GetVertexIndices(int first, int count, Indices* indices) const
+    {
+        int mesh = std::upper_bound(meshIndexOffsets.begin(), meshIndexOffsets.end(), first) - meshIndexOffsets.begin() - 1;
+        for (int i = first; i < first + count; i++)
+        {
+            while (i >= meshIndexOffsets[mesh] + meshes[mesh]->bvh->GetNumIndices())
+                mesh++;
+
+            int index = meshes[mesh]->bvh->GetIndices()[i - meshIndexOffsets[mesh]];
+            int vertex = index * 3 + meshVertexOffsets[mesh];
+            indices[i - first] = Indices{ vertex, vertex + 1, vertex + 2 };
+        }
+    }
+
+    uint64_t Scene::Hash() const
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const void* data, size_t size)
+        {
+            const unsigned char* bytes = (const unsigned char*)data;
+            for (size_t i = 0; i < size; i++)
+            {
+                hash ^= bytes[i];
+                hash *= 1099511628211ull;
+            }
+        };
+
+        for (const Mesh* mesh : meshes)
+        {
+            uint64_t key = BlasCache::Key(*mesh);
+            mix(&key, sizeof(key));
+        }
+        for (int i = 0; i < NumInstanceRecords(); i++)
+        {
+            const MeshInstance& instance = GetInstanceRecord(i);
+            int ids[3] = { instance.meshID, instance.materialID, instance.groupID };
+            mix(ids, sizeof(ids));
+        }
+        if (!transforms.empty())
+            mix(&transforms[0], sizeof(Mat4) * transforms.size());
+        if (!materials.empty())
+            mix(&materials[0], sizeof(Material) * materials.size());
+        if (!materialTables.empty())
+            mix(&materialTables[0], sizeof(int) * materialTables.size());
+        if (!lights.empty())
+            mix(&lights[0], sizeof(Light) * lights.size());
+
+        if (camera)
+        {
+            float view[12] = { camera->position.x, camera->position.y, camera->position.z, camera->forward.x, camera->forward.y, camera->forward.z,
+                               camera->up.x, camera->up.y, camera->up.z, camera->fov, camera->focalDist, camera->aperture };
+            mix(view, sizeof(view));
+        }
+        if (envMap)
+        {
+            float env[3] = { (float)envMap->width, (float)envMap->height, envMap->totalSum };
+            mix(env, sizeof(env));
+        }
+
+        const RenderOptions& options = renderOptions;
+        int settings[21] = { options.renderResolution.x, options.renderResolution.y, options.tileWidth, options.tileHeight, options.maxDepth,
+                             options.RRDepth, options.enableRR, options.lightSampling, options.enableEnvMap, options.enableUniformLight,
+                             options.hideEmitters, options.enableRoughnessMollification, options.enableVolumeMIS, options.enableTextureLod,
+                             options.useBidirectionalPathTracing, options.useHRRVC, options.enableAdaptiveSampling, options.adaptiveMinSpp, options.sampler,
+                             options.enableVertexMerging, options.enablePathGuiding };
+        int pathLengths[2] = { options.sc_BDPT_EYEPATH, options.sc_BDPT_LIGHTPATH };
+        float values[10] = { options.envMapIntensity, options.envMapRot, options.roughnessMollificationAmt,
+                            options.uniformLightCol.x, options.uniformLightCol.y, options.uniformLightCol.z, options.adaptiveThreshold,
+                            options.vertexMergingRadius, options.vertexMergingAlpha, options.guidingBsdfFraction };
+        mix(settings, sizeof(settings));
+        mix(pathLengths, sizeof(pathLengths));
+        mix(values, sizeof(values));
+        return hash;
+    }
+
     void Scene::ProcessScene()
     {
         printf("Processing scene data\n");
         createBLAS();
 
+        // Average emission of every material. Emission maps replace the constant emission in the shader
+        emissionLuminance.resize(materials.size());
+        for (int i = 0; i < materials.size(); i++)
+        {
+            const Material& mat = materials[i];
+            int texID = (int)mat.emissionmapTexID;
+            if (texID >= 0 && texID < textures.size())
+            {
+                const Texture* tex = textures[texID];
+                double sum = 0.0;
+                int numTexels = tex->width * tex->height;
+                for (int j = 0; j < numTexels; j++)
+                {
+                    const unsigned char* texel = &tex->texData[j * tex->components];
+                    sum += Luminance(powf(texel[0] / 255.0f, 2.2f), powf(texel[1] / 255.0f, 2.2f), powf(texel[2] / 255.0f, 2.2f));
+                }
+                emissionLuminance[i] = numTexels > 0 ? (float)(sum / numTexels) : 0.0f;
+            }
+            else
+                emissionLuminance[i] = Luminance(mat.emission.x, mat.emission.y, mat.emission.z);
+        }
+
+        flattenInstanceGroups();
+        if (!instanceGroups.empty())
+        {
+            printf("Building BVHs for %d instance groups\n", (int)instanceGroups.size());
+            createGroupBVHs();
+        }
+
         printf("Building scene BVH\n");
         createTLAS();
 
+        // Distant lights go to the end of the list as the light sampler addresses them as a range
+        std::stable_partition(lights.begin(), lights.end(), [](const Light& light) { return (int)light.type != LightType::DistantLight; });
+        buildLightSampler();
+
         // Flatten BVH
         printf("Flattening BVH\n");
-        bvhTranslator.Process(sceneBvh, meshes, meshInstances);
+        bvhTranslator.buildWideNodes = renderOptions.compressBVH;
+        bvhTranslator.Process(sceneBvh, meshes, meshInstances, instanceGroups, groupedInstances);
 
-        // Copy mesh data
-        int verticesCnt = 0;
+        bool materialOverrides = false;
+        for (int i = 0; i < NumInstanceRecords(); i++)
+            materialOverrides |= !GetInstanceRecord(i).materialOverrides.empty();
+
+        // Offsets of the mesh data. Indices come from the BVH and not from the mesh as spatial splits
+        // can share a triangle between leaf nodes
         printf("Copying Mesh Data\n");
+        meshIndexOffsets.resize(meshes.size());
+        meshVertexOffsets.resize(meshes.size());
+        numIndices = 0;
+        numVertices = 0;
         for (int i = 0; i < meshes.size(); i++)
         {
-            // Copy indices from BVH and not from Mesh. 
-            // Required if splitBVH is used as a triangle can be shared by leaf nodes
-            int numIndices = meshes[i]->bvh->GetNumIndices();
-            const int* triIndices = meshes[i]->bvh->GetIndices();
+            meshIndexOffsets[i] = numIndices;
+            meshVertexOffsets[i] = numVertices;
+            numIndices += meshes[i]->bvh->GetNumIndices();
+            numVertices += meshes[i]->verticesUVX.size();
 
-            for (int j = 0; j < numIndices; j++)
+            if (materialOverrides)
             {
-                int index = triIndices[j];
-                int v1 = (index * 3 + 0) + verticesCnt;
-                int v2 = (index * 3 + 1) + verticesCnt;
-                int v3 = (index * 3 + 2) + verticesCnt;
-
-                vertIndices.push_back(Indices{ v1, v2, v3 });
+                const std::vector<int>& slots = meshes[i]->materialSlots;
+                if (slots.empty())
+                    triangleMaterialSlots.resize(triangleMaterialSlots.size() + meshes[i]->verticesUVX.size() / 3, 0);
+                else
+                    triangleMaterialSlots.insert(triangleMaterialSlots.end(), slots.begin(), slots.end());
             }
-
-            verticesUVX.insert(verticesUVX.end(), meshes[i]->verticesUVX.begin(), meshes[i]->verticesUVX.end());
-            normalsUVY.insert(normalsUVY.end(), meshes[i]->normalsUVY.begin(), meshes[i]->normalsUVY.end());
-
-            verticesCnt += meshes[i]->verticesUVX.size();
         }
+        buildMaterialTables();
 
         // Copy transforms
         printf("Copying transforms\n");
-        transforms.resize(meshInstances.size());
-        for (int i = 0; i < meshInstances.size(); i++)
-            transforms[i] = meshInstances[i].transform;
+        transforms.resize(NumInstanceRecords());
+        for (int i = 0; i < NumInstanceRecords(); i++)
+            transforms[i] = GetInstanceRecord(i).transform;
 
         // Copy textures
         if (!textures.empty())
@@ -284,6 +817,59 @@ namespace GLSLPT
                 std::copy(textures[i]->texData.begin(), textures[i]->texData.end(), &textureMapsArray[i * texBytes]);
         }
 
+        // Build mip chains for the texture array. Albedo and emission maps are filtered in linear space and
+        // normal maps are renormalized, everything else is averaged as is
+        if (!textures.empty())
+            printf("Generating texture mipmaps\n");
+
+        std::vector<TexelEncoding> texEncodings(textures.size(), TexelEncoding::Linear);
+        for (int i = 0; i < materials.size(); i++)
+        {
+            int baseColorTex = (int)materials[i].baseColorTexId;
+            int emissionTex = (int)materials[i].emissionmapTexID;
+            int normalTex = (int)materials[i].normalmapTexID;
+
+            if (baseColorTex >= 0 && baseColorTex < textures.size())
+                texEncodings[baseColorTex] = TexelEncoding::Gamma;
+            if (emissionTex >= 0 && emissionTex < textures.size())
+                texEncodings[emissionTex] = TexelEncoding::Gamma;
+            if (normalTex >= 0 && normalTex < textures.size())
+                texEncodings[normalTex] = TexelEncoding::NormalMap;
+        }
+
+        int numMipLevels = textures.empty() ? 1 : MipLevelCount(reqWidth, reqHeight);
+        textureMapsArrayMips.resize(numMipLevels - 1);
+        for (int level = 1; level < numMipLevels; level++)
+        {
+            size_t levelBytes = (size_t)MipLevelSize(reqWidth, level) * MipLevelSize(reqHeight, level) * 4;
+            textureMapsArrayMips[level - 1].resize(levelBytes * textures.size());
+        }
+
+#pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < textures.size(); i++)
+        {
+            const unsigned char* prev = &textureMapsArray[i * texBytes];
+            int prevWidth = reqWidth;
+            int prevHeight = reqHeight;
+
+            for (int level = 1; level < numMipLevels; level++)
+            {
+                int w = MipLevelSize(reqWidth, level);
+                int h = MipLevelSize(reqHeight, level);
+                unsigned char* dst = &textureMapsArrayMips[level - 1][(size_t)i * w * h * 4];
+
+                DownsampleRGBA8(prev, prevWidth, prevHeight, dst, w, h, texEncodings[i]);
+
+                prev = dst;
+                prevWidth = w;
+                prevHeight = h;
+            }
+        }
+
+        // Block compress the texture array if requested
+        if (renderOptions.enableTextureCompression && !textures.empty())
+            compressTextures(texEncodings);
+
         // Add a default camera
         if (!camera)
         {
@@ -24,16 +24,20 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include "EnvironmentMap.h"
+#include "LightSampler.h"
 #include "bvh.h"
 #include "Renderer.h"
 #include "Mesh.h"
 #include "Camera.h"
 #include "bvh_translator.h"
 #include "Texture.h"
+#include "MipMap.h"
 #include "Material.h"
 
 namespace GLSLPT
@@ -82,18 +86,38 @@ namespace GLSLPT
 
         void ProcessScene();
         void RebuildInstances();
+        // Cheaper than RebuildInstances when a single instance moved or changed material.
+        // Refits the top level BVH and falls back to a rebuild once its quality degrades
+        void UpdateInstance(int instanceIndex);
+
+        // Vertex indices [first, first + count) of the GPU index buffer, three vertices per entry
+        void GetVertexIndices(int first, int count, Indices* indices) const;
+
+        // Identifies the image being rendered: geometry, instances, materials, lights, camera and the
+        // render options the samples depend on. Checkpoints only resume a render with the same hash
+        uint64_t Hash() const;
 
         // Options
         RenderOptions renderOptions;
 
         // Meshes
         std::vector<Mesh*> meshes;
-
-        // Scene Mesh Data 
-        std::vector<Indices> vertIndices;
-        std::vector<Vec4> verticesUVX; // Vertex + texture Coord (u/s)
-        std::vector<Vec4> normalsUVY; // Normal + texture Coord (v/t)
+        // Index of every mesh loaded from a file
+        std::unordered_map<std::string, int> meshIDs;
+        // Instance group of every loaded GLTF file, so loading a file again only places the group again
+        std::unordered_map<std::string, int> groupIDs;
+
+        // Scene Mesh Data. Vertices and indices stay in the meshes and are streamed to the GPU buffers,
+        // these are the offsets of every mesh in them
+        std::vector<int> meshIndexOffsets;
+        std::vector<int> meshVertexOffsets;
+        int numIndices = 0;
+        int numVertices = 0;
         std::vector<Mat4> transforms;
+        // Material slot per triangle in the order of the vertices. Empty when no instance overrides materials
+        std::vector<int> triangleMaterialSlots;
+        // Offset of the table of every instance followed by the tables, which map material slots to scene materials
+        std::vector<int> materialTables;
 
         // Materials
         std::vector<Material> materials;
@@ -101,8 +125,25 @@ namespace GLSLPT
         // Instances
         std::vector<MeshInstance> meshInstances;
 
+        // Instance groups and the instances placed inside them. The GPU instance records (transforms, material
+        // tables, emitters) of grouped instances follow the ones of meshInstances
+        std::vector<InstanceGroup> instanceGroups;
+        std::vector<MeshInstance> groupedInstances;
+        int NumInstanceRecords() const { return meshInstances.size() + groupedInstances.size(); }
+        const MeshInstance& GetInstanceRecord(int record) const
+        {
+            int numInstances = meshInstances.size();
+            return record < numInstances ? meshInstances[record] : groupedInstances[record - numInstances];
+        }
+
         // Lights
         std::vector<Light> lights;
+        LightSampler lightSampler;
+
+        // Emissive mesh triangles, sampled as lights after the analytic ones. instanceEmitters holds
+        // (has emitters, emitter index - first triangle of the mesh) per instance so a hit triangle can find its emitter
+        std::vector<EmissiveTriangle> emissiveTriangles;
+        std::vector<iVec2> instanceEmitters;
 
         // Environment Map
         EnvironmentMap* envMap;
@@ -117,16 +158,34 @@ namespace GLSLPT
         // Texture Data
         std::vector<Texture*> textures;
         std::vector<unsigned char> textureMapsArray;
+        std::vector<std::vector<unsigned char>> textureMapsArrayMips; // Levels 1..n of the texture array, all layers per level
+
+        // Block compressed texture data, replaces textureMapsArray when renderOptions.enableTextureCompression is set.
+        // Material texture IDs are remapped to layers of these arrays
+        std::vector<std::vector<unsigned char>> compressedTextureMaps; // BC7, one entry per mip level
+        std::vector<std::vector<unsigned char>> compressedNormalMaps;  // BC5, one entry per mip level
+        int numColorLayers = 0;
+        int numNormalLayers = 0;
+        bool texturesCompressed = false;
 
         bool initialized;
         bool dirty;
         // To check if scene elements need to be resent to GPU
         bool instancesModified = false;
+        bool emittersModified = false;
         bool envMapModified = false;
 
     private:
         RadeonRays::Bvh* sceneBvh;
         void createBLAS();
         void createTLAS();
+        void flattenInstanceGroups();
+        void createGroupBVHs();
+        RadeonRays::bbox getInstanceBounds(const MeshInstance& instance) const;
+        void buildLightSampler();
+        bool instanceEmits(const MeshInstance& instance) const;
+        void buildMaterialTables();
+        std::vector<float> emissionLuminance; // Average emitted luminance per material
+        void compressTextures(const std::vector<TexelEncoding>& texEncodings);
     };
 }
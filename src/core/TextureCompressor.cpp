@@ -0,0 +1,385 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include "TextureCompressor.h"
+
+namespace GLSLPT
+{
+    namespace
+    {
+        // Bump when the encoders change so stale cache entries are not picked up
+        const uint32_t kEncoderVersion = 1;
+        const uint32_t kCacheMagic = 0x58544342; // "BCTX"
+
+        const int kWeights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+        struct BitWriter
+        {
+            unsigned char* out;
+            int pos;
+
+            void Write(uint32_t value, int bits)
+            {
+                for (int i = 0; i < bits; i++, pos++)
+                    if ((value >> i) & 1)
+                        out[pos >> 3] |= (unsigned char)(1 << (pos & 7));
+            }
+        };
+
+        struct Mode6Block
+        {
+            int q[2][4]; // 7 bit endpoints
+            int p[2];    // p-bits
+            int indices[16];
+            float error;
+        };
+
+        // Quantizes the endpoints for every p-bit combination, fits indices and keeps the best result
+        void FitMode6(const float e0[4], const float e1[4], const unsigned char* block, Mode6Block& best)
+        {
+            for (int p0 = 0; p0 < 2; p0++)
+            {
+                for (int p1 = 0; p1 < 2; p1++)
+                {
+                    Mode6Block cand;
+                    cand.p[0] = p0;
+                    cand.p[1] = p1;
+
+                    int ep[2][4];
+                    for (int c = 0; c < 4; c++)
+                    {
+                        cand.q[0][c] = std::min(std::max((int)floorf((e0[c] - p0) * 0.5f + 0.5f), 0), 127);
+                        cand.q[1][c] = std::min(std::max((int)floorf((e1[c] - p1) * 0.5f + 0.5f), 0), 127);
+                        ep[0][c] = (cand.q[0][c] << 1) | p0;
+                        ep[1][c] = (cand.q[1][c] << 1) | p1;
+                    }
+
+                    int palette[16][4];
+                    for (int i = 0; i < 16; i++)
+                        for (int c = 0; c < 4; c++)
+                            palette[i][c] = ((64 - kWeights4[i]) * ep[0][c] + kWeights4[i] * ep[1][c] + 32) >> 6;
+
+                    cand.error = 0.0f;
+                    for (int i = 0; i < 16; i++)
+                    {
+                        const unsigned char* px = block + i * 4;
+                        int bestIdx = 0;
+                        int bestErr = 0x7fffffff;
+                        for (int j = 0; j < 16; j++)
+                        {
+                            int err = 0;
+                            for (int c = 0; c < 4; c++)
+                            {
+                                int d = palette[j][c] - px[c];
+                                err += d * d;
+                            }
+                            if (err < bestErr)
+                            {
+                                bestErr = err;
+                                bestIdx = j;
+                            }
+                        }
+                        cand.indices[i] = bestIdx;
+                        cand.error += bestErr;
+                    }
+
+                    if (cand.error < best.error)
+                        best = cand;
+                }
+            }
+        }
+
+        void EncodeBC4Channel(const unsigned char* block, int channel, unsigned char* out)
+        {
+            int minV = 255, maxV = 0;
+            for (int i = 0; i < 16; i++)
+            {
+                minV = std::min(minV, (int)block[i * 4 + channel]);
+                maxV = std::max(maxV, (int)block[i * 4 + channel]);
+            }
+
+            out[0] = (unsigned char)maxV;
+            out[1] = (unsigned char)minV;
+
+            // With red0 > red1 the block interpolates 6 values between the endpoints
+            int palette[8];
+            palette[0] = maxV;
+            palette[1] = minV;
+            for (int i = 2; i < 8; i++)
+                palette[i] = ((8 - i) * maxV + (i - 1) * minV) / 7;
+
+            uint64_t bits = 0;
+            if (maxV != minV)
+            {
+                for (int i = 0; i < 16; i++)
+                {
+                    int v = block[i * 4 + channel];
+                    int bestIdx = 0;
+                    int bestErr = 256;
+                    for (int j = 0; j < 8; j++)
+                    {
+                        int err = abs(palette[j] - v);
+                        if (err < bestErr)
+                        {
+                            bestErr = err;
+                            bestIdx = j;
+                        }
+                    }
+                    bits |= (uint64_t)bestIdx << (3 * i);
+                }
+            }
+
+            for (int i = 0; i < 6; i++)
+                out[2 + i] = (unsigned char)(bits >> (8 * i));
+        }
+    }
+
+    void EncodeBC7Block(const unsigned char* block, unsigned char* out)
+    {
+        // Principal axis of the block in RGBA space
+        float mean[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int i = 0; i < 16; i++)
+            for (int c = 0; c < 4; c++)
+                mean[c] += block[i * 4 + c];
+        for (int c = 0; c < 4; c++)
+            mean[c] /= 16.0f;
+
+        float cov[4][4] = {};
+        for (int i = 0; i < 16; i++)
+        {
+            float d[4];
+            for (int c = 0; c < 4; c++)
+                d[c] = block[i * 4 + c] - mean[c];
+            for (int r = 0; r < 4; r++)
+                for (int c = 0; c < 4; c++)
+                    cov[r][c] += d[r] * d[c];
+        }
+
+        float axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+        for (int iter = 0; iter < 8; iter++)
+        {
+            float next[4];
+            for (int r = 0; r < 4; r++)
+                next[r] = cov[r][0] * axis[0] + cov[r][1] * axis[1] + cov[r][2] * axis[2] + cov[r][3] * axis[3];
+            float len = sqrtf(next[0] * next[0] + next[1] * next[1] + next[2] * next[2] + next[3] * next[3]);
+            if (len < 1e-6f)
+                break;
+            for (int c = 0; c < 4; c++)
+                axis[c] = next[c] / len;
+        }
+
+        float tMin = 1e30f, tMax = -1e30f;
+        for (int i = 0; i < 16; i++)
+        {
+            float t = 0.0f;
+            for (int c = 0; c < 4; c++)
+                t += (block[i * 4 + c] - mean[c]) * axis[c];
+            tMin = std::min(tMin, t);
+            tMax = std::max(tMax, t);
+        }
+
+        float e0[4], e1[4];
+        for (int c = 0; c < 4; c++)
+        {
+            e0[c] = std::min(std::max(mean[c] + tMin * axis[c], 0.0f), 255.0f);
+            e1[c] = std::min(std::max(mean[c] + tMax * axis[c], 0.0f), 255.0f);
+        }
+
+        Mode6Block best;
+        best.error = 1e30f;
+        FitMode6(e0, e1, block, best);
+
+        // One least squares refit of the endpoints using the chosen indices
+        float a = 0.0f, b = 0.0f, d = 0.0f;
+        float x0[4] = {}, x1[4] = {};
+        for (int i = 0; i < 16; i++)
+        {
+            float w = kWeights4[best.indices[i]] / 64.0f;
+            a += (1.0f - w) * (1.0f - w);
+            b += (1.0f - w) * w;
+            d += w * w;
+            for (int c = 0; c < 4; c++)
+            {
+                x0[c] += (1.0f - w) * block[i * 4 + c];
+                x1[c] += w * block[i * 4 + c];
+            }
+        }
+        float det = a * d - b * b;
+        if (fabsf(det) > 1e-6f)
+        {
+            for (int c = 0; c < 4; c++)
+            {
+                e0[c] = std::min(std::max((d * x0[c] - b * x1[c]) / det, 0.0f), 255.0f);
+                e1[c] = std::min(std::max((a * x1[c] - b * x0[c]) / det, 0.0f), 255.0f);
+            }
+            FitMode6(e0, e1, block, best);
+        }
+
+        // The anchor index is stored with an implicit zero MSB
+        if (best.indices[0] & 8)
+        {
+            for (int c = 0; c < 4; c++)
+                std::swap(best.q[0][c], best.q[1][c]);
+            std::swap(best.p[0], best.p[1]);
+            for (int i = 0; i < 16; i++)
+                best.indices[i] = 15 - best.indices[i];
+        }
+
+        memset(out, 0, 16);
+        BitWriter writer = { out, 0 };
+        writer.Write(1 << 6, 7); // Mode 6
+        for (int c = 0; c < 4; c++)
+        {
+            writer.Write(best.q[0][c], 7);
+            writer.Write(best.q[1][c], 7);
+        }
+        writer.Write(best.p[0], 1);
+        writer.Write(best.p[1], 1);
+        writer.Write(best.indices[0], 3);
+        for (int i = 1; i < 16; i++)
+            writer.Write(best.indices[i], 4);
+    }
+
+    void EncodeBC5Block(const unsigned char* block, unsigned char* out)
+    {
+        EncodeBC4Channel(block, 0, out);
+        EncodeBC4Channel(block, 1, out + 8);
+    }
+
+    void CompressImage(const unsigned char* rgba, int width, int height, BlockFormat format, std::vector<unsigned char>& out)
+    {
+        int blocksX = (width + 3) / 4;
+        int blocksY = (height + 3) / 4;
+        out.resize(CompressedLevelSize(width, height));
+
+#pragma omp parallel for schedule(dynamic)
+        for (int by = 0; by < blocksY; by++)
+        {
+            unsigned char block[64];
+            for (int bx = 0; bx < blocksX; bx++)
+            {
+                // Gather the block, clamping at the image edges
+                for (int y = 0; y < 4; y++)
+                {
+                    int sy = std::min(by * 4 + y, height - 1);
+                    for (int x = 0; x < 4; x++)
+                    {
+                        int sx = std::min(bx * 4 + x, width - 1);
+                        memcpy(&block[(y * 4 + x) * 4], &rgba[((size_t)sy * width + sx) * 4], 4);
+                    }
+                }
+
+                unsigned char* dst = &out[((size_t)by * blocksX + bx) * 16];
+                if (format == BlockFormat::BC7)
+                    EncodeBC7Block(block, dst);
+                else
+                    EncodeBC5Block(block, dst);
+            }
+        }
+    }
+
+    uint64_t TextureCache::Key(const unsigned char* rgba, int width, int height, BlockFormat format, TexelEncoding encoding)
+    {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const unsigned char* data, size_t size)
+        {
+            for (size_t i = 0; i < size; i++)
+            {
+                hash ^= data[i];
+                hash *= 1099511628211ull;
+            }
+        };
+
+        uint32_t header[5] = { kEncoderVersion, (uint32_t)width, (uint32_t)height, (uint32_t)format, (uint32_t)encoding };
+        mix((const unsigned char*)header, sizeof(header));
+        mix(rgba, (size_t)width * height * 4);
+        return hash;
+    }
+
+    std::string TextureCache::Path(uint64_t key) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bctex", (unsigned long long)key);
+        return directory + "/" + name;
+    }
+
+    bool TextureCache::Load(uint64_t key, int width, int height, int numLevels, std::vector<std::vector<unsigned char>>& levels) const
+    {
+        FILE* file = fopen(Path(key).c_str(), "rb");
+        if (!file)
+            return false;
+
+        uint32_t header[3];
+        bool ok = fread(header, sizeof(header), 1, file) == 1 && header[0] == kCacheMagic && header[1] == kEncoderVersion && (int)header[2] == numLevels;
+
+        levels.resize(numLevels);
+        for (int i = 0; ok && i < numLevels; i++)
+        {
+            // The size must match the level exactly, it is copied into the texture array as is. Expected sizes
+            // are never 0, so the read below always has a first element
+            uint64_t size = 0;
+            ok = fread(&size, sizeof(size), 1, file) == 1 && size == CompressedLevelSize(MipLevelSize(width, i), MipLevelSize(height, i));
+            if (ok)
+            {
+                levels[i].resize(size);
+                ok = fread(&levels[i][0], 1, size, file) == size;
+            }
+        }
+        fclose(file);
+
+        if (!ok)
+            printf("Ignoring invalid texture cache entry %s\n", Path(key).c_str());
+        return ok;
+    }
+
+    bool TextureCache::Save(uint64_t key, const std::vector<std::vector<unsigned char>>& levels) const
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(directory, ec);
+
+        FILE* file = fopen(Path(key).c_str(), "wb");
+        if (!file)
+        {
+            printf("Couldn't open %s for writing\n", Path(key).c_str());
+            return false;
+        }
+
+        uint32_t header[3] = { kCacheMagic, kEncoderVersion, (uint32_t)levels.size() };
+        fwrite(header, sizeof(header), 1, file);
+        for (size_t i = 0; i < levels.size(); i++)
+        {
+            uint64_t size = levels[i].size();
+            fwrite(&size, sizeof(size), 1, file);
+            fwrite(&levels[i][0], 1, size, file);
+        }
+        fclose(file);
+        return true;
+    }
+}
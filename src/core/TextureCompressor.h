@@ -0,0 +1,70 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "MipMap.h"
+
+namespace GLSLPT
+{
+    enum class BlockFormat
+    {
+        BC7, // RGBA, encoded with mode 6 (single subset, 4 bit indices)
+        BC5  // Two channel (RG), used for tangent space normal maps
+    };
+
+    // Size in bytes of one level of a block compressed image
+    inline size_t CompressedLevelSize(int width, int height)
+    {
+        return (size_t)((width + 3) / 4) * ((height + 3) / 4) * 16;
+    }
+
+    // Encodes a 4x4 RGBA8 block (row major, 64 bytes) into 16 bytes
+    void EncodeBC7Block(const unsigned char* block, unsigned char* out);
+    void EncodeBC5Block(const unsigned char* block, unsigned char* out);
+
+    // Compresses an RGBA8 image. Edge blocks are padded by clamping, rows of blocks are encoded in parallel
+    void CompressImage(const unsigned char* rgba, int width, int height, BlockFormat format, std::vector<unsigned char>& out);
+
+    // Disk cache for encoded mip chains. Entries are keyed by a hash of the source texels, size, block format
+    // and the filter used for the mips so a texture is only ever encoded once
+    class TextureCache
+    {
+    public:
+        explicit TextureCache(const std::string& directory) : directory(directory) {}
+
+        static uint64_t Key(const unsigned char* rgba, int width, int height, BlockFormat format, TexelEncoding encoding);
+
+        // Entries whose level sizes don't match the mip chain of width x height are rejected
+        bool Load(uint64_t key, int width, int height, int numLevels, std::vector<std::vector<unsigned char>>& levels) const;
+        bool Save(uint64_t key, const std::vector<std::vector<unsigned char>>& levels) const;
+
+    private:
+        std::string Path(uint64_t key) const;
+        std::string directory;
+    };
+}
@@ -381,6 +381,18 @@ namespace GLSLPT
 
     bool LoadGLTF(const std::string& filename, Scene* scene, RenderOptions& renderOptions, Mat4 xform, bool binary)
     {
+        // Instancing a file that was already loaded only places its instance group again, the meshes, materials
+        // and textures are shared
+        auto it = scene->groupIDs.find(filename);
+        if (it != scene->groupIDs.end())
+        {
+            printf("Instancing GLTF %s\n", filename.c_str());
+            MeshInstance instance(filename, -1, xform, -1);
+            instance.groupID = it->second;
+            scene->AddMeshInstance(instance);
+            return true;
+        }
+
         tinygltf::Model gltfModel;
         tinygltf::TinyGLTF loader;
         std::string err;
@@ -405,7 +417,26 @@ namespace GLSLPT
         LoadMeshes(scene, gltfModel, meshPrimMap);
         LoadMaterials(scene, gltfModel);
         LoadTextures(scene, gltfModel);
-        LoadInstances(scene, gltfModel, xform, meshPrimMap);
+
+        // Instances are created relative to the file and moved into a group, which is placed once per load of the file.
+        // Groups that end up placed only once are flattened again when the scene is processed
+        int firstInstance = scene->meshInstances.size();
+        LoadInstances(scene, gltfModel, Mat4(), meshPrimMap);
+        if ((int)scene->meshInstances.size() == firstInstance)
+            return true;
+
+        InstanceGroup group;
+        group.name = filename;
+        group.firstInstance = scene->groupedInstances.size();
+        group.numInstances = scene->meshInstances.size() - firstInstance;
+        scene->groupedInstances.insert(scene->groupedInstances.end(), scene->meshInstances.begin() + firstInstance, scene->meshInstances.end());
+        scene->meshInstances.erase(scene->meshInstances.begin() + firstInstance, scene->meshInstances.end());
+
+        MeshInstance instance(filename, -1, xform, -1);
+        instance.groupID = scene->instanceGroups.size();
+        scene->groupIDs[filename] = instance.groupID;
+        scene->instanceGroups.push_back(group);
+        scene->AddMeshInstance(instance);
 
         return true;
     }
@@ -25,6 +25,7 @@ freely, subject to the following restrictions:
     Link to original code: https://github.com/mmacklin/tinsel
 */
 
+#include <algorithm>
 #include <cstring>
 #include "Loader.h"
 #include "GLTFLoader.h"
@@ -95,7 +96,7 @@ namespace GLSLPT
 
                     sscanf(line, " color %f %f %f", &material.baseColor.x, &material.baseColor.y, &material.baseColor.z);
                     sscanf(line, " opacity %f", &material.opacity);
-                    sscanf(line, " alphamode %s", alphaMode);
+                    sscanf(line, " alphamode %19s", alphaMode);
                     sscanf(line, " alphacutoff %f", &material.alphaCutoff);
                     sscanf(line, " emission %f %f %f", &material.emission.x, &material.emission.y, &material.emission.z);
                     sscanf(line, " metallic %f", &material.metallic);
@@ -109,11 +110,11 @@ namespace GLSLPT
                     sscanf(line, " clearcoatgloss %f", &material.clearcoatGloss);
                     sscanf(line, " spectrans %f", &material.specTrans);
                     sscanf(line, " ior %f", &material.ior);
-                    sscanf(line, " albedotexture %s", albedoTexName);
-                    sscanf(line, " metallicroughnesstexture %s", metallicRoughnessTexName);
-                    sscanf(line, " normaltexture %s", normalTexName);
-                    sscanf(line, " emissiontexture %s", emissionTexName);
-                    sscanf(line, " mediumtype %s", mediumType);
+                    sscanf(line, " albedotexture %99s", albedoTexName);
+                    sscanf(line, " metallicroughnesstexture %99s", metallicRoughnessTexName);
+                    sscanf(line, " normaltexture %99s", normalTexName);
+                    sscanf(line, " emissiontexture %99s", emissionTexName);
+                    sscanf(line, " mediumtype %19s", mediumType);
                     sscanf(line, " mediumdensity %f", &material.mediumDensity);
                     sscanf(line, " mediumcolor %f %f %f", &material.mediumColor.x, &material.mediumColor.y, &material.mediumColor.z);
                     sscanf(line, " mediumanisotropy %f", &material.mediumAnisotropy);
@@ -180,7 +181,7 @@ namespace GLSLPT
                     sscanf(line, " radius %f", &light.radius);
                     sscanf(line, " v1 %f %f %f", &v1.x, &v1.y, &v1.z);
                     sscanf(line, " v2 %f %f %f", &v2.x, &v2.y, &v2.z);
-                    sscanf(line, " type %s", lightType);
+                    sscanf(line, " type %19s", lightType);
                 }
 
                 if (strcmp(lightType, "quad") == 0)
@@ -268,6 +269,19 @@ namespace GLSLPT
                 char enableRoughnessMollification[10] = "none";
                 char enableVolumeMIS[10] = "none";
                 char enableUniformLight[10] = "none";
+                char enableTextureLod[10] = "none";
+                char enableTextureCompression[10] = "none";
+                char textureCacheDir[200] = "none";
+                char lightSampling[10] = "none";
+                char sampler[20] = "none";
+                char packBVH[10] = "none";
+                char compressBVH[10] = "none";
+                char denoiserAOVs[10] = "none";
+                char denoiserPrefilter[10] = "none";
+                char enableAdaptiveSampling[10] = "none";
+                char enableVertexMerging[10] = "none";
+                char enablePathGuiding[10] = "none";
+                char blasCacheDir[200] = "none";
 
                 while (fgets(line, kMaxLineLength, file))
                 {
@@ -275,31 +289,51 @@ namespace GLSLPT
                     if (strchr(line, '}'))
                         break;
 
-                    sscanf(line, " envmapfile %s", envMap);
+                    sscanf(line, " envmapfile %199s", envMap);
                     sscanf(line, " resolution %d %d", &renderOptions.renderResolution.x, &renderOptions.renderResolution.y);
                     sscanf(line, " windowresolution %d %d", &renderOptions.windowResolution.x, &renderOptions.windowResolution.y);
                     sscanf(line, " envmapintensity %f", &renderOptions.envMapIntensity);
                     sscanf(line, " maxdepth %i", &renderOptions.maxDepth);
                     sscanf(line, " maxspp %i", &renderOptions.maxSpp);
+                    sscanf(line, " checkpointinterval %i", &renderOptions.checkpointInterval);
                     sscanf(line, " tilewidth %i", &renderOptions.tileWidth);
                     sscanf(line, " tileheight %i", &renderOptions.tileHeight);
-                    sscanf(line, " enablerr %s", enableRR);
+                    sscanf(line, " enablerr %9s", enableRR);
                     sscanf(line, " rrdepth %i", &renderOptions.RRDepth);
-                    sscanf(line, " enabletonemap %s", enableTonemap);
-                    sscanf(line, " enableaces %s", enableAces);
+                    sscanf(line, " enabletonemap %9s", enableTonemap);
+                    sscanf(line, " enableaces %9s", enableAces);
                     sscanf(line, " texarraywidth %i", &renderOptions.texArrayWidth);
                     sscanf(line, " texarrayheight %i", &renderOptions.texArrayHeight);
-                    sscanf(line, " openglnormalmap %s", openglNormalMap);
-                    sscanf(line, " hideemitters %s", hideEmitters);
-                    sscanf(line, " enablebackground %s", enableBackground);
-                    sscanf(line, " transparentbackground %s", transparentBackground);
+                    sscanf(line, " openglnormalmap %9s", openglNormalMap);
+                    sscanf(line, " hideemitters %9s", hideEmitters);
+                    sscanf(line, " enablebackground %9s", enableBackground);
+                    sscanf(line, " transparentbackground %9s", transparentBackground);
                     sscanf(line, " backgroundcolor %f %f %f", &renderOptions.backgroundCol.x, &renderOptions.backgroundCol.y, &renderOptions.backgroundCol.z);
-                    sscanf(line, " independentrendersize %s", independentRenderSize);
+                    sscanf(line, " independentrendersize %9s", independentRenderSize);
                     sscanf(line, " envmaprotation %f", &renderOptions.envMapRot);
-                    sscanf(line, " enableroughnessmollification %s", enableRoughnessMollification);
+                    sscanf(line, " enableroughnessmollification %9s", enableRoughnessMollification);
                     sscanf(line, " roughnessmollificationamt %f", &renderOptions.roughnessMollificationAmt);
-                    sscanf(line, " enablevolumemis %s", enableVolumeMIS);
-                    sscanf(line, " enableuniformlight %s", enableUniformLight);
+                    sscanf(line, " enablevolumemis %9s", enableVolumeMIS);
+                    sscanf(line, " enableuniformlight %9s", enableUniformLight);
+                    sscanf(line, " enabletexturelod %9s", enableTextureLod);
+                    sscanf(line, " compresstextures %9s", enableTextureCompression);
+                    sscanf(line, " texturecachedir %199s", textureCacheDir);
+                    sscanf(line, " lightsampling %9s", lightSampling);
+                    sscanf(line, " sampler %19s", sampler);
+                    sscanf(line, " packbvh %9s", packBVH);
+                    sscanf(line, " compressbvh %9s", compressBVH);
+                    sscanf(line, " denoiseraovs %9s", denoiserAOVs);
+                    sscanf(line, " denoiserprefilter %9s", denoiserPrefilter);
+                    sscanf(line, " enableadaptivesampling %9s", enableAdaptiveSampling);
+                    sscanf(line, " adaptivethreshold %f", &renderOptions.adaptiveThreshold);
+                    sscanf(line, " adaptiveminspp %i", &renderOptions.adaptiveMinSpp);
+                    sscanf(line, " enablevertexmerging %9s", enableVertexMerging);
+                    sscanf(line, " vertexmergingradius %f", &renderOptions.vertexMergingRadius);
+                    sscanf(line, " vertexmergingalpha %f", &renderOptions.vertexMergingAlpha);
+                    sscanf(line, " enablepathguiding %9s", enablePathGuiding);
+                    sscanf(line, " guidingbsdffraction %f", &renderOptions.guidingBsdfFraction);
+                    sscanf(line, " blascachedir %199s", blasCacheDir);
+                    sscanf(line, " blascachememory %i", &renderOptions.blasCacheMemory);
                     sscanf(line, " uniformlightcolor %f %f %f", &renderOptions.uniformLightCol.x, &renderOptions.uniformLightCol.y, &renderOptions.uniformLightCol.z);
                 }
 
@@ -366,6 +400,74 @@ namespace GLSLPT
                 else if (strcmp(enableUniformLight, "true") == 0)
                     renderOptions.enableUniformLight = true;
 
+                if (strcmp(enableTextureLod, "false") == 0)
+                    renderOptions.enableTextureLod = false;
+                else if (strcmp(enableTextureLod, "true") == 0)
+                    renderOptions.enableTextureLod = true;
+
+                if (strcmp(enableTextureCompression, "false") == 0)
+                    renderOptions.enableTextureCompression = false;
+                else if (strcmp(enableTextureCompression, "true") == 0)
+                    renderOptions.enableTextureCompression = true;
+
+                if (strcmp(textureCacheDir, "none") != 0)
+                    renderOptions.textureCacheDir = path + textureCacheDir;
+
+                if (strcmp(blasCacheDir, "none") != 0)
+                    renderOptions.blasCacheDir = path + blasCacheDir;
+
+                // Same range as the UI slider, the guide must never take all or none of the samples
+                renderOptions.guidingBsdfFraction = std::min(std::max(renderOptions.guidingBsdfFraction, 0.05f), 0.95f);
+
+                if (strcmp(lightSampling, "uniform") == 0)
+                    renderOptions.lightSampling = UniformLightSampling;
+                else if (strcmp(lightSampling, "power") == 0)
+                    renderOptions.lightSampling = PowerLightSampling;
+                else if (strcmp(lightSampling, "bvh") == 0)
+                    renderOptions.lightSampling = BvhLightSampling;
+
+                if (strcmp(sampler, "independent") == 0)
+                    renderOptions.sampler = IndependentSampler;
+                else if (strcmp(sampler, "sobol") == 0)
+                    renderOptions.sampler = SobolSampler;
+                else if (strcmp(sampler, "bluenoise") == 0)
+                    renderOptions.sampler = BlueNoiseSobolSampler;
+
+                if (strcmp(packBVH, "false") == 0)
+                    renderOptions.packBVH = false;
+                else if (strcmp(packBVH, "true") == 0)
+                    renderOptions.packBVH = true;
+
+                if (strcmp(compressBVH, "false") == 0)
+                    renderOptions.compressBVH = false;
+                else if (strcmp(compressBVH, "true") == 0)
+                    renderOptions.compressBVH = true;
+
+                if (strcmp(denoiserAOVs, "false") == 0)
+                    renderOptions.denoiserAOVs = false;
+                else if (strcmp(denoiserAOVs, "true") == 0)
+                    renderOptions.denoiserAOVs = true;
+
+                if (strcmp(denoiserPrefilter, "false") == 0)
+                    renderOptions.denoiserPrefilter = false;
+                else if (strcmp(denoiserPrefilter, "true") == 0)
+                    renderOptions.denoiserPrefilter = true;
+
+                if (strcmp(enableAdaptiveSampling, "false") == 0)
+                    renderOptions.enableAdaptiveSampling = false;
+                else if (strcmp(enableAdaptiveSampling, "true") == 0)
+                    renderOptions.enableAdaptiveSampling = true;
+
+                if (strcmp(enableVertexMerging, "false") == 0)
+                    renderOptions.enableVertexMerging = false;
+                else if (strcmp(enableVertexMerging, "true") == 0)
+                    renderOptions.enableVertexMerging = true;
+
+                if (strcmp(enablePathGuiding, "false") == 0)
+                    renderOptions.enablePathGuiding = false;
+                else if (strcmp(enablePathGuiding, "true") == 0)
+                    renderOptions.enablePathGuiding = true;
+
                 if (!renderOptions.independentRenderSize)
                     renderOptions.windowResolution = renderOptions.renderResolution;
             }
@@ -380,8 +482,12 @@ namespace GLSLPT
                 Vec4 rotQuat;
                 Mat4 xform, translate, rot, scale;
                 int material_id = 0; // Default Material ID
+                std::vector<int> materialOverrides;
                 char meshName[200] = "none";
                 bool matrixProvided = false;
+                char spatialSplits[10] = "none";
+                float splitBudget = -1.0f;
+                char optimizeBvh[10] = "none";
 
                 while (fgets(line, kMaxLineLength, file))
                 {
@@ -393,11 +499,28 @@ namespace GLSLPT
                     char matName[100];
 
                     sscanf(line, " name %[^\t\n]s", meshName);
+                    sscanf(line, " spatialsplits %9s", spatialSplits);
+                    sscanf(line, " splitbudget %f", &splitBudget);
+                    sscanf(line, " optimizebvh %9s", optimizeBvh);
 
-                    if (sscanf(line, " file %s", file) == 1)
+                    if (sscanf(line, " file %2047s", file) == 1)
                         filename = path + file;
 
-                    if (sscanf(line, " material %s", matName) == 1)
+                    // Material of a slot (usemtl index in the .obj) for this instance only. Checked first as
+                    // the material keyword is a prefix of it
+                    int slot;
+                    if (sscanf(line, " materialslot %d %99s", &slot, matName) == 2)
+                    {
+                        if (slot >= 0 && materialMap.find(matName) != materialMap.end())
+                        {
+                            if (slot >= materialOverrides.size())
+                                materialOverrides.resize(slot + 1, -1);
+                            materialOverrides[slot] = materialMap[matName].id;
+                        }
+                        else
+                            printf("Could not find material %s\n", matName);
+                    }
+                    else if (sscanf(line, " material %99s", matName) == 1)
                     {
                         // look up material in dictionary
                         if (materialMap.find(matName) != materialMap.end())
@@ -425,6 +548,19 @@ namespace GLSLPT
                     int mesh_id = scene->AddMesh(filename);
                     if (mesh_id != -1)
                     {
+                        // BVH settings belong to the mesh and are shared by all its instances
+                        BvhSettings& bvhSettings = scene->meshes[mesh_id]->bvhSettings;
+                        if (strcmp(spatialSplits, "true") == 0)
+                            bvhSettings.spatialSplits = true;
+                        else if (strcmp(spatialSplits, "false") == 0)
+                            bvhSettings.spatialSplits = false;
+                        if (splitBudget >= 0.0f)
+                            bvhSettings.splitBudget = splitBudget;
+                        if (strcmp(optimizeBvh, "true") == 0)
+                            bvhSettings.optimize = true;
+                        else if (strcmp(optimizeBvh, "false") == 0)
+                            bvhSettings.optimize = false;
+
                         std::string instanceName;
 
                         if (strcmp(meshName, "none") != 0)
@@ -443,6 +579,7 @@ namespace GLSLPT
                             transformMat = scale * rot * translate;
 
                         MeshInstance instance(instanceName, mesh_id, transformMat, material_id);
+                        instance.materialOverrides = materialOverrides;
                         scene->AddMeshInstance(instance);
                     }
                 }
@@ -457,6 +594,9 @@ namespace GLSLPT
                 Vec4 rotQuat;
                 Mat4 xform, translate, rot, scale;
                 bool matrixProvided = false;
+                char spatialSplits[10] = "none";
+                float splitBudget = -1.0f;
+                char optimizeBvh[10] = "none";
 
                 while (fgets(line, kMaxLineLength, file))
                 {
@@ -466,9 +606,13 @@ namespace GLSLPT
 
                     char file[2048];
 
-                    if (sscanf(line, " file %s", file) == 1)
+                    if (sscanf(line, " file %2047s", file) == 1)
                         filename = path + file;
 
+                    sscanf(line, " spatialsplits %9s", spatialSplits);
+                    sscanf(line, " splitbudget %f", &splitBudget);
+                    sscanf(line, " optimizebvh %9s", optimizeBvh);
+
                     if (sscanf(line, " matrix %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f %f",
                         &xform[0][0], &xform[1][0], &xform[2][0], &xform[3][0],
                         &xform[0][1], &xform[1][1], &xform[2][1], &xform[3][1],
@@ -495,8 +639,9 @@ namespace GLSLPT
                     else
                         transformMat = scale * rot * translate;
 
-                    // TODO: Add support for instancing.
-                    // If the same gltf is loaded multiple times then mesh data gets duplicated
+                    int firstMesh = scene->meshes.size();
+
+                    // Loading the same file again instances it, the mesh data is shared
                     if (ext == "gltf")
                         success = LoadGLTF(filename, scene, renderOptions, transformMat, false);
                     else if (ext == "glb")
@@ -507,6 +652,18 @@ namespace GLSLPT
                         printf("Unable to load gltf %s\n", filename.c_str());
                         exit(0);
                     }
+
+                    // BVH settings apply to every mesh of the file
+                    for (int i = firstMesh; i < scene->meshes.size(); i++)
+                    {
+                        BvhSettings& bvhSettings = scene->meshes[i]->bvhSettings;
+                        if (strcmp(spatialSplits, "true") == 0)
+                            bvhSettings.spatialSplits = true;
+                        if (splitBudget >= 0.0f)
+                            bvhSettings.splitBudget = splitBudget;
+                        if (strcmp(optimizeBvh, "true") == 0)
+                            bvhSettings.optimize = true;
+                    }
                 }
             }
         }
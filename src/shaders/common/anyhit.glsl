@@ -63,7 +63,12 @@ bool AnyHit(Ray r, float maxDist)
 #endif
 
     // Intersect BVH and tris
+#ifdef OPT_COMPRESSED_BVH
+    // Wide nodes push up to three children more than they pop
+    int stack[96];
+#else
     int stack[64];
+#endif
     int ptr = 0;
     stack[ptr++] = -1;
 
@@ -75,18 +80,46 @@ bool AnyHit(Ray r, float maxDist)
     int currMatID = 0;
 #endif
     bool BLAS = false;
+    bool group = false;
+    mat4 groupMat;
 
     Ray rTrans;
     rTrans.origin = r.origin;
     rTrans.direction = r.direction;
 
+    // Ray in the space of the instance group being traversed
+    Ray rGroup;
+
     while (index != -1)
     {
+#if defined(OPT_COMPRESSED_BVH)
+        // Stack entries are wide nodes (index << 3), BLAS leaf children of a wide node (index << 3 | child << 1 | 1)
+        // or instances (-instance-2). Leaves decode to the same values as the other layouts
+        int leftIndex  = index < -1 ? texelFetch(instanceMaterialsTex, -index - 2).y << 3 : index >> 3;
+        int rightIndex = 0;
+        int leaf       = index < -1 ? index + 1 : 0;
+        if (index >= 0 && (index & 1) != 0)
+        {
+            int child     = (index >> 1) & 3;
+            ivec4 counts  = texelFetch(BVH, (index >> 3) * 4 + 2);
+            ivec4 offsets = texelFetch(BVH, (index >> 3) * 4 + 3);
+            leftIndex     = offsets[child];
+            rightIndex    = (counts[2 + (child >> 1)] >> ((child & 1) * 16)) & 0xffff;
+            leaf          = 1;
+        }
+#elif defined(OPT_PACKED_BVH)
+        // Siblings are adjacent, the second texel holds the primitive count or the instance of a TLAS leaf
+        int leftIndex  = texelFetch(BVH, index * 2 + 0).w;
+        int count      = texelFetch(BVH, index * 2 + 1).w;
+        int rightIndex = count > 0 ? count : leftIndex + 1;
+        int leaf       = count > 0 ? 1 : count;
+#else
         ivec3 LRLeaf = ivec3(texelFetch(BVH, index * 3 + 2).xyz);
 
         int leftIndex  = int(LRLeaf.x);
         int rightIndex = int(LRLeaf.y);
         int leaf       = int(LRLeaf.z);
+#endif
 
         if (leaf > 0) // Leaf node of BLAS
         {
@@ -122,10 +155,15 @@ bool AnyHit(Ray r, float maxDist)
 
                     vec2 texCoord = t0 * uvt.w + t1 * uvt.x + t2 * uvt.y;
 
-                    vec4 texIDs      = texelFetch(materialsTex, ivec2(currMatID * 8 + 6, 0), 0);
-                    vec4 alphaParams = texelFetch(materialsTex, ivec2(currMatID * 8 + 7, 0), 0);
+#ifdef OPT_MATERIAL_TABLES
+                    int matID = texelFetch(materialTablesTex, currMatID + texelFetch(triangleSlotsTex, vertIndices.x / 3).x).x;
+#else
+                    int matID = currMatID;
+#endif
+                    vec4 texIDs      = texelFetch(materialsTex, ivec2(matID * 8 + 6, 0), 0);
+                    vec4 alphaParams = texelFetch(materialsTex, ivec2(matID * 8 + 7, 0), 0);
                     
-                    float alpha = texture(textureMapsArrayTex, vec3(texCoord, texIDs.x)).a;
+                    float alpha = textureLod(textureMapsArrayTex, vec3(texCoord, texIDs.x), 0.0).a;
 
                     float opacity = alphaParams.x;
                     int alphaMode = int(alphaParams.y);
@@ -143,32 +181,85 @@ bool AnyHit(Ray r, float maxDist)
                     
             }
         }
-        else if (leaf < 0) // Leaf node of TLAS
+        else if (leaf < 0) // Instance leaf of the TLAS or of an instance group
         {
-            vec4 r1 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 0, 0), 0).xyzw;
-            vec4 r2 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 1, 0), 0).xyzw;
-            vec4 r3 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 2, 0), 0).xyzw;
-            vec4 r4 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 3, 0), 0).xyzw;
+            int record = -leaf - 1;
+            vec4 r1 = texelFetch(transformsTex, ivec2(record * 4 + 0, 0), 0).xyzw;
+            vec4 r2 = texelFetch(transformsTex, ivec2(record * 4 + 1, 0), 0).xyzw;
+            vec4 r3 = texelFetch(transformsTex, ivec2(record * 4 + 2, 0), 0).xyzw;
+            vec4 r4 = texelFetch(transformsTex, ivec2(record * 4 + 3, 0), 0).xyzw;
 
             mat4 transform = mat4(r1, r2, r3, r4);
+#if defined(OPT_PACKED_BVH) || defined(OPT_COMPRESSED_BVH)
+            int instanceMatID = texelFetch(instanceMaterialsTex, record).x;
+#else
+            int instanceMatID = rightIndex;
+#endif
 
-            rTrans.origin    = vec3(inverse(transform) * vec4(r.origin, 1.0));
-            rTrans.direction = vec3(inverse(transform) * vec4(r.direction, 0.0));
-
-            // Add a marker. We'll return to this spot after we've traversed the entire BLAS
+            // Add a marker. We'll return to this spot after we've traversed the entire BLAS or group
             stack[ptr++] = -1;
 
             index = leftIndex;
+
+            // Group instances have no material and lead to a tree of instances placed relative to the group
+            if (instanceMatID < 0)
+            {
+                groupMat = transform;
+                rGroup.origin    = vec3(inverse(groupMat) * vec4(r.origin, 1.0));
+                rGroup.direction = vec3(inverse(groupMat) * vec4(r.direction, 0.0));
+                rTrans = rGroup;
+                group = true;
+                continue;
+            }
+
+            if (group)
+                transform = groupMat * transform;
+
+            rTrans.origin    = vec3(inverse(transform) * vec4(r.origin, 1.0));
+            rTrans.direction = vec3(inverse(transform) * vec4(r.direction, 0.0));
+
             BLAS = true;
 #if defined(OPT_ALPHA_TEST) && !defined(OPT_MEDIUM)
-            currMatID = rightIndex;
+#if defined(OPT_MATERIAL_TABLES)
+            // Offset of the material table of the instance, resolved per triangle
+            currMatID = texelFetch(materialTablesTex, record).x;
+#else
+            currMatID = instanceMatID;
+#endif
 #endif
             continue;
         }
         else
         {
+#ifdef OPT_COMPRESSED_BVH
+            ivec4 n0 = texelFetch(BVH, leftIndex * 4 + 0);
+            ivec4 n1 = texelFetch(BVH, leftIndex * 4 + 1);
+            ivec4 n2 = texelFetch(BVH, leftIndex * 4 + 2);
+            ivec4 n3 = texelFetch(BVH, leftIndex * 4 + 3);
+
+            vec3 origin = intBitsToFloat(n0.xyz);
+            vec3 scale = uintBitsToFloat(uvec3((n0.www >> ivec3(0, 8, 16)) & 0xff) << 23);
+            int numChildren = (n0.w >> 24) & 0xff;
+
+            // Any hit ends the traversal so children are not sorted
+            for (int i = 0; i < numChildren; i++)
+            {
+                vec3 qlo = vec3((n1.xyz >> (i * 8)) & 0xff);
+                vec3 qhi = vec3((ivec3(n1.w, n2.xy) >> (i * 8)) & 0xff);
+                if (AABBIntersect(origin + scale * qlo, origin + scale * qhi, rTrans) <= 0.0)
+                    continue;
+
+                int count = (n2[2 + (i >> 1)] << (16 - (i & 1) * 16)) >> 16;
+                stack[ptr++] = count > 0 ? (index | (i << 1) | 1) : (count < 0 ? -n3[i] - 2 : n3[i] << 3);
+            }
+#else
+#ifdef OPT_PACKED_BVH
+            leftHit  = AABBIntersect(intBitsToFloat(texelFetch(BVH, leftIndex  * 2 + 0).xyz), intBitsToFloat(texelFetch(BVH, leftIndex  * 2 + 1).xyz), rTrans);
+            rightHit = AABBIntersect(intBitsToFloat(texelFetch(BVH, rightIndex * 2 + 0).xyz), intBitsToFloat(texelFetch(BVH, rightIndex * 2 + 1).xyz), rTrans);
+#else
             leftHit =  AABBIntersect(texelFetch(BVH, leftIndex  * 3 + 0).xyz, texelFetch(BVH, leftIndex  * 3 + 1).xyz, rTrans);
             rightHit = AABBIntersect(texelFetch(BVH, rightIndex * 3 + 0).xyz, texelFetch(BVH, rightIndex * 3 + 1).xyz, rTrans);
+#endif
 
             if (leftHit > 0.0 && rightHit > 0.0)
             {
@@ -197,16 +288,28 @@ bool AnyHit(Ray r, float maxDist)
                 index = rightIndex;
                 continue;
             }
+#endif
         }
         index = stack[--ptr];
 
-        // If we've traversed the entire BLAS then switch to back to TLAS and resume where we left off
+        // If we've traversed the entire BLAS then switch back to the group or the TLAS and resume where we left off
         if (BLAS && index == -1)
         {
             BLAS = false;
 
             index = stack[--ptr];
 
+            rTrans.origin = group ? rGroup.origin : r.origin;
+            rTrans.direction = group ? rGroup.direction : r.direction;
+        }
+
+        // Same once the whole group has been traversed
+        if (group && index == -1)
+        {
+            group = false;
+
+            index = stack[--ptr];
+
             rTrans.origin = r.origin;
             rTrans.direction = r.direction;
         }
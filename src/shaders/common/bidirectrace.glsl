@@ -47,6 +47,7 @@ vec4 traceEyePath( in Ray ray_) {
     vec3 rd = ray_.direction;
 
     State state; 
+    InitRayCone(state, pixelSpreadAngle);
     vec3 radiance = vec3(0.);
     vec3 throughput = vec3(1.); 
     LightSampleRec lightSample;
@@ -181,6 +182,7 @@ vec4 sc_traceEyePath( in Ray ray_) {
     vec3 rd = ray_.direction;
 
     State state; 
+    InitRayCone(state, pixelSpreadAngle);
     vec3 radiance = vec3(0.);
     vec3 throughput = vec3(1.); 
     LightSampleRec lightSample;
@@ -220,7 +222,15 @@ vec4 sc_traceEyePath( in Ray ray_) {
         curnormal = state.ffnormal;
         // Bidirectional path tracing
 
+#ifdef OPT_PATH_GUIDING
+        BeginSampleDimensions(BOUNCE_DIM(j, DIM_GUIDE), 4);
+        vec3 guideRand = vec3(rand(), rand(), rand());
+        BeginSampleDimensions(BOUNCE_DIM(j, DIM_BSDF), 4);
+        scatterSample.f = GuidedSample(state, -r.direction, curnormal, guideRand, scatterSample.L, scatterSample.pdf);
+#else
+        BeginSampleDimensions(BOUNCE_DIM(j, DIM_BSDF), 4);
         scatterSample.f = DisneySample(state,  -r.direction, curnormal, scatterSample.L, scatterSample.pdf);
+#endif
         rd = scatterSample.L;
         ro = state.fhp + normalize(rd)*EPS;
         
@@ -300,8 +310,13 @@ vec4 sc_traceEyePath( in Ray ray_) {
         }
 #endif
 
+        BeginSampleDimensions(BOUNCE_DIM(j, DIM_LIGHT), 12);
         radiance += DirectLight(r,state,true)*throughput;
 
+#ifdef OPT_PATH_GUIDING
+        if (j == 0)
+            GuideBeginRecord(state.fhp, scatterSample.L, scatterSample.f, scatterSample.pdf, radiance);
+#endif
         
         if (scatterSample.pdf > 0.0)
             throughput *= scatterSample.f / scatterSample.pdf;
@@ -311,12 +326,17 @@ vec4 sc_traceEyePath( in Ray ray_) {
         if (state.depth >= OPT_RR_DEPTH)
         {
             float q = min(max(throughput.x, max(throughput.y, throughput.z)) + 0.001, 0.95);
+            BeginSampleDimensions(BOUNCE_DIM(j, DIM_RR), 4);
             if (rand() > q)
                 break;
             throughput /= q;
         }
 #endif
     }  
+
+#ifdef OPT_PATH_GUIDING
+    GuideEndRecord(radiance);
+#endif
     
     return vec4(radiance, 1.0);
 }
@@ -420,8 +440,10 @@ struct EyeNode{
     Material mat;
 };
 
+#define LIGHT_VERTEX_TEXELS 9 // Renderer::LightInfo
+
 void GetLightPathNodeInfo(inout LightPathNode node, int index){
-    int ind = index * 7; 
+    int ind = index * LIGHT_VERTEX_TEXELS; 
     vec3 param1 = vec3(texelFetch(lightPathTex, ind + 0).xyz);
     vec3 param2 = vec3(texelFetch(lightPathTex, ind + 1).xyz);
     vec3 param3 = vec3(texelFetch(lightPathTex, ind + 2).xyz);
@@ -439,6 +461,10 @@ void GetLightPathNodeInfo(inout LightPathNode node, int index){
     node.avaliable = int(param6.z);
     node.texCoord = param7.xy;
     float matroughness = param7.z;
+#ifdef OPT_VERTEX_MERGING
+    node.flux = texelFetch(lightPathTex, ind + 7).xyz;
+    node.vcm = texelFetch(lightPathTex, ind + 8).xyz;
+#endif
 
 
     int matind = node.matID * 8;
@@ -483,7 +509,7 @@ void GetLightPathNodeInfo(inout LightPathNode node, int index){
 
     if (texIDs.x >= 0)
     {
-        vec4 col = texture(textureMapsArrayTex, vec3(node.texCoord, texIDs.x));
+        vec4 col = textureLod(textureMapsArrayTex, vec3(node.texCoord, texIDs.x), 0.0);
         node.mat.baseColor.rgb *= pow(col.rgb, vec3(2.2));
         node.mat.opacity *= col.a;
     }
@@ -491,7 +517,7 @@ void GetLightPathNodeInfo(inout LightPathNode node, int index){
     // Metallic Roughness Map
     if (texIDs.y >= 0)
     {
-        vec2 matRgh = texture(textureMapsArrayTex, vec3(node.texCoord, texIDs.y)).bg;
+        vec2 matRgh = textureLod(textureMapsArrayTex, vec3(node.texCoord, texIDs.y), 0.0).bg;
         node.mat.metallic = matRgh.x;
         node.mat.roughness = max(matRgh.y * matRgh.y, 0.001);
     }
@@ -504,7 +530,7 @@ void GetLightPathNodeInfo(inout LightPathNode node, int index){
 
     // Emission Map
     if (texIDs.w >= 0)
-        node.mat.emission = pow(texture(textureMapsArrayTex, vec3(node.texCoord, texIDs.w)).rgb, vec3(2.2));
+        node.mat.emission = pow(textureLod(textureMapsArrayTex, vec3(node.texCoord, texIDs.w), 0.0).rgb, vec3(2.2));
 
 }
 
@@ -587,11 +613,78 @@ vec3 VertexConnect(LightPathNode lightnode, EyeNode eyenode){
 
 }
 
+#ifdef OPT_VERTEX_MERGING
+// Density estimate of the light vertices within vmRadius of the eye vertex. The vertices are read straight
+// from the light path textures, the light path BVH is traversed with the search sphere
+vec3 MergeLightVertices(in State state, vec3 V, vec3 eyeVcm)
+{
+    vec3 result = vec3(0.0);
+    float radius2 = vmRadius * vmRadius;
+
+    // The renderer keeps the light path BVH at most 63 levels deep, so the siblings waiting here always fit
+    int stack[64];
+    int ptr = 0;
+    stack[ptr++] = 0;
+    while (ptr > 0)
+    {
+        int nodeIndex = stack[--ptr];
+        LinearBVHNode bvhnode;
+        fetchLightBVHnode(bvhnode, nodeIndex);
+
+        vec3 d = max(bvhnode.pmin - state.fhp, vec3(0.0)) + max(state.fhp - bvhnode.pmax, vec3(0.0));
+        if (dot(d, d) > radius2)
+            continue;
+
+        if (bvhnode.axis != 3)
+        {
+            if (ptr < 63)
+            {
+                stack[ptr++] = bvhnode.primitivesOffsetOrSecondChildOffset;
+                stack[ptr++] = nodeIndex + 1;
+            }
+            continue;
+        }
+
+        for (int i = 0; i < bvhnode.nPrimitives; i++)
+        {
+            int index;
+            fetchLightBVHnodeIndex(index, bvhnode.primitivesOffsetOrSecondChildOffset + i);
+            int ind = index * LIGHT_VERTEX_TEXELS;
+
+            vec3 toVertex = texelFetch(lightPathTex, ind + 0).xyz - state.fhp;
+            vec3 info = texelFetch(lightPathTex, ind + 5).xyz;
+            // Unused slots and vertices on the lights, next event estimation covers the latter
+            if (dot(toVertex, toVertex) > radius2 || int(info.z) == 0 || int(info.y) == -1)
+                continue;
+
+            // Vertices that arrived at the other side of the surface
+            if (dot(texelFetch(lightPathTex, ind + 3).xyz, state.ffnormal) <= 0.0)
+                continue;
+
+            vec3 wi = -texelFetch(lightPathTex, ind + 4).xyz;
+            float cosIn = abs(dot(state.ffnormal, wi));
+            float eyePdfW, eyeRevPdfW;
+            vec3 f = DisneyEval(state, V, state.ffnormal, wi, eyePdfW);
+            DisneyEval(state, wi, state.ffnormal, V, eyeRevPdfW);
+            if (eyePdfW <= 0.0 || cosIn < EPS)
+                continue;
+
+            vec3 flux = texelFetch(lightPathTex, ind + 7).xyz;
+            vec3 lightVcm = texelFetch(lightPathTex, ind + 8).xyz;
+            result += VcmMergeWeight(eyeVcm, lightVcm, eyePdfW, eyeRevPdfW) * f / cosIn * flux;
+        }
+    }
+
+    return result / vmEta;
+}
+#endif
+
 vec4 HRRVC( in Ray ray_) { 
     vec3 ro = ray_.origin; 
     vec3 rd = ray_.direction;
 
     State state; 
+    InitRayCone(state, pixelSpreadAngle);
     vec3 radiance = vec3(0.);
     vec3 throughput = vec3(1.); 
     LightSampleRec lightSample;
@@ -600,6 +693,9 @@ vec4 HRRVC( in Ray ray_) {
     
     bool hit = false; 
     vec3 curnormal = rd;
+#ifdef OPT_VERTEX_MERGING
+    vec3 eyeVcm = vec3(0.0);
+#endif
     
     for( int j=0; j<EYEPATHLENGTH; ++j ) {
         
@@ -617,9 +713,13 @@ vec4 HRRVC( in Ray ray_) {
         // if hit light, return light color
         if(state.isEmitter){
             float misWeight = 1.0;
+#ifdef OPT_VERTEX_MERGING
+            misWeight = VcmLightHitWeight(eyeVcm, state.emitterIndex, state.fhp, r.direction, state.hitDist);
+#else
             if (j > 0){
                 misWeight = PowerHeuristic(scatterSample.pdf, lightSample.pdf);
             }
+#endif
             radiance += misWeight * throughput * lightSample.emission;
             break;
         }
@@ -627,7 +727,12 @@ vec4 HRRVC( in Ray ray_) {
         GetMaterial(state, r);
         mat = state.mat;
         curnormal = state.ffnormal;
+#ifdef OPT_VERTEX_MERGING
+        VcmArrive(eyeVcm, state.hitDist, abs(dot(state.ffnormal, r.direction)));
+        radiance += MergeLightVertices(state, -r.direction, eyeVcm) * throughput;
+#endif
         // Sample BRDF
+        BeginSampleDimensions(BOUNCE_DIM(j, DIM_BSDF), 4);
         scatterSample.f = DisneySample(state, -r.direction, curnormal, scatterSample.L, scatterSample.pdf);
         rd = scatterSample.L;
         ro = state.fhp + normalize(rd)*EPS;
@@ -667,6 +772,7 @@ vec4 HRRVC( in Ray ray_) {
         fetchLightBVHnode(bvhnode, currentNodeIndex); 
 
 
+        BeginSampleDimensions(BOUNCE_DIM(j, DIM_HRRVC), 8);
         float randomNumberMin = rand()/ bvhnode.nPrimitives ;
         float infimum = 1.0f / bvhnode.nPrimitives;
 
@@ -768,7 +874,13 @@ vec4 HRRVC( in Ray ray_) {
                     // if(index%LIGHTPATHLENGTH==0)
                     // continue;
 
-                    float misWeight=1.0/(2.0+j+(index)%LIGHTPATHLENGTH)/12000.0;
+#ifdef OPT_VERTEX_MERGING
+                    if (node.matID == -1)
+                        continue;
+                    float misWeight = VcmConnectWeight(state, -r.direction, eyeVcm, node) / float(numLightPaths);
+#else
+                    float misWeight=1.0/(2.0+j+(index)%LIGHTPATHLENGTH)/float(numLightPaths);
+#endif
 
                     #ifdef OPT_RR
                     float weight=misWeight/(p_y_z*sqrt(dot(scatterSample.f, scatterSample.f)));
@@ -793,7 +905,19 @@ vec4 HRRVC( in Ray ray_) {
             infimum = stackElement.infimum;
             // out result 
         }
+        BeginSampleDimensions(BOUNCE_DIM(j, DIM_LIGHT), 12);
+#ifdef OPT_VERTEX_MERGING
+        radiance += VcmDirectLight(r, state, eyeVcm) * throughput;
+
+        if (scatterSample.pdf > 0.0)
+        {
+            float revPdf;
+            DisneyEval(state, rd, state.ffnormal, -r.direction, revPdf);
+            VcmScatter(eyeVcm, abs(dot(state.ffnormal, rd)), scatterSample.pdf, revPdf);
+        }
+#else
         radiance += DirectLight(r,state,true)*throughput;
+#endif
 
         if (scatterSample.pdf > 0.0)
             throughput *= scatterSample.f / scatterSample.pdf;
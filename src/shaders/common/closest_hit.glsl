@@ -26,6 +26,7 @@ bool ClosestHit(Ray r, inout State state, inout LightSampleRec lightSample)
 {
     float t = INF;
     float d;
+    state.emitterIndex = -1;
 
 #ifdef OPT_LIGHTS
     // Intersect Emitters
@@ -60,9 +61,10 @@ if(state.depth > 0)
             {
                 t = d;
                 float cosTheta = dot(-r.direction, normal);
-                lightSample.pdf = (t * t) / (area * cosTheta);
+                lightSample.pdf = (t * t) / (area * cosTheta) * LightPmf(r.origin, i);
                 lightSample.emission = emission;
                 state.isEmitter = true;
+                state.emitterIndex = i;
                 state.normal = normal; //fuck
             }
         }
@@ -78,16 +80,22 @@ if(state.depth > 0)
                 vec3 hitPt = r.origin + t * r.direction;
                 float cosTheta = dot(-r.direction, normalize(hitPt - position));
                 // TODO: Fix this. Currently assumes the light will be hit only from the outside
-                lightSample.pdf = (t * t) / (area * cosTheta * 0.5);
+                lightSample.pdf = (t * t) / (area * cosTheta * 0.5) * LightPmf(r.origin, i);
                 lightSample.emission = emission;
                 state.isEmitter = true;
+                state.emitterIndex = i;
             }
         }
     }
 #endif
 
     // Intersect BVH and tris
+#ifdef OPT_COMPRESSED_BVH
+    // Wide nodes push up to three children more than they pop
+    int stack[96];
+#else
     int stack[64];
+#endif
     int ptr = 0;
     stack[ptr++] = -1;
 
@@ -96,10 +104,14 @@ if(state.depth > 0)
     float rightHit = 0.0;
 
     int currMatID = 0;
+    int currInstance = 0;
+    int hitInstance = 0;
     bool BLAS = false;
+    bool group = false;
 
     ivec3 triID = ivec3(-1);
     mat4 transMat;
+    mat4 groupMat;
     mat4 transform;
     vec3 bary;
     vec4 vert0, vert1, vert2;
@@ -108,13 +120,39 @@ if(state.depth > 0)
     rTrans.origin = r.origin;
     rTrans.direction = r.direction;
 
+    // Ray in the space of the instance group being traversed
+    Ray rGroup;
+
     while (index != -1)
     {
+#if defined(OPT_COMPRESSED_BVH)
+        // Stack entries are wide nodes (index << 3), BLAS leaf children of a wide node (index << 3 | child << 1 | 1)
+        // or instances (-instance-2). Leaves decode to the same values as the other layouts
+        int leftIndex  = index < -1 ? texelFetch(instanceMaterialsTex, -index - 2).y << 3 : index >> 3;
+        int rightIndex = 0;
+        int leaf       = index < -1 ? index + 1 : 0;
+        if (index >= 0 && (index & 1) != 0)
+        {
+            int child     = (index >> 1) & 3;
+            ivec4 counts  = texelFetch(BVH, (index >> 3) * 4 + 2);
+            ivec4 offsets = texelFetch(BVH, (index >> 3) * 4 + 3);
+            leftIndex     = offsets[child];
+            rightIndex    = (counts[2 + (child >> 1)] >> ((child & 1) * 16)) & 0xffff;
+            leaf          = 1;
+        }
+#elif defined(OPT_PACKED_BVH)
+        // Siblings are adjacent, the second texel holds the primitive count or the instance of a TLAS leaf
+        int leftIndex  = texelFetch(BVH, index * 2 + 0).w;
+        int count      = texelFetch(BVH, index * 2 + 1).w;
+        int rightIndex = count > 0 ? count : leftIndex + 1;
+        int leaf       = count > 0 ? 1 : count;
+#else
         ivec3 LRLeaf = ivec3(texelFetch(BVH, index * 3 + 2).xyz);
 
         int leftIndex  = int(LRLeaf.x);
         int rightIndex = int(LRLeaf.y);
         int leaf       = int(LRLeaf.z);
+#endif
 
         if (leaf > 0) // Leaf node of BLAS
         {
@@ -156,32 +194,98 @@ if(state.depth > 0)
                     bary = uvt.wxy;
                     vert0 = v0, vert1 = v1, vert2 = v2;
                     transform = transMat;
+                    hitInstance = currInstance;
                 }
             }
         }
-        else if (leaf < 0) // Leaf node of TLAS
+        else if (leaf < 0) // Instance leaf of the TLAS or of an instance group
         {
-            vec4 r1 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 0, 0), 0).xyzw;
-            vec4 r2 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 1, 0), 0).xyzw;
-            vec4 r3 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 2, 0), 0).xyzw;
-            vec4 r4 = texelFetch(transformsTex, ivec2((-leaf - 1) * 4 + 3, 0), 0).xyzw;
+            int record = -leaf - 1;
+            vec4 r1 = texelFetch(transformsTex, ivec2(record * 4 + 0, 0), 0).xyzw;
+            vec4 r2 = texelFetch(transformsTex, ivec2(record * 4 + 1, 0), 0).xyzw;
+            vec4 r3 = texelFetch(transformsTex, ivec2(record * 4 + 2, 0), 0).xyzw;
+            vec4 r4 = texelFetch(transformsTex, ivec2(record * 4 + 3, 0), 0).xyzw;
+
+            mat4 instanceMat = mat4(r1, r2, r3, r4);
+#if defined(OPT_PACKED_BVH) || defined(OPT_COMPRESSED_BVH)
+            int instanceMatID = texelFetch(instanceMaterialsTex, record).x;
+#else
+            int instanceMatID = rightIndex;
+#endif
+
+            // Add a marker. We'll return to this spot after we've traversed the entire BLAS or group
+            stack[ptr++] = -1;
+            index = leftIndex;
 
-            transMat = mat4(r1, r2, r3, r4);
+            // Group instances have no material and lead to a tree of instances placed relative to the group
+            if (instanceMatID < 0)
+            {
+                groupMat = instanceMat;
+                rGroup.origin    = vec3(inverse(groupMat) * vec4(r.origin, 1.0));
+                rGroup.direction = vec3(inverse(groupMat) * vec4(r.direction, 0.0));
+                rTrans = rGroup;
+                group = true;
+                continue;
+            }
+
+            transMat = group ? groupMat * instanceMat : instanceMat;
 
             rTrans.origin    = vec3(inverse(transMat) * vec4(r.origin, 1.0));
             rTrans.direction = vec3(inverse(transMat) * vec4(r.direction, 0.0));
 
-            // Add a marker. We'll return to this spot after we've traversed the entire BLAS
-            stack[ptr++] = -1;
-            index = leftIndex;
             BLAS = true;
-            currMatID = rightIndex;
+            currMatID = instanceMatID;
+            currInstance = record;
             continue;
         }
         else
         {
+#ifdef OPT_COMPRESSED_BVH
+            ivec4 n0 = texelFetch(BVH, leftIndex * 4 + 0);
+            ivec4 n1 = texelFetch(BVH, leftIndex * 4 + 1);
+            ivec4 n2 = texelFetch(BVH, leftIndex * 4 + 2);
+            ivec4 n3 = texelFetch(BVH, leftIndex * 4 + 3);
+
+            // Child bounds are 8 bit offsets on a grid with power of two spacing, built from the float exponents
+            vec3 origin = intBitsToFloat(n0.xyz);
+            vec3 scale = uintBitsToFloat(uvec3((n0.www >> ivec3(0, 8, 16)) & 0xff) << 23);
+            int numChildren = (n0.w >> 24) & 0xff;
+
+            // Push the hit children furthest first so the nearest one is popped next
+            float hitDist[4];
+            int hitEntry[4];
+            int numHits = 0;
+            for (int i = 0; i < numChildren; i++)
+            {
+                vec3 qlo = vec3((n1.xyz >> (i * 8)) & 0xff);
+                vec3 qhi = vec3((ivec3(n1.w, n2.xy) >> (i * 8)) & 0xff);
+                float dist = AABBIntersect(origin + scale * qlo, origin + scale * qhi, rTrans);
+                if (dist <= 0.0)
+                    continue;
+
+                int count = (n2[2 + (i >> 1)] << (16 - (i & 1) * 16)) >> 16;
+                int entry = count > 0 ? (index | (i << 1) | 1) : (count < 0 ? -n3[i] - 2 : n3[i] << 3);
+
+                int j = numHits++;
+                for (; j > 0 && hitDist[j - 1] < dist; j--)
+                {
+                    hitDist[j] = hitDist[j - 1];
+                    hitEntry[j] = hitEntry[j - 1];
+                }
+                hitDist[j] = dist;
+                hitEntry[j] = entry;
+            }
+
+            for (int i = 0; i < numHits; i++)
+                stack[ptr++] = hitEntry[i];
+#else
+#ifdef OPT_PACKED_BVH
+            leftHit  = AABBIntersect(intBitsToFloat(texelFetch(BVH, leftIndex  * 2 + 0).xyz), intBitsToFloat(texelFetch(BVH, leftIndex  * 2 + 1).xyz), rTrans);
+            rightHit = AABBIntersect(intBitsToFloat(texelFetch(BVH, rightIndex * 2 + 0).xyz), intBitsToFloat(texelFetch(BVH, rightIndex * 2 + 1).xyz), rTrans);
+#else
             leftHit  = AABBIntersect(texelFetch(BVH, leftIndex  * 3 + 0).xyz, texelFetch(BVH, leftIndex  * 3 + 1).xyz, rTrans);
             rightHit = AABBIntersect(texelFetch(BVH, rightIndex * 3 + 0).xyz, texelFetch(BVH, rightIndex * 3 + 1).xyz, rTrans);
+#endif
 
             if (leftHit > 0.0 && rightHit > 0.0)
             {
@@ -210,16 +314,28 @@ if(state.depth > 0)
                 index = rightIndex;
                 continue;
             }
+#endif
         }
         index = stack[--ptr];
 
-        // If we've traversed the entire BLAS then switch to back to TLAS and resume where we left off
+        // If we've traversed the entire BLAS then switch back to the group or the TLAS and resume where we left off
         if (BLAS && index == -1)
         {
             BLAS = false;
 
             index = stack[--ptr];
 
+            rTrans.origin = group ? rGroup.origin : r.origin;
+            rTrans.direction = group ? rGroup.direction : r.direction;
+        }
+
+        // Same once the whole group has been traversed
+        if (group && index == -1)
+        {
+            group = false;
+
+            index = stack[--ptr];
+
             rTrans.origin = r.origin;
             rTrans.direction = r.direction;
         }
@@ -231,11 +347,26 @@ if(state.depth > 0)
 
     state.hitDist = t;
     state.fhp = r.origin + r.direction * t;
+    state.coneWidth += state.coneSpread * t;
 
     // Ray hit a triangle and not a light source
     if (triID.x != -1)
     {
         state.isEmitter = false;
+        state.emitterIndex = -1;
+
+#ifdef OPT_MATERIAL_TABLES
+        // Resolve the material slot of the triangle through the table of the instance
+        int slot = texelFetch(triangleSlotsTex, triID.x / 3).x;
+        state.matID = texelFetch(materialTablesTex, texelFetch(materialTablesTex, hitInstance).x + slot).x;
+#endif
+
+#ifdef OPT_EMISSIVE_TRIANGLES
+        // Vertices are stored three per triangle so the first vertex index identifies the triangle
+        ivec2 instanceEmitters = texelFetch(instanceEmittersTex, hitInstance).xy;
+        if (instanceEmitters.x != 0)
+            state.emitterIndex = instanceEmitters.y + triID.x / 3;
+#endif
 
         // Normals
         vec4 n0 = texelFetch(normalsTex, triID.x);
@@ -268,6 +399,13 @@ if(state.depth > 0)
 
         state.tangent = normalize(mat3(transform) * state.tangent);
         state.bitangent = normalize(mat3(transform) * state.bitangent);
+
+#ifdef OPT_TEXTURE_LOD
+        // Triangle LOD constant (ratio of texel area to world space area) for ray cone texture filtering
+        float uvArea = abs(deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
+        float worldArea = length(cross(mat3(transform) * deltaPos1, mat3(transform) * deltaPos2));
+        state.texLod = (uvArea > 0.0 && worldArea > 0.0) ? 0.5 * log2(uvArea / worldArea) : 0.0;
+#endif
     }
 
     return true;
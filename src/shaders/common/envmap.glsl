@@ -25,33 +25,26 @@
 #ifdef OPT_ENVMAP
 #ifndef OPT_UNIFORM_LIGHT
 
-vec2 BinarySearch(float value)
+// Samples a pixel with the alias tables built by EnvironmentMap::BuildSamplingTables.
+// Returns the uv of the sample and its pdf with respect to the unit square
+vec2 SampleEnvMapAlias(out float pdf)
 {
     ivec2 envMapResInt = ivec2(envMapRes);
-    int lower = 0;
-    int upper = envMapResInt.y - 1;
-    while (lower < upper)
-    {
-        int mid = (lower + upper) >> 1;
-        if (value < texelFetch(envMapCDFTex, ivec2(envMapResInt.x - 1, mid), 0).r)
-            upper = mid;
-        else
-            lower = mid + 1;
-    }
-    int y = clamp(lower, 0, envMapResInt.y - 1);
 
-    lower = 0;
-    upper = envMapResInt.x - 1;
-    while (lower < upper)
-    {
-        int mid = (lower + upper) >> 1;
-        if (value < texelFetch(envMapCDFTex, ivec2(mid, y), 0).r)
-            upper = mid;
-        else
-            lower = mid + 1;
-    }
-    int x = clamp(lower, 0, envMapResInt.x - 1);
-    return vec2(x, y) / envMapRes;
+    // Pick a row from the marginal table in the last column
+    int y = min(int(rand() * envMapRes.y), envMapResInt.y - 1);
+    vec4 marginal = texelFetch(envMapAliasTex, ivec2(envMapResInt.x, y), 0);
+    if (rand() >= marginal.x)
+        y = int(marginal.y);
+
+    // Pick a column from the conditional table of that row
+    int x = min(int(rand() * envMapRes.x), envMapResInt.x - 1);
+    vec4 conditional = texelFetch(envMapAliasTex, ivec2(x, y), 0);
+    if (rand() >= conditional.x)
+        x = int(conditional.y);
+
+    pdf = texelFetch(envMapAliasTex, ivec2(x, y), 0).z;
+    return (vec2(x, y) + vec2(rand(), rand())) / envMapRes;
 }
 
 vec4 EvalEnvMap(Ray r)
@@ -60,27 +53,31 @@ vec4 EvalEnvMap(Ray r)
     vec2 uv = vec2((PI + atan(r.direction.z, r.direction.x)) * INV_TWO_PI, theta * INV_PI) + vec2(envMapRot, 0.0);
     
     vec3 color = texture(envMapTex, uv).rgb;
-    float pdf = Luminance(color) / envMapTotalSum;
-                
-    return vec4(color, (pdf * envMapRes.x * envMapRes.y) / (TWO_PI * PI * sin(theta)));
+
+    ivec2 texel = clamp(ivec2(fract(uv) * envMapRes), ivec2(0), ivec2(envMapRes) - 1);
+    float pdf = texelFetch(envMapAliasTex, texel, 0).z;
+    float sinTheta = sin(theta);
+
+    return vec4(color, sinTheta > 0.0 ? pdf / (TWO_PI * PI * sinTheta) : 0.0);
 }
 
 vec4 SampleEnvMap(inout vec3 color)
 {
-    vec2 uv = BinarySearch(rand() * envMapTotalSum);
+    float pdf;
+    vec2 uv = SampleEnvMapAlias(pdf);
 
     color = texture(envMapTex, uv).rgb;
-    float pdf = Luminance(color) / envMapTotalSum;
 
     uv.x -= envMapRot;
     float phi = uv.x * TWO_PI;
     float theta = uv.y * PI;
+    float sinTheta = sin(theta);
 
-    if (sin(theta) == 0.0)
+    if (sinTheta == 0.0)
         pdf = 0.0;
 
-    return vec4(-sin(theta) * cos(phi), cos(theta), -sin(theta) * sin(phi), (pdf * envMapRes.x * envMapRes.y) / (TWO_PI * PI * sin(theta)));
+    return vec4(-sinTheta * cos(phi), cos(theta), -sinTheta * sin(phi), sinTheta > 0.0 ? pdf / (TWO_PI * PI * sinTheta) : 0.0);
 }
 
 #endif
-#endif
\ No newline at end of file
+#endif
@@ -136,13 +136,28 @@ struct State
     vec3 bitangent;
 
     bool isEmitter;
+    int emitterIndex; // Light sampler index of a hit light or emissive triangle, -1 otherwise
 
     vec2 texCoord;
     int matID;
     Material mat;
     Medium medium;
+
+    // Ray cone used for texture LOD selection
+    float coneWidth;
+    float coneSpread;
+    float texLod;
 };
 
+// Eye paths start the cone with the pixel spread angle. A spread of 0 (light subpaths, shadow rays) keeps
+// the cone closed so those paths always sample the base level
+void InitRayCone(inout State state, float spread)
+{
+    state.coneWidth = 0.0;
+    state.coneSpread = spread;
+    state.texLod = 0.0;
+}
+
 struct ScatterSampleRec
 {
     vec3 L;
@@ -185,13 +200,122 @@ void pcg4d(inout uvec4 v)
     v = v ^ (v >> 16u);
     v.x += v.y * v.w; v.y += v.z * v.x; v.z += v.x * v.y; v.w += v.y * v.z;
 }
+
+// Sample dimensions. The camera and the light subpath of BDPT come first, then every bounce of the eye path
+// owns a block. rand() draws the dimensions of the current block in order and falls back to the
+// independent RNG above once the block is used up
+#define DIM_CAMERA 0 // Pixel jitter and lens
+#define DIM_LIGHT_PATH 4
+#define DIM_LIGHT_PATH_COUNT 16
+#define DIM_BOUNCE 20
+#define DIM_BOUNCE_SIZE 32
+#define DIM_BSDF 0   // Lobe and direction, 4
+#define DIM_LIGHT 4  // Environment map, light and position on the light of next event estimation, 12
+#define DIM_RR 16    // 4
+#define DIM_HRRVC 20 // Upper levels of the light vertex traversal, 8
+#define DIM_GUIDE 28 // Strategy and direction of path guiding, 4
+#define BOUNCE_DIM(bounce, offset) (DIM_BOUNCE + (bounce) * DIM_BOUNCE_SIZE + (offset))
+
+int sampleDim = 0;
+int sampleDimEnd = 0;
+
+void BeginSampleDimensions(int first, int count)
+{
+    sampleDim = first;
+    sampleDimEnd = first + count;
+}
+
+#ifdef OPT_SOBOL
+// Owen scrambled Sobol points (Burley 2020, Practical Hash-based Owen Scrambling). sobolDirectionsTex holds
+// the first SOBOL_DIMENSIONS dimensions, higher ones reuse them with independently shuffled sample indices
+#define SOBOL_DIMENSIONS 4
+
+uint sobolSeed;
+int sobolIndex;
+ivec2 sobolPixel;
+
+uint HashUint(uint x)
+{
+    x ^= x >> 16u;
+    x *= 0x7feb352du;
+    x ^= x >> 15u;
+    x *= 0x846ca68bu;
+    x ^= x >> 16u;
+    return x;
+}
+
+uint ReverseBits(uint x)
+{
+    x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+    x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+    x = ((x >> 4u) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4u);
+    x = ((x >> 8u) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8u);
+    return (x >> 16u) | (x << 16u);
+}
+
+// Every bit is flipped depending on the bits above it (Laine-Karras hash on the reversed bits)
+uint NestedUniformScramble(uint x, uint seed)
+{
+    x = ReverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return ReverseBits(x);
+}
+
+void InitSampler(ivec2 imagePixel, int index)
+{
+    sobolIndex = index;
+    sobolPixel = imagePixel;
+#ifdef OPT_BLUE_NOISE
+    // All pixels share one sequence and only differ by the blue noise shift
+    sobolSeed = 0x9e3779b9u;
+#else
+    sobolSeed = HashUint(uint(imagePixel.x) ^ HashUint(uint(imagePixel.y)));
+#endif
+}
+
+uint SobolSample(int dim)
+{
+    int component = dim % SOBOL_DIMENSIONS;
+    uint groupSeed = HashUint(sobolSeed ^ HashUint(uint(dim / SOBOL_DIMENSIONS)));
+
+    uint index = NestedUniformScramble(uint(sobolIndex), groupSeed);
+    uint x = 0u;
+    for (int bit = 0; index != 0u; bit++, index >>= 1u)
+    {
+        if ((index & 1u) != 0u)
+            x ^= texelFetch(sobolDirectionsTex, ivec2(bit, component), 0).r;
+    }
+    x = NestedUniformScramble(x, HashUint(groupSeed + uint(component)));
+
+#ifdef OPT_BLUE_NOISE
+    // Toroidal shift by the blue noise mask, offset by the R2 sequence for every dimension
+    ivec2 maskSize = textureSize(blueNoiseTex, 0);
+    ivec2 offset = ivec2(fract(float(dim) * vec2(0.7548776662, 0.5698402910)) * vec2(maskSize));
+    x += uint(texelFetch(blueNoiseTex, (sobolPixel + offset) % maskSize, 0).r * 4294967296.0);
+#endif
+    return x;
+}
+#endif
+
 /*rand 函数在全局种子向量上调用 pcg4d 并返回一个介于 0 和 1 之间的随机值，方法是将种子的 x 分量除以无符号 32 位整数的最大值。*/
 float rand()
 {
+#ifdef OPT_SOBOL
+    if (sampleDim < sampleDimEnd)
+        return float(SobolSample(sampleDim++) >> 8u) / 16777216.0;
+#endif
     pcg4d(seed); return float(seed.x) / float(0xffffffffu);
 }
 
 uint randint(){
+#ifdef OPT_SOBOL
+    if (sampleDim < sampleDimEnd)
+        return SobolSample(sampleDim++);
+#endif
     pcg4d(seed); return seed.x;
 }
 /*
@@ -0,0 +1,212 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+// Path guiding with the SD-tree learned by PathGuide. Directions are mapped to the square of cylindrical
+// coordinates (cos theta, phi), which keeps areas, so the quadtrees are piecewise constant over solid angle
+
+#ifdef OPT_PATH_GUIDING
+
+#define GUIDE_MAX_DEPTH 20
+
+// First bounce of the eye path, recorded for training
+vec3 guideRecordPos;
+vec3 guideRecordDir;
+vec3 guideRecordF;
+float guideRecordPdf = 0.0;
+vec3 guideRecordBase;
+float guideRecordValue = 0.0;
+
+vec2 GuideDirToSquare(vec3 dir)
+{
+    float phi = atan(dir.y, dir.x);
+    if (phi < 0.0)
+        phi += TWO_PI;
+    return min(vec2((clamp(dir.z, -1.0, 1.0) + 1.0) * 0.5, phi * INV_TWO_PI), vec2(ONE_MINUS_EPS));
+}
+
+vec3 GuideSquareToDir(vec2 p)
+{
+    float cosTheta = 2.0 * p.x - 1.0;
+    float sinTheta = sqrt(max(1.0 - cosTheta * cosTheta, 0.0));
+    float phi = TWO_PI * p.y;
+    return vec3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+}
+
+// Quadtree learned around p, -1 where nothing was learned yet or the material is too specular to profit
+int GuideQuadtree(in State state)
+{
+    if (state.mat.specTrans > 0.5 || (state.mat.metallic > 0.5 && state.mat.roughness < 0.1))
+        return -1;
+
+    vec3 p = clamp((state.fhp - guideBoundsMin) / guideBoundsSize, 0.0, 1.0);
+    int node = 0;
+    while (true)
+    {
+        vec4 texel = texelFetch(guideTreeTex, node);
+        int axis = int(texel.x);
+        if (axis < 0)
+            return int(texel.y);
+
+        float c = p[axis] * 2.0;
+        bool second = c >= 1.0;
+        p[axis] = second ? c - 1.0 : c;
+        node = int(texel.y) + (second ? 1 : 0);
+    }
+}
+
+float GuidePdf(int root, vec3 dir)
+{
+    vec2 p = GuideDirToSquare(dir);
+    float pdf = INV_4_PI;
+    int node = root;
+    for (int depth = 0; depth < GUIDE_MAX_DEPTH; depth++)
+    {
+        vec4 sums = texelFetch(guideTreeTex, node);
+        float total = sums.x + sums.y + sums.z + sums.w;
+        ivec2 quadrant = ivec2(greaterThanEqual(p, vec2(0.5)));
+        int q = quadrant.x + 2 * quadrant.y;
+        // Nothing was recorded in this quadrant, this also keeps an empty node from dividing by zero
+        if (sums[q] <= 0.0)
+            return 0.0;
+        pdf *= 4.0 * sums[q] / total;
+
+        int child = int(texelFetch(guideTreeTex, node + 1)[q]);
+        if (child < 0)
+            break;
+        p = p * 2.0 - vec2(quadrant);
+        node = child;
+    }
+    return pdf;
+}
+
+// Warps u through the quadtree, first along cos theta and then along phi within the chosen half
+vec3 GuideSample(int root, vec2 u, out float pdf)
+{
+    vec2 origin = vec2(0.0);
+    float size = 1.0;
+    pdf = INV_4_PI;
+    int node = root;
+    for (int depth = 0; depth < GUIDE_MAX_DEPTH; depth++)
+    {
+        vec4 sums = texelFetch(guideTreeTex, node);
+        float total = sums.x + sums.y + sums.z + sums.w;
+
+        ivec2 quadrant;
+        float low = (sums.x + sums.z) / total;
+        if (u.x < low)
+        {
+            quadrant.x = 0;
+            u.x /= low;
+        }
+        else
+        {
+            quadrant.x = 1;
+            u.x = (u.x - low) / (1.0 - low);
+        }
+
+        float bottom = quadrant.x == 0 ? sums.x / (sums.x + sums.z) : sums.y / (sums.y + sums.w);
+        if (u.y < bottom)
+        {
+            quadrant.y = 0;
+            u.y /= bottom;
+        }
+        else
+        {
+            quadrant.y = 1;
+            u.y = (u.y - bottom) / (1.0 - bottom);
+        }
+        u = min(u, vec2(ONE_MINUS_EPS));
+
+        int q = quadrant.x + 2 * quadrant.y;
+        pdf *= 4.0 * sums[q] / total;
+        size *= 0.5;
+        origin += vec2(quadrant) * size;
+
+        int child = int(texelFetch(guideTreeTex, node + 1)[q]);
+        if (child < 0)
+            break;
+        node = child;
+    }
+    return GuideSquareToDir(origin + u * size);
+}
+
+// One-sample MIS of BSDF sampling and the learned incident radiance, u picks the strategy and the guided
+// direction. The pdf is the one of the mixture
+vec3 GuidedSample(in State state, vec3 V, vec3 N, vec3 u, out vec3 L, out float pdf)
+{
+    int root = GuideQuadtree(state);
+    if (root < 0)
+        return DisneySample(state, V, N, L, pdf);
+
+    vec3 f;
+    float bsdfPdf, guidePdf;
+    if (u.x < guideBsdfFraction)
+    {
+        f = DisneySample(state, V, N, L, bsdfPdf);
+        if (bsdfPdf <= 0.0)
+        {
+            pdf = 0.0;
+            return f;
+        }
+        guidePdf = GuidePdf(root, L);
+    }
+    else
+    {
+        L = GuideSample(root, u.yz, guidePdf);
+        f = DisneyEval(state, V, N, L, bsdfPdf);
+    }
+
+    pdf = mix(guidePdf, bsdfPdf, guideBsdfFraction);
+    return f;
+}
+
+// Mixture pdf of a direction sampled otherwise, for the MIS weights of next event estimation
+float GuidedPdf(in State state, vec3 L, float bsdfPdf)
+{
+    int root = GuideQuadtree(state);
+    if (root < 0)
+        return bsdfPdf;
+    return mix(GuidePdf(root, L), bsdfPdf, guideBsdfFraction);
+}
+
+// The radiance gathered after the first bounce divided by its throughput is the incident radiance
+void GuideBeginRecord(vec3 position, vec3 direction, vec3 f, float pdf, vec3 radiance)
+{
+    guideRecordPos = position;
+    guideRecordDir = direction;
+    guideRecordF = f;
+    guideRecordPdf = pdf;
+    guideRecordBase = radiance;
+}
+
+void GuideEndRecord(vec3 radiance)
+{
+    if (guideRecordPdf <= 0.0)
+        return;
+    vec3 incident = (radiance - guideRecordBase) * guideRecordPdf / max(guideRecordF, vec3(1e-7));
+    guideRecordValue = Luminance(incident) / guideRecordPdf;
+}
+
+#endif
@@ -0,0 +1,303 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+// Light selection with the structures built by LightSampler. Every routine takes its random number
+// explicitly so the seeded light path construction can use it as well.
+// Emitters are the analytic lights followed by the emissive triangles
+
+#define ONE_MINUS_EPS 0.99999994
+
+int NumEmitters()
+{
+    return numOfLights + numEmissiveTriangles;
+}
+
+int SampleLightByPower(float u, out float pmf)
+{
+#if defined(OPT_LIGHT_ALIAS) || defined(OPT_LIGHT_BVH)
+    float scaled = u * float(NumEmitters());
+    int index = min(int(scaled), NumEmitters() - 1);
+    vec4 entry = texelFetch(lightAliasTex, index);
+    if (scaled - float(index) >= entry.x)
+        index = int(entry.y);
+
+    pmf = texelFetch(lightAliasTex, index).z;
+    return index;
+#else
+    pmf = 1.0 / float(NumEmitters());
+    return min(int(u * float(NumEmitters())), NumEmitters() - 1);
+#endif
+}
+
+// Probability of SampleLightByPower picking the light
+float LightPowerPmf(int lightIndex)
+{
+#if defined(OPT_LIGHT_ALIAS) || defined(OPT_LIGHT_BVH)
+    return texelFetch(lightAliasTex, lightIndex).z;
+#else
+    return 1.0 / float(NumEmitters());
+#endif
+}
+
+#ifdef OPT_LIGHT_BVH
+
+// https://pbr-book.org/4ed/Light_Sources/Light_Sampling#BVHLightSampling
+// Conservative estimate of the power a light bvh node delivers to p. The receiver normal is left out so the
+// same value can be recomputed from the previous path vertex when an emitter is hit
+float LightBoundsImportance(vec3 p, int node)
+{
+    vec4 t0 = texelFetch(lightBvhTex, node * 4 + 0);
+    vec4 t1 = texelFetch(lightBvhTex, node * 4 + 1);
+    vec4 t2 = texelFetch(lightBvhTex, node * 4 + 2);
+    bool twoSided = texelFetch(lightBvhTex, node * 4 + 3).z > 0.0;
+
+    vec3 pmin = t0.xyz;
+    vec3 pmax = t1.xyz;
+    float phi = t0.w;
+    float cosThetaO = t1.w;
+    vec3 w = t2.xyz;
+    float cosThetaE = t2.w;
+
+    vec3 pc = (pmin + pmax) * 0.5;
+    float dist2 = dot(p - pc, p - pc);
+    float d2 = max(dist2, length(pmax - pmin) * 0.5);
+
+    // Angle between the cone axis and the direction to p
+    vec3 wi = normalize(p - pc);
+    float cosThetaW = dot(w, wi);
+    if (twoSided)
+        cosThetaW = abs(cosThetaW);
+    float sinThetaW = sqrt(max(0.0, 1.0 - cosThetaW * cosThetaW));
+
+    // Angle subtended by the bounding sphere of the node
+    float radius2 = dot(pmax - pc, pmax - pc);
+    float cosThetaB = dist2 < radius2 ? -1.0 : sqrt(max(0.0, 1.0 - radius2 / dist2));
+    float sinThetaB = sqrt(max(0.0, 1.0 - cosThetaB * cosThetaB));
+    float sinThetaO = sqrt(max(0.0, 1.0 - cosThetaO * cosThetaO));
+
+    // cos(max(0, thetaW - thetaO - thetaB))
+    float cosThetaX = cosThetaW > cosThetaO ? 1.0 : cosThetaW * cosThetaO + sinThetaW * sinThetaO;
+    float sinThetaX = cosThetaW > cosThetaO ? 0.0 : sinThetaW * cosThetaO - cosThetaW * sinThetaO;
+    float cosThetaP = cosThetaX > cosThetaB ? 1.0 : cosThetaX * cosThetaB + sinThetaX * sinThetaB;
+
+    if (cosThetaP <= cosThetaE)
+        return 0.0;
+
+    return phi * cosThetaP / d2;
+}
+
+// Descends the light bvh choosing children proportionally to their importance
+int SampleLightBVH(vec3 p, float u, out float pmf)
+{
+    int node = 0;
+    pmf = 1.0;
+
+    vec4 info = texelFetch(lightBvhTex, 3);
+    if (info.y > 0.0)
+    {
+        if (LightBoundsImportance(p, 0) > 0.0)
+            return int(info.x);
+        pmf = 0.0;
+        return -1;
+    }
+
+    for (int depth = 0; depth < 32; depth++)
+    {
+        info = texelFetch(lightBvhTex, node * 4 + 3);
+        if (info.y > 0.0)
+            return int(info.x);
+
+        int child0 = node + 1;
+        int child1 = int(info.x);
+        float ci0 = LightBoundsImportance(p, child0);
+        float ci1 = LightBoundsImportance(p, child1);
+
+        if (ci0 == 0.0 && ci1 == 0.0)
+            break;
+
+        float p0 = ci0 / (ci0 + ci1);
+        if (u < p0)
+        {
+            node = child0;
+            u = min(u / p0, ONE_MINUS_EPS);
+            pmf *= p0;
+        }
+        else
+        {
+            node = child1;
+            u = min((u - p0) / (1.0 - p0), ONE_MINUS_EPS);
+            pmf *= 1.0 - p0;
+        }
+    }
+
+    pmf = 0.0;
+    return -1;
+}
+
+// Probability of SampleLightBVH returning the light. Follows the bit trail of the light from the root
+float LightBVHPmf(vec3 p, int lightIndex)
+{
+    uint trail = uint(texelFetch(lightAliasTex, lightIndex).w);
+    int node = 0;
+    float pmf = 1.0;
+
+    for (int depth = 0; depth < 32; depth++)
+    {
+        vec4 info = texelFetch(lightBvhTex, node * 4 + 3);
+        if (info.y > 0.0)
+            return pmf;
+
+        int child0 = node + 1;
+        int child1 = int(info.x);
+        float ci0 = LightBoundsImportance(p, child0);
+        float ci1 = LightBoundsImportance(p, child1);
+
+        if (ci0 == 0.0 && ci1 == 0.0)
+            return 0.0;
+
+        if ((trail & 1u) != 0u)
+        {
+            pmf *= ci1 / (ci0 + ci1);
+            node = child1;
+        }
+        else
+        {
+            pmf *= ci0 / (ci0 + ci1);
+            node = child0;
+        }
+        trail >>= 1;
+    }
+
+    return 0.0;
+}
+
+// Distant lights sit at the end of the analytic lights and are picked uniformly with a probability
+// of one share next to the bvh
+float InfiniteLightProb()
+{
+    int numBounded = NumEmitters() - numInfiniteLights;
+    return float(numInfiniteLights) / float(numInfiniteLights + (numBounded > 0 ? 1 : 0));
+}
+
+#endif
+
+// Picks a light for next event estimation at p. Returns -1 if no light can contribute
+int SampleLightIndex(vec3 p, float u, out float pmf)
+{
+#ifdef OPT_LIGHT_BVH
+    float pInfinite = InfiniteLightProb();
+
+    if (u < pInfinite)
+    {
+        pmf = pInfinite / float(numInfiniteLights);
+        return numOfLights - numInfiniteLights + min(int(u / pInfinite * float(numInfiniteLights)), numInfiniteLights - 1);
+    }
+
+    u = min((u - pInfinite) / (1.0 - pInfinite), ONE_MINUS_EPS);
+    int index = SampleLightBVH(p, u, pmf);
+    pmf *= 1.0 - pInfinite;
+    return index;
+#else
+    return SampleLightByPower(u, pmf);
+#endif
+}
+
+// Probability of SampleLightIndex picking the light from p
+float LightPmf(vec3 p, int lightIndex)
+{
+#ifdef OPT_LIGHT_BVH
+    float pInfinite = InfiniteLightProb();
+    if (lightIndex >= numOfLights - numInfiniteLights && lightIndex < numOfLights)
+        return pInfinite / float(numInfiniteLights);
+
+    return (1.0 - pInfinite) * LightBVHPmf(p, lightIndex);
+#elif defined(OPT_LIGHT_ALIAS)
+    return texelFetch(lightAliasTex, lightIndex).z;
+#else
+    return 1.0 / float(NumEmitters());
+#endif
+}
+
+#ifdef OPT_EMISSIVE_TRIANGLES
+
+// Emission of a material at uv, matching GetMaterial
+vec3 EmissiveTriangleRadiance(int matID, vec2 uv)
+{
+    vec3 emission = texelFetch(materialsTex, ivec2(matID * 8 + 1, 0), 0).rgb;
+    int emissionTexID = int(texelFetch(materialsTex, ivec2(matID * 8 + 6, 0), 0).w);
+    if (emissionTexID >= 0)
+        emission = pow(textureLod(textureMapsArrayTex, vec3(uv, emissionTexID), 0.0).rgb, vec3(2.2));
+
+    return emission;
+}
+
+// Picks a point uniformly over the area of the triangle. Emission is two sided so the normal is
+// returned facing scatterPos
+float SampleEmissiveTriangle(int tri, vec3 scatterPos, float r1, float r2, inout LightSampleRec lightSample)
+{
+    vec4 t0 = texelFetch(emissiveTrianglesTex, tri * 4 + 0);
+    vec4 t1 = texelFetch(emissiveTrianglesTex, tri * 4 + 1);
+    vec4 t2 = texelFetch(emissiveTrianglesTex, tri * 4 + 2);
+    vec4 t3 = texelFetch(emissiveTrianglesTex, tri * 4 + 3);
+
+    float su = sqrt(r1);
+    vec3 bary = vec3(1.0 - su, r2 * su, 0.0);
+    bary.z = 1.0 - bary.x - bary.y;
+
+    vec3 lightSurfacePos = t0.xyz * bary.x + t1.xyz * bary.y + t2.xyz * bary.z;
+    vec2 uv = vec2(t0.w, t1.w) * bary.x + vec2(t2.w, t3.x) * bary.y + t3.yz * bary.z;
+
+    vec3 n = cross(t1.xyz - t0.xyz, t2.xyz - t0.xyz);
+    float area = 0.5 * length(n);
+    n = normalize(n);
+
+    lightSample.direction = lightSurfacePos - scatterPos;
+    lightSample.dist = length(lightSample.direction);
+    float distSq = lightSample.dist * lightSample.dist;
+    lightSample.direction /= lightSample.dist;
+    lightSample.normal = dot(n, lightSample.direction) > 0.0 ? -n : n;
+    lightSample.emission = EmissiveTriangleRadiance(int(t3.w), uv);
+    lightSample.pdf = distSq / (area * abs(dot(n, lightSample.direction)));
+
+    return area;
+}
+
+// Solid angle pdf of SampleEmissiveTriangle for a ray from origin hitting the triangle at hitPos
+float EmissiveTrianglePdf(int tri, vec3 origin, vec3 hitPos)
+{
+    vec3 p0 = texelFetch(emissiveTrianglesTex, tri * 4 + 0).xyz;
+    vec3 p1 = texelFetch(emissiveTrianglesTex, tri * 4 + 1).xyz;
+    vec3 p2 = texelFetch(emissiveTrianglesTex, tri * 4 + 2).xyz;
+
+    vec3 n = cross(p1 - p0, p2 - p0);
+    float area = 0.5 * length(n);
+    vec3 dir = hitPos - origin;
+    float distSq = dot(dir, dir);
+    float cosTheta = abs(dot(normalize(n), dir)) / sqrt(distSq);
+
+    return distSq / (area * cosTheta);
+}
+
+#endif
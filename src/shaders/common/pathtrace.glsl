@@ -72,10 +72,21 @@ void GetMaterial(inout State state, in Ray r)
     mat.alphaMode          = int(param8.y);
     mat.alphaCutoff        = param8.z;
 
+    // Texture LOD from the ray cone footprint at the hit point
+    float lod = 0.0;
+#ifdef OPT_TEXTURE_LOD
+    if (state.coneWidth > 0.0)
+    {
+        vec2 texSize = vec2(textureSize(textureMapsArrayTex, 0).xy);
+        float cosTheta = max(abs(dot(r.direction, state.normal)), 0.01);
+        lod = max(state.texLod + 0.5 * log2(texSize.x * texSize.y) + log2(state.coneWidth / cosTheta), 0.0);
+    }
+#endif
+
     // Base Color Map
     if (texIDs.x >= 0)
     {
-        vec4 col = texture(textureMapsArrayTex, vec3(state.texCoord, texIDs.x));
+        vec4 col = textureLod(textureMapsArrayTex, vec3(state.texCoord, texIDs.x), lod);
         mat.baseColor.rgb *= pow(col.rgb, vec3(2.2));
         mat.opacity *= col.a;
     }
@@ -83,7 +94,7 @@ void GetMaterial(inout State state, in Ray r)
     // Metallic Roughness Map
     if (texIDs.y >= 0)
     {
-        vec2 matRgh = texture(textureMapsArrayTex, vec3(state.texCoord, texIDs.y)).bg;
+        vec2 matRgh = textureLod(textureMapsArrayTex, vec3(state.texCoord, texIDs.y), lod).bg;
         mat.metallic = matRgh.x;
         mat.roughness = max(matRgh.y * matRgh.y, 0.001);
     }
@@ -91,12 +102,22 @@ void GetMaterial(inout State state, in Ray r)
     // Normal Map
     if (texIDs.z >= 0)
     {
-        vec3 texNormal = texture(textureMapsArrayTex, vec3(state.texCoord, texIDs.z)).rgb;
+#ifdef OPT_COMPRESSED_TEXTURES
+        // BC5 normal maps only store xy
+        vec3 texNormal = vec3(textureLod(normalMapsArrayTex, vec3(state.texCoord, texIDs.z), lod).rg, 1.0);
+#else
+        vec3 texNormal = textureLod(textureMapsArrayTex, vec3(state.texCoord, texIDs.z), lod).rgb;
+#endif
 
 #ifdef OPT_OPENGL_NORMALMAP
         texNormal.y = 1.0 - texNormal.y;
 #endif
+#ifdef OPT_COMPRESSED_TEXTURES
+        texNormal.xy = texNormal.xy * 2.0 - 1.0;
+        texNormal.z = sqrt(max(1.0 - dot(texNormal.xy, texNormal.xy), 0.0));
+#else
         texNormal = normalize(texNormal * 2.0 - 1.0);
+#endif
 
         vec3 origNormal = state.normal;
         state.normal = normalize(state.tangent * texNormal.x + state.bitangent * texNormal.y + state.normal * texNormal.z);
@@ -110,12 +131,18 @@ void GetMaterial(inout State state, in Ray r)
 
     // Emission Map
     if (texIDs.w >= 0)
-        mat.emission = pow(texture(textureMapsArrayTex, vec3(state.texCoord, texIDs.w)).rgb, vec3(2.2));
+        mat.emission = pow(textureLod(textureMapsArrayTex, vec3(state.texCoord, texIDs.w), lod).rgb, vec3(2.2));
 
     float aspect = sqrt(1.0 - mat.anisotropic * 0.9);
     mat.ax = max(0.001, mat.roughness / aspect);
     mat.ay = max(0.001, mat.roughness * aspect);
 
+#ifdef OPT_TEXTURE_LOD
+    // Widen the cone for the next bounce by roughly the width of the specular lobe, eye paths only
+    if (state.coneSpread > 0.0)
+        state.coneSpread += 2.0 * max(mat.ax, mat.ay);
+#endif
+
     state.mat = mat;
     state.eta = dot(r.direction, state.normal) < 0.0 ? (1.0 / mat.ior) : mat.ior;
 }
@@ -134,6 +161,7 @@ vec3 EvalTransmittance(Ray r)
     */
     LightSampleRec lightSample;
     State state;
+    InitRayCone(state, 0.0);
     vec3 transmittance = vec3(1.0);
     /*
         然后该函数进入一个循环，该循环将一直持续到光线达到其最大深度或与发射器（即光源）相交为止。
@@ -225,7 +253,12 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
         Li *= EvalTransmittance(shadowRay);
 
         if (isSurface)
+        {
             scatterSample.f = DisneyEval(state, -r.direction, state.ffnormal, lightDir, scatterSample.pdf);
+#ifdef OPT_PATH_GUIDING
+            scatterSample.pdf = GuidedPdf(state, lightDir, scatterSample.pdf);
+#endif
+        }
         else
         {
             float p = PhaseHG(dot(-r.direction, lightDir), state.medium.anisotropy);
@@ -249,6 +282,9 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
         if (!inShadow)
         {
             scatterSample.f = DisneyEval(state, -r.direction, state.ffnormal, lightDir, scatterSample.pdf);
+#ifdef OPT_PATH_GUIDING
+            scatterSample.pdf = GuidedPdf(state, lightDir, scatterSample.pdf);
+#endif
 
             if (scatterSample.pdf > 0.0)
             {
@@ -280,8 +316,10 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
         LightSampleRec lightSample;
         Light light;
 
-        //Pick a light to sample
-        int index = int(rand() * float(numOfLights)) * 5;
+        // Pick a light to sample, lights that contribute more to scatterPos are picked more often
+        float lightPmf;
+        int lightIndex = SampleLightIndex(scatterPos, rand(), lightPmf);
+        int index = lightIndex < numOfLights ? max(lightIndex, 0) * 5 : 0;
 
         // Fetch light Data
         vec3 position = texelFetch(lightsTex, ivec2(index + 0, 0), 0).xyz;
@@ -294,10 +332,16 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
         float type    = params.z; // 0->Rect, 1->Sphere, 2->Distant
 
         light = Light(position, emission, u, v, radius, area, type);
-        SampleOneLight(light, scatterPos, lightSample);// sc: smaple the light and get the lightSample
+#ifdef OPT_EMISSIVE_TRIANGLES
+        if (lightIndex >= numOfLights)
+            light.area = SampleEmissiveTriangle(lightIndex - numOfLights, scatterPos, rand(), rand(), lightSample);
+        else
+#endif
+            SampleOneLight(light, scatterPos, lightSample);// sc: smaple the light and get the lightSample
+        lightSample.pdf *= lightPmf;
         Li = lightSample.emission;
 
-        if (dot(lightSample.direction, lightSample.normal) < 0.0) // Required for quad lights with single sided emission
+        if (lightIndex >= 0 && dot(lightSample.direction, lightSample.normal) < 0.0) // Required for quad lights with single sided emission
         {
             Ray shadowRay = Ray(scatterPos, lightSample.direction);
 
@@ -312,7 +356,12 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
             Li *= EvalTransmittance(shadowRay);
 
             if (isSurface)
+            {
                 scatterSample.f = DisneyEval(state, -r.direction, state.ffnormal, lightSample.direction, scatterSample.pdf);
+#ifdef OPT_PATH_GUIDING
+                scatterSample.pdf = GuidedPdf(state, lightSample.direction, scatterSample.pdf);
+#endif
+            }
             else
             {
                 float p = PhaseHG(dot(-r.direction, lightSample.direction), state.medium.anisotropy);
@@ -335,6 +384,9 @@ vec3 DirectLight(in Ray r, in State state, bool isSurface)
             {
                 
                 scatterSample.f = DisneyEval(state, -r.direction, state.ffnormal, lightSample.direction, scatterSample.pdf);
+#ifdef OPT_PATH_GUIDING
+                scatterSample.pdf = GuidedPdf(state, lightSample.direction, scatterSample.pdf);
+#endif
                 
                 // 这里针对平行光，平行光不需要mis
                 float misWeight = 1.0;
@@ -367,6 +419,7 @@ vec4 PathTrace(Ray r)
     vec3 radiance = vec3(0.0);
     vec3 throughput = vec3(1.0);
     State state;
+    InitRayCone(state, pixelSpreadAngle);
     LightSampleRec lightSample;
     ScatterSampleRec scatterSample;
 
@@ -433,8 +486,22 @@ vec4 PathTrace(Ray r)
         */
         GetMaterial(state, r);
 
-        // Gather radiance from emissive objects. Emission from meshes is not importance sampled
-        radiance += state.mat.emission * throughput;// sc: if the mesh emissive, then add the emission to the radiance
+        // Gather radiance from emissive objects. Emissive triangles are also sampled in DirectLight, so
+        // use scatterSample.pdf from the previous bounce for MIS
+        float emissionMisWeight = 1.0;
+#ifdef OPT_EMISSIVE_TRIANGLES
+        if (state.depth > 0 && state.emitterIndex >= numOfLights)
+        {
+            float lightPdf = EmissiveTrianglePdf(state.emitterIndex - numOfLights, r.origin, state.fhp) * LightPmf(r.origin, state.emitterIndex);
+            emissionMisWeight = PowerHeuristic(scatterSample.pdf, lightPdf);
+
+    #if defined(OPT_MEDIUM) && !defined(OPT_VOL_MIS)
+            if(!surfaceScatter)
+                emissionMisWeight = 1.0f;
+    #endif
+        }
+#endif
+        radiance += emissionMisWeight * state.mat.emission * throughput;// sc: if the mesh emissive, then add the emission to the radiance
         
 #ifdef OPT_LIGHTS
         // sc: this is the hitted light part
@@ -550,7 +617,12 @@ vec4 PathTrace(Ray r)
                 radiance += DirectLight(r, state, true) * throughput;
 
                 // Sample BSDF for color and outgoing direction
+#ifdef OPT_PATH_GUIDING
+                vec3 guideRand = vec3(rand(), rand(), rand());
+                scatterSample.f = GuidedSample(state, -r.direction, state.ffnormal, guideRand, scatterSample.L, scatterSample.pdf);
+#else
                 scatterSample.f = DisneySample(state, -r.direction, state.ffnormal, scatterSample.L, scatterSample.pdf);
+#endif
                 if (scatterSample.pdf > 0.0)
                     throughput *= scatterSample.f / scatterSample.pdf;
                 else
@@ -597,3 +669,24 @@ vec4 PathTrace(Ray r)
 /*该函数返回一个包含最终辐射值和 alpha 值的 vec4 对象。*/
     return vec4(radiance, alpha);
 }
+
+#ifdef OPT_DENOISER_AOVS
+// First hit albedo and world space normal that guide the denoiser. Lights and the background count as white
+void FirstHitAOVs(Ray r, out vec3 albedo, out vec3 normal)
+{
+    State state;
+    InitRayCone(state, pixelSpreadAngle);
+    LightSampleRec lightSample;
+    state.depth = 0;
+
+    albedo = vec3(1.0);
+    normal = -r.direction;
+
+    if (!ClosestHit(r, state, lightSample) || state.isEmitter)
+        return;
+
+    GetMaterial(state, r);
+    albedo = any(greaterThan(state.mat.emission, vec3(0.0))) ? vec3(1.0) : state.mat.baseColor;
+    normal = state.ffnormal;
+}
+#endif
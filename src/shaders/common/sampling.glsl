@@ -209,7 +209,7 @@ void SampleSphereLight(in Light light, in vec3 scatterPos, inout LightSampleRec
 
     lightSample.direction /= lightSample.dist;
     lightSample.normal = normalize(lightSurfacePos - light.position);
-    lightSample.emission = light.emission * float(numOfLights);
+    lightSample.emission = light.emission;
     lightSample.pdf = distSq / (light.area * 0.5 * abs(dot(lightSample.normal, lightSample.direction)));
 }
 
@@ -224,7 +224,7 @@ void SampleRectLight(in Light light, in vec3 scatterPos, inout LightSampleRec li
     float distSq = lightSample.dist * lightSample.dist;
     lightSample.direction /= lightSample.dist;
     lightSample.normal = normalize(cross(light.u, light.v));
-    lightSample.emission = light.emission * float(numOfLights);
+    lightSample.emission = light.emission;
     lightSample.pdf = distSq / (light.area * abs(dot(lightSample.normal, lightSample.direction)));
 }
 
@@ -232,7 +232,7 @@ void SampleDistantLight(in Light light, in vec3 scatterPos, inout LightSampleRec
 {
     lightSample.direction = normalize(light.position - vec3(0.0));
     lightSample.normal = normalize(scatterPos - light.position);
-    lightSample.emission = light.emission * float(numOfLights);
+    lightSample.emission = light.emission;
     lightSample.dist = INF;
     lightSample.pdf = 1.0;
 }
@@ -29,7 +29,16 @@ uniform vec2 tileOffset;
 uniform vec2 invNumTiles;
 
 uniform sampler2D accumTexture;
+#if defined(OPT_PACKED_BVH) || defined(OPT_COMPRESSED_BVH)
+uniform isamplerBuffer BVH;
+uniform isamplerBuffer instanceMaterialsTex;
+#else
 uniform samplerBuffer BVH;
+#endif
+#ifdef OPT_MATERIAL_TABLES
+uniform isamplerBuffer materialTablesTex;
+uniform isamplerBuffer triangleSlotsTex;
+#endif
 uniform isamplerBuffer vertexIndicesTex;
 uniform samplerBuffer verticesTex;
 uniform samplerBuffer normalsTex;
@@ -41,21 +50,46 @@ uniform samplerBuffer lightPathBVHIndexTex;
 uniform sampler2D materialsTex;
 uniform sampler2D transformsTex;
 uniform sampler2D lightsTex;
+uniform samplerBuffer lightAliasTex;
+uniform samplerBuffer lightBvhTex;
+uniform samplerBuffer emissiveTrianglesTex;
+uniform isamplerBuffer instanceEmittersTex;
 uniform sampler2DArray textureMapsArrayTex;
+uniform sampler2DArray normalMapsArrayTex;
 
 uniform sampler2D envMapTex;
-uniform sampler2D envMapCDFTex;
+uniform sampler2D envMapAliasTex;
+#ifdef OPT_SOBOL
+uniform usampler2D sobolDirectionsTex;
+uniform int sampleIndex;
+#endif
+#ifdef OPT_BLUE_NOISE
+uniform sampler2D blueNoiseTex;
+#endif
+#ifdef OPT_PATH_GUIDING
+uniform samplerBuffer guideTreeTex;
+uniform vec3 guideBoundsMin;
+uniform vec3 guideBoundsSize;
+uniform float guideBsdfFraction;
+#endif
+#ifdef OPT_VERTEX_MERGING
+uniform float vmRadius;
+uniform float vmEta; // pi * vmRadius^2 * number of light subpaths
+#endif
 
 uniform vec2 envMapRes;
-uniform float envMapTotalSum;
 uniform float envMapIntensity;
 uniform float envMapRot;
 uniform vec3 uniformLightCol;
 uniform int numOfLights;
+uniform int numInfiniteLights;
+uniform int numEmissiveTriangles;
 uniform int maxDepth;
 uniform int LIGHTPATHLENGTH;
+uniform int numLightPaths; // Light subpaths traced per generation, connections are averaged over them
 uniform int EYEPATHLENGTH;
 
 uniform int topBVHIndex;
 uniform int frameNum;
-uniform float roughnessMollificationAmt;
\ No newline at end of file
+uniform float roughnessMollificationAmt;
+uniform float pixelSpreadAngle;
\ No newline at end of file
@@ -0,0 +1,199 @@
+/*
+ * MIT License
+ *
+ * Copyright(c) 2019 Asif Ali
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+// Vertex connection and merging (Georgiev et al. 2012) for HRRVC. Subpath vertices carry the partial
+// MIS quantities dVCM, dVC and dVM in a vec3, so the weight of every strategy is found from the two
+// vertices it joins. There is no light tracing strategy, eye subpaths start with zero.
+// The light selection probability is the one of the light subpaths everywhere, next event estimation
+// picking lights differently only makes the weights less than optimal
+
+#ifdef OPT_VERTEX_MERGING
+
+// Area density of the light subpath origins on the light, sphere lights are sampled on one half
+float VcmLightPdfA(int lightIndex, float area, float type)
+{
+    return LightPowerPmf(lightIndex) * (type == SPHERE_LIGHT ? 2.0 : 1.0) / area;
+}
+
+// Origin and uniform hemisphere direction of a light subpath
+float VcmEmissionPdfW(int lightIndex, float area, float type)
+{
+    return VcmLightPdfA(lightIndex, area, type) * INV_TWO_PI;
+}
+
+vec3 VcmLightStart(float emissionPdfW, float directPdfA, float cosLight)
+{
+    float dVC = cosLight / emissionPdfW;
+    return vec3(directPdfA / emissionPdfW, dVC, dVC / vmEta);
+}
+
+// Subpath reached a vertex at distance dist from the previous one
+void VcmArrive(inout vec3 vcm, float dist, float cosIn)
+{
+    vcm.x *= dist * dist;
+    vcm /= max(cosIn, 1e-6);
+}
+
+// Subpath continues with a direction sampled with pdfW, pdfRevW is the density of the opposite direction
+void VcmScatter(inout vec3 vcm, float cosOut, float pdfW, float pdfRevW)
+{
+    float dVC = cosOut / pdfW * (vcm.y * pdfRevW + vcm.x + vmEta);
+    float dVM = cosOut / pdfW * (vcm.z * pdfRevW + vcm.x / vmEta + 1.0);
+    vcm = vec3(1.0 / pdfW, dVC, dVM);
+}
+
+// Eye subpath hitting an analytic light, weighted against next event estimation and the connections
+float VcmLightHitWeight(vec3 eyeVcm, int lightIndex, vec3 hitPos, vec3 rayDir, float dist)
+{
+    int index = lightIndex * 5;
+    vec3 position = texelFetch(lightsTex, ivec2(index + 0, 0), 0).xyz;
+    vec3 u        = texelFetch(lightsTex, ivec2(index + 2, 0), 0).xyz;
+    vec3 v        = texelFetch(lightsTex, ivec2(index + 3, 0), 0).xyz;
+    vec3 params   = texelFetch(lightsTex, ivec2(index + 4, 0), 0).xyz;
+
+    vec3 lightNormal = params.z == SPHERE_LIGHT ? normalize(hitPos - position) : normalize(cross(u, v));
+    float cosLight = abs(dot(lightNormal, rayDir));
+
+    vec3 vcm = eyeVcm;
+    VcmArrive(vcm, dist, cosLight);
+
+    float directPdfA = VcmLightPdfA(lightIndex, params.y, params.z);
+    float wCamera = directPdfA * vcm.x + directPdfA * INV_TWO_PI * vcm.y;
+    return 1.0 / (1.0 + wCamera);
+}
+
+// Connection of the eye vertex in state to a stored light vertex
+float VcmConnectWeight(in State state, vec3 V, vec3 eyeVcm, in LightPathNode node)
+{
+    vec3 toLight = node.position - state.fhp;
+    float dist2 = dot(toLight, toLight);
+    toLight /= sqrt(dist2);
+
+    float eyePdfW, eyeRevPdfW;
+    DisneyEval(state, V, state.ffnormal, toLight, eyePdfW);
+    DisneyEval(state, toLight, state.ffnormal, V, eyeRevPdfW);
+
+    State lightState;
+    lightState.mat = node.mat;
+    lightState.eta = node.eta;
+    float lightPdfW, lightRevPdfW;
+    DisneyEval(lightState, -node.direction, node.ffnormal, -toLight, lightPdfW);
+    DisneyEval(lightState, -toLight, node.ffnormal, -node.direction, lightRevPdfW);
+
+    float cosEye = abs(dot(state.ffnormal, toLight));
+    float cosLight = abs(dot(node.ffnormal, toLight));
+
+    float wLight = eyePdfW * cosLight / dist2 * (vmEta + node.vcm.x + node.vcm.y * lightRevPdfW);
+    float wCamera = lightPdfW * cosEye / dist2 * (vmEta + eyeVcm.x + eyeVcm.y * eyeRevPdfW);
+    return 1.0 / (wLight + 1.0 + wCamera);
+}
+
+// Merge of the eye vertex with a light vertex arriving from direction wi
+float VcmMergeWeight(vec3 eyeVcm, vec3 lightVcm, float eyePdfW, float eyeRevPdfW)
+{
+    float wLight = lightVcm.x / vmEta + lightVcm.z * eyePdfW;
+    float wCamera = eyeVcm.x / vmEta + eyeVcm.z * eyeRevPdfW;
+    return 1.0 / (wLight + 1.0 + wCamera);
+}
+
+// Next event estimation of HRRVC. The environment, distant lights and emissive triangles are not reached
+// by any other strategy and keep the full weight
+vec3 VcmDirectLight(in Ray r, in State state, vec3 eyeVcm)
+{
+    vec3 Ld = vec3(0.0);
+    vec3 scatterPos = state.fhp + state.normal * EPS;
+    vec3 V = -r.direction;
+
+#if defined(OPT_ENVMAP) && !defined(OPT_UNIFORM_LIGHT)
+    {
+        vec3 Li;
+        vec4 dirPdf = SampleEnvMap(Li);
+        if (!AnyHit(Ray(scatterPos, dirPdf.xyz), INF - EPS))
+        {
+            float bsdfPdfW;
+            vec3 f = DisneyEval(state, V, state.ffnormal, dirPdf.xyz, bsdfPdfW);
+            if (bsdfPdfW > 0.0)
+                Ld += Li * f * envMapIntensity / dirPdf.w;
+        }
+    }
+#endif
+
+#ifdef OPT_LIGHTS
+    {
+        LightSampleRec lightSample;
+
+        float lightPmf;
+        int lightIndex = SampleLightIndex(scatterPos, rand(), lightPmf);
+        int index = lightIndex < numOfLights ? max(lightIndex, 0) * 5 : 0;
+
+        vec3 position = texelFetch(lightsTex, ivec2(index + 0, 0), 0).xyz;
+        vec3 emission = texelFetch(lightsTex, ivec2(index + 1, 0), 0).xyz;
+        vec3 u        = texelFetch(lightsTex, ivec2(index + 2, 0), 0).xyz;
+        vec3 v        = texelFetch(lightsTex, ivec2(index + 3, 0), 0).xyz;
+        vec3 params   = texelFetch(lightsTex, ivec2(index + 4, 0), 0).xyz;
+
+        Light light = Light(position, emission, u, v, params.x, params.y, params.z);
+        bool analytic = lightIndex < numOfLights;
+#ifdef OPT_EMISSIVE_TRIANGLES
+        if (!analytic)
+            light.area = SampleEmissiveTriangle(lightIndex - numOfLights, scatterPos, rand(), rand(), lightSample);
+        else
+#endif
+            SampleOneLight(light, scatterPos, lightSample);
+        lightSample.pdf *= lightPmf;
+
+        if (lightIndex >= 0 && dot(lightSample.direction, lightSample.normal) < 0.0 &&
+            !AnyHit(Ray(scatterPos, lightSample.direction), lightSample.dist - EPS))
+        {
+            float bsdfPdfW;
+            vec3 f = DisneyEval(state, V, state.ffnormal, lightSample.direction, bsdfPdfW);
+
+            float misWeight = 1.0;
+            if (analytic && light.area > 0.0)
+            {
+                float bsdfRevPdfW;
+                DisneyEval(state, lightSample.direction, state.ffnormal, V, bsdfRevPdfW);
+
+                float cosLight = abs(dot(lightSample.normal, lightSample.direction));
+                float cosToLight = abs(dot(state.ffnormal, lightSample.direction));
+                float directPdfA = VcmLightPdfA(lightIndex, light.area, light.type);
+                float directPdfW = directPdfA * lightSample.dist * lightSample.dist / cosLight;
+                float emissionPdfW = directPdfA * INV_TWO_PI;
+
+                float wLight = bsdfPdfW / directPdfW;
+                float wCamera = emissionPdfW * cosToLight / (directPdfW * cosLight) * (vmEta + eyeVcm.x + eyeVcm.y * bsdfRevPdfW);
+                misWeight = 1.0 / (wLight + 1.0 + wCamera);
+            }
+
+            if (bsdfPdfW > 0.0)
+                Ld += misWeight * lightSample.emission * f / lightSample.pdf;
+        }
+    }
+#endif
+
+    return Ld;
+}
+
+#endif
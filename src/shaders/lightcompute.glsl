@@ -6,11 +6,13 @@ layout (local_size_x = KS, local_size_y = KS) in;
 
 uniform sampler2D u_inputTex;
 uniform writeonly image2D u_outImg;
+uniform int lightPathEpoch; // Light paths are regenerated with a new sequence every epoch
 
 #include common/uniforms.glsl
 #include common/globals.glsl
 #include common/intersection.glsl
 #include common/sampling.glsl
+#include common/lightsampling.glsl
 #include common/envmap.glsl
 #include common/anyhit.glsl
 #include common/closest_hit.glsl
@@ -18,6 +20,7 @@ uniform writeonly image2D u_outImg;
 #include common/lambert.glsl
 #include common/pathtrace.glsl
 #include sc/lightvertex.glsl
+#include common/vcm.glsl
 #include sc/lightvertexseed.glsl
 
 
@@ -29,8 +32,7 @@ void main()
 	ivec2 pixelPos = ivec2(KS) * gid + tid;
 
 	if(pixelPos[1] == 0){
-		float seed = pixelPos.x * 3.43121412313;
-		sc_constructLightPath_using_seed(seed); 
+		sc_constructLightPath_using_seed(pixelPos.x, lightPathEpoch);
 		
 		for(int j = 0; j < LIGHTPATHLENGTH; j++){
 			imageStore(u_outImg, ivec2(pixelPos[0],j),      vec4(lightVertices[j].position, 0.0));
@@ -45,6 +47,10 @@ void main()
 			imageStore(u_outImg, ivec2(pixelPos[0],j + 18), vec4(lightVertices[j].texCoord.x, 
 																 lightVertices[j].texCoord.y, 
 																 lightVertices[j].matroughness, 0.0));														 
+#ifdef OPT_VERTEX_MERGING
+			imageStore(u_outImg, ivec2(pixelPos[0],j + 21), vec4(lightVertices[j].flux, 0.0));
+			imageStore(u_outImg, ivec2(pixelPos[0],j + 24), vec4(lightVertices[j].vcm, 0.0));
+#endif
 		}
 	}
 }
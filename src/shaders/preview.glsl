@@ -31,11 +31,13 @@ in vec2 TexCoords;
 #include common/globals.glsl
 #include common/intersection.glsl
 #include common/sampling.glsl
+#include common/lightsampling.glsl
 #include common/envmap.glsl
 #include common/anyhit.glsl
 #include common/closest_hit.glsl
 #include common/disney.glsl
 #include common/lambert.glsl
+#include common/guiding.glsl
 #include common/pathtrace.glsl
 #include sc/lightvertex.glsl
 
@@ -10,6 +10,8 @@ struct LightPathNode {
     int avaliable;
     vec2 texCoord; 
     float matroughness;
+    vec3 flux; // Vertex merging only
+    vec3 vcm;
     
     Material mat;
 };
@@ -44,7 +46,7 @@ vec3 SampleSphereLightVertex(in Light light, inout LightSampleRec lightSample, o
     lightDirection = ToWorld(T, B, lightNormal, lightDirection);
 
     lightSample.normal = lightNormal;
-    lightSample.emission = light.emission*float(numOfLights);
+    lightSample.emission = light.emission;
     lightSample.direction = lightDirection;
 
     // hit point
@@ -77,7 +79,7 @@ vec3 SampleRectLightVertex(in Light light, inout LightSampleRec lightSample, out
     // lightDirection = T*lightDirection.x + B*lightDirection.y + lightNormal*lightDirection.z;
 
     lightSample.normal = lightNormal;
-    lightSample.emission = light.emission*float(numOfLights);
+    lightSample.emission = light.emission;
     lightSample.direction = normalize(lightDirection);
 
    // hit point
@@ -108,7 +110,7 @@ vec3 SampleRectLightVertexUniform(in Light light, inout LightSampleRec lightSamp
     lightDirection = ToWorld(T, B, lightNormal, lightDirection);
 
     lightSample.normal = lightNormal;
-    lightSample.emission = light.emission*float(numOfLights);
+    lightSample.emission = light.emission;
     lightSample.direction = normalize(lightDirection);
 
    // hit point
@@ -131,20 +133,88 @@ vec3 SampleDistantLightVertex(in Light light, inout LightSampleRec lightSample,
     return vec3(0.0);
 }
 
+#ifdef OPT_EMISSIVE_TRIANGLES
+// Starts a light path on an emissive triangle. r1, r2 pick the point, r3 the emitting side and localDir
+// is the cosine distributed direction around the normal of that side
+vec3 SampleEmissiveTriangleVertexDir(int tri, float r1, float r2, float r3, vec3 localDir, inout LightSampleRec lightSample, out bool hit, inout State state, out float area)
+{
+    vec4 t0 = texelFetch(emissiveTrianglesTex, tri * 4 + 0);
+    vec4 t1 = texelFetch(emissiveTrianglesTex, tri * 4 + 1);
+    vec4 t2 = texelFetch(emissiveTrianglesTex, tri * 4 + 2);
+    vec4 t3 = texelFetch(emissiveTrianglesTex, tri * 4 + 3);
+
+    float su = sqrt(r1);
+    vec3 bary = vec3(1.0 - su, r2 * su, 0.0);
+    bary.z = 1.0 - bary.x - bary.y;
+
+    vec3 lightSurfacePos = t0.xyz * bary.x + t1.xyz * bary.y + t2.xyz * bary.z;
+    vec2 uv = vec2(t0.w, t1.w) * bary.x + vec2(t2.w, t3.x) * bary.y + t3.yz * bary.z;
+
+    vec3 lightNormal = cross(t1.xyz - t0.xyz, t2.xyz - t0.xyz);
+    area = 0.5 * length(lightNormal);
+    lightNormal = normalize(lightNormal);
+    if (r3 < 0.5)
+        lightNormal = -lightNormal;
+
+    vec3 T, B;
+    Onb(lightNormal, T, B);
+    vec3 lightDirection = ToWorld(T, B, lightNormal, localDir);
+
+    lightSample.normal = lightNormal;
+    lightSample.emission = EmissiveTriangleRadiance(int(t3.w), uv);
+    lightSample.direction = normalize(lightDirection);
+
+    // hit point
+    Ray r = Ray(lightSurfacePos + lightNormal * EPS, lightSample.direction);
+    LightSampleRec tmpLightSample;
+    hit = ClosestHit(r, state, tmpLightSample);
+    if(!hit){
+        return lightSurfacePos;
+    }
+    vec3 fhp = state.fhp;
+    lightSample.dist = length(fhp - lightSurfacePos);
+    // Same measure as SampleRectLightVertex, halved as one of the two sides was picked
+    lightSample.pdf = 0.5 * lightSample.dist * lightSample.dist / (area * abs(dot(lightNormal, lightSample.direction)));
+    lightSample.dist = area;
+    return lightSurfacePos;
+}
+
+vec3 SampleEmissiveTriangleVertex(int tri, inout LightSampleRec lightSample, out bool hit, inout State state, out float area)
+{
+    float r1 = rand();
+    float r2 = rand();
+    float r3 = rand();
+    float directpdf;
+    vec3 localDir = SampleCosWeightedHemisphereDirection(directpdf);
+    return SampleEmissiveTriangleVertexDir(tri, r1, r2, r3, localDir, lightSample, hit, state, area);
+}
+#endif
+
 void sc_constructLightPath(in float seed ) {
     State state; 
+    InitRayCone(state, 0.0);
     LightSampleRec lightSample;
     ScatterSampleRec scatterSample;
     Light light;
     
-    // 1. sample the light
-    int index = int(rand() * float(numOfLights)) * 5;
-
-    vec3 position = texelFetch(lightsTex, ivec2(index + 0, 0), 0).xyz;
-    vec3 emission = texelFetch(lightsTex, ivec2(index + 1, 0), 0).xyz;
-    vec3 u        = texelFetch(lightsTex, ivec2(index + 2, 0), 0).xyz; 
-    vec3 v        = texelFetch(lightsTex, ivec2(index + 3, 0), 0).xyz; 
-    vec3 params   = texelFetch(lightsTex, ivec2(index + 4, 0), 0).xyz;
+    // 1. sample the light, proportionally to its power
+    float lightPmf;
+    int lightIndex = SampleLightByPower(rand(), lightPmf);
+    // Emissive triangles follow the analytic lights in the emitter list and have no entry in lightsTex
+    vec3 position = vec3(0.0);
+    vec3 emission = vec3(0.0);
+    vec3 u        = vec3(0.0);
+    vec3 v        = vec3(0.0);
+    vec3 params   = vec3(0.0);
+    if (lightIndex < numOfLights)
+    {
+        int index = lightIndex * 5;
+        position = texelFetch(lightsTex, ivec2(index + 0, 0), 0).xyz;
+        emission = texelFetch(lightsTex, ivec2(index + 1, 0), 0).xyz;
+        u        = texelFetch(lightsTex, ivec2(index + 2, 0), 0).xyz;
+        v        = texelFetch(lightsTex, ivec2(index + 3, 0), 0).xyz;
+        params   = texelFetch(lightsTex, ivec2(index + 4, 0), 0).xyz;
+    }
     float radius  = params.x;
     float area    = params.y;
     float type    = params.z; // 0->Rect, 1->Sphere, 2->Distant
@@ -158,6 +228,11 @@ void sc_constructLightPath(in float seed ) {
     bool hit;
     vec3 x0;
 
+#ifdef OPT_EMISSIVE_TRIANGLES
+    if(lightIndex >= numOfLights)
+        x0 = SampleEmissiveTriangleVertex(lightIndex - numOfLights, lightSample, hit, state, params.y);
+    else
+#endif
     if(type == 0)
         x0 = SampleRectLightVertex(light, lightSample, hit, state);
     else if(type == 1)
@@ -166,7 +241,7 @@ void sc_constructLightPath(in float seed ) {
         x0 = SampleDistantLightVertex(light, lightSample, hit, state);
 
     
-    vec3 throughput=lightSample.emission;
+    vec3 throughput = lightSample.emission / lightPmf;
     // x0 is record as light vertex
     Ray r = Ray(x0, normalize(lightSample.direction));
     lightVertices[0].avaliable = 1;
@@ -1,26 +1,36 @@
 
-float hash1(inout float seed){
-    float x = sin(seed++) * 43758.5453123;
-    return fract(x);
+// Sobol dimensions of a light subpath, which is the sample index: the light and the position on it, then the
+// emission direction, then a block per bounce like the eye paths
+#define DIM_EMITTER 0  // Light choice, position and side of emissive triangles
+#define DIM_EMISSION 4
+
+#ifdef OPT_SOBOL
+// One sequence for all light subpaths of a light cache epoch
+void InitSubpathSampler(int subpath, int epoch)
+{
+    sobolSeed = HashUint(uint(epoch) ^ 0x68bc21ebu);
+    sobolIndex = subpath;
 }
+#endif
 
-vec3 SampleCosWeightedHemisphereDirectionseed(out float pdf, inout float seed){
-    float cdf = hash1(seed); // theta in [0, pi/2]
+vec3 SampleCosWeightedHemisphereDirectionseed(out float pdf){
+    BeginSampleDimensions(DIM_EMISSION, 4);
+    float cdf = rand(); // theta in [0, pi/2]
     float theta = acos(1 - cdf);
-    float phi = hash1(seed) * 2 * PI;
+    float phi = rand() * 2 * PI;
     pdf = sin(theta)*INV_TWO_PI;
     return vec3(sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta));
 }
 
-vec3 SampleSphereLightVertexseed(in Light light, inout LightSampleRec lightSample, out bool hit, inout State state, inout float seed)
+vec3 SampleSphereLightVertexseed(in Light light, inout LightSampleRec lightSample, out bool hit, inout State state)
 {
-    float r1=hash1(seed);
-    float r2=hash1(seed);
+    float r1=rand();
+    float r2=rand();
     float directpdf;
 
     vec3 sampledDir = UniformSampleHemisphere(r1, r2);
     vec3 lightSurfacePos = light.position + light.radius * sampledDir;
-    vec3 lightDirection = SampleCosWeightedHemisphereDirectionseed(directpdf, seed);
+    vec3 lightDirection = SampleCosWeightedHemisphereDirectionseed(directpdf);
     vec3 lightNormal = normalize(lightSurfacePos - light.position);
 
     vec3 T, B;
@@ -28,7 +38,7 @@ vec3 SampleSphereLightVertexseed(in Light light, inout LightSampleRec lightSampl
     lightDirection = ToWorld(T, B, lightNormal, lightDirection);
 
     lightSample.normal = lightNormal;
-    lightSample.emission = light.emission*float(numOfLights);
+    lightSample.emission = light.emission;
     lightSample.direction = lightDirection;
 
     // hit point
@@ -45,14 +55,14 @@ vec3 SampleSphereLightVertexseed(in Light light, inout LightSampleRec lightSampl
     return lightSurfacePos;
 }
 
-vec3 SampleRectLightVertexseed(in Light light, inout LightSampleRec lightSample, out bool hit, inout State state, inout float seed)
+vec3 SampleRectLightVertexseed(in Light light, inout LightSampleRec lightSample, out bool hit, inout State state)
 {
-    float r1=hash1(seed);
-    float r2=hash1(seed);
+    float r1=rand();
+    float r2=rand();
     float directpdf;
 
     vec3 lightSurfacePos = light.position + light.u * r1 + light.v * r2;
-    vec3 lightDirection = SampleCosWeightedHemisphereDirectionseed(directpdf, seed);
+    vec3 lightDirection = SampleCosWeightedHemisphereDirectionseed(directpdf);
     vec3 lightNormal = normalize(cross(light.u, light.v));
     
     vec3 T, B;
@@ -61,7 +71,7 @@ vec3 SampleRectLightVertexseed(in Light light, inout LightSampleRec lightSample,
     // lightDirection = T*lightDirection.x + B*lightDirection.y + lightNormal*lightDirection.z;
 
     lightSample.normal = lightNormal;
-    lightSample.emission = light.emission*float(numOfLights);
+    lightSample.emission = light.emission;
     lightSample.direction = normalize(lightDirection);
 
    // hit point
@@ -77,13 +87,14 @@ vec3 SampleRectLightVertexseed(in Light light, inout LightSampleRec lightSample,
     lightSample.pdf = lightSample.dist*lightSample.dist/ (light.area*abs(dot(lightNormal, lightDirection)));
     return lightSurfacePos;
 }
-vec3 SampleRectLightVertexUniformseed(in Light light, inout LightSampleRec lightSample, out bool hit, inout State state, inout float seed)
+vec3 SampleRectLightVertexUniformseed(in Light light, inout LightSampleRec lightSample, out bool hit, inout State state)
 {
-    float r1=hash1(seed);
-    float r2=hash1(seed);
+    float r1=rand();
+    float r2=rand();
 
     vec3 lightSurfacePos = light.position + light.u * r1 + light.v * r2;
-    vec3 lightDirection = UniformSampleHemisphere(hash1(seed), hash1(seed));
+    BeginSampleDimensions(DIM_EMISSION, 4);
+    vec3 lightDirection = UniformSampleHemisphere(rand(), rand());
     vec3 lightNormal = normalize(cross(light.u, light.v));
     
     vec3 T, B;
@@ -91,7 +102,7 @@ vec3 SampleRectLightVertexUniformseed(in Light light, inout LightSampleRec light
     lightDirection = ToWorld(T, B, lightNormal, lightDirection);
 
     lightSample.normal = lightNormal;
-    lightSample.emission = light.emission*float(numOfLights);
+    lightSample.emission = light.emission;
     lightSample.direction = normalize(lightDirection);
 
    // hit point
@@ -109,26 +120,59 @@ vec3 SampleRectLightVertexUniformseed(in Light light, inout LightSampleRec light
     return lightSurfacePos;
 }
 
-vec3 SampleDistantLightVertexseed(in Light light, inout LightSampleRec lightSample, out bool hit, inout State state, inout float seed)
+vec3 SampleDistantLightVertexseed(in Light light, inout LightSampleRec lightSample, out bool hit, inout State state)
 {
     return vec3(0.0);
 }
 
+#ifdef OPT_EMISSIVE_TRIANGLES
+vec3 SampleEmissiveTriangleVertexseed(int tri, inout LightSampleRec lightSample, out bool hit, inout State state, out float area)
+{
+    float r1 = rand();
+    float r2 = rand();
+    float r3 = rand();
+    float directpdf;
+    vec3 localDir = SampleCosWeightedHemisphereDirectionseed(directpdf);
+    return SampleEmissiveTriangleVertexDir(tri, r1, r2, r3, localDir, lightSample, hit, state, area);
+}
+#endif
+
+
+void sc_constructLightPath_using_seed(int subpath, int epoch) {
+    // Subpaths are the samples of one low discrepancy sequence, so they cover the emitters evenly
+    InitRNG(vec2(subpath, 0), epoch);
+#ifdef OPT_SOBOL
+    InitSubpathSampler(subpath, epoch);
+#endif
+
+    for (int i = 0; i < LIGHTPATHLENGTH; i++)
+        lightVertices[i].avaliable = 0;
 
-void sc_constructLightPath_using_seed(inout float seed ) {
     State state; 
+    InitRayCone(state, 0.0);
     LightSampleRec lightSample;
     ScatterSampleRec scatterSample;
     Light light;
     
-    // 1. sample the light
-    int index = int(hash1(seed)* float(numOfLights)) * 5;
-
-    vec3 position = texelFetch(lightsTex, ivec2(index + 0, 0), 0).xyz;
-    vec3 emission = texelFetch(lightsTex, ivec2(index + 1, 0), 0).xyz;
-    vec3 u        = texelFetch(lightsTex, ivec2(index + 2, 0), 0).xyz; 
-    vec3 v        = texelFetch(lightsTex, ivec2(index + 3, 0), 0).xyz; 
-    vec3 params   = texelFetch(lightsTex, ivec2(index + 4, 0), 0).xyz;
+    // 1. sample the light, proportionally to its power
+    float lightPmf;
+    BeginSampleDimensions(DIM_EMITTER, 4);
+    int lightIndex = SampleLightByPower(rand(), lightPmf);
+    // Emissive triangles follow the analytic lights in the emitter list and have no entry in lightsTex
+    vec3 position = vec3(0.0);
+    vec3 emission = vec3(0.0);
+    vec3 u        = vec3(0.0);
+    vec3 v        = vec3(0.0);
+    vec3 params   = vec3(0.0);
+    if (lightIndex < numOfLights)
+    {
+        int index = lightIndex * 5;
+        position = texelFetch(lightsTex, ivec2(index + 0, 0), 0).xyz;
+        emission = texelFetch(lightsTex, ivec2(index + 1, 0), 0).xyz;
+        u        = texelFetch(lightsTex, ivec2(index + 2, 0), 0).xyz;
+        v        = texelFetch(lightsTex, ivec2(index + 3, 0), 0).xyz;
+        params   = texelFetch(lightsTex, ivec2(index + 4, 0), 0).xyz;
+    }
     float radius  = params.x;
     float area    = params.y;
     float type    = params.z; // 0->Rect, 1->Sphere, 2->Distant
@@ -142,15 +186,29 @@ void sc_constructLightPath_using_seed(inout float seed ) {
     bool hit;
     vec3 x0;
     
+#ifdef OPT_EMISSIVE_TRIANGLES
+    if(lightIndex >= numOfLights)
+        x0 = SampleEmissiveTriangleVertexseed(lightIndex - numOfLights, lightSample, hit, state, params.y);
+    else
+#endif
     if(type == 0)
-        x0 = SampleRectLightVertexseed(light, lightSample, hit, state, seed);
+        x0 = SampleRectLightVertexseed(light, lightSample, hit, state);
     else if(type == 1)
-        x0 = SampleSphereLightVertexseed(light, lightSample, hit, state, seed);
+        x0 = SampleSphereLightVertexseed(light, lightSample, hit, state);
     else if(type == 2)
-        x0 = SampleDistantLightVertexseed(light, lightSample, hit, state, seed);
+        x0 = SampleDistantLightVertexseed(light, lightSample, hit, state);
 
     
-    vec3 throughput=lightSample.emission;
+    vec3 throughput = lightSample.emission / lightPmf;
+#ifdef OPT_VERTEX_MERGING
+    // Flux and partial MIS quantities of the subpath, both follow the densities the vertices were sampled with
+    float cosLight = abs(dot(lightSample.normal, lightSample.direction));
+    float emissionPdfW = VcmEmissionPdfW(lightIndex, params.y, type);
+    vec3 flux = lightSample.emission * cosLight / emissionPdfW;
+    vec3 vcm = VcmLightStart(emissionPdfW, VcmLightPdfA(lightIndex, params.y, type), cosLight);
+    lightVertices[0].flux = flux;
+    lightVertices[0].vcm = vcm;
+#endif
     // x0 is record as light vertex
     Ray r = Ray(x0, normalize(lightSample.direction));
     lightVertices[0].avaliable = 1;
@@ -175,6 +233,10 @@ void sc_constructLightPath_using_seed(inout float seed ) {
     for(int i=1; i<LIGHTPATHLENGTH; i++){
         GetMaterial(state, r);
         vec3 fdirection = r.direction;
+#ifdef OPT_VERTEX_MERGING
+        VcmArrive(vcm, state.hitDist, abs(dot(state.ffnormal, fdirection)));
+#endif
+        BeginSampleDimensions(BOUNCE_DIM(i, DIM_BSDF), 4);
         scatterSample.f = DisneySample(state, -r.direction, state.ffnormal, scatterSample.L, scatterSample.pdf);
         r.origin = state.fhp+normalize(scatterSample.L)*EPS;
         r.direction = scatterSample.L;
@@ -190,6 +252,17 @@ void sc_constructLightPath_using_seed(inout float seed ) {
         lightVertices[i].ffnormal = state.ffnormal;
         lightVertices[i].texCoord = state.texCoord;
         lightVertices[i].matroughness = state.mat.roughness;
+#ifdef OPT_VERTEX_MERGING
+        lightVertices[i].flux = flux;
+        lightVertices[i].vcm = vcm;
+        if (scatterSample.pdf > 0.0)
+        {
+            float revPdf;
+            DisneyEval(state, scatterSample.L, state.ffnormal, -fdirection, revPdf);
+            VcmScatter(vcm, abs(dot(state.ffnormal, scatterSample.L)), scatterSample.pdf, revPdf);
+            flux *= scatterSample.f / scatterSample.pdf;
+        }
+#endif
 
         vec3 dis = lightVertices[i].position - lightVertices[i-1].position;
         float invDist2 = 1.0/length(dis);
@@ -24,20 +24,41 @@
 
 #version 330
 
-out vec4 color;
+layout(location = 0) out vec4 color;
+#ifdef OPT_DENOISER_AOVS
+layout(location = 1) out vec4 albedoOut;
+layout(location = 2) out vec4 normalOut;
+uniform sampler2D accumAlbedoTexture;
+uniform sampler2D accumNormalTexture;
+#endif
+#ifdef OPT_ADAPTIVE_SAMPLING
+layout(location = 3) out vec4 momentsOut;
+uniform sampler2D accumMomentsTexture;
+uniform int numSamples;
+uniform float adaptiveThreshold;
+uniform int adaptiveMinSpp;
+#endif
+#ifdef OPT_PATH_GUIDING
+// Training sample of PathGuide, position and value in the first, direction in the second
+layout(location = 4) out vec4 guidePositionOut;
+layout(location = 5) out vec4 guideDirectionOut;
+#endif
 in vec2 TexCoords;
 
 #include common/uniforms.glsl
 #include common/globals.glsl
 #include common/intersection.glsl
 #include common/sampling.glsl
+#include common/lightsampling.glsl
 #include common/envmap.glsl
 #include common/anyhit.glsl
 #include common/closest_hit.glsl
 #include common/disney.glsl
 #include common/lambert.glsl
+#include common/guiding.glsl
 #include common/pathtrace.glsl
 #include sc/lightvertex.glsl
+#include common/vcm.glsl
 #include sc/lightvertexseed.glsl
 #include common/bidirectrace.glsl
 /*
@@ -47,7 +68,32 @@ void main(void)
 {
     vec2 coordsTile = mix(tileOffset, tileOffset + invNumTiles, TexCoords);
 
+#ifdef OPT_ADAPTIVE_SAMPLING
+    // x is the sum of the squared luminance, y is set once the pixel converged. Converged pixels add their
+    // mean instead of a new sample so every pixel keeps the same sample count
+    vec4 moments = texture(accumMomentsTexture, coordsTile);
+    if (moments.y > 0.0)
+    {
+        float pad = float(numSamples + 1) / float(numSamples);
+        color = texture(accumTexture, coordsTile) * pad;
+        momentsOut = vec4(moments.x * pad, 1.0, 0.0, 0.0);
+#ifdef OPT_DENOISER_AOVS
+        albedoOut = texture(accumAlbedoTexture, coordsTile) * pad;
+        normalOut = texture(accumNormalTexture, coordsTile) * pad;
+#endif
+#ifdef OPT_PATH_GUIDING
+        guidePositionOut = vec4(0.0);
+        guideDirectionOut = vec4(0.0);
+#endif
+        return;
+    }
+#endif
+
     InitRNG(gl_FragCoord.xy, frameNum);
+#ifdef OPT_SOBOL
+    InitSampler(ivec2(coordsTile * resolution), sampleIndex);
+#endif
+    BeginSampleDimensions(DIM_CAMERA, 4);
 
     float r1 = 2.0 * rand();
     float r2 = 2.0 * rand();
@@ -81,6 +127,7 @@ void main(void)
 #ifdef OPT_HRRVC
     pixelColor = HRRVC( ray );
 #else
+    BeginSampleDimensions(DIM_LIGHT_PATH, DIM_LIGHT_PATH_COUNT);
     sc_constructLightPath( seed );
     pixelColor = sc_traceEyePath(ray);
 #endif
@@ -90,4 +137,29 @@ void main(void)
 #endif
 
     color = pixelColor + accumColor;
+
+#ifdef OPT_PATH_GUIDING
+    guidePositionOut = vec4(guideRecordPos, guideRecordValue);
+    guideDirectionOut = vec4(guideRecordDir, 0.0);
+#endif
+
+#ifdef OPT_DENOISER_AOVS
+    // Accumulated like the color, alpha counts the samples
+    vec3 firstHitAlbedo, firstHitNormal;
+    FirstHitAOVs(ray, firstHitAlbedo, firstHitNormal);
+    albedoOut = vec4(firstHitAlbedo, 1.0) + texture(accumAlbedoTexture, coordsTile);
+    normalOut = vec4(firstHitNormal, 1.0) + texture(accumNormalTexture, coordsTile);
+#endif
+
+#ifdef OPT_ADAPTIVE_SAMPLING
+    // Relative standard error of the mean luminance
+    float n = float(numSamples + 1);
+    float lum = Luminance(pixelColor.rgb);
+    float sumSquares = moments.x + lum * lum;
+    float mean = Luminance(color.rgb) / n;
+    float variance = max(sumSquares / n - mean * mean, 0.0) * n / max(n - 1.0, 1.0);
+    float relError = sqrt(variance / n) / max(mean, 1e-3);
+    bool converged = numSamples + 1 >= adaptiveMinSpp && relError < adaptiveThreshold;
+    momentsOut = vec4(sumSquares, converged ? 1.0 : 0.0, 0.0, 0.0);
+#endif
 }
\ No newline at end of file
@@ -25,25 +25,73 @@ THE SOFTWARE.
 #include <stack>
 #include <numeric>
 #include <cassert>
+#include <limits>
 #include <vector>
 #include <future>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "bvh.h"
 
 namespace RadeonRays
 {
     static int constexpr kMaxPrimitivesPerLeaf = 1;
+    // Nodes at least this big bin their primitives on all threads
+    static int constexpr kMinParallelBinPrims = 1 << 16;
+    // Lower bound for the size of the subtrees handed out to threads
+    static int constexpr kMinSubtreePrims = 1 << 12;
+    // Leaves of an optimized treelet. The cost of a treelet grows with 3^n
+    static int constexpr kTreeletLeaves = 7;
+    // Subtrees per thread when optimizing
+    static int constexpr kOptimizeSubtreesPerThread = 8;
 
     static bool is_nan(float v)
     {
         return v != v;
     }
 
+    static int ThreadIndex()
+    {
+#ifdef _OPENMP
+        return omp_get_thread_num();
+#else
+        return 0;
+#endif
+    }
+
+    static int MaxThreads()
+    {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    // Index of the lowest set bit of a treelet subset
+    static int LeafIndex(int subset)
+    {
+        int index = 0;
+        while ((subset & (1 << index)) == 0)
+            ++index;
+        return index;
+    }
+
     void Bvh::Build(bbox const* bounds, int numbounds)
     {
-        for (int i = 0; i < numbounds; ++i)
+#pragma omp parallel
         {
-            // Calc bbox
-            m_bounds.grow(bounds[i]);
+            bbox threadbounds;
+
+#pragma omp for nowait
+            for (int i = 0; i < numbounds; ++i)
+            {
+                // Calc bbox
+                threadbounds.grow(bounds[i]);
+            }
+
+#pragma omp critical
+            m_bounds.grow(threadbounds);
         }
 
         BuildImpl(bounds, numbounds);
@@ -65,31 +113,51 @@ namespace RadeonRays
         return &m_nodes[m_nodecnt++];
     }
 
+    void Bvh::InitParallelBuild(int numprims)
+    {
+        int numthreads = MaxThreads();
+        m_scratch.resize(numthreads);
+        for (auto& scratch : m_scratch)
+        {
+            scratch.bins.resize(3 * m_num_bins);
+            scratch.rightbounds.resize(m_num_bins - 1);
+            scratch.height = 0;
+        }
+
+        // Enough subtrees to keep every thread busy while the tree is unbalanced
+        m_subtree_size = std::max(kMinSubtreePrims, numprims / (numthreads * 16));
+    }
+
+    Bvh::BuildScratch& Bvh::GetScratch()
+    {
+        // The top levels run on the thread calling Build, which may itself be a worker of an
+        // enclosing parallel loop, so only threads of the subtree loop use their own index
+        return m_scratch[m_defer_subtrees ? 0 : ThreadIndex()];
+    }
+
     void Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices)
     {
-        m_height = std::max(m_height, req.level);
+        // Top levels only split, the subtrees below are built later on all threads
+        if (m_defer_subtrees && req.numprims <= m_subtree_size)
+        {
+            m_subtree_requests.push_back(req);
+            return;
+        }
+
+        BuildScratch& scratch = GetScratch();
+        scratch.height = std::max(scratch.height, req.level);
 
         Node* node = AllocateNode();
         node->bounds = req.bounds;
         node->index = req.index;
 
-        // Create leaf node if we have enough prims
-        if (req.numprims < 2)
+        // Create leaf node if we have enough prims.
+        // Every primitive lands in exactly one leaf, so leaves point straight into the partitioned indices
+        if (req.numprims <= m_max_leaf_prims)
         {
-#ifdef USE_TBB
-            primitive_mutex_.lock();
-#endif
             node->type = kLeaf;
-            node->startidx = static_cast<int>(m_packed_indices.size());
+            node->startidx = req.startidx;
             node->numprims = req.numprims;
-
-            for (auto i = 0; i < req.numprims; ++i)
-            {
-                m_packed_indices.push_back(primindices[req.startidx + i]);
-            }
-#ifdef USE_TBB
-            primitive_mutex_.unlock();
-#endif
         }
         else
         {
@@ -109,14 +177,9 @@ namespace RadeonRays
                     if (req.numprims < ss.sah && req.numprims < kMaxPrimitivesPerLeaf)
                     {
                         node->type = kLeaf;
-                        node->startidx = static_cast<int>(m_packed_indices.size());
+                        node->startidx = req.startidx;
                         node->numprims = req.numprims;
 
-                        for (auto i = 0; i < req.numprims; ++i)
-                        {
-                            m_packed_indices.push_back(primindices[req.startidx + i]);
-                        }
-
                         if (req.ptr) *req.ptr = node;
                         return;
                     }
@@ -224,9 +287,9 @@ namespace RadeonRays
             }
 
             // Left request
-            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1, (req.index << 1) };
+            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1, (req.index << 1), 0 };
             // Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1 };
+            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1, 0 };
 
             {
                 // Put those to stack
@@ -242,7 +305,42 @@ namespace RadeonRays
         if (req.ptr) *req.ptr = node;
     }
 
-    Bvh::SahSplit Bvh::FindSahSplit(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices) const
+    void Bvh::BinPrimitives(SplitRequest const& req, int begin, int end, bbox const* bounds, Vec3 const* centroids, int const* primindices, Bin* bins) const
+    {
+        Vec3 rootmin = req.centroid_bounds.pmin;
+        Vec3 centroid_extents = req.centroid_bounds.extents();
+        Vec3 invcentroid_rng;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            invcentroid_rng[axis] = 1.f / centroid_extents[axis];
+
+            for (int i = 0; i < m_num_bins; ++i)
+            {
+                bins[axis * m_num_bins + i].count = 0;
+                bins[axis * m_num_bins + i].bounds = bbox();
+            }
+        }
+
+        for (int i = begin; i < end; ++i)
+        {
+            int idx = primindices[i];
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                // If the box is degenerate in that dimension skip it
+                if (centroid_extents[axis] == 0.f) continue;
+
+                int binidx = (int)std::min<float>(static_cast<float>(m_num_bins) * ((centroids[idx][axis] - rootmin[axis]) * invcentroid_rng[axis]), static_cast<float>(m_num_bins - 1));
+
+                Bin& bin = bins[axis * m_num_bins + binidx];
+                ++bin.count;
+                bin.bounds.grow(bounds[idx]);
+            }
+        }
+    }
+
+    Bvh::SahSplit Bvh::FindSahSplit(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices)
     {
         // SAH implementation
         // calc centroids histogram
@@ -265,18 +363,38 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has bbox and occurence count
-        struct Bin
+        Bin* bins = &GetScratch().bins[0];
+        bbox* rightbounds = &GetScratch().rightbounds[0];
+
+        // Calc primitive refs histogram
+        int numblocks = static_cast<int>(m_scratch.size());
+        if (m_defer_subtrees && numblocks > 1 && req.numprims >= kMinParallelBinPrims)
         {
-            bbox bounds;
-            int count;
-        };
+            // Only reached while the top levels are built on one thread, so every scratch is free
+            // to hold the bins of one block
+#pragma omp parallel for schedule(static, 1)
+            for (int block = 0; block < numblocks; ++block)
+            {
+                int begin = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * block / numblocks);
+                int end = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * (block + 1) / numblocks);
+                BinPrimitives(req, begin, end, bounds, centroids, primindices, &m_scratch[block].bins[0]);
+            }
 
-        // Keep bins for each dimension
-        std::vector<Bin> bins[3];
-        bins[0].resize(m_num_bins);
-        bins[1].resize(m_num_bins);
-        bins[2].resize(m_num_bins);
+            bins = &m_scratch[0].bins[0];
+            for (int block = 1; block < numblocks; ++block)
+            {
+                Bin const* blockbins = &m_scratch[block].bins[0];
+                for (int i = 0; i < 3 * m_num_bins; ++i)
+                {
+                    bins[i].count += blockbins[i].count;
+                    bins[i].bounds.grow(blockbins[i].bounds);
+                }
+            }
+        }
+        else
+        {
+            BinPrimitives(req, req.startidx, req.startidx + req.numprims, bounds, centroids, primindices, bins);
+        }
 
         // Precompute inverse parent area
         float invarea = 1.f / req.bounds.surface_area();
@@ -286,38 +404,16 @@ namespace RadeonRays
         // Evaluate all dimensions
         for (int axis = 0; axis < 3; ++axis)
         {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            float centroid_rng = centroid_extents[axis];
-            float invcentroid_rng = 1.f / centroid_rng;
-
             // If the box is degenerate in that dimension skip it
-            if (centroid_rng == 0.f) continue;
+            if (centroid_extents[axis] == 0.f) continue;
 
-            // Initialize bins
-            for (int i = 0; i < m_num_bins; ++i)
-            {
-                bins[axis][i].count = 0;
-                bins[axis][i].bounds = bbox();
-            }
-
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
-            {
-                int idx = primindices[i];
-                int binidx = (int)std::min<float>(static_cast<float>(m_num_bins) * ((centroids[idx][axis] - rootminc) * invcentroid_rng), static_cast<float>(m_num_bins - 1));
-
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.grow(bounds[idx]);
-            }
-
-            std::vector<bbox> rightbounds(m_num_bins - 1);
+            Bin const* axisbins = bins + axis * m_num_bins;
 
             // Start with 1-bin right box
             bbox rightbox = bbox();
             for (int i = m_num_bins - 1; i > 0; --i)
             {
-                rightbox.grow(bins[axis][i].bounds);
+                rightbox.grow(axisbins[i].bounds);
                 rightbounds[i - 1] = rightbox;
             }
 
@@ -330,9 +426,9 @@ namespace RadeonRays
             float sahtmp = 0.f;
             for (int i = 0; i < m_num_bins - 1; ++i)
             {
-                leftbox.grow(bins[axis][i].bounds);
-                leftcount += bins[axis][i].count;
-                rightcount -= bins[axis][i].count;
+                leftbox.grow(axisbins[i].bounds);
+                leftcount += axisbins[i].count;
+                rightcount -= axisbins[i].count;
 
                 // Compute SAH
                 sahtmp = m_traversal_cost + (leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area()) * invarea;
@@ -364,18 +460,30 @@ namespace RadeonRays
         // Cache some stuff to have faster partitioning
         std::vector<Vec3> centroids(numbounds);
         m_indices.resize(numbounds);
-        std::iota(m_indices.begin(), m_indices.end(), 0);
 
         // Calc bbox
         bbox centroid_bounds;
-        for (size_t i = 0; i < static_cast<size_t>(numbounds); ++i)
+#pragma omp parallel
         {
-            Vec3 c = bounds[i].center();
-            centroid_bounds.grow(c);
-            centroids[i] = c;
+            bbox threadbounds;
+
+#pragma omp for nowait
+            for (int i = 0; i < numbounds; ++i)
+            {
+                Vec3 c = bounds[i].center();
+                threadbounds.grow(c);
+                centroids[i] = c;
+                m_indices[i] = i;
+            }
+
+#pragma omp critical
+            centroid_bounds.grow(threadbounds);
         }
 
-        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1 };
+        InitParallelBuild(numbounds);
+
+        // Object splits never duplicate references, so there is no reference budget
+        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1, 0 };
 
 #ifdef USE_BUILD_STACK
         std::stack<SplitRequest> stack;
@@ -471,9 +579,9 @@ namespace RadeonRays
                 }
 
                 // Left request
-                SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds };
+                SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1, (req.index << 1), 0 };
                 // Right request
-                SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds };
+                SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1, 0 };
 
                 // Put those to stack
                 stack.push(leftrequest);
@@ -484,7 +592,31 @@ namespace RadeonRays
             if (req.ptr) *req.ptr = node;
         }
 #else
+        // Split the top levels on this thread, binning big nodes on all threads
+        m_subtree_requests.clear();
+        m_defer_subtrees = true;
         BuildNode(init, bounds, &centroids[0], &m_indices[0]);
+        m_defer_subtrees = false;
+
+        // Then build the remaining subtrees independently, largest first
+        std::sort(m_subtree_requests.begin(), m_subtree_requests.end(),
+            [](SplitRequest const& a, SplitRequest const& b) { return a.numprims > b.numprims; });
+
+        int numsubtrees = static_cast<int>(m_subtree_requests.size());
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int i = 0; i < numsubtrees; ++i)
+        {
+            BuildNode(m_subtree_requests[i], bounds, &centroids[0], &m_indices[0]);
+        }
+
+        m_subtree_requests.clear();
+        for (auto const& scratch : m_scratch)
+        {
+            m_height = std::max(m_height, scratch.height);
+        }
+
+        // Leaves index the partitioned primitive array directly
+        m_packed_indices = m_indices;
 #endif
 
         // Set root_ pointer
@@ -501,4 +633,371 @@ namespace RadeonRays
         os << "Tree height: " << GetHeight() << "\n";
     }
 
+    float Bvh::GetSahCost() const
+    {
+        if (!m_root)
+            return 0.f;
+
+        float cost = 0.f;
+        std::stack<Node const*> stack;
+        stack.push(m_root);
+        while (!stack.empty())
+        {
+            Node const* node = stack.top();
+            stack.pop();
+
+            if (node->type == kLeaf)
+            {
+                cost += node->bounds.surface_area() * node->numprims;
+            }
+            else
+            {
+                cost += node->bounds.surface_area() * m_traversal_cost;
+                stack.push(node->lc);
+                stack.push(node->rc);
+            }
+        }
+
+        float rootarea = m_root->bounds.surface_area();
+        return rootarea > 0.f ? cost / rootarea : 0.f;
+    }
+
+    size_t Bvh::GetMemoryUsage() const
+    {
+        return m_nodecnt * sizeof(Node) + m_packed_indices.size() * sizeof(int);
+    }
+
+    void Bvh::Save(std::ostream& os) const
+    {
+        // Children are stored as node indices
+        int header[3] = { (int)m_nodecnt, (int)m_packed_indices.size(), m_height };
+        os.write((char const*)header, sizeof(header));
+        os.write((char const*)&m_bounds.pmin, sizeof(Vec3));
+        os.write((char const*)&m_bounds.pmax, sizeof(Vec3));
+
+        for (int i = 0; i < m_nodecnt; ++i)
+        {
+            Node const& node = m_nodes[i];
+            bool leaf = node.type == kLeaf;
+            int data[3] = { (int)node.type, leaf ? node.startidx : (int)(node.lc - &m_nodes[0]), leaf ? node.numprims : (int)(node.rc - &m_nodes[0]) };
+            os.write((char const*)&node.bounds.pmin, sizeof(Vec3));
+            os.write((char const*)&node.bounds.pmax, sizeof(Vec3));
+            os.write((char const*)data, sizeof(data));
+        }
+
+        if (!m_packed_indices.empty())
+        {
+            os.write((char const*)&m_packed_indices[0], m_packed_indices.size() * sizeof(int));
+        }
+    }
+
+    bool Bvh::Load(std::istream& is, int numprims, int maxrefs)
+    {
+        // Counts are bounded by the mesh before anything is allocated. A tree over n references has 2n - 1 nodes
+        int header[3];
+        if (!is.read((char*)header, sizeof(header)) || header[1] <= 0 || header[1] > maxrefs || header[0] <= 0 || header[0] > 2 * header[1] - 1)
+            return false;
+
+        is.read((char*)&m_bounds.pmin, sizeof(Vec3));
+        is.read((char*)&m_bounds.pmax, sizeof(Vec3));
+
+        int numnodes = header[0];
+        int numrefs = header[1];
+        InitNodeAllocator(numnodes);
+        for (int i = 0; i < numnodes && is; ++i)
+        {
+            Node* node = AllocateNode();
+            int data[3];
+            is.read((char*)&node->bounds.pmin, sizeof(Vec3));
+            is.read((char*)&node->bounds.pmax, sizeof(Vec3));
+            is.read((char*)data, sizeof(data));
+
+            if (data[0] != kLeaf && data[0] != kInternal)
+                return false;
+
+            node->type = (NodeType)data[0];
+            node->index = i;
+            if (node->type == kLeaf)
+            {
+                node->startidx = data[1];
+                node->numprims = data[2];
+                if (data[1] < 0 || data[2] <= 0 || data[1] > numrefs - data[2])
+                    return false;
+            }
+            else
+            {
+                if (data[1] < 0 || data[1] >= numnodes || data[2] < 0 || data[2] >= numnodes)
+                    return false;
+                node->lc = &m_nodes[data[1]];
+                node->rc = &m_nodes[data[2]];
+            }
+        }
+
+        m_packed_indices.resize(numrefs);
+        is.read((char*)&m_packed_indices[0], numrefs * sizeof(int));
+
+        if (!is)
+            return false;
+
+        // Every reference has to name a primitive of the mesh
+        for (int i = 0; i < numrefs; ++i)
+        {
+            if (m_packed_indices[i] < 0 || m_packed_indices[i] >= numprims)
+                return false;
+        }
+
+        // Optimized trees can have children before their parent, make sure the links form a tree that reaches
+        // every node exactly once. The height is taken from the links rather than the file
+        std::vector<int> depths(numnodes, -1);
+        std::stack<Node const*> stack;
+        depths[0] = 0;
+        stack.push(&m_nodes[0]);
+        int numreached = 0;
+        int height = 0;
+        while (!stack.empty())
+        {
+            Node const* node = stack.top();
+            stack.pop();
+            ++numreached;
+
+            int depth = depths[node - &m_nodes[0]];
+            height = std::max(height, depth + 1);
+            if (node->type == kInternal)
+            {
+                for (Node const* child : { node->lc, node->rc })
+                {
+                    int& childdepth = depths[child - &m_nodes[0]];
+                    if (childdepth >= 0)
+                        return false;
+                    childdepth = depth + 1;
+                    stack.push(child);
+                }
+            }
+        }
+
+        if (numreached != numnodes)
+            return false;
+
+        m_height = height;
+        m_root = &m_nodes[0];
+        return true;
+    }
+
+    void Bvh::ComputeNodeCosts(Node* node, std::vector<Node*>& order)
+    {
+        // Reversed preorder lists every node after all of its descendants
+        order.clear();
+        order.push_back(node);
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            if (order[i]->type == kInternal)
+            {
+                order.push_back(order[i]->lc);
+                order.push_back(order[i]->rc);
+            }
+        }
+        std::reverse(order.begin(), order.end());
+
+        for (auto n : order)
+        {
+            float area = n->bounds.surface_area();
+            if (n->type == kLeaf)
+                m_node_costs[n - &m_nodes[0]] = area * n->numprims;
+            else
+                m_node_costs[n - &m_nodes[0]] = area * m_traversal_cost + m_node_costs[n->lc - &m_nodes[0]] + m_node_costs[n->rc - &m_nodes[0]];
+        }
+    }
+
+    void Bvh::OptimizeTreelet(Node* root, Treelet& treelet)
+    {
+        // Grow the treelet by expanding the leaf with the largest surface area
+        treelet.interior[0] = root;
+        treelet.numinterior = 1;
+        treelet.leaves[0] = root->lc;
+        treelet.leaves[1] = root->rc;
+        treelet.numleaves = 2;
+
+        while (treelet.numleaves < kTreeletLeaves)
+        {
+            int best = -1;
+            float bestarea = -1.f;
+            for (int i = 0; i < treelet.numleaves; ++i)
+            {
+                float area = treelet.leaves[i]->bounds.surface_area();
+                if (treelet.leaves[i]->type == kInternal && area > bestarea)
+                {
+                    best = i;
+                    bestarea = area;
+                }
+            }
+
+            if (best == -1)
+                break;
+
+            Node* node = treelet.leaves[best];
+            treelet.interior[treelet.numinterior++] = node;
+            treelet.leaves[best] = node->lc;
+            treelet.leaves[treelet.numleaves++] = node->rc;
+        }
+
+        // Two leaves have only one topology
+        if (treelet.numleaves < 3)
+            return;
+
+        // Subsets in increasing order visit every proper subset before the set itself
+        int numsubsets = 1 << treelet.numleaves;
+        for (int s = 1; s < numsubsets; ++s)
+        {
+            int lowbit = s & -s;
+            if (s == lowbit)
+            {
+                Node* leaf = treelet.leaves[LeafIndex(s)];
+                treelet.bounds[s] = leaf->bounds;
+                treelet.cost[s] = m_node_costs[leaf - &m_nodes[0]];
+                continue;
+            }
+
+            treelet.bounds[s] = bboxunion(treelet.bounds[s ^ lowbit], treelet.bounds[lowbit]);
+
+            // Partitions containing the lowest leaf cover every split exactly once
+            float bestcost = std::numeric_limits<float>::max();
+            int bestpartition = 0;
+            for (int p = (s - 1) & s; p != 0; p = (p - 1) & s)
+            {
+                if ((p & lowbit) == 0)
+                    continue;
+
+                float cost = treelet.cost[p] + treelet.cost[s ^ p];
+                if (cost < bestcost)
+                {
+                    bestcost = cost;
+                    bestpartition = p;
+                }
+            }
+
+            treelet.cost[s] = treelet.bounds[s].surface_area() * m_traversal_cost + bestcost;
+            treelet.partition[s] = bestpartition;
+        }
+
+        int full = numsubsets - 1;
+        float& rootcost = m_node_costs[root - &m_nodes[0]];
+        if (treelet.cost[full] < rootcost * (1.f - 1e-5f))
+        {
+            treelet.numinterior = 1;
+            RelinkTreelet(treelet, root, full);
+            rootcost = treelet.cost[full];
+        }
+    }
+
+    void Bvh::RelinkTreelet(Treelet& treelet, Node* node, int subset)
+    {
+        int partition[2] = { treelet.partition[subset], subset ^ treelet.partition[subset] };
+        Node* children[2];
+
+        for (int i = 0; i < 2; ++i)
+        {
+            int s = partition[i];
+            if ((s & (s - 1)) == 0)
+            {
+                children[i] = treelet.leaves[LeafIndex(s)];
+            }
+            else
+            {
+                // Interior nodes of the old topology are reused in any order
+                children[i] = treelet.interior[treelet.numinterior++];
+                RelinkTreelet(treelet, children[i], s);
+            }
+        }
+
+        node->lc = children[0];
+        node->rc = children[1];
+        node->bounds = treelet.bounds[subset];
+        m_node_costs[node - &m_nodes[0]] = treelet.cost[subset];
+    }
+
+    void Bvh::Optimize(int iterations)
+    {
+        if (!m_root || m_root->type == kLeaf)
+            return;
+
+        m_node_costs.resize(m_nodes.size());
+        std::vector<Node*> order;
+        ComputeNodeCosts(m_root, order);
+
+        for (int iteration = 0; iteration < iterations; ++iteration)
+        {
+            // Split off enough subtrees to keep every thread busy, one level at a time. Their treelets never leave them
+            std::vector<Node*> top;
+            std::vector<Node*> subtrees(1, m_root);
+            std::vector<Node*> next;
+            size_t numsubtrees = static_cast<size_t>(MaxThreads() * kOptimizeSubtreesPerThread);
+            while (subtrees.size() < numsubtrees)
+            {
+                next.clear();
+                for (auto node : subtrees)
+                {
+                    if (node->type == kLeaf)
+                    {
+                        next.push_back(node);
+                    }
+                    else
+                    {
+                        top.push_back(node);
+                        next.push_back(node->lc);
+                        next.push_back(node->rc);
+                    }
+                }
+
+                if (next.size() == subtrees.size())
+                    break;
+                subtrees.swap(next);
+            }
+
+            int numtasks = static_cast<int>(subtrees.size());
+#pragma omp parallel
+            {
+                Treelet treelet;
+                std::vector<Node*> nodes;
+
+#pragma omp for schedule(dynamic, 1)
+                for (int i = 0; i < numtasks; ++i)
+                {
+                    ComputeNodeCosts(subtrees[i], nodes);
+                    for (auto node : nodes)
+                    {
+                        if (node->type == kInternal)
+                            OptimizeTreelet(node, treelet);
+                    }
+                }
+            }
+
+            // Nodes above the subtrees were split off parents first. Their costs changed with the subtrees
+            Treelet treelet;
+            for (auto it = top.rbegin(); it != top.rend(); ++it)
+            {
+                Node* node = *it;
+                m_node_costs[node - &m_nodes[0]] = node->bounds.surface_area() * m_traversal_cost + m_node_costs[node->lc - &m_nodes[0]] + m_node_costs[node->rc - &m_nodes[0]];
+                OptimizeTreelet(node, treelet);
+            }
+        }
+
+        // Restructuring changes the depth of the tree
+        ComputeNodeCosts(m_root, order);
+        m_height = 0;
+        std::vector<int> depths(m_nodes.size(), 0);
+        for (auto it = order.rbegin(); it != order.rend(); ++it)
+        {
+            Node* node = *it;
+            int depth = depths[node - &m_nodes[0]];
+            m_height = std::max(m_height, depth + 1);
+            if (node->type == kInternal)
+            {
+                depths[node->lc - &m_nodes[0]] = depth + 1;
+                depths[node->rc - &m_nodes[0]] = depth + 1;
+            }
+        }
+
+        m_node_costs.clear();
+        m_node_costs.shrink_to_fit();
+    }
 }
@@ -39,12 +39,15 @@ namespace RadeonRays
     class Bvh
     {
     public:
-        Bvh(float traversal_cost, int num_bins = 64, bool usesah = false)
+        Bvh(float traversal_cost, int num_bins = 64, bool usesah = false, int max_leaf_prims = 1)
             : m_root(nullptr)
             , m_num_bins(num_bins)
             , m_usesah(usesah)
             , m_height(0)
             , m_traversal_cost(traversal_cost)
+            , m_max_leaf_prims(max_leaf_prims)
+            , m_subtree_size(0)
+            , m_defer_subtrees(false)
         {
         }
 
@@ -70,6 +73,23 @@ namespace RadeonRays
 
         // Print BVH statistics
         virtual void PrintStatistics(std::ostream& os) const;
+
+        // SAH cost of the tree relative to the root area. Nodes cost m_traversal_cost, primitives cost 1
+        float GetSahCost() const;
+
+        // Restructures treelets of up to 7 leaves bottom up so they have the lowest SAH cost (TRBVH).
+        // Only the interior nodes change, leaves and primitive indices are kept
+        void Optimize(int iterations);
+
+        // Bytes used by the nodes and primitive indices of the built tree
+        size_t GetMemoryUsage() const;
+
+        // Binary serialization of the built tree. Build settings and the build scratch are not stored,
+        // a loaded tree can be traversed and optimized but not rebuilt with its original settings
+        // Loading fails unless every count and index fits a mesh of numprims primitives with at most maxrefs
+        // references, so a stale or corrupt file can't be used
+        void Save(std::ostream& os) const;
+        bool Load(std::istream& is, int numprims, int maxrefs);
     protected:
         // Build function
         virtual void BuildImpl(bbox const* bounds, int numbounds);
@@ -95,6 +115,8 @@ namespace RadeonRays
             int level;
             // Node index
             int index;
+            // Extra references the subtree may still create with spatial splits
+            int refbudget;
         };
 
         struct SahSplit
@@ -105,9 +127,53 @@ namespace RadeonRays
             float overlap;
         };
 
+        // Bin has bbox and occurence count
+        struct Bin
+        {
+            bbox bounds;
+            int count;
+        };
+
+        // Scratch owned by one build thread, allocated once per build
+        struct BuildScratch
+        {
+            // m_num_bins bins for each dimension
+            std::vector<Bin> bins;
+            std::vector<bbox> rightbounds;
+            // Deepest level reached by this thread
+            int height;
+        };
+
         void BuildNode(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices);
 
-        SahSplit FindSahSplit(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices) const;
+        SahSplit FindSahSplit(SplitRequest const& req, bbox const* bounds, Vec3 const* centroids, int* primindices);
+
+        // Sizes the per-thread scratch and the subtree size of a parallel build
+        void InitParallelBuild(int numprims);
+        // Scratch of the calling thread
+        BuildScratch& GetScratch();
+
+        // Fills 3 * m_num_bins bins with the primitives in [begin, end)
+        void BinPrimitives(SplitRequest const& req, int begin, int end, bbox const* bounds, Vec3 const* centroids, int const* primindices, Bin* bins) const;
+
+        // Treelet restructuring state for one treelet root, 2^7 subsets of the leaves
+        struct Treelet
+        {
+            Node* leaves[7];
+            Node* interior[6];
+            int numleaves;
+            int numinterior;
+            bbox bounds[128];
+            float cost[128];
+            int partition[128];
+        };
+
+        // Writes the subtree costs of all nodes below node and returns the nodes children first
+        void ComputeNodeCosts(Node* node, std::vector<Node*>& order);
+        // Replaces the treelet below root by its cheapest topology
+        void OptimizeTreelet(Node* root, Treelet& treelet);
+        // Links the nodes of the subset with the best partition found for it
+        void RelinkTreelet(Treelet& treelet, Node* node, int subset);
 
         // Enum for node type
         enum NodeType
@@ -138,6 +204,19 @@ namespace RadeonRays
         float m_traversal_cost;
         // Number of spatial bins to use for SAH
         int m_num_bins;
+        // Nodes with this many primitives or less become leaves
+        int m_max_leaf_prims;
+
+        // Parallel build state
+        // Subtrees up to this size are handed to a single thread
+        int m_subtree_size;
+        // Set while the top levels are built, collects subtree requests instead of recursing
+        bool m_defer_subtrees;
+        std::vector<SplitRequest> m_subtree_requests;
+        // One scratch per thread
+        std::vector<BuildScratch> m_scratch;
+        // SAH cost of the subtree below every node, used while optimizing
+        std::vector<float> m_node_costs;
 
 
     private:
@@ -22,67 +22,138 @@ THE SOFTWARE.
 
 //	Modified version of code from https://github.com/GPUOpen-LibrariesAndSDKs/RadeonRays_SDK 
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <stack>
 #include <iostream>
 #include "bvh_translator.h"
 
 namespace RadeonRays
 {
-    int BvhTranslator::ProcessBLASNodes(const Bvh::Node* node)
+    // Refitted top level trees are rebuilt once their SAH cost grows by this factor
+    static const float kMaxRefitCostRatio = 1.5f;
+
+    // Sibling pairs per treelet in the node layout. Four packed pairs span two 128 byte cache lines
+    static const int kTreeletPairs = 4;
+
+    // Children per compressed node
+    static const int kWideChildren = 4;
+    static_assert(sizeof(BvhTranslator::WideNode) == 64, "Shaders read a wide node as four integer texels");
+
+    static float SurfaceArea(const Vec3& pmin, const Vec3& pmax)
     {
-        RadeonRays::bbox bbox = node->bounds;
+        Vec3 extents = pmax - pmin;
+        return 2.f * (extents.x * extents.y + extents.x * extents.z + extents.y * extents.z);
+    }
 
-        nodes[curNode].bboxmin = bbox.pmin;
-        nodes[curNode].bboxmax = bbox.pmax;
-        nodes[curNode].LRLeaf.z = 0;
+    static bool SameBounds(const Vec3& pmin, const Vec3& pmax, const BvhTranslator::Node& node)
+    {
+        return pmin.x == node.bboxmin.x && pmin.y == node.bboxmin.y && pmin.z == node.bboxmin.z &&
+               pmax.x == node.bboxmax.x && pmax.y == node.bboxmax.y && pmax.z == node.bboxmax.z;
+    }
 
-        int index = curNode;
+    void BvhTranslator::ProcessBLASNode(const Bvh::Node* node, int index)
+    {
+        nodes[index].bboxmin = node->bounds.pmin;
+        nodes[index].bboxmax = node->bounds.pmax;
+        nodes[index].LRLeaf.z = 0;
 
         if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
         {
-            nodes[curNode].LRLeaf.x = curTriIndex + node->startidx;
-            nodes[curNode].LRLeaf.y = node->numprims;
-            nodes[curNode].LRLeaf.z = 1;
+            nodes[index].LRLeaf.x = curTriIndex + node->startidx;
+            nodes[index].LRLeaf.y = node->numprims;
+            nodes[index].LRLeaf.z = 1;
         }
-        else
-        {
-            curNode++;
-            nodes[index].LRLeaf.x = ProcessBLASNodes(node->lc);
-            curNode++;
-            nodes[index].LRLeaf.y = ProcessBLASNodes(node->rc);
-        }
-        return index;
     }
 
-    int BvhTranslator::ProcessTLASNodes(const Bvh::Node* node)
+    void BvhTranslator::ProcessTLASNode(const Bvh::Node* node, int index)
     {
-        RadeonRays::bbox bbox = node->bounds;
-
-        nodes[curNode].bboxmin = bbox.pmin;
-        nodes[curNode].bboxmax = bbox.pmax;
-        nodes[curNode].LRLeaf.z = 0;
-
-        int index = curNode;
+        nodes[index].bboxmin = node->bounds.pmin;
+        nodes[index].bboxmax = node->bounds.pmax;
+        nodes[index].LRLeaf.z = 0;
 
         if (node->type == RadeonRays::Bvh::NodeType::kLeaf)
         {
-            int instanceIndex = topLevelBvh->m_packed_indices[node->startidx];
-            int meshIndex = meshInstances[instanceIndex].meshID;
-            int materialID = meshInstances[instanceIndex].materialID;
+            int instanceIndex = level.bvh->m_packed_indices[node->startidx];
+            const GLSLPT::MeshInstance& instance = level.instances[instanceIndex];
 
-            nodes[curNode].LRLeaf.x = bvhRootStartIndices[meshIndex];
-            nodes[curNode].LRLeaf.y = materialID;
-            nodes[curNode].LRLeaf.z = -instanceIndex - 1;
+            // Group instances continue into the group tree and have no material
+            nodes[index].LRLeaf.x = instance.groupID >= 0 ? groupRootIndices[instance.groupID] : bvhRootStartIndices[instance.meshID];
+            nodes[index].LRLeaf.y = instance.materialID;
+            nodes[index].LRLeaf.z = -(level.firstRecord + instanceIndex) - 1;
         }
+    }
+
+    // Writes the tree starting at curNode with the root first. Siblings are stored next to each other, larger
+    // surface area first, so a traversal step finds both child boxes together. Nodes are grouped into treelets
+    // that grow towards the children most likely to be hit, and the remaining subtrees are laid out largest first
+    void BvhTranslator::LayoutNodes(const Bvh::Node* root, bool instanceTree)
+    {
+        typedef std::pair<const Bvh::Node*, int> NodeRef;
+
+        std::vector<NodeRef> treeletRoots;
+        std::vector<NodeRef> frontier;
+        if (instanceTree)
+            ProcessTLASNode(root, curNode);
         else
+            ProcessBLASNode(root, curNode);
+
+        if (root->type != RadeonRays::Bvh::NodeType::kLeaf)
+            treeletRoots.push_back(NodeRef(root, curNode));
+
+        while (!treeletRoots.empty())
         {
-            curNode++;
-            nodes[index].LRLeaf.x = ProcessTLASNodes(node->lc);
-            curNode++;
-            nodes[index].LRLeaf.y = ProcessTLASNodes(node->rc);
+            frontier.assign(1, treeletRoots.back());
+            treeletRoots.pop_back();
+
+            for (int pairs = 0; pairs < kTreeletPairs && !frontier.empty(); pairs++)
+            {
+                // Expand the interior node with the largest surface area
+                int best = 0;
+                for (int i = 1; i < (int)frontier.size(); i++)
+                {
+                    if (frontier[i].first->bounds.surface_area() > frontier[best].first->bounds.surface_area())
+                        best = i;
+                }
+                NodeRef parent = frontier[best];
+                frontier[best] = frontier.back();
+                frontier.pop_back();
+
+                const Bvh::Node* first = parent.first->lc;
+                const Bvh::Node* second = parent.first->rc;
+                if (second->bounds.surface_area() > first->bounds.surface_area())
+                    std::swap(first, second);
+
+                int left = ++curNode;
+                int right = ++curNode;
+                nodes[parent.second].LRLeaf.x = left;
+                nodes[parent.second].LRLeaf.y = right;
+
+                if (instanceTree)
+                {
+                    ProcessTLASNode(first, left);
+                    ProcessTLASNode(second, right);
+                }
+                else
+                {
+                    ProcessBLASNode(first, left);
+                    ProcessBLASNode(second, right);
+                }
+
+                if (first->type != RadeonRays::Bvh::NodeType::kLeaf)
+                    frontier.push_back(NodeRef(first, left));
+                if (second->type != RadeonRays::Bvh::NodeType::kLeaf)
+                    frontier.push_back(NodeRef(second, right));
+            }
+
+            // Subtrees left over become treelets of their own. The largest is popped first so it follows this treelet
+            std::sort(frontier.begin(), frontier.end(), [](const NodeRef& a, const NodeRef& b)
+            {
+                return a.first->bounds.surface_area() < b.first->bounds.surface_area();
+            });
+            treeletRoots.insert(treeletRoots.end(), frontier.begin(), frontier.end());
         }
-        return index;
     }
 
     void BvhTranslator::ProcessBLAS()
@@ -91,6 +162,8 @@ namespace RadeonRays
 
         for (int i = 0; i < meshes.size(); i++)
             nodeCnt += meshes[i]->bvh->m_nodecnt;
+        for (int i = 0; i < (int)instanceGroups.size(); i++)
+            nodeCnt += instanceGroups[i].bvh->m_nodecnt;
         topLevelIndex = nodeCnt;
 
         // reserve space for top level nodes
@@ -108,15 +181,30 @@ namespace RadeonRays
             bvhRootStartIndices.push_back(bvhRootIndex);
             bvhRootIndex += mesh->bvh->m_nodecnt;
 
-            ProcessBLASNodes(mesh->bvh->m_root);
+            LayoutNodes(mesh->bvh->m_root, false);
             curTriIndex += mesh->bvh->GetNumIndices();
         }
+
+        // Records of grouped instances follow the ones of the scene instances
+        for (int i = 0; i < (int)instanceGroups.size(); i++)
+        {
+            const GLSLPT::InstanceGroup& group = instanceGroups[i];
+            curNode = bvhRootIndex;
+
+            groupRootIndices.push_back(bvhRootIndex);
+            bvhRootIndex += group.bvh->m_nodecnt;
+
+            level = InstanceLevel{ group.bvh.get(), &groupedInstances[group.firstInstance], (int)meshInstances.size() + group.firstInstance };
+            LayoutNodes(group.bvh->m_root, true);
+        }
     }
 
     void BvhTranslator::ProcessTLAS()
     {
         curNode = topLevelIndex;
-        ProcessTLASNodes(topLevelBvh->m_root);
+        level = InstanceLevel{ topLevelBvh, meshInstances.data(), 0 };
+        LayoutNodes(topLevelBvh->m_root, true);
+        LinkTLASNodes();
     }
 
     void BvhTranslator::UpdateTLAS(const Bvh* topLevelBvh, const std::vector<GLSLPT::MeshInstance>& sceneInstances)
@@ -124,15 +212,297 @@ namespace RadeonRays
         this->topLevelBvh = topLevelBvh;
         meshInstances = sceneInstances;
         curNode = topLevelIndex;
-        ProcessTLASNodes(topLevelBvh->m_root);
+        level = InstanceLevel{ topLevelBvh, meshInstances.data(), 0 };
+        LayoutNodes(topLevelBvh->m_root, true);
+        LinkTLASNodes();
+
+        if (buildWideNodes)
+            CompressTLAS();
+    }
+
+    void BvhTranslator::LinkTLASNodes()
+    {
+        int numNodes = curNode + 1 - topLevelIndex;
+        topLevelParents.assign(numNodes, -1);
+        instanceLeaves.assign(meshInstances.size(), -1);
+
+        float area = 0.0f;
+        for (int i = topLevelIndex; i < topLevelIndex + numNodes; i++)
+        {
+            const Node& node = nodes[i];
+            if (node.LRLeaf.z < 0)
+            {
+                instanceLeaves[-(int)node.LRLeaf.z - 1] = i;
+            }
+            else
+            {
+                topLevelParents[(int)node.LRLeaf.x - topLevelIndex] = i;
+                topLevelParents[(int)node.LRLeaf.y - topLevelIndex] = i;
+                area += SurfaceArea(node.bboxmin, node.bboxmax);
+            }
+        }
+
+        float rootArea = SurfaceArea(nodes[topLevelIndex].bboxmin, nodes[topLevelIndex].bboxmax);
+        buildCost = refitCost = rootArea > 0.0f ? area / rootArea : 0.0f;
+
+        // Everything has to be sent again
+        dirtyBegin = topLevelIndex;
+        dirtyEnd = topLevelIndex + numNodes;
+    }
+
+    bool BvhTranslator::RefitTLAS(int instanceIndex, const bbox& bounds, int materialID)
+    {
+        int index = instanceLeaves[instanceIndex];
+        nodes[index].bboxmin = bounds.pmin;
+        nodes[index].bboxmax = bounds.pmax;
+        nodes[index].LRLeaf.y = materialID;
+        meshInstances[instanceIndex].materialID = materialID;
+
+        dirtyBegin = dirtyEnd > dirtyBegin ? std::min(dirtyBegin, index) : index;
+        dirtyEnd = std::max(dirtyEnd, index + 1);
+
+        float oldRootArea = SurfaceArea(nodes[topLevelIndex].bboxmin, nodes[topLevelIndex].bboxmax);
+        float area = refitCost * oldRootArea;
+
+        // Walk up until a node no longer changes
+        for (int parent = topLevelParents[index - topLevelIndex]; parent != -1; parent = topLevelParents[parent - topLevelIndex])
+        {
+            Node& node = nodes[parent];
+            const Node& left = nodes[(int)node.LRLeaf.x];
+            const Node& right = nodes[(int)node.LRLeaf.y];
+
+            Vec3 bboxmin = Vec3::Min(left.bboxmin, right.bboxmin);
+            Vec3 bboxmax = Vec3::Max(left.bboxmax, right.bboxmax);
+            if (SameBounds(bboxmin, bboxmax, node))
+                break;
+
+            area += SurfaceArea(bboxmin, bboxmax) - SurfaceArea(node.bboxmin, node.bboxmax);
+            node.bboxmin = bboxmin;
+            node.bboxmax = bboxmax;
+            dirtyBegin = std::min(dirtyBegin, parent);
+        }
+
+        float rootArea = SurfaceArea(nodes[topLevelIndex].bboxmin, nodes[topLevelIndex].bboxmax);
+        refitCost = rootArea > 0.0f ? area / rootArea : 0.0f;
+
+        if (refitCost > buildCost * kMaxRefitCostRatio)
+            return false;
+
+        if (buildWideNodes)
+            CompressTLAS();
+        return true;
     }
 
-    void BvhTranslator::Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& sceneMeshes, const std::vector<GLSLPT::MeshInstance>& sceneInstances)
+    bbox BvhTranslator::GetTLASBounds() const
+    {
+        return bbox(nodes[topLevelIndex].bboxmin, nodes[topLevelIndex].bboxmax);
+    }
+
+    const std::vector<int>& BvhTranslator::GetBLASRootIndices() const
+    {
+        return bvhRootStartIndices;
+    }
+
+    const std::vector<int>& BvhTranslator::GetGroupRootIndices() const
+    {
+        return groupRootIndices;
+    }
+
+    void BvhTranslator::PackNodes(int begin, int end, std::vector<PackedNode>& packedNodes) const
+    {
+        packedNodes.resize(end - begin);
+
+        for (int i = begin; i < end; i++)
+        {
+            const Node& node = nodes[i];
+            PackedNode& packed = packedNodes[i - begin];
+            packed.bboxmin = node.bboxmin;
+            packed.bboxmax = node.bboxmax;
+            packed.child = (int)node.LRLeaf.x;
+
+            if (node.LRLeaf.z > 0)
+                packed.count = (int)node.LRLeaf.y;
+            else if (node.LRLeaf.z < 0)
+                packed.count = (int)node.LRLeaf.z;
+            else
+            {
+                // The last reserved top level node is never written
+                assert(i > curNode || (int)node.LRLeaf.y == packed.child + 1);
+                packed.count = 0;
+            }
+        }
+    }
+
+    void BvhTranslator::Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& sceneMeshes, const std::vector<GLSLPT::MeshInstance>& sceneInstances,
+                                const std::vector<GLSLPT::InstanceGroup>& groups, const std::vector<GLSLPT::MeshInstance>& sceneGroupedInstances)
     {
         this->topLevelBvh = topLevelBvh;
         meshes = sceneMeshes;
         meshInstances = sceneInstances;
+        instanceGroups = groups;
+        groupedInstances = sceneGroupedInstances;
         ProcessBLAS();
         ProcessTLAS();
+
+        if (buildWideNodes)
+        {
+            CompressBLAS();
+            CompressTLAS();
+        }
+    }
+
+    void BvhTranslator::CompressBLAS()
+    {
+        // A wide node holds at least two children so a tree never needs more than half of its binary nodes
+        int maxNodes = 0;
+        for (int i = 0; i < (int)meshes.size(); i++)
+            maxNodes += std::max(1, meshes[i]->bvh->m_nodecnt / 2);
+        for (int i = 0; i < (int)instanceGroups.size(); i++)
+            maxNodes += std::max(1, instanceGroups[i].bvh->m_nodecnt / 2);
+        wideNodes.resize(maxNodes);
+
+        int next = 0;
+        wideRootIndices.resize(meshes.size());
+        for (int i = 0; i < (int)meshes.size(); i++)
+        {
+            wideRootIndices[i] = next;
+            next = CompressTree(bvhRootStartIndices[i], next);
+        }
+
+        wideGroupRootIndices.resize(instanceGroups.size());
+        for (int i = 0; i < (int)instanceGroups.size(); i++)
+        {
+            wideGroupRootIndices[i] = next;
+            next = CompressTree(groupRootIndices[i], next);
+        }
+
+        // Room for the top level nodes, which keep their place across rebuilds
+        wideTopLevelIndex = next;
+        wideNodes.resize(next + std::max(1, (int)meshInstances.size() - 1));
+    }
+
+    void BvhTranslator::CompressTLAS()
+    {
+        std::fill(wideNodes.begin() + wideTopLevelIndex, wideNodes.end(), WideNode());
+        int end = CompressTree(topLevelIndex, wideTopLevelIndex);
+        assert(end <= (int)wideNodes.size());
+        (void)end;
+    }
+
+    int BvhTranslator::CompressTree(int root, int wideIndex)
+    {
+        int next = wideIndex + 1;
+        std::vector<std::pair<int, int>> stack(1, std::make_pair(root, wideIndex));
+
+        while (!stack.empty())
+        {
+            int index = stack.back().first;
+            WideNode& wide = wideNodes[stack.back().second];
+            stack.pop_back();
+
+            // Open the interior child with the largest area until there are four children.
+            // A leaf root ends up as the only child of its wide node
+            int children[kWideChildren] = { index };
+            int numChildren = 1;
+            if (nodes[index].LRLeaf.z == 0)
+            {
+                children[0] = (int)nodes[index].LRLeaf.x;
+                children[1] = (int)nodes[index].LRLeaf.y;
+                numChildren = 2;
+            }
+
+            while (numChildren < kWideChildren)
+            {
+                int best = -1;
+                float bestArea = -1.0f;
+                for (int c = 0; c < numChildren; c++)
+                {
+                    const Node& child = nodes[children[c]];
+                    float area = SurfaceArea(child.bboxmin, child.bboxmax);
+                    if (child.LRLeaf.z == 0 && area > bestArea)
+                    {
+                        best = c;
+                        bestArea = area;
+                    }
+                }
+
+                if (best == -1)
+                    break;
+
+                const Node& opened = nodes[children[best]];
+                children[best] = (int)opened.LRLeaf.x;
+                children[numChildren++] = (int)opened.LRLeaf.y;
+            }
+
+            Vec3 pmin = nodes[children[0]].bboxmin;
+            Vec3 pmax = nodes[children[0]].bboxmax;
+            for (int c = 1; c < numChildren; c++)
+            {
+                pmin = Vec3::Min(pmin, nodes[children[c]].bboxmin);
+                pmax = Vec3::Max(pmax, nodes[children[c]].bboxmax);
+            }
+
+            wide = WideNode();
+            wide.origin = pmin;
+            wide.numChildren = numChildren;
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                // Smallest power of two spacing that covers the parent with 255 steps. The extent is rounded, so
+                // the loop checks the decoded maximum itself or the top step could fall short of the parent
+                float extent = pmax[axis] - pmin[axis];
+                int exponent = extent > 0.0f ? std::max(-126, std::min(127, (int)ceilf(log2f(extent / 255.0f)))) : -126;
+                while (exponent < 127 && pmin[axis] + ldexpf(255.0f, exponent) < pmax[axis])
+                    exponent++;
+
+                float origin = pmin[axis];
+                float scale = ldexpf(1.0f, exponent);
+                wide.exponents[axis] = (uint8_t)(exponent + 127);
+
+                // Minimums round down and maximums round up. The shaders decode origin + scale * q, where the
+                // product is exact, so checking the rounding of the sum here keeps every decoded box conservative
+                for (int c = 0; c < numChildren; c++)
+                {
+                    float lo = nodes[children[c]].bboxmin[axis];
+                    float hi = nodes[children[c]].bboxmax[axis];
+
+                    int qlo = std::max(0, std::min(255, (int)floorf((lo - origin) / scale)));
+                    while (qlo > 0 && origin + scale * qlo > lo)
+                        qlo--;
+
+                    int qhi = std::max(0, std::min(255, (int)ceilf((hi - origin) / scale)));
+                    while (qhi < 255 && origin + scale * qhi < hi)
+                        qhi++;
+
+                    assert(origin + scale * qlo <= lo && origin + scale * qhi >= hi);
+                    wide.qlo[axis][c] = (uint8_t)qlo;
+                    wide.qhi[axis][c] = (uint8_t)qhi;
+                }
+            }
+
+            for (int c = 0; c < numChildren; c++)
+            {
+                const Node& child = nodes[children[c]];
+                if (child.LRLeaf.z > 0)
+                {
+                    assert(child.LRLeaf.y < 32768);
+                    wide.children[c] = (int)child.LRLeaf.x;
+                    wide.counts[c] = (int16_t)child.LRLeaf.y;
+                }
+                else if (child.LRLeaf.z < 0)
+                {
+                    wide.children[c] = -(int)child.LRLeaf.z - 1;
+                    wide.counts[c] = -1;
+                }
+                else
+                {
+                    wide.children[c] = next;
+                    wide.counts[c] = 0;
+                    stack.push_back(std::make_pair(children[c], next++));
+                }
+            }
+        }
+
+        return next;
     }
 }
@@ -27,6 +27,7 @@ THE SOFTWARE.
 #ifndef BVH_TRANSLATOR_H
 #define BVH_TRANSLATOR_H
 
+#include <cstdint>
 #include <map>
 #include "bvh.h"
 #include "Mesh.h"
@@ -49,21 +50,93 @@ namespace RadeonRays
             Vec3 LRLeaf;
         };
 
+        // 32 byte node with integer links. Siblings are always stored next to each other
+        // so interior nodes only keep the index of their first child
+        struct PackedNode
+        {
+            Vec3 bboxmin;
+            int child;  // First child, first primitive of a BLAS leaf or BLAS root of an instance
+            Vec3 bboxmax;
+            int count;  // 0 for interior nodes, primitive count of a BLAS leaf or -instance-1 for an instance leaf
+        };
+
+        // 64 byte node of a 4-wide BVH. Child bounds are quantized to 8 bits on a grid that starts at origin
+        // and has a power of two spacing per axis, rounded outwards so they stay conservative
+        struct WideNode
+        {
+            Vec3 origin;
+            uint8_t exponents[3];   // Grid spacing is 2^(exponent-127), the exponent field of a float
+            uint8_t numChildren;
+            uint8_t qlo[3][4];      // [axis][child]
+            uint8_t qhi[3][4];
+            int16_t counts[4];      // 0 for interior children, primitive count of a BLAS leaf or -1 for an instance
+            int children[4];        // Wide node, first primitive of a BLAS leaf or instance record
+        };
+
         void ProcessBLAS();
         void ProcessTLAS();
         void UpdateTLAS(const Bvh* topLevelBvh, const std::vector<GLSLPT::MeshInstance>& instances);
-        void Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances);
+        void Process(const Bvh* topLevelBvh, const std::vector<GLSLPT::Mesh*>& meshes, const std::vector<GLSLPT::MeshInstance>& instances,
+                     const std::vector<GLSLPT::InstanceGroup>& groups, const std::vector<GLSLPT::MeshInstance>& groupedInstances);
+
+        // Moves the leaf of one instance and refits the top level nodes above it.
+        // Returns false once refitting has degraded the tree enough that it should be rebuilt
+        bool RefitTLAS(int instanceIndex, const bbox& bounds, int materialID);
+        bbox GetTLASBounds() const;
+        // Converts nodes [begin, end) to the packed layout
+        void PackNodes(int begin, int end, std::vector<PackedNode>& packedNodes) const;
+        // Root node of every mesh BVH
+        const std::vector<int>& GetBLASRootIndices() const;
+        // Root node of every instance group BVH. Group trees follow the mesh BVHs and have instance leaves
+        // like the top level, whose leaves point at a group root for group instances
+        const std::vector<int>& GetGroupRootIndices() const;
+
+        // Also keep a 4-wide compressed copy of the hierarchy. Mesh and group BVHs come first and the top level
+        // nodes are rebuilt in place whenever the top level BVH is refit or rebuilt
+        bool buildWideNodes = false;
+        std::vector<WideNode> wideNodes;
+        std::vector<int> wideRootIndices;
+        std::vector<int> wideGroupRootIndices;
+        int wideTopLevelIndex = 0;
+
         int topLevelIndex = 0;
         std::vector<Node> nodes;
         int nodeTexWidth;
 
+        // Range of nodes modified since the last upload
+        int dirtyBegin = 0;
+        int dirtyEnd = 0;
+
     private:
         int curNode = 0;
         int curTriIndex = 0;
         std::vector<int> bvhRootStartIndices;
-        int ProcessBLASNodes(const Bvh::Node* root);
-        int ProcessTLASNodes(const Bvh::Node* root);
+        std::vector<int> groupRootIndices;
+        void ProcessBLASNode(const Bvh::Node* node, int index);
+        void ProcessTLASNode(const Bvh::Node* node, int index);
+        void LayoutNodes(const Bvh::Node* root, bool instanceTree);
+        // Instance tree being laid out, the top level or a group. Leaves store the record firstRecord + instance
+        struct InstanceLevel
+        {
+            const Bvh* bvh;
+            const GLSLPT::MeshInstance* instances;
+            int firstRecord;
+        };
+        InstanceLevel level;
+        void LinkTLASNodes();
+        void CompressBLAS();
+        void CompressTLAS();
+        // Writes the wide nodes of the binary tree below root from wideIndex on, returns the next free wide node
+        int CompressTree(int root, int wideIndex);
+        // Parent of every top level node (-1 for the root) and the leaf of every instance
+        std::vector<int> topLevelParents;
+        std::vector<int> instanceLeaves;
+        // Sum of the top level interior node areas relative to the root, at build time and now
+        float buildCost = 0.0f;
+        float refitCost = 0.0f;
         std::vector<GLSLPT::MeshInstance> meshInstances;
+        std::vector<GLSLPT::InstanceGroup> instanceGroups;
+        std::vector<GLSLPT::MeshInstance> groupedInstances;
         std::vector<GLSLPT::Mesh*> meshes;
         const Bvh* topLevelBvh;
     };
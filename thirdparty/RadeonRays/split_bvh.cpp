@@ -23,59 +23,159 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <numeric>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "split_bvh.h"
 
 using namespace std;
 
 namespace RadeonRays
 {
+    // Nodes at least this big bin and split their references on all threads
+    static int constexpr kMinParallelSplitPrims = 1 << 16;
+    // Number of bins for spatial splits
+    static int constexpr kNumSpatialBins = 128;
+
+    // Surface area of the overlap of two boxes, zero if they are disjoint
+    static float OverlapArea(bbox const& box1, bbox const& box2)
+    {
+        Vec3 ext = Vec3::Max(Vec3::Min(box1.pmax, box2.pmax) - Vec3::Max(box1.pmin, box2.pmin), Vec3(0.f, 0.f, 0.f));
+        return 2.f * (ext.x * ext.y + ext.x * ext.z + ext.y * ext.z);
+    }
+
+    static bool IsEmpty(bbox const& box)
+    {
+        return box.pmin.x > box.pmax.x || box.pmin.y > box.pmax.y || box.pmin.z > box.pmax.z;
+    }
+
+    void SplitBvh::SetTriangles(Vec4 const* vertices)
+    {
+        m_vertices = vertices;
+    }
+
+    int SplitBvh::GetNumExtraRefs() const
+    {
+        return static_cast<int>(m_packed_indices.size()) - (m_num_nodes_for_regular + 1) / 2;
+    }
+
     void SplitBvh::BuildImpl(bbox const* bounds, int numbounds)
     {
         // Initialize prim refs structures
-        PrimRefArray primrefs(numbounds);
+        SubtreeBuild root;
+        root.refs.resize(numbounds);
+        root.height = 0;
 
         // Keep centroids to speed up partitioning
-        std::vector<Vec3> centroids(numbounds);
         bbox centroid_bounds;
 
-        for (auto i = 0; i < numbounds; ++i)
+#pragma omp parallel
         {
-            primrefs[i] = PrimRef{ bounds[i], bounds[i].center(), i };
+            bbox threadbounds;
 
-            auto c = bounds[i].center();
-            centroid_bounds.grow(c);
+#pragma omp for nowait
+            for (int i = 0; i < numbounds; ++i)
+            {
+                auto c = bounds[i].center();
+                root.refs[i] = PrimRef{ bounds[i], c, i };
+                threadbounds.grow(c);
+            }
+
+#pragma omp critical
+            centroid_bounds.grow(threadbounds);
         }
 
+        // The budget caps the number of references and with it the number of nodes,
+        // so nodes are allocated once and can be handed out to all threads
+        int refbudget = static_cast<int>(numbounds * m_extra_refs_budget);
         m_num_nodes_for_regular = (2 * numbounds - 1);
-        m_num_nodes_required = (int)(m_num_nodes_for_regular * (1.f + m_extra_refs_budget));
+        m_num_nodes_required = 2 * (numbounds + refbudget) - 1;
 
         InitNodeAllocator(m_num_nodes_required);
+        InitParallelBuild(numbounds);
+
+        float rootarea = m_bounds.surface_area();
+        m_inv_root_area = rootarea > 0.f ? 1.f / rootarea : 0.f;
 
-        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0 };
+        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1, refbudget };
 
-        // Start from the top
-        BuildNode(init, primrefs);
+        // Split the top levels on this thread, binning and splitting big nodes on all threads
+        m_subtrees.clear();
+        m_defer_subtrees = true;
+        BuildNode(init, root);
+        m_defer_subtrees = false;
+
+        // Then build the remaining subtrees independently, largest first.
+        // Every subtree owns its references and gets a share of the budget of its parent
+        std::vector<int> order(m_subtrees.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(),
+            [this](int a, int b) { return m_subtrees[a].req.numprims > m_subtrees[b].req.numprims; });
+
+        int numsubtrees = static_cast<int>(m_subtrees.size());
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int i = 0; i < numsubtrees; ++i)
+        {
+            SubtreeBuild& build = m_subtrees[order[i]];
+            BuildNode(build.req, build);
+            PrimRefArray().swap(build.refs);
+        }
+
+        // Gather the leaf indices of all subtrees
+        m_packed_indices = std::move(root.indices);
+        m_height = root.height;
+
+        for (auto& build : m_subtrees)
+        {
+            int offset = static_cast<int>(m_packed_indices.size());
+            for (auto leaf : build.leaves)
+            {
+                leaf->startidx += offset;
+            }
+
+            m_packed_indices.insert(m_packed_indices.end(), build.indices.begin(), build.indices.end());
+            m_height = std::max(m_height, build.height);
+        }
+
+        m_subtrees.clear();
     }
 
-    void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
+    void SplitBvh::BuildNode(SplitRequest& req, SubtreeBuild& build)
     {
+        // Top levels only split, the subtrees below are built later on all threads
+        if (m_defer_subtrees && req.numprims <= m_subtree_size)
+        {
+            SubtreeBuild subtree;
+            subtree.req = req;
+            subtree.req.startidx = 0;
+            subtree.refs.assign(build.refs.begin() + req.startidx, build.refs.begin() + req.startidx + req.numprims);
+            subtree.height = 0;
+            m_subtrees.push_back(std::move(subtree));
+            return;
+        }
+
+        PrimRefArray& primrefs = build.refs;
+
         // Update current height
-        m_height = std::max(m_height, req.level);
+        build.height = std::max(build.height, req.level);
 
         // Allocate new node
         Node* node = AllocateNode();
         node->bounds = req.bounds;
+        node->index = req.index;
 
         // Create leaf node if we have enough prims
         if (req.numprims < 4)
         {
             node->type = kLeaf;
-            node->startidx = (int)m_packed_indices.size();
+            node->startidx = (int)build.indices.size();
             node->numprims = req.numprims;
+            build.leaves.push_back(node);
 
             for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
             {
-                m_packed_indices.push_back(primrefs[i].idx);
+                build.indices.push_back(primrefs[i].idx);
             }
         }
         else
@@ -89,36 +189,38 @@ namespace RadeonRays
             SahSplit os = FindObjectSahSplit(req, primrefs);
             SahSplit ss;
             auto split_type = SplitType::kObject;
+            int extra_refs = 0;
 
             // Only use split if
             // 1. Maximum depth is not exceeded
-            // 2. We found spatial split
-            // 3. It is better than object split
-            // 4. Object split is not good enought (too much overlap)
-            // 5. Our node budget still allows us to split references
-            if (req.level < m_max_split_depth && m_nodecnt < m_num_nodes_required && os.overlap > m_min_overlap)
+            // 2. Object split is not good enought (too much overlap relative to the root)
+            // 3. We found spatial split
+            // 4. It is better than object split
+            // 5. The budget of this subtree still allows us to split references
+            if (req.level < m_max_split_depth && req.refbudget > 0 && os.overlap * m_inv_root_area > m_min_overlap)
             {
                 ss = FindSpatialSahSplit(req, primrefs);
 
                 if (!isnan(ss.split) &&
                     ss.sah < os.sah)
                 {
-                    split_type = SplitType::kSpatial;
+                    // Right pieces are appended behind the refs of this request
+                    size_t elems = req.startidx + req.numprims + std::min(req.numprims, req.refbudget);
+                    if (primrefs.size() < elems)
+                    {
+                        primrefs.resize(elems);
+                    }
+
+                    // Split prim refs and add extra refs to request
+                    if (SplitPrimRefs(ss, req, primrefs, extra_refs))
+                    {
+                        split_type = SplitType::kSpatial;
+                    }
                 }
             }
 
             if (split_type == SplitType::kSpatial)
             {
-                // First we need maximum 2x numprims elements allocated
-                size_t elems = req.startidx + req.numprims * 2;
-                if (primrefs.size() < elems)
-                {
-                    primrefs.resize(elems);
-                }
-
-                // Split prim refs and add extra refs to request
-                int extra_refs = 0;
-                SplitPrimRefs(ss, req, primrefs, extra_refs);
                 req.numprims += extra_refs;
                 border = ss.split;
                 axis = ss.dim;
@@ -196,20 +298,25 @@ namespace RadeonRays
                 }
             }
 
+            // What is left of the budget is shared in proportion to the children sizes
+            int leftcount = splitidx - req.startidx;
+            int refbudget = req.refbudget - extra_refs;
+            int leftbudget = static_cast<int>(static_cast<long long>(refbudget) * leftcount / req.numprims);
+
             // Left request
-            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1 };
+            SplitRequest leftrequest = { req.startidx, leftcount, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1, (req.index << 1), leftbudget };
             // Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1 };
+            SplitRequest rightrequest = { splitidx, req.numprims - leftcount, &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1, refbudget - leftbudget };
 
 
             // The order is very important here since right node uses the space at the end of the array to partition
             {
-                BuildNode(rightrequest, primrefs);
+                BuildNode(rightrequest, build);
             }
 
             {
                 // Put those to stack
-                BuildNode(leftrequest, primrefs);
+                BuildNode(leftrequest, build);
             }
         }
 
@@ -217,7 +324,40 @@ namespace RadeonRays
         if (req.ptr) *req.ptr = node;
     }
 
-    SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(SplitRequest const& req, PrimRefArray const& refs) const
+    void SplitBvh::BinObjects(SplitRequest const& req, PrimRefArray const& refs, int begin, int end, Bin* bins) const
+    {
+        Vec3 rootmin = req.centroid_bounds.pmin;
+        Vec3 centroid_extents = req.centroid_bounds.extents();
+        Vec3 invcentroid_rng;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            invcentroid_rng[axis] = 1.f / centroid_extents[axis];
+
+            for (int i = 0; i < m_num_bins; ++i)
+            {
+                bins[axis * m_num_bins + i].count = 0;
+                bins[axis * m_num_bins + i].bounds = bbox();
+            }
+        }
+
+        for (int i = begin; i < end; ++i)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                // If the box is degenerate in that dimension skip it
+                if (centroid_extents[axis] == 0.f) continue;
+
+                auto binidx = (int)std::min<float>(static_cast<float>(m_num_bins) * ((refs[i].center[axis] - rootmin[axis]) * invcentroid_rng[axis]), static_cast<float>(m_num_bins - 1));
+
+                Bin& bin = bins[axis * m_num_bins + binidx];
+                ++bin.count;
+                bin.bounds.grow(refs[i].bounds);
+            }
+        }
+    }
+
+    SplitBvh::SahSplit SplitBvh::FindObjectSahSplit(SplitRequest const& req, PrimRefArray const& refs)
     {
         // SAH implementation
         // calc centroids histogram
@@ -229,6 +369,7 @@ namespace RadeonRays
         split.dim = 0;
         split.split = std::numeric_limits<float>::quiet_NaN();
         split.sah = sah;
+        split.overlap = 0.f;
 
         // if we cannot apply histogram algorithm
         // put NAN sentinel as split border
@@ -240,18 +381,38 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has bbox and occurence count
-        struct Bin
+        Bin* bins = &GetScratch().bins[0];
+        bbox* rightbounds = &GetScratch().rightbounds[0];
+
+        // Calc primitive refs histogram
+        int numblocks = static_cast<int>(m_scratch.size());
+        if (m_defer_subtrees && numblocks > 1 && req.numprims >= kMinParallelSplitPrims)
         {
-            bbox bounds;
-            int count;
-        };
+            // Only reached while the top levels are built on one thread, so every scratch is free
+            // to hold the bins of one block
+#pragma omp parallel for schedule(static, 1)
+            for (int block = 0; block < numblocks; ++block)
+            {
+                int begin = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * block / numblocks);
+                int end = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * (block + 1) / numblocks);
+                BinObjects(req, refs, begin, end, &m_scratch[block].bins[0]);
+            }
 
-        // Keep bins for each dimension
-        std::vector<Bin> bins[3];
-        bins[0].resize(m_num_bins);
-        bins[1].resize(m_num_bins);
-        bins[2].resize(m_num_bins);
+            bins = &m_scratch[0].bins[0];
+            for (int block = 1; block < numblocks; ++block)
+            {
+                Bin const* blockbins = &m_scratch[block].bins[0];
+                for (int i = 0; i < 3 * m_num_bins; ++i)
+                {
+                    bins[i].count += blockbins[i].count;
+                    bins[i].bounds.grow(blockbins[i].bounds);
+                }
+            }
+        }
+        else
+        {
+            BinObjects(req, refs, req.startidx, req.startidx + req.numprims, bins);
+        }
 
         // Precompute inverse parent area
         auto invarea = 1.f / req.bounds.surface_area();
@@ -261,38 +422,16 @@ namespace RadeonRays
         // Evaluate all dimensions
         for (int axis = 0; axis < 3; ++axis)
         {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            auto centroid_rng = centroid_extents[axis];
-            auto invcentroid_rng = 1.f / centroid_rng;
-
             // If the box is degenerate in that dimension skip it
-            if (centroid_rng == 0.f) continue;
-
-            // Initialize bins
-            for (int i = 0; i < m_num_bins; ++i)
-            {
-                bins[axis][i].count = 0;
-                bins[axis][i].bounds = bbox();
-            }
-
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
-            {
-                auto idx = i;
-                auto binidx = (int)std::min<float>(static_cast<float>(m_num_bins) * ((refs[idx].center[axis] - rootminc) * invcentroid_rng), static_cast<float>(m_num_bins - 1));
-
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.grow(refs[idx].bounds);
-            }
+            if (centroid_extents[axis] == 0.f) continue;
 
-            std::vector<bbox> rightbounds(m_num_bins - 1);
+            Bin const* axisbins = bins + axis * m_num_bins;
 
             // Start with 1-bin right box
             bbox rightbox = bbox();
             for (int i = m_num_bins - 1; i > 0; --i)
             {
-                rightbox.grow(bins[axis][i].bounds);
+                rightbox.grow(axisbins[i].bounds);
                 rightbounds[i - 1] = rightbox;
             }
 
@@ -305,9 +444,9 @@ namespace RadeonRays
             float sahtmp = 0.f;
             for (int i = 0; i < m_num_bins - 1; ++i)
             {
-                leftbox.grow(bins[axis][i].bounds);
-                leftcount += bins[axis][i].count;
-                rightcount -= bins[axis][i].count;
+                leftbox.grow(axisbins[i].bounds);
+                leftcount += axisbins[i].count;
+                rightcount -= axisbins[i].count;
 
                 // Compute SAH
                 sahtmp = m_traversal_cost + (leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area()) * invarea;
@@ -319,8 +458,8 @@ namespace RadeonRays
                     splitidx = i;
                     sah = sahtmp;
 
-                    // Calculate percentage of overlap 
-                    split.overlap = intersection(leftbox, rightbounds[i]).surface_area() * invarea;
+                    // Calculate the overlap of the children
+                    split.overlap = OverlapArea(leftbox, rightbounds[i]);
                 }
             }
         }
@@ -336,68 +475,37 @@ namespace RadeonRays
         return split;
     }
 
-    SplitBvh::SahSplit SplitBvh::FindSpatialSahSplit(SplitRequest const& req, PrimRefArray const& refs) const
+    void SplitBvh::BinSpatial(SplitRequest const& req, PrimRefArray const& refs, int begin, int end, SpatialBin* bins) const
     {
-        // SAH implementation
-        // calc centroids histogram
-        int const kNumBins = 128;
-        // Set SAH to maximum float value as a start
-        auto sah = std::numeric_limits<float>::max();
-        SahSplit split;
-        split.dim = 0;
-        split.split = std::numeric_limits<float>::quiet_NaN();
-        split.sah = sah;
-
-
-        // Extents
-        Vec3 extents = req.bounds.extents();
-        auto invarea = 1.f / req.bounds.surface_area();
-
-        // If there are too few primitives don't split them
-        if (Vec3::Dot(extents, extents) == 0.f)
-        {
-            return split;
-        }
-
-        // Bin has start and exit counts + bounds
-        struct Bin
-        {
-            bbox bounds;
-            int enter;
-            int exit;
-        };
-
-        Bin bins[3][kNumBins];
-
         // Prepcompute some useful stuff
+        Vec3 extents = req.bounds.extents();
         Vec3 origin = req.bounds.pmin;
-        Vec3 binsize = req.bounds.extents() * (1.f / kNumBins);
+        Vec3 binsize = req.bounds.extents() * (1.f / kNumSpatialBins);
         Vec3 invbinsize = Vec3(1.f / binsize.x, 1.f / binsize.y, 1.f / binsize.z);
 
         // Initialize bins
-        for (int axis = 0; axis < 3; ++axis)
+        for (int i = 0; i < 3 * kNumSpatialBins; ++i)
         {
-            for (int i = 0; i < kNumBins; ++i)
-            {
-                bins[axis][i].bounds = bbox();
-                bins[axis][i].enter = 0;
-                bins[axis][i].exit = 0;
-            }
+            bins[i].bounds = bbox();
+            bins[i].enter = 0;
+            bins[i].exit = 0;
         }
 
         // Iterate thru all primitive refs
-        for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+        for (int i = begin; i < end; ++i)
         {
             PrimRef const& primref(refs[i]);
             // Determine starting bin for this primitive
-            Vec3 firstbin = Vec3::Clamp((primref.bounds.pmin - origin) * invbinsize, Vec3(0, 0, 0), Vec3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
+            Vec3 firstbin = Vec3::Clamp((primref.bounds.pmin - origin) * invbinsize, Vec3(0, 0, 0), Vec3(kNumSpatialBins - 1, kNumSpatialBins - 1, kNumSpatialBins - 1));
             // Determine finishing bin
-            Vec3 lastbin = Vec3::Clamp((primref.bounds.pmax - origin) * invbinsize, firstbin, Vec3(kNumBins - 1, kNumBins - 1, kNumBins - 1));
+            Vec3 lastbin = Vec3::Clamp((primref.bounds.pmax - origin) * invbinsize, firstbin, Vec3(kNumSpatialBins - 1, kNumSpatialBins - 1, kNumSpatialBins - 1));
             // Iterate over axis
             for (int axis = 0; axis < 3; ++axis)
             {
                 // Skip in case of a degenerate dimension
                 if (extents[axis] == 0.f) continue;
+
+                SpatialBin* axisbins = bins + axis * kNumSpatialBins;
                 // Break the prim into bins
                 auto tempref = primref;
 
@@ -409,21 +517,79 @@ namespace RadeonRays
                     if (SplitPrimRef(tempref, axis, splitval, leftref, rightref))
                     {
                         // Add left one
-                        bins[axis][j].bounds.grow(leftref.bounds);
+                        axisbins[j].bounds.grow(leftref.bounds);
                         // Save right to add part of it into the next bin
                         tempref = rightref;
                     }
                 }
                 // Add the last piece into the last bin
-                bins[axis][(int)lastbin[axis]].bounds.grow(tempref.bounds);
+                axisbins[(int)lastbin[axis]].bounds.grow(tempref.bounds);
                 // Adjust enter & exit counters
-                bins[axis][(int)firstbin[axis]].enter++;
-                bins[axis][(int)lastbin[axis]].exit++;
+                axisbins[(int)firstbin[axis]].enter++;
+                axisbins[(int)lastbin[axis]].exit++;
+            }
+        }
+    }
+
+    SplitBvh::SahSplit SplitBvh::FindSpatialSahSplit(SplitRequest const& req, PrimRefArray const& refs) const
+    {
+        // SAH implementation
+        // Set SAH to maximum float value as a start
+        auto sah = std::numeric_limits<float>::max();
+        SahSplit split;
+        split.dim = 0;
+        split.split = std::numeric_limits<float>::quiet_NaN();
+        split.sah = sah;
+
+
+        // Extents
+        Vec3 extents = req.bounds.extents();
+        auto invarea = 1.f / req.bounds.surface_area();
+
+        // If there are too few primitives don't split them
+        if (Vec3::Dot(extents, extents) == 0.f)
+        {
+            return split;
+        }
+
+        SpatialBin bins[3 * kNumSpatialBins];
+
+        int numblocks = static_cast<int>(m_scratch.size());
+        if (m_defer_subtrees && numblocks > 1 && req.numprims >= kMinParallelSplitPrims)
+        {
+            std::vector<SpatialBin> blockbins(numblocks * 3 * kNumSpatialBins);
+
+#pragma omp parallel for schedule(static, 1)
+            for (int block = 0; block < numblocks; ++block)
+            {
+                int begin = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * block / numblocks);
+                int end = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * (block + 1) / numblocks);
+                BinSpatial(req, refs, begin, end, &blockbins[block * 3 * kNumSpatialBins]);
+            }
+
+            for (int i = 0; i < 3 * kNumSpatialBins; ++i)
+            {
+                bins[i] = blockbins[i];
+                for (int block = 1; block < numblocks; ++block)
+                {
+                    SpatialBin const& bin = blockbins[block * 3 * kNumSpatialBins + i];
+                    bins[i].bounds.grow(bin.bounds);
+                    bins[i].enter += bin.enter;
+                    bins[i].exit += bin.exit;
+                }
             }
         }
+        else
+        {
+            BinSpatial(req, refs, req.startidx, req.startidx + req.numprims, bins);
+        }
+
+        // Prepcompute some useful stuff
+        Vec3 origin = req.bounds.pmin;
+        Vec3 binsize = req.bounds.extents() * (1.f / kNumSpatialBins);
 
         // Prepare moving window data
-        bbox rightbounds[kNumBins - 1];
+        bbox rightbounds[kNumSpatialBins - 1];
         split.sah = std::numeric_limits<float>::max();
 
         // Iterate over axis
@@ -433,11 +599,13 @@ namespace RadeonRays
             if (extents[axis] == 0.f)
                 continue;
 
+            SpatialBin const* axisbins = bins + axis * kNumSpatialBins;
+
             // Start with 1-bin right box
             bbox rightbox = bbox();
-            for (int i = kNumBins - 1; i > 0; --i)
+            for (int i = kNumSpatialBins - 1; i > 0; --i)
             {
-                rightbox = bboxunion(rightbox, bins[axis][i].bounds);
+                rightbox = bboxunion(rightbox, axisbins[i].bounds);
                 rightbounds[i - 1] = rightbox;
             }
 
@@ -446,17 +614,17 @@ namespace RadeonRays
             int  rightcount = req.numprims;
 
             // Start moving border to the right
-            for (int i = 1; i < kNumBins; ++i)
+            for (int i = 1; i < kNumSpatialBins; ++i)
             {
                 // New left box
-                leftbox.grow(bins[axis][i - 1].bounds);
+                leftbox.grow(axisbins[i - 1].bounds);
                 // New left box count
-                leftcount += bins[axis][i - 1].enter;
+                leftcount += axisbins[i - 1].enter;
                 // Adjust right box
-                rightcount -= bins[axis][i - 1].exit;
+                rightcount -= axisbins[i - 1].exit;
                 // Calc SAH
-                float sah = m_traversal_cost + (leftbox.surface_area() *
-                    +rightbounds[i - 1].surface_area() * rightcount) * invarea;
+                float sah = m_traversal_cost + (leftbox.surface_area() * leftcount
+                    + rightbounds[i - 1].surface_area() * rightcount) * invarea;
 
                 // Update SAH if it is needed
                 if (sah < split.sah)
@@ -479,61 +647,149 @@ namespace RadeonRays
         // Start with left and right refs equal to original ref
         leftref.idx = rightref.idx = ref.idx;
         leftref.bounds = rightref.bounds = ref.bounds;
+        leftref.center = rightref.center = ref.center;
 
         // Only split if split value is within our bounds range
-        if (split > ref.bounds.pmin[axis] && split < ref.bounds.pmax[axis])
+        if (split <= ref.bounds.pmin[axis] || split >= ref.bounds.pmax[axis])
+        {
+            return false;
+        }
+
+        if (m_vertices)
+        {
+            // Clip the triangle against the plane and keep the parts inside the reference bounds
+            bbox left, right;
+            for (int i = 0; i < 3; ++i)
+            {
+                Vec3 v0 = Vec3(m_vertices[ref.idx * 3 + i]);
+                Vec3 v1 = Vec3(m_vertices[ref.idx * 3 + (i + 1) % 3]);
+
+                if (v0[axis] <= split) left.grow(v0);
+                if (v0[axis] >= split) right.grow(v0);
+
+                if ((v0[axis] < split && v1[axis] > split) || (v0[axis] > split && v1[axis] < split))
+                {
+                    Vec3 p = v0 + (v1 - v0) * ((split - v0[axis]) / (v1[axis] - v0[axis]));
+                    p[axis] = split;
+                    left.grow(p);
+                    right.grow(p);
+                }
+            }
+
+            intersection(left, ref.bounds, leftref.bounds);
+            intersection(right, ref.bounds, rightref.bounds);
+
+            // Inside these bounds the triangle lies on one side only
+            if (IsEmpty(leftref.bounds) || IsEmpty(rightref.bounds))
+            {
+                leftref.bounds = rightref.bounds = ref.bounds;
+                return false;
+            }
+        }
+        else
         {
             // Trim left box on the right
             leftref.bounds.pmax[axis] = split;
             // Trim right box on the left
             rightref.bounds.pmin[axis] = split;
-            return true;
         }
 
-        return false;
+        leftref.center = leftref.bounds.center();
+        rightref.center = rightref.bounds.center();
+        return true;
     }
 
-    void SplitBvh::SplitPrimRefs(SahSplit const& split, SplitRequest const& req, PrimRefArray& refs, int& extra_refs)
+    bool SplitBvh::SplitPrimRefs(SahSplit const& split, SplitRequest const& req, PrimRefArray& refs, int& extra_refs) const
     {
-        // We are going to append new primitives at the end of the array
-        int appendprims = req.numprims;
+        int numblocks = static_cast<int>(m_scratch.size());
+        bool parallel = m_defer_subtrees && numblocks > 1 && req.numprims >= kMinParallelSplitPrims;
 
-        // Split refs if any of them require to be split
+        // Conservative budget check, a straddling triangle may still end up on one side once clipped
+        int straddling = 0;
+#pragma omp parallel for reduction(+:straddling) if (parallel)
         for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
         {
-            assert(static_cast<size_t>(req.startidx + appendprims) < refs.size());
+            if (split.split > refs[i].bounds.pmin[split.dim] && split.split < refs[i].bounds.pmax[split.dim])
+                ++straddling;
+        }
+
+        if (straddling > req.refbudget)
+        {
+            return false;
+        }
+
+        if (!parallel)
+        {
+            // We are going to append new primitives at the end of the array
+            int appendprims = req.numprims;
+
+            // Split refs if any of them require to be split
+            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
+            {
+                PrimRef leftref, rightref;
+                if (SplitPrimRef(refs[i], split.dim, split.split, leftref, rightref))
+                {
+                    assert(static_cast<size_t>(req.startidx + appendprims) < refs.size());
+
+                    // Copy left ref instead of original
+                    refs[i] = leftref;
+                    // Append right one at the end
+                    refs[req.startidx + appendprims++] = rightref;
+                }
+            }
+
+            // Return number of primitives after this operation
+            extra_refs = appendprims - req.numprims;
+            return true;
+        }
+
+        // Count the splits of every block first so each block can append behind the previous ones
+        std::vector<int> blockoffsets(numblocks + 1, 0);
+
+#pragma omp parallel for schedule(static, 1)
+        for (int block = 0; block < numblocks; ++block)
+        {
+            int begin = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * block / numblocks);
+            int end = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * (block + 1) / numblocks);
 
             PrimRef leftref, rightref;
-            if (SplitPrimRef(refs[i], split.dim, split.split, leftref, rightref))
+            for (int i = begin; i < end; ++i)
             {
-                // Copy left ref instead of original
-                refs[i] = leftref;
-                // Append right one at the end
-                refs[req.startidx + appendprims++] = rightref;
+                if (SplitPrimRef(refs[i], split.dim, split.split, leftref, rightref))
+                    ++blockoffsets[block + 1];
             }
         }
 
-        // Return number of primitives after this operation
-        extra_refs = appendprims - req.numprims;
-    }
+        for (int block = 0; block < numblocks; ++block)
+        {
+            blockoffsets[block + 1] += blockoffsets[block];
+        }
 
-    SplitBvh::Node* SplitBvh::AllocateNode()
-    {
-        if (m_nodecnt - m_num_nodes_archived >= m_num_nodes_for_regular)
+#pragma omp parallel for schedule(static, 1)
+        for (int block = 0; block < numblocks; ++block)
         {
-            m_node_archive.push_back(std::move(m_nodes));
-            m_num_nodes_archived += m_num_nodes_for_regular;
-            m_nodes = std::vector<Node>(m_num_nodes_for_regular);
+            int begin = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * block / numblocks);
+            int end = req.startidx + static_cast<int>(static_cast<long long>(req.numprims) * (block + 1) / numblocks);
+            int appendidx = req.startidx + req.numprims + blockoffsets[block];
+
+            PrimRef leftref, rightref;
+            for (int i = begin; i < end; ++i)
+            {
+                if (SplitPrimRef(refs[i], split.dim, split.split, leftref, rightref))
+                {
+                    refs[i] = leftref;
+                    refs[appendidx++] = rightref;
+                }
+            }
         }
 
-        return &m_nodes[m_nodecnt++ - m_num_nodes_archived];
+        extra_refs = blockoffsets[numblocks];
+        return true;
     }
 
     void SplitBvh::InitNodeAllocator(size_t maxnum)
     {
-        m_node_archive.clear();
-        m_nodecnt = 0;
-        m_nodes.resize(maxnum);
+        Bvh::InitNodeAllocator(maxnum);
 
         // Set root_ pointer
         m_root = &m_nodes[0];
@@ -548,6 +804,7 @@ namespace RadeonRays
         os << "SAH bins: " << m_num_bins << "\n";
         os << "Max split depth: " << m_max_split_depth << "\n";
         os << "Min node overlap: " << m_min_overlap << "\n";
+        os << "Extra refs budget: " << m_extra_refs_budget * 100.f << "%\n";
         os << "Number of triangles: " << num_triangles << "\n";
         os << "Number of triangle refs: " << num_refs << "\n";
         os << "Ref duplication: " << ((float)(num_refs - num_triangles) / num_triangles) * 100.f << "%\n";
@@ -557,4 +814,3 @@ namespace RadeonRays
         os << "Tree height: " << GetHeight() << "\n";
     }
 }
-
@@ -39,12 +39,20 @@ namespace RadeonRays
             , m_extra_refs_budget(extra_refs_budget)
             , m_num_nodes_required(0)
             , m_num_nodes_for_regular(0)
-            , m_num_nodes_archived(0)
+            , m_vertices(nullptr)
+            , m_inv_root_area(0.f)
         {
         }
 
         ~SplitBvh() = default;
 
+        // Optional triangle soup, 3 vertices per primitive. Spatial splits then clip the
+        // triangles instead of their bounding boxes
+        void SetTriangles(Vec4 const* vertices);
+
+        // Number of references beyond one per primitive
+        int GetNumExtraRefs() const;
+
     protected:
         struct PrimRef;
         using PrimRefArray = std::vector<PrimRef>;
@@ -55,21 +63,42 @@ namespace RadeonRays
             kSpatial
         };
 
+        // References, leaves and height of a subtree built by a single thread
+        struct SubtreeBuild
+        {
+            SplitRequest req;
+            PrimRefArray refs;
+            std::vector<int> indices;
+            std::vector<Node*> leaves;
+            int height;
+        };
+
+        // Spatial bin has start and exit counts + bounds
+        struct SpatialBin
+        {
+            bbox bounds;
+            int enter;
+            int exit;
+        };
+
         // Build function
         void BuildImpl(bbox const* bounds, int numbounds) override;
-        void BuildNode(SplitRequest& req, PrimRefArray& primrefs);
+        void BuildNode(SplitRequest& req, SubtreeBuild& build);
 
-        SahSplit FindObjectSahSplit(SplitRequest const& req, PrimRefArray const& refs) const;
+        SahSplit FindObjectSahSplit(SplitRequest const& req, PrimRefArray const& refs);
         SahSplit FindSpatialSahSplit(SplitRequest const& req, PrimRefArray const& refs) const;
 
-        void SplitPrimRefs(SahSplit const& split, SplitRequest const& req, PrimRefArray& refs, int& extra_refs);
+        void BinObjects(SplitRequest const& req, PrimRefArray const& refs, int begin, int end, Bin* bins) const;
+        void BinSpatial(SplitRequest const& req, PrimRefArray const& refs, int begin, int end, SpatialBin* bins) const;
+
+        // Returns false and leaves refs untouched if the split would exceed the budget of the request
+        bool SplitPrimRefs(SahSplit const& split, SplitRequest const& req, PrimRefArray& refs, int& extra_refs) const;
         bool SplitPrimRef(PrimRef const& ref, int axis, float split, PrimRef& leftref, PrimRef& rightref) const;
 
         // Print BVH statistics
         void PrintStatistics(std::ostream& os) const override;
 
     protected:
-        Node* AllocateNode() override;
         void  InitNodeAllocator(size_t maxnum) override;
 
     private:
@@ -80,14 +109,12 @@ namespace RadeonRays
         int m_num_nodes_required;
         int m_num_nodes_for_regular;
 
-        // Node archive for memory management
-        // As m_nodes fills up we archive it into m_node_archive
-        // allocate new chunk and work there.
+        Vec4 const* m_vertices;
+        // Overlap thresholds are relative to the root surface area
+        float m_inv_root_area;
 
-        // How many nodes have been archived so far
-        int m_num_nodes_archived;
-        // Container for archived chunks
-        std::list<std::vector<Node>> m_node_archive;
+        // Subtrees collected while the top levels are split
+        std::vector<SubtreeBuild> m_subtrees;
 
         SplitBvh(SplitBvh const&) = delete;
         SplitBvh& operator = (SplitBvh const&) = delete;